@@ -0,0 +1,306 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "test.h"
+
+#include "alloc.h"
+
+/* Allocations are charged to the calling thread's current tag. Built
+ * with ALLOC_STATS and linked with --wrap for malloc, calloc, realloc and
+ * free, every allocation made by werf's own code is recorded in a table
+ * keyed by address; pointers the table does not know (from strdup or
+ * libraries) are passed through. Without it only tags are switched. */
+
+typedef struct {
+	uintptr_t ptr; // 0 for an empty slot
+	size_t size;
+	int tag;
+} alloc_slot_t;
+
+static struct {
+	pthread_mutex_t lock;
+	alloc_slot_t *slot;
+	size_t nslot; // power of two
+	size_t used;
+	alloc_stats_t stats[ALLOC_NTAGS];
+} acct = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static _Thread_local int cur_tag;
+
+static const char *tag_name[ALLOC_NTAGS] = {
+	[ALLOC_OTHER] = "other",
+	[ALLOC_DOCUMENT] = "document",
+	[ALLOC_UNDO] = "undo",
+	[ALLOC_GLYPHS] = "glyphs",
+	[ALLOC_PIPES] = "pipes",
+	[ALLOC_FONTS] = "fonts"
+};
+
+#ifdef ALLOC_STATS
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+#define raw_calloc __real_calloc
+#define raw_free __real_free
+#else
+#define raw_calloc calloc
+#define raw_free free
+#endif
+
+/* sets the tag for allocations of this thread, returns the previous one */
+int
+alloc_tag(int tag)
+{
+	int prev = cur_tag;
+	cur_tag = tag;
+	return prev;
+}
+
+static size_t
+slot_hash(uintptr_t ptr)
+{
+	return (uint64_t)(ptr >> 4) * UINT64_C(0x9E3779B97F4A7C15) >> 32;
+}
+
+static size_t
+slot_find(uintptr_t ptr)
+{
+	size_t mask = acct.nslot - 1;
+	size_t i = slot_hash(ptr) & mask;
+	while(acct.slot[i].ptr && acct.slot[i].ptr != ptr) {
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+static void
+slot_grow(void)
+{
+	alloc_slot_t *old = acct.slot;
+	size_t nold = acct.nslot;
+
+	acct.nslot = nold ? nold * 2 : 1024;
+	acct.slot = raw_calloc(acct.nslot, sizeof acct.slot[0]);
+	DIEIF(acct.slot == NULL);
+	for(size_t i = 0; i < nold; i++) {
+		if(old[i].ptr) {
+			acct.slot[slot_find(old[i].ptr)] = old[i];
+		}
+	}
+	raw_free(old);
+}
+
+static void
+note_locked(void *ptr, size_t size)
+{
+	if(!ptr) {
+		return;
+	}
+	if((acct.used + 1) * 2 > acct.nslot) {
+		slot_grow();
+	}
+	alloc_slot_t *s = &acct.slot[slot_find((uintptr_t)ptr)];
+	if(s->ptr) {
+		acct.stats[s->tag].live -= s->size;
+	} else {
+		acct.used++;
+	}
+	*s = (alloc_slot_t){(uintptr_t)ptr, size, cur_tag};
+
+	alloc_stats_t *st = &acct.stats[cur_tag];
+	st->live += size;
+	st->peak = MAX(st->peak, st->live);
+	st->nalloc++;
+	st->total += size;
+}
+
+/* linear probing, so later slots of the cluster are shifted back */
+static void
+forget_locked(void *ptr)
+{
+	if(!ptr || !acct.nslot) {
+		return;
+	}
+	size_t mask = acct.nslot - 1;
+	size_t i = slot_find((uintptr_t)ptr);
+	if(!acct.slot[i].ptr) {
+		return;
+	}
+	acct.stats[acct.slot[i].tag].live -= acct.slot[i].size;
+	acct.slot[i].ptr = 0;
+	acct.used--;
+
+	for(size_t j = (i + 1) & mask; acct.slot[j].ptr; j = (j + 1) & mask) {
+		size_t k = slot_hash(acct.slot[j].ptr) & mask;
+		if(i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+			continue;
+		}
+		acct.slot[i] = acct.slot[j];
+		acct.slot[j].ptr = 0;
+		i = j;
+	}
+}
+
+void
+alloc_note(void *ptr, size_t size)
+{
+	pthread_mutex_lock(&acct.lock);
+	note_locked(ptr, size);
+	pthread_mutex_unlock(&acct.lock);
+}
+
+void
+alloc_forget(void *ptr)
+{
+	pthread_mutex_lock(&acct.lock);
+	forget_locked(ptr);
+	pthread_mutex_unlock(&acct.lock);
+}
+
+#ifdef ALLOC_STATS
+void *
+__wrap_malloc(size_t size)
+{
+	void *ptr = __real_malloc(size);
+	alloc_note(ptr, size);
+	return ptr;
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+	void *ptr = __real_calloc(nmemb, size);
+	alloc_note(ptr, nmemb * size);
+	return ptr;
+}
+
+/* under the lock, the old address may be handed out again at once */
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+	pthread_mutex_lock(&acct.lock);
+	void *nptr = __real_realloc(ptr, size);
+	if(nptr || !size) {
+		forget_locked(ptr);
+		note_locked(nptr, size);
+	}
+	pthread_mutex_unlock(&acct.lock);
+	return nptr;
+}
+
+void
+__wrap_free(void *ptr)
+{
+	alloc_forget(ptr);
+	__real_free(ptr);
+}
+#endif
+
+void
+alloc_stats(alloc_stats_t *stats)
+{
+	pthread_mutex_lock(&acct.lock);
+	memcpy(stats, acct.stats, sizeof acct.stats);
+	pthread_mutex_unlock(&acct.lock);
+}
+
+static size_t
+rss_bytes(void)
+{
+	unsigned long size, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if(f) {
+		if(fscanf(f, "%lu %lu", &size, &resident) != 2) {
+			resident = 0;
+		}
+		fclose(f);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/* rates are over the time since the previous report */
+void
+alloc_report(FILE *f)
+{
+	static alloc_stats_t last[ALLOC_NTAGS];
+	static struct timespec last_ts;
+	alloc_stats_t st[ALLOC_NTAGS];
+	struct timespec ts;
+
+	alloc_stats(st);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	double sec = last_ts.tv_sec ? (ts.tv_sec - last_ts.tv_sec) +
+		(ts.tv_nsec - last_ts.tv_nsec) / 1E9 : 0;
+
+#ifndef ALLOC_STATS
+	fprintf(f, "built without ALLOC_STATS, allocations are not counted\n");
+#endif
+	fprintf(f, "%-10s %12s %12s %10s %10s %10s\n",
+		"tag", "live KiB", "peak KiB", "allocs", "allocs/s", "KiB/s");
+	for(int i = 0; i < ALLOC_NTAGS; i++) {
+		double nrate = sec > 0 ? (st[i].nalloc - last[i].nalloc) / sec : 0;
+		double brate = sec > 0 ? (st[i].total - last[i].total) / sec / 1024 : 0;
+		fprintf(f, "%-10s %12.1f %12.1f %10llu %10.1f %10.1f\n", tag_name[i],
+			st[i].live / 1024.0, st[i].peak / 1024.0,
+			(unsigned long long)st[i].nalloc, nrate, brate);
+	}
+	fprintf(f, "%-10s %12.1f\n", "rss", rss_bytes() / 1024.0);
+
+	memcpy(last, st, sizeof last);
+	last_ts = ts;
+}
+
+int
+TEST_alloc_note(void)
+{
+	enum { N = 10000 };
+	char call[BUFSIZ];
+	alloc_stats_t before[ALLOC_NTAGS], after[ALLOC_NTAGS];
+
+	// odd addresses never come from malloc
+	alloc_stats(before);
+	int prev = alloc_tag(ALLOC_FONTS);
+	for(uintptr_t i = 0; i < N; i++) {
+		alloc_note((void*)(i * 16 + 1), 10);
+	}
+	// noted again, as by realloc in place, it moves to the new tag
+	alloc_tag(ALLOC_UNDO);
+	TEST_CALL(call, sizeof(call), "%p, %d", alloc_note, ((void*)1, 100));
+	alloc_tag(prev);
+	alloc_stats(after);
+
+	TEST_OP("%zu", after[ALLOC_FONTS].live - before[ALLOC_FONTS].live, ==,
+		(size_t)(N - 1) * 10, "%s", call);
+	TEST_OP("%zu", after[ALLOC_UNDO].live - before[ALLOC_UNDO].live, ==,
+		(size_t)100, "%s", call);
+	TEST_OP("%llu", (unsigned long long)(after[ALLOC_FONTS].nalloc - before[ALLOC_FONTS].nalloc),
+		==, (unsigned long long)N, "%s", call);
+
+	// every other one, the rest must still be found
+	for(uintptr_t i = 0; i < N; i += 2) {
+		alloc_forget((void*)(i * 16 + 1));
+	}
+	alloc_forget((void*)3);
+	alloc_stats(after);
+	TEST_OP("%zu", after[ALLOC_FONTS].live - before[ALLOC_FONTS].live, ==,
+		(size_t)N / 2 * 10, "%s", "alloc_forget");
+	for(uintptr_t i = 1; i < N; i += 2) {
+		alloc_forget((void*)(i * 16 + 1));
+	}
+	alloc_stats(after);
+	TEST_OP("%zu", after[ALLOC_FONTS].live, ==, before[ALLOC_FONTS].live, "%s", "alloc_forget");
+	TEST_OP("%zu", after[ALLOC_UNDO].live, ==, before[ALLOC_UNDO].live, "%s", "alloc_forget");
+	TEST_OP("%zu", after[ALLOC_FONTS].peak - before[ALLOC_FONTS].live, >=,
+		(size_t)N * 10 - 10, "%s", "peak");
+	return 0;
+}
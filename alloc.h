@@ -0,0 +1,22 @@
+enum {
+	ALLOC_OTHER,
+	ALLOC_DOCUMENT,
+	ALLOC_UNDO,
+	ALLOC_GLYPHS,
+	ALLOC_PIPES,
+	ALLOC_FONTS,
+	ALLOC_NTAGS
+};
+
+typedef struct {
+	size_t live; // bytes
+	size_t peak;
+	uint64_t nalloc;
+	uint64_t total; // bytes ever allocated
+} alloc_stats_t;
+
+int alloc_tag(int tag);
+void alloc_note(void *ptr, size_t size);
+void alloc_forget(void *ptr);
+void alloc_stats(alloc_stats_t *stats);
+void alloc_report(FILE *f);
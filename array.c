@@ -1,9 +1,31 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "util.h"
 #include "array.h"
+#include "test.h"
+
+array_policy_t array_policy = {
+	.min_bytes = 16,
+	.grow = 50,
+	.shrink = 4
+};
+
+size_t
+array_capacity(size_t size, size_t nmemb)
+{
+	size_t min = (array_policy.min_bytes + size - 1) / size;
+	return MAX(nmemb + nmemb / 100 * array_policy.grow +
+		nmemb % 100 * array_policy.grow / 100, MAX(min, 1));
+}
+
+static bool
+array_shrinks(size_t amemb, size_t nmemb, size_t cap)
+{
+	return nmemb * array_policy.shrink < amemb && cap < amemb;
+}
 
 void
 array_free(array_t *a)
@@ -30,10 +52,10 @@ array_realloc(array_t *a, size_t size, size_t amemb)
 bool
 array_resize(array_t *a, size_t size, size_t nmemb)
 {
-	size_t next = next_size(nmemb, size * 8);
+	size_t cap = array_capacity(size, nmemb);
 	a->nmemb = nmemb;
-	if(a->nmemb > a->amemb || next * 4 < a->amemb) {
-		return array_realloc(a, size, next);
+	if(a->nmemb > a->amemb || array_shrinks(a->amemb, nmemb, cap)) {
+		return array_realloc(a, size, cap);
 	}
 	return false;
 }
@@ -135,6 +157,330 @@ array_fragment_resize(array_t *a, size_t size, size_t start, size_t end,
 	return false;
 }
 
+void
+iarray_free(void *p)
+{
+	if(p) {
+		free(IARR_HDR(p));
+	}
+}
+
+void *
+iarray_resize(void *p, size_t size, size_t nmemb)
+{
+	if(!nmemb) {
+		iarray_free(p);
+		return NULL;
+	}
+	// the top bit of amemb marks a pooled string
+	DIEIF(nmemb >= ISTR_POOLED);
+
+	iarray_t *h = p ? IARR_HDR(p) : NULL;
+	size_t amemb = h ? h->amemb : 0;
+	size_t cap = MIN(array_capacity(size, nmemb), ISTR_POOLED - 1);
+	if(nmemb > amemb || array_shrinks(amemb, nmemb, cap)) {
+		h = xrealloc(h, 1, sizeof h[0] + cap * size);
+		h->amemb = cap;
+	}
+	h->nmemb = nmemb;
+	return h + 1;
+}
+
+/* replaces elements start..end with nmemb uninitialized ones */
+void *
+iarray_fragment_resize(void *p, size_t size, size_t start, size_t end,
+		size_t nmemb)
+{
+	size_t len = IARR_LEN(p);
+	size_t tail = len - end;
+	size_t nlen = len - (end - start) + nmemb;
+	if(nlen > len) {
+		p = iarray_resize(p, size, nlen);
+	}
+	if(tail) {
+		memmove((char*)p + (start + nmemb) * size, (char*)p + end * size, tail * size);
+	}
+	if(nlen <= len) {
+		p = iarray_resize(p, size, nlen);
+	}
+	return p;
+}
+
+typedef union istr_slot {
+	union istr_slot *next; // when free
+	struct {
+		iarray_t hdr;
+		char buf[ISTR_SLOT];
+	} s;
+} istr_slot_t;
+
+/* slots for short strings, chunks are only kept to be reachable */
+static struct {
+	istr_slot_t *free;
+	ARRAY(istr_slot_t*) chunks;
+} pool;
+
+static char *
+slot_get(void)
+{
+	enum { NSLOTS = 1024 };
+	if(!pool.free) {
+		istr_slot_t *chunk = xmalloc(NSLOTS, sizeof chunk[0]);
+		ARR_EXTEND(&pool.chunks, 1);
+		pool.chunks.data[pool.chunks.nmemb - 1] = chunk;
+		for(int i = 0; i < NSLOTS; i++) {
+			chunk[i].next = i + 1 < NSLOTS ? &chunk[i + 1] : NULL;
+		}
+		pool.free = chunk;
+	}
+	istr_slot_t *slot = pool.free;
+	pool.free = slot->next;
+	slot->s.hdr.amemb = ISTR_SLOT | ISTR_POOLED;
+	return slot->s.buf;
+}
+
+static void
+slot_put(char *buf)
+{
+	istr_slot_t *slot = (istr_slot_t*)(void*)IARR_HDR(buf);
+	slot->next = pool.free;
+	pool.free = slot;
+}
+
+/* not the inline form */
+static void
+istr_release(istring_t *s)
+{
+	if(istr_is_pooled(s)) {
+		slot_put(s->heap);
+	} else {
+		iarray_free(s->heap);
+	}
+}
+
+void
+istr_free(istring_t *s)
+{
+	if(!istr_is_inline(s)) {
+		istr_release(s);
+	}
+	s->heap = NULL;
+}
+
+/* keeps the first MIN(old, len) bytes, moving between the forms */
+void
+istr_resize(istring_t *s, size_t len)
+{
+	size_t old = istr_len(s);
+	char tmp[ISTR_SLOT];
+
+	if(len <= ISTR_INLINE) {
+		if(!istr_is_inline(s)) {
+			if(MIN(old, len)) {
+				memcpy(tmp, s->heap, MIN(old, len));
+			}
+			istr_release(s);
+			s->bits = 1;
+			memcpy(istr_data(s), tmp, MIN(old, len));
+		}
+		s->bits = (s->bits & ~(uintptr_t)0xFF) | len << 1 | 1;
+		return;
+	}
+	if(len <= ISTR_SLOT) {
+		if(!istr_is_pooled(s)) {
+			char *buf = slot_get();
+			if(MIN(old, len)) {
+				memcpy(buf, istr_data(s), MIN(old, len));
+			}
+			istr_free(s);
+			s->heap = buf;
+		}
+		IARR_HDR(s->heap)->nmemb = len;
+		return;
+	}
+	if(istr_is_inline(s) || istr_is_pooled(s)) {
+		memcpy(tmp, istr_data(s), old);
+		istr_free(s);
+		IARR_RESIZE(&s->heap, len);
+		memcpy(s->heap, tmp, old);
+		return;
+	}
+	IARR_RESIZE(&s->heap, len);
+}
+
+/* replaces bytes start..end with len uninitialized ones */
+void
+istr_fragment_resize(istring_t *s, size_t start, size_t end, size_t len)
+{
+	size_t old = istr_len(s);
+	size_t tail = old - end;
+	size_t nlen = old - (end - start) + len;
+	if(nlen > old) {
+		istr_resize(s, nlen);
+	}
+	if(tail) {
+		char *data = istr_data(s);
+		memmove(data + start + len, data + end, tail);
+	}
+	if(nlen <= old) {
+		istr_resize(s, nlen);
+	}
+}
+
+int
+TEST_istr_fragment_resize(void)
+{
+	char call[BUFSIZ];
+	istring_t s = {0};
+
+	istr_resize(&s, 3);
+	memcpy(istr_data(&s), "abc", 3);
+	TEST_OP("%d", istr_is_inline(&s), ==, true, "%s", "short");
+
+	// grows out of the handle
+	TEST_CALL(call, sizeof(call), "%p, %d, %d, %d",
+		istr_fragment_resize, ((void*)&s, 1, 2, 10));
+	TEST_OP("%d", istr_is_inline(&s), ==, false, "%s", call);
+	memcpy(s.heap + 1, "0123456789", 10);
+	TEST_OP("%zu", istr_len(&s), ==, (size_t)12, "%s", call);
+	TEST_MEMCMP_OP(istr_data(&s), ==, "a0123456789c", 12, "%s", call);
+	TEST_OP("%u", IARR_HDR(s.heap)->amemb, >=, 12u, "%s", call);
+
+	// and back into it
+	TEST_CALL(call, sizeof(call), "%p, %d, %d, %d",
+		istr_fragment_resize, ((void*)&s, 2, 11, 0));
+	TEST_OP("%d", istr_is_inline(&s), ==, true, "%s", call);
+	TEST_OP("%zu", istr_len(&s), ==, (size_t)3, "%s", call);
+	TEST_MEMCMP_OP(istr_data(&s), ==, "a0c", 3, "%s", call);
+
+	istr_resize(&s, 0);
+	TEST_OP("%zu", istr_len(&s), ==, (size_t)0, "%s", "empty");
+
+	// short ones share a pool, the freed slot is taken again
+	istr_resize(&s, 20);
+	TEST_OP("%d", istr_is_pooled(&s), ==, true, "%s", "pooled");
+	char *slot = istr_data(&s);
+	memcpy(slot, "twenty bytes of text", 20);
+	istr_resize(&s, 100);
+	TEST_OP("%d", istr_is_pooled(&s), ==, false, "%s", "out of the pool");
+	TEST_MEMCMP_OP(istr_data(&s), ==, "twenty bytes of text", 20, "%s", "out of the pool");
+	istr_resize(&s, 25);
+	TEST_OP("%d", istr_is_pooled(&s), ==, true, "%s", "back in the pool");
+	TEST_OP("%p", (void*)istr_data(&s), ==, (void*)slot, "%s", "back in the pool");
+	TEST_MEMCMP_OP(istr_data(&s), ==, "twenty bytes of text", 20, "%s", "back in the pool");
+	istr_free(&s);
+
+	// capacity follows the policy, shrinks only well below it
+	char *p = NULL;
+	IARR_RESIZE(&p, 1000);
+	TEST_OP("%u", IARR_HDR(p)->amemb, ==, 1500u, "%s", "grow");
+	IARR_RESIZE(&p, 400);
+	TEST_OP("%u", IARR_HDR(p)->amemb, ==, 1500u, "%s", "no shrink");
+	IARR_RESIZE(&p, 300);
+	TEST_OP("%u", IARR_HDR(p)->amemb, ==, 450u, "%s", "shrink");
+	IARR_FREE(&p);
+	TEST_OP("%p", (void*)p, ==, NULL, "%s", "IARR_FREE");
+	return 0;
+}
+
+struct arena_chunk {
+	arena_chunk_t *next;
+	size_t size; // of data
+	size_t used;
+};
+
+#define CHUNK_HDR ((sizeof(arena_chunk_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define CHUNK_DATA(c) ((char*)(c) + CHUNK_HDR)
+
+static arena_chunk_t *
+chunk_new(size_t size, arena_chunk_t *next)
+{
+	arena_chunk_t *c = xmalloc(1, CHUNK_HDR + size);
+	c->next = next;
+	c->size = size;
+	c->used = 0;
+	return c;
+}
+
+void *
+arena_alloc(arena_t *a, size_t nmemb, size_t size)
+{
+	DIEIF(size && nmemb > (SIZE_MAX - ARENA_ALIGN) / size);
+	size_t bytes = (nmemb * size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	arena_chunk_t *c = a->head;
+	if(!c || c->size - c->used < bytes) {
+		c = a->head = chunk_new(MAX(bytes, (size_t)ARENA_CHUNK), a->head);
+	}
+	void *p = CHUNK_DATA(c) + c->used;
+	c->used += bytes;
+	a->used += bytes;
+	return p;
+}
+
+void
+arena_reset(arena_t *a)
+{
+	a->peak = MAX(a->peak, a->used);
+	a->used = 0;
+	if(!a->head) {
+		return;
+	}
+	if(!a->head->next) {
+		a->head->used = 0;
+		return;
+	}
+	size_t size = 0;
+	for(arena_chunk_t *c = a->head; c; c = c->next) {
+		size += c->size;
+	}
+	arena_free(a);
+	a->head = chunk_new(size, NULL);
+}
+
+void
+arena_free(arena_t *a)
+{
+	for(arena_chunk_t *c = a->head, *next; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	a->head = NULL;
+	a->used = 0;
+}
+
+int
+TEST_arena_reset(void)
+{
+	char call[BUFSIZ];
+	arena_t a = {0};
+
+	// more than a chunk, in odd sizes
+	arena_alloc(&a, 1, 1);
+	for(int i = 1; i < 1000; i++) {
+		char *p = arena_alloc(&a, i, 3);
+		size_t misalign = (uintptr_t)p & (ARENA_ALIGN - 1);
+		TEST_OP("%zu", misalign, ==, (size_t)0, "%s", "aligned");
+		memset(p, i, i * 3);
+	}
+	TEST_OP("%d", a.head->next != NULL, ==, true, "%s", "grown");
+
+	// merged, the same again fits in one chunk
+	TEST_CALL(call, sizeof(call), "%p", arena_reset, ((void*)&a));
+	TEST_OP("%d", a.head->next == NULL, ==, true, "%s", call);
+	arena_chunk_t *head = a.head;
+	for(int i = 0; i < 1000; i++) {
+		arena_alloc(&a, i ? i : 1, i ? 3 : 1);
+	}
+	TEST_OP("%p", (void*)a.head, ==, (void*)head, "%s", "steady");
+	TEST_OP("%zu", a.used, ==, a.peak, "%s", "steady");
+
+	arena_reset(&a);
+	TEST_OP("%p", arena_alloc(&a, 1, 1), ==, (void*)CHUNK_DATA(head), "%s", "reused");
+	arena_free(&a);
+	return 0;
+}
+
 /*
 void *
 slice_get(slice_t *slice, ssize_t idx)
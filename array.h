@@ -50,6 +50,107 @@ void array_fragment_shift(array_t *a, size_t size, size_t start, size_t end,
 		ssize_t shift);
 bool array_fragment_resize(array_t *a, size_t size, size_t start, size_t end,
 		size_t nmemb);
+
+/* capacity given for nmemb elements: at least min_bytes, grow percent
+ * more than needed, and given back once less than 1/shrink is used */
+typedef struct {
+	size_t min_bytes;
+	unsigned grow;
+	unsigned shrink;
+} array_policy_t;
+
+extern array_policy_t array_policy;
+
+size_t array_capacity(size_t size, size_t nmemb);
+
+/* Intrusive array: the handle points at the payload, 32-bit nmemb and
+ * amemb sit right before it, NULL is an empty array. Payload is 8 byte
+ * aligned. */
+typedef struct {
+	uint32_t nmemb;
+	uint32_t amemb;
+} iarray_t;
+
+#define IARR_HDR(p) ((iarray_t*)(void*)(p) - 1)
+#define IARR_LEN(p) ((p) ? IARR_HDR(p)->nmemb : 0)
+#define IARR_FREE(pp) \
+	(iarray_free(*(pp)), *(pp) = NULL)
+#define IARR_RESIZE(pp, nmemb) \
+	(*(pp) = iarray_resize(*(pp), sizeof((*(pp))[0]), nmemb))
+#define IARR_FRAG_RESIZE(pp, start, end, nmemb) \
+	(*(pp) = iarray_fragment_resize(*(pp), sizeof((*(pp))[0]), start, end, nmemb))
+
+void iarray_free(void *p);
+void *iarray_resize(void *p, size_t size, size_t nmemb);
+void *iarray_fragment_resize(void *p, size_t size, size_t start, size_t end,
+		size_t nmemb);
+
+/* Bytes in an intrusive array, or up to ISTR_INLINE of them in the handle
+ * itself. A heap payload is 8 byte aligned, so a set low bit marks the
+ * inline form, with the length in the rest of the low byte. Up to
+ * ISTR_SLOT bytes take a slot from a shared pool instead of a malloc. */
+typedef union {
+	char *heap;
+	uintptr_t bits;
+	char inl[sizeof(char*)];
+} istring_t;
+
+enum { ISTR_INLINE = sizeof(char*) - 1 };
+enum { ISTR_SLOT = 32 };
+#define ISTR_POOLED (UINT32_C(1) << 31) // in amemb of a pool slot
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ISTR_INLINE_DATA 0
+#else
+#define ISTR_INLINE_DATA 1
+#endif
+
+static inline bool
+istr_is_inline(const istring_t *s)
+{
+	return s->bits & 1;
+}
+
+static inline size_t
+istr_len(const istring_t *s)
+{
+	return istr_is_inline(s) ? (s->bits & 0xFF) >> 1 : IARR_LEN(s->heap);
+}
+
+static inline bool
+istr_is_pooled(const istring_t *s)
+{
+	return !istr_is_inline(s) && s->heap && (IARR_HDR(s->heap)->amemb & ISTR_POOLED);
+}
+
+static inline char *
+istr_data(istring_t *s)
+{
+	return istr_is_inline(s) ? s->inl + ISTR_INLINE_DATA : s->heap;
+}
+
+void istr_free(istring_t *s);
+void istr_resize(istring_t *s, size_t len);
+void istr_fragment_resize(istring_t *s, size_t start, size_t end, size_t len);
+
+/* Bump allocator for temporaries that all die together, as the glyphs of
+ * one reshape. A reset keeps the memory: if it took more than one chunk,
+ * they are merged into one, so a steady cycle stops calling malloc. */
+typedef struct arena_chunk arena_chunk_t;
+
+typedef struct {
+	arena_chunk_t *head;
+	size_t used; // bytes handed out since the last reset
+	size_t peak;
+} arena_t;
+
+enum { ARENA_CHUNK = 64 * 1024 };
+enum { ARENA_ALIGN = 16 };
+
+void *arena_alloc(arena_t *a, size_t nmemb, size_t size);
+void arena_reset(arena_t *a);
+void arena_free(arena_t *a);
+
 /*
 void *slice_get(slice_t *slice, ssize_t idx);
 */
@@ -0,0 +1,270 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cairo/cairo.h>
+
+#include "util.h"
+#include "array.h"
+
+#include "atlas.h"
+
+/* Text is drawn through the user font of font.c, which for every glyph
+ * sets the font it comes from and shows it, or strokes the name of a
+ * control character. Here that is done once per glyph, font and phase,
+ * and a line is blitted from the mask in the colour of the source. */
+
+static void
+atlas_init(atlas_t *a)
+{
+	a->surf = cairo_image_surface_create(CAIRO_FORMAT_A8, ATLAS_SIZE, ATLAS_SIZE);
+	a->cr = cairo_create(a->surf);
+	a->nslot = 1024;
+	a->slot = xcalloc(a->nslot, sizeof a->slot[0]);
+}
+
+/* all glyphs go, they are drawn again as they are shown */
+static void
+atlas_reset(atlas_t *a)
+{
+	cairo_save(a->cr);
+	cairo_set_operator(a->cr, CAIRO_OPERATOR_CLEAR);
+	cairo_paint(a->cr);
+	cairo_restore(a->cr);
+	memset(a->slot, 0, a->nslot * sizeof a->slot[0]);
+	a->used = 0;
+	a->shelf_x = 0;
+	a->shelf_y = 0;
+	a->shelf_height = 0;
+}
+
+static size_t
+atlas_font(atlas_t *a, cairo_scaled_font_t *font)
+{
+	for(size_t i = 0; i < a->fonts.nmemb; i++) {
+		if(a->fonts.data[i] == font) {
+			return i;
+		}
+	}
+	if(a->fonts.nmemb > UINT8_MAX) {
+		atlas_reset(a);
+		for(size_t i = 0; i < a->fonts.nmemb; i++) {
+			cairo_scaled_font_destroy(a->fonts.data[i]);
+		}
+		a->fonts.nmemb = 0;
+	}
+	ARR_EXTEND(&a->fonts, 1);
+	a->fonts.data[a->fonts.nmemb - 1] = cairo_scaled_font_reference(font);
+	return a->fonts.nmemb - 1;
+}
+
+static atlas_glyph_t *
+atlas_slot(atlas_t *a, uint64_t key)
+{
+	size_t mask = a->nslot - 1;
+	size_t i = (key * UINT64_C(0x9E3779B97F4A7C15)) >> 32 & mask;
+	while(a->slot[i].key && a->slot[i].key != key) {
+		i = (i + 1) & mask;
+	}
+	return &a->slot[i];
+}
+
+static void
+atlas_grow(atlas_t *a)
+{
+	atlas_glyph_t *old = a->slot;
+	size_t nold = a->nslot;
+	a->nslot *= 2;
+	a->slot = xcalloc(a->nslot, sizeof a->slot[0]);
+	for(size_t i = 0; i < nold; i++) {
+		if(old[i].key) {
+			*atlas_slot(a, old[i].key) = old[i];
+		}
+	}
+	free(old);
+}
+
+/* Draws a glyph into the next free place, with its origin phase / ATLAS_PHASES
+ * of a pixel to the right. False when it is bigger than the atlas. */
+static bool
+atlas_add(atlas_t *a, cairo_scaled_font_t *font, unsigned long glyph, int phase,
+		atlas_glyph_t *e)
+{
+	double off = (double)phase / ATLAS_PHASES;
+	cairo_text_extents_t ext;
+	cairo_scaled_font_glyph_extents(font, &(cairo_glyph_t){glyph, 0, 0}, 1, &ext);
+	memset(e, 0, sizeof *e);
+	if(ext.width <= 0 || ext.height <= 0) {
+		return true;
+	}
+
+	// a pixel around for antialiasing and strokes
+	int left = floor(ext.x_bearing + off) - 1;
+	int top = floor(ext.y_bearing) - 1;
+	int width = (int)ceil(ext.x_bearing + off + ext.width) + 1 - left;
+	int height = (int)ceil(ext.y_bearing + ext.height) + 1 - top;
+	if(width > ATLAS_SIZE || height > ATLAS_SIZE) {
+		return false;
+	}
+	if(a->shelf_x + width > ATLAS_SIZE) {
+		a->shelf_x = 0;
+		a->shelf_y += a->shelf_height;
+		a->shelf_height = 0;
+	}
+	if(a->shelf_y + height > ATLAS_SIZE) {
+		atlas_reset(a);
+	}
+	*e = (atlas_glyph_t){
+		.x = a->shelf_x, .y = a->shelf_y,
+		.width = width, .height = height,
+		.left = left, .top = top
+	};
+	a->shelf_x += width;
+	a->shelf_height = MAX(a->shelf_height, height);
+
+	cairo_save(a->cr);
+	cairo_rectangle(a->cr, e->x, e->y, width, height);
+	cairo_clip(a->cr);
+	cairo_set_scaled_font(a->cr, font);
+	cairo_set_source_rgba(a->cr, 0, 0, 0, 1);
+	cairo_show_glyphs(a->cr, &(cairo_glyph_t){glyph, e->x - left + off, e->y - top}, 1);
+	cairo_restore(a->cr);
+	cairo_surface_flush(a->surf);
+	return true;
+}
+
+static atlas_glyph_t *
+atlas_lookup(atlas_t *a, cairo_scaled_font_t *font, size_t fi, unsigned long glyph, int phase)
+{
+	uint64_t key = UINT64_C(1) << 63 | (uint64_t)fi << 40 | (uint64_t)phase << 32 |
+		(glyph & UINT32_MAX);
+	atlas_glyph_t *e = atlas_slot(a, key);
+	if(e->key) {
+		return e;
+	}
+	atlas_glyph_t added;
+	if(!atlas_add(a, font, glyph, phase, &added)) {
+		return NULL;
+	}
+	added.key = key;
+	if((a->used + 1) * 2 > a->nslot) {
+		atlas_grow(a);
+	}
+	e = atlas_slot(a, key);
+	*e = added;
+	a->used++;
+	return e;
+}
+
+static inline uint32_t
+blend(uint32_t dst, uint32_t src, unsigned cov)
+{
+	uint32_t out = 0;
+	for(int sh = 0; sh < 24; sh += 8) {
+		unsigned d = dst >> sh & 0xFF;
+		unsigned s = src >> sh & 0xFF;
+		out |= (d * (255 - cov) + s * cov + 127) / 255 << sh;
+	}
+	return out;
+}
+
+static void
+atlas_blit(atlas_t *a, atlas_glyph_t *e, uint8_t *data, int stride,
+		int x, int y, const int clip[4], uint32_t rgb, unsigned alpha)
+{
+	int x0 = MAX(x, clip[0]);
+	int y0 = MAX(y, clip[1]);
+	int x1 = MIN(x + e->width, clip[2]);
+	int y1 = MIN(y + e->height, clip[3]);
+	int astride = cairo_image_surface_get_stride(a->surf);
+	const uint8_t *mask = cairo_image_surface_get_data(a->surf) +
+		(size_t)(e->y + y0 - y) * astride + e->x + x0 - x;
+
+	for(int py = y0; py < y1; py++, mask += astride) {
+		uint32_t *p = (uint32_t*)(data + (size_t)py * stride);
+		for(int px = x0; px < x1; px++) {
+			unsigned cov = mask[px - x0] * alpha / 255;
+			if(cov == 255) {
+				p[px] = rgb;
+			} else if(cov) {
+				p[px] = blend(p[px], rgb, cov);
+			}
+		}
+	}
+}
+
+/* as cairo_show_glyphs, which it falls back to unless cr draws in a solid
+ * colour, only moved, onto an RGB24 image such as window.c and headless.c
+ * draw in; the clip is taken as its extents, draw.c clips to rectangles */
+void
+atlas_show_glyphs(atlas_t *a, cairo_t *cr, const cairo_glyph_t *glyphs, int n)
+{
+	cairo_surface_t *target = cairo_get_target(cr);
+	cairo_matrix_t m;
+	double r, g, b, alpha;
+
+	cairo_get_matrix(cr, &m);
+	if(cairo_surface_get_type(target) != CAIRO_SURFACE_TYPE_IMAGE ||
+	cairo_image_surface_get_format(target) != CAIRO_FORMAT_RGB24 ||
+	m.xx != 1 || m.yy != 1 || m.xy != 0 || m.yx != 0 ||
+	cairo_pattern_get_rgba(cairo_get_source(cr), &r, &g, &b, &alpha) != CAIRO_STATUS_SUCCESS) {
+		cairo_show_glyphs(cr, glyphs, n);
+		return;
+	}
+	if(!a->surf) {
+		atlas_init(a);
+	}
+	cairo_scaled_font_t *font = cairo_get_scaled_font(cr);
+	size_t fi = atlas_font(a, font);
+
+	double cx1, cy1, cx2, cy2;
+	cairo_clip_extents(cr, &cx1, &cy1, &cx2, &cy2);
+	int clip[4] = {
+		MAX(lround(cx1 + m.x0), 0),
+		MAX(lround(cy1 + m.y0), 0),
+		MIN(lround(cx2 + m.x0), cairo_image_surface_get_width(target)),
+		MIN(lround(cy2 + m.y0), cairo_image_surface_get_height(target))
+	};
+	if(clip[0] >= clip[2] || clip[1] >= clip[3]) {
+		return;
+	}
+	uint32_t rgb = lround(r * 255) << 16 | lround(g * 255) << 8 | lround(b * 255);
+	unsigned al = lround(alpha * 255);
+
+	cairo_surface_flush(target);
+	uint8_t *data = cairo_image_surface_get_data(target);
+	int stride = cairo_image_surface_get_stride(target);
+	for(int i = 0; i < n; i++) {
+		long p = floor((glyphs[i].x + m.x0) * ATLAS_PHASES + 0.5);
+		int phase = p & (ATLAS_PHASES - 1);
+		int x = (p - phase) / ATLAS_PHASES;
+		int y = floor(glyphs[i].y + m.y0 + 0.5);
+		atlas_glyph_t *e = atlas_lookup(a, font, fi, glyphs[i].index, phase);
+		if(!e) {
+			cairo_surface_mark_dirty(target);
+			cairo_show_glyphs(cr, &glyphs[i], 1);
+			cairo_surface_flush(target);
+		} else if(e->width) {
+			atlas_blit(a, e, data, stride, x + e->left, y + e->top, clip, rgb, al);
+		}
+	}
+	cairo_surface_mark_dirty_rectangle(target, clip[0], clip[1],
+		clip[2] - clip[0], clip[3] - clip[1]);
+}
+
+void
+atlas_free(atlas_t *a)
+{
+	if(!a->surf) {
+		return;
+	}
+	for(size_t i = 0; i < a->fonts.nmemb; i++) {
+		cairo_scaled_font_destroy(a->fonts.data[i]);
+	}
+	ARR_FREE(&a->fonts);
+	cairo_destroy(a->cr);
+	cairo_surface_destroy(a->surf);
+	free(a->slot);
+	memset(a, 0, sizeof *a);
+}
@@ -0,0 +1,32 @@
+enum {
+	ATLAS_SIZE = 1024, // square, alpha only
+	ATLAS_PHASES = 4 // glyph positions within a pixel, across
+};
+
+typedef struct {
+	uint64_t key; // 0 for an empty slot
+	int16_t x; // in the atlas
+	int16_t y;
+	int16_t width;
+	int16_t height;
+	int16_t left; // of the glyph origin, in pixels
+	int16_t top;
+} atlas_glyph_t;
+
+/* Glyphs drawn once each, per font and position within a pixel, into
+ * an alpha mask, and blitted from it onto image surfaces. Rows of it are
+ * filled left to right; when it is full it is cleared. */
+typedef struct {
+	cairo_surface_t *surf;
+	cairo_t *cr;
+	ARRAY(cairo_scaled_font_t *) fonts; // referenced, keys have an index
+	atlas_glyph_t *slot;
+	size_t nslot; // power of two
+	size_t used;
+	int shelf_x; // next free place
+	int shelf_y;
+	int shelf_height;
+} atlas_t;
+
+void atlas_show_glyphs(atlas_t *a, cairo_t *cr, const cairo_glyph_t *glyphs, int n);
+void atlas_free(atlas_t *a);
@@ -0,0 +1,321 @@
+#include <sys/types.h>
+#include <errno.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "array.h"
+
+#include "re.h"
+#include "edit.h"
+#include "proto.h"
+#include "backend.h"
+
+/* A frontend keeps a mirror of the file, so what it sends is checked
+ * against the file before it is applied. */
+
+static bool
+address_ok(file_t *f, address_t *a)
+{
+	return a->line < f->content.nmemb &&
+		a->offset <= istr_len(&f->content.data[a->line]);
+}
+
+static bool
+range_ok(range_t *rng)
+{
+	return address_ok(rng->file, &rng->start) && address_ok(rng->file, &rng->end) &&
+		address_cmp(&rng->start, &rng->end) <= 0;
+}
+
+static int
+backend_lines(backend_t *b, size_t start, size_t end)
+{
+	file_t *f = b->file;
+	end = MIN(end, f->content.nmemb);
+	if(start >= end) {
+		return 0;
+	}
+	proto_begin(&b->out, PROTO_LINES);
+	proto_put(&b->out, start);
+	proto_put(&b->out, end - start);
+	for(size_t i = start; i < end; i++) {
+		istring_t *line = &f->content.data[i];
+		proto_put_text(&b->out, istr_data(line), istr_len(line));
+	}
+	return proto_send(&b->conn, &b->out);
+}
+
+static int
+backend_change(backend_t *b, size_t start, size_t old_end, size_t new_end)
+{
+	proto_begin(&b->out, PROTO_CHANGE);
+	proto_put(&b->out, start);
+	proto_put(&b->out, old_end);
+	proto_put(&b->out, new_end);
+	return proto_send(&b->conn, &b->out);
+}
+
+/* [lo, hi) of lines changed, carried through a later change c */
+static void
+region_apply(size_t *lo, size_t *hi, linechange_t *c)
+{
+	if(*lo >= *hi) {
+		*lo = c->start;
+		*hi = c->new_end;
+		return;
+	}
+	if(*lo >= c->old_end) {
+		*lo = *lo - c->old_end + c->new_end;
+	}
+	*hi = *hi >= c->old_end ? *hi - c->old_end + c->new_end : MIN(*hi, c->start);
+	*lo = MIN(*lo, c->start);
+	*hi = MAX(*hi, c->new_end);
+}
+
+/* Tells the frontend how lines moved since it was told last and sends
+ * the first of those that changed along, which is all of them for a
+ * keystroke. When the log of changes was overrun or does not add up,
+ * the frontend starts over with the line count alone. */
+static int
+backend_changes(backend_t *b)
+{
+	file_t *f = b->file;
+	size_t lo = 0, hi = 0;
+	size_t n = b->nlines;
+
+	for(uint64_t i = b->gen; n != SIZE_MAX && i < f->nchanges; i++) {
+		linechange_t *c = &f->changes[i % FILE_CHANGES];
+		n = f->nchanges - i > FILE_CHANGES || c->old_end > n ?
+			SIZE_MAX : n - c->old_end + c->new_end;
+	}
+	if(n != f->content.nmemb) {
+		if(backend_change(b, 0, b->nlines, f->content.nmemb) < 0) {
+			return -1;
+		}
+		lo = 0;
+		hi = f->content.nmemb;
+	} else {
+		for(; b->gen < f->nchanges; b->gen++) {
+			linechange_t *c = &f->changes[b->gen % FILE_CHANGES];
+			if(backend_change(b, c->start, c->old_end, c->new_end) < 0) {
+				return -1;
+			}
+			region_apply(&lo, &hi, c);
+		}
+	}
+	b->gen = f->nchanges;
+	b->nlines = f->content.nmemb;
+	return backend_lines(b, lo, MIN(hi, lo + PROTO_EAGER));
+}
+
+static int
+backend_range(backend_t *b, range_t *rng)
+{
+	proto_begin(&b->out, PROTO_RANGE);
+	proto_put_range(&b->out, rng);
+	return proto_send(&b->conn, &b->out);
+}
+
+static int64_t
+backend_fetch(backend_t *b)
+{
+	size_t start = proto_get(&b->in);
+	size_t end = proto_get(&b->in);
+	if(b->in.err) {
+		return -EINVAL;
+	}
+	return backend_lines(b, start, end) < 0 ? -EIO : 0;
+}
+
+static int64_t
+backend_push(backend_t *b)
+{
+	range_t rng = {.file = b->file};
+	proto_get_range(&b->in, &rng);
+	uint64_t type = proto_get(&b->in);
+	size_t len;
+	char *text = proto_get_text(&b->in, &len);
+	if(b->in.err || !range_ok(&rng) || type > OP_Replace) {
+		return -EINVAL;
+	}
+	range_push(&rng, text, len, type);
+	return backend_range(b, &rng) < 0 ? -EIO : 0;
+}
+
+/* edits must be in order and apart, as file_push_batch wants them */
+static int64_t
+backend_batch(backend_t *b)
+{
+	static ARRAY(edit_t) edits;
+	size_t n = proto_get(&b->in);
+	if(b->in.err || n > b->in.buf.nmemb) {
+		return -EINVAL;
+	}
+	edits.nmemb = 0;
+	ARR_EXTEND(&edits, n);
+	address_t pos = {0, 0};
+	for(size_t i = 0; i < n; i++) {
+		edit_t *e = &edits.data[i];
+		range_t rng = {.file = b->file};
+		proto_get_range(&b->in, &rng);
+		e->start = rng.start;
+		e->end = rng.end;
+		e->mod = proto_get_text(&b->in, &e->mod_len);
+		if(b->in.err || !range_ok(&rng) || address_cmp(&e->start, &pos) < 0) {
+			return -EINVAL;
+		}
+		pos = e->end;
+	}
+	file_push_batch(b->file, edits.data, n);
+
+	proto_begin(&b->out, PROTO_EDITS);
+	proto_put(&b->out, n);
+	for(size_t i = 0; i < n; i++) {
+		proto_put_range(&b->out, &(range_t){edits.data[i].start, edits.data[i].end});
+	}
+	return proto_send(&b->conn, &b->out) < 0 ? -EIO : 0;
+}
+
+static int64_t
+backend_undo(backend_t *b)
+{
+	range_t rng = {.file = b->file};
+	proto_get_range(&b->in, &rng);
+	bool redo = proto_get(&b->in);
+	if(b->in.err || !range_ok(&rng)) {
+		return -EINVAL;
+	}
+	if(redo) {
+		file_redo(&rng);
+	} else {
+		file_undo(&rng);
+	}
+	return backend_range(b, &rng) < 0 ? -EIO : 0;
+}
+
+/* the program is compiled by the frontend, 1 is found, 0 is not */
+static int64_t
+backend_find(backend_t *b)
+{
+	range_t rng = {.file = b->file};
+	re_t re = {0};
+	int64_t status = -EINVAL;
+
+	proto_get_range(&b->in, &rng);
+	bool backward = proto_get(&b->in);
+	re.lit = proto_get_int(&b->in);
+	size_t n = proto_get(&b->in);
+	if(b->in.err || !range_ok(&rng) || re.lit < -1 || re.lit > 255 || n > b->in.buf.nmemb) {
+		goto out;
+	}
+	ARR_RESIZE(&re.prog, n);
+	for(size_t i = 0; i < n; i++) {
+		re_inst_t *inst = &re.prog.data[i];
+		inst->op = proto_get(&b->in);
+		inst->c = proto_get(&b->in);
+		inst->x = proto_get_int(&b->in);
+		inst->y = proto_get_int(&b->in);
+	}
+	n = proto_get(&b->in);
+	if(b->in.err || n > b->in.buf.nmemb) {
+		goto out;
+	}
+	ARR_RESIZE(&re.classes, n);
+	for(size_t i = 0; i < n; i++) {
+		for(size_t j = 0; j < LEN(re.classes.data[i].bits); j++) {
+			re.classes.data[i].bits[j] = proto_get(&b->in);
+		}
+	}
+	if(b->in.err || re_check(&re) < 0) {
+		goto out;
+	}
+
+	status = range_find(&rng, &re, backward);
+	if(status && backend_range(b, &rng) < 0) {
+		status = -EIO;
+	}
+out:
+	re_free(&re);
+	return status;
+}
+
+static int64_t
+backend_save(backend_t *b)
+{
+	size_t len;
+	char *text = proto_get_text(&b->in, &len);
+	if(b->in.err || memchr(text, '\0', len) || (!len && !b->filename)) {
+		return -EINVAL;
+	}
+	char *fname = len ? strndup(text, len) : b->filename;
+	DIEIF(!fname);
+	ssize_t nbytes = file_save(b->file, fname);
+	int64_t status = nbytes < 0 ? -errno : nbytes;
+	if(fname != b->filename) {
+		free(fname);
+	}
+	return status;
+}
+
+/* Serves requests until the frontend goes away, which is 0, or the
+ * connection fails, -1. Every one ends with PROTO_DONE and its status,
+ * a negative errno on failure, after the changes it made. */
+int
+backend_serve(backend_t *b)
+{
+	int type;
+	b->gen = b->file->nchanges;
+	b->nlines = b->file->content.nmemb;
+	proto_begin(&b->out, PROTO_HELLO);
+	proto_put(&b->out, b->nlines);
+	if(proto_send(&b->conn, &b->out) < 0) {
+		type = -1;
+		goto out;
+	}
+
+	while( (type = proto_recv(&b->conn, &b->in)) > 0 ) {
+		int64_t status;
+		switch(type) {
+		case PROTO_FETCH:
+			status = backend_fetch(b);
+			break;
+		case PROTO_PUSH:
+			status = backend_push(b);
+			break;
+		case PROTO_BATCH:
+			status = backend_batch(b);
+			break;
+		case PROTO_UNDO:
+			status = backend_undo(b);
+			break;
+		case PROTO_FIND:
+			status = backend_find(b);
+			break;
+		case PROTO_SAVE:
+			status = backend_save(b);
+			break;
+		default:
+			status = -EINVAL;
+			break;
+		}
+		if(status == -EIO || backend_changes(b) < 0) {
+			type = -1;
+			break;
+		}
+		proto_begin(&b->out, PROTO_DONE);
+		proto_put_int(&b->out, status);
+		if(proto_send(&b->conn, &b->out) < 0) {
+			type = -1;
+			break;
+		}
+	}
+out:
+	ARR_FREE(&b->in.buf);
+	ARR_FREE(&b->out.buf);
+	return type;
+}
@@ -0,0 +1,12 @@
+/* serves a file to one frontend, see proto.h */
+typedef struct {
+	file_t *file;
+	char *filename; // saved to by default
+	proto_conn_t conn;
+	proto_msg_t in;
+	proto_msg_t out;
+	uint64_t gen; // changes of file the frontend was told about
+	size_t nlines; // the frontend has
+} backend_t;
+
+int backend_serve(backend_t *b);
@@ -0,0 +1,99 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "bench.h"
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+#ifdef __linux__
+static int
+perf_open(uint64_t config, int group)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+/* fails where perf events are not allowed, timing still works then */
+int
+bench_perf_open(bench_t *b)
+{
+	b->perf_fd[0] = b->perf_fd[1] = -1;
+#ifdef __linux__
+	b->perf_fd[0] = perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+	if(b->perf_fd[0] < 0) {
+		return -1;
+	}
+	b->perf_fd[1] = perf_open(PERF_COUNT_HW_CACHE_MISSES, b->perf_fd[0]);
+	if(b->perf_fd[1] < 0) {
+		bench_perf_close(b);
+		return -1;
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+void
+bench_perf_close(bench_t *b)
+{
+	for(int i = 0; i < 2; i++) {
+		if(b->perf_fd[i] >= 0) {
+			close(b->perf_fd[i]);
+		}
+		b->perf_fd[i] = -1;
+	}
+}
+
+void
+bench_start(bench_t *b)
+{
+	b->started = true;
+#ifdef __linux__
+	if(b->perf_fd[0] >= 0) {
+		ioctl(b->perf_fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(b->perf_fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+#endif
+	b->start = now_ns();
+}
+
+void
+bench_stop(bench_t *b)
+{
+	b->ns += now_ns() - b->start;
+#ifdef __linux__
+	if(b->perf_fd[0] >= 0) {
+		ioctl(b->perf_fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		for(int i = 0; i < 2; i++) {
+			uint64_t val;
+			if(read(b->perf_fd[i], &val, sizeof val) == sizeof val) {
+				b->counters[i] += val;
+			}
+		}
+	}
+#endif
+}
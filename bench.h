@@ -0,0 +1,26 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* BENCH_ functions are found by gen-benches.h.awk, each runs its
+ * measured part b->n times between bench_start and bench_stop */
+typedef struct {
+	size_t n;
+	uint64_t ns;
+	uint64_t start;
+	bool started;
+	int perf_fd[2]; // cycles, cache misses; -1 when not counting
+	uint64_t counters[2];
+} bench_t;
+
+void bench_start(bench_t *b);
+void bench_stop(bench_t *b);
+int bench_perf_open(bench_t *b);
+void bench_perf_close(bench_t *b);
+
+/* keeps the compiler from dropping results of the measured code */
+static inline void
+bench_keep(const void *p)
+{
+	__asm__ volatile("" : : "g"(p) : "memory");
+}
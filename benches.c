@@ -0,0 +1,198 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "bench.h"
+#include "benches.h"
+
+enum { MAX_REPS = 1000 };
+
+typedef struct {
+	char name[64];
+	double min;
+	double median;
+	double p99;
+	double cycles;
+	double misses;
+} result_t;
+
+static int reps = 31;
+static int warmup = 3;
+static uint64_t target_ns = 2000000;
+static bool perf;
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void
+run_once(void (*func)(bench_t *b), bench_t *b, size_t n)
+{
+	b->n = n;
+	b->ns = 0;
+	b->started = false;
+	b->counters[0] = b->counters[1] = 0;
+	func(b);
+}
+
+/* grows n until one sample takes target_ns, then times reps samples */
+static void
+run_bench(void (*func)(bench_t *b), const char *name, result_t *res)
+{
+	bench_t b = {.perf_fd = {-1, -1}};
+	double ns[MAX_REPS];
+	uint64_t counters[2] = {0};
+	size_t n = 1;
+
+	if(perf && bench_perf_open(&b) < 0) {
+		fprintf(stderr, "perf counters not available\n");
+		perf = false;
+	}
+
+	for(;;) {
+		run_once(func, &b, n);
+		if(!b.started) {
+			fprintf(stderr, "%s: bench_start never called\n", name);
+			exit(1);
+		}
+		if(b.ns >= target_ns || n >= SIZE_MAX / 2) {
+			break;
+		}
+		n = b.ns ? MAX(n * 2, (size_t)(n * 1.2 * target_ns / b.ns)) : n * 100;
+	}
+	for(int i = 0; i < warmup; i++) {
+		run_once(func, &b, n);
+	}
+	for(int i = 0; i < reps; i++) {
+		run_once(func, &b, n);
+		ns[i] = (double)b.ns / n;
+		counters[0] += b.counters[0];
+		counters[1] += b.counters[1];
+	}
+	bench_perf_close(&b);
+
+	qsort(ns, reps, sizeof ns[0], cmp_double);
+	snprintf(res->name, sizeof res->name, "%s", name);
+	res->min = ns[0];
+	res->median = ns[reps / 2];
+	res->p99 = ns[MAX((reps * 99 + 99) / 100 - 1, 0)];
+	res->cycles = (double)counters[0] / n / reps;
+	res->misses = (double)counters[1] / n / reps;
+}
+
+static int
+load_baseline(const char *fname, result_t **out)
+{
+	FILE *f = fopen(fname, "r");
+	if(!f) {
+		perror(fname);
+		return -1;
+	}
+	char line[BUFSIZ];
+	int n = 0;
+	*out = NULL;
+	while(fgets(line, sizeof line, f)) {
+		result_t r = {0};
+		if(sscanf(line, " {\"name\": \"%63[^\"]\", \"min\": %lf, \"median\": %lf, \"p99\": %lf",
+				r.name, &r.min, &r.median, &r.p99) == 4) {
+			*out = xrealloc(*out, n + 1, sizeof **out);
+			(*out)[n++] = r;
+		}
+	}
+	fclose(f);
+	return n;
+}
+
+static void
+write_json(FILE *f, result_t *res, int n)
+{
+	fprintf(f, "[\n");
+	for(int i = 0; i < n; i++) {
+		fprintf(f, "{\"name\": \"%s\", \"min\": %.3f, \"median\": %.3f, \"p99\": %.3f, "
+			"\"cycles\": %.3f, \"cache_misses\": %.3f}%s\n",
+			res[i].name, res[i].min, res[i].median, res[i].p99,
+			res[i].cycles, res[i].misses, i + 1 < n ? "," : "");
+	}
+	fprintf(f, "]\n");
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-p] [-r reps] [-w warmup] [-t ms] "
+		"[-o out.json] [-c baseline.json] [BENCH_name...]\n", argv0);
+	exit(1);
+}
+
+int
+__wrap_main(int argc, char *argv[])
+{
+	const char *out = NULL;
+	const char *baseline = NULL;
+	int opt;
+
+	while((opt = getopt(argc, argv, "pr:w:t:o:c:")) != -1) {
+		switch(opt) {
+		case 'p': perf = true; break;
+		case 'r': reps = clampss(atoi(optarg), 1, MAX_REPS); break;
+		case 'w': warmup = MAX(atoi(optarg), 0); break;
+		case 't': target_ns = MAX(atof(optarg), 0.001) * 1E6; break;
+		case 'o': out = optarg; break;
+		case 'c': baseline = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	result_t *base = NULL;
+	int nbase = baseline ? load_baseline(baseline, &base) : 0;
+	if(nbase < 0) {
+		return 1;
+	}
+
+	result_t res[LEN(BENCHES)];
+	int n = 0;
+	for(size_t i = 0; i < LEN(BENCHES); i++) {
+		bool run = optind == argc;
+		for(int j = optind; j < argc; j++) {
+			run |= !strcmp(argv[j], BENCHES[i].name);
+		}
+		if(!run) {
+			continue;
+		}
+
+		result_t *r = &res[n++];
+		run_bench(BENCHES[i].func, BENCHES[i].name, r);
+		printf("%-32s min %10.1f  median %10.1f  p99 %10.1f ns/op",
+			r->name, r->min, r->median, r->p99);
+		if(perf) {
+			printf("  cycles %8.1f  cache-misses %6.2f", r->cycles, r->misses);
+		}
+		for(int j = 0; j < nbase; j++) {
+			if(!strcmp(base[j].name, r->name) && base[j].median > 0) {
+				printf("  %+6.1f%%", (r->median / base[j].median - 1) * 100);
+			}
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+	free(base);
+
+	if(out) {
+		FILE *f = fopen(out, "w");
+		if(!f) {
+			perror(out);
+			return 1;
+		}
+		write_json(f, res, n);
+		fclose(f);
+	}
+	return 0;
+}
@@ -16,36 +16,15 @@ exec gcc -Og -g -std=c99 -Wall -Wextra -pedantic block.c -o block
 
 #include "util.h"
 #include "test.h"
+#include "bench.h"
+#include "alloc.h"
+
+#include "block.h"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
 #define LEN(a) (sizeof(a) / sizeof(a)[0])
 
-#define BLOCK_SIZE 4096
-
-typedef struct {
-	int len; // 0..BLOCK_SIZE
-	int nlines; // 0..BLOCK_SIZE
-	struct blockbuf { char buf[BLOCK_SIZE]; } *p; // != NULL
-} block_t;
-
-typedef struct {
-	int nblocks; // 1..INT_MAX
-	int64_t nlines; // 0..INT64_MAX
-	block_t *block; // != NULL
-} buffer_t;
-
-typedef struct {
-	int blk; // 0..INT_MAX
-	int off; // 0..BLOCK_SIZE
-} address_t;
-
-// for undo use buffer wide offsets
-typedef struct {
-	address_t start;
-	address_t end;
-} range_t;
-
 void*
 xreallocarray(void *optr, size_t nmemb, size_t elem_size)
 {
@@ -64,6 +43,35 @@ blockmove(block_t *dest, const block_t *src, size_t n)
 	return dest;
 }
 
+static int
+block_append(block_t *blk, int nblk, const int maxblk, char *buf, int len /* 0..BLOCK_SIZE */);
+
+/* block_append of bytes found at foff in the file, blocks stay clean
+ * as long as their content is contiguous in the file */
+static int
+block_append_at(block_t *blk, int nblk, const int maxblk, char *buf, int len, int64_t foff)
+{
+	int first = MAX(nblk, 1) - 1;
+	int prev_len = blk[first].len;
+	int64_t prev_foff = blk[first].foff;
+
+	nblk = block_append(blk, nblk, maxblk, buf, len);
+	if(nblk < 0 || len == 0) {
+		return nblk;
+	}
+
+	if(prev_len == 0) {
+		blk[first].foff = foff;
+	} else if(prev_foff < 0 || foff < 0 || prev_foff + prev_len != foff) {
+		blk[first].foff = -1;
+	}
+	if(nblk - 1 > first) {
+		int head_len = BLOCK_SIZE - prev_len;
+		blk[nblk-1].foff = foff < 0 ? -1 : foff + head_len;
+	}
+	return nblk;
+}
+
 static int
 block_append(block_t *blk, int nblk, const int maxblk, char *buf, int len /* 0..BLOCK_SIZE */)
 {
@@ -93,6 +101,9 @@ block_append(block_t *blk, int nblk, const int maxblk, char *buf, int len /* 0..
 	int head_len = MIN(capacity, len);
 	memcpy(&blk[nblk-1].p->buf[blk[nblk-1].len], buf, head_len);
 	blk[nblk-1].len += head_len;
+	if(head_len > 0) {
+		blk[nblk-1].foff = -1;
+	}
 
 	capacity = BLOCK_SIZE;
 	int tail_len = len - head_len;
@@ -100,6 +111,7 @@ block_append(block_t *blk, int nblk, const int maxblk, char *buf, int len /* 0..
 		nblk++;
 		memcpy(blk[nblk-1].p->buf, &buf[head_len], tail_len);
 		blk[nblk-1].len = tail_len;
+		blk[nblk-1].foff = -1;
 	}
 
 	return nblk;
@@ -278,12 +290,15 @@ TEST_block_append(void)
 void
 buffer_init(buffer_t *buffer, int nblocks)
 {
+	int tag = alloc_tag(ALLOC_DOCUMENT);
 	// FIXME: check for NULL / xrealloc
 	buffer->block = xcalloc(nblocks, sizeof(*buffer->block));
 	for(int i = 0; i < nblocks; i++) {
 		// FIXME: check for NULL / xmalloc
 		buffer->block[i].p = xmalloc(1, BLOCK_SIZE);
+		buffer->block[i].foff = -1;
 	}
+	alloc_tag(tag);
 	buffer->nlines = 0;
 	buffer->nblocks = nblocks;
 }
@@ -299,27 +314,30 @@ buffer_free(buffer_t *buffer)
 
 #define LEN_TO_NBLOCKS(x) (((x) + BLOCK_SIZE - 1) / BLOCK_SIZE)
 
-int buffer_read_blocks(buffer_t *buffer, range_t *rng, block_t *blk, int nblk, int maxblk, int len);
-
 int
 buffer_read(buffer_t *buffer, range_t *rng, char *mod, int len /* 0..BLOCK_SIZE */)
 {
 	// one extra block may be needed for the tail of the selection
 	block_t blk[4];
+	int tag = alloc_tag(ALLOC_DOCUMENT);
 
 	for(unsigned i = 0; i < LEN(blk); i++) {
 		blk[i].p = xmalloc(1, BLOCK_SIZE);
 		blk[i].len = 0;
 		blk[i].nlines = 0;
+		blk[i].foff = -1;
 	}
 
 	// headSEL SEL SELtail
 	// copy the head of the first selected block
-	int nblk = block_append(blk, 1, LEN(blk), buffer->block[rng->start.blk].p->buf, rng->start.off);
+	block_t *first = &buffer->block[rng->start.blk];
+	int nblk = block_append_at(blk, 1, LEN(blk), first->p->buf, rng->start.off, first->foff);
 
 	nblk = block_append(blk, nblk, LEN(blk), mod, len);
 
-	return buffer_read_blocks(buffer, rng, blk, nblk, LEN(blk), len);
+	int ret = buffer_read_blocks(buffer, rng, blk, nblk, LEN(blk), len);
+	alloc_tag(tag);
+	return ret;
 }
 
 int
@@ -1404,17 +1422,20 @@ buffer_read_fd(buffer_t *buffer, range_t *rng, int fd)
 	struct iovec iov[8];
 	// one extra block may be needed for the tail of the selection
 	block_t blk[LEN(iov)+1];
+	int tag = alloc_tag(ALLOC_DOCUMENT);
 
 	for(unsigned i = 0; i < LEN(blk); i++) {
 		// FIXME: check for NULL / xmalloc
 		blk[i].p = xmalloc(1, BLOCK_SIZE);
 		blk[i].len = 0;
 		blk[i].nlines = 0;
+		blk[i].foff = -1;
 	}
 
 	// headSEL SEL SELtail
 	// copy the head of the first selected block
-	int nblk = block_append(blk, 1, LEN(blk), buffer->block[rng->start.blk].p->buf, rng->start.off);
+	block_t *first = &buffer->block[rng->start.blk];
+	int nblk = block_append_at(blk, 1, LEN(blk), first->p->buf, rng->start.off, first->foff);
 	iov[0].iov_base = &blk[0].p->buf[rng->start.off];
 	iov[0].iov_len = BLOCK_SIZE - rng->start.off;
 
@@ -1422,20 +1443,32 @@ buffer_read_fd(buffer_t *buffer, range_t *rng, int fd)
 		iov[i].iov_base = blk[i].p->buf;
 		iov[i].iov_len = BLOCK_SIZE;
 	}
+	// -1 for pipes, blocks from them can not be saved in place
+	int64_t pos = lseek(fd, 0, SEEK_CUR);
 	ssize_t len = readv(fd, iov, LEN(iov));
 
 	if(len >= 0) {
-		int i;
-		nblk = LEN_TO_NBLOCKS(len);
-		for(i = 0; i < nblk-1; i++) {
-			blk[i].len = BLOCK_SIZE;
+		int64_t total = rng->start.off + len;
+		nblk = MAX(LEN_TO_NBLOCKS(total), 1);
+		for(int i = 0; i < nblk; i++) {
+			blk[i].len = MIN(total - (int64_t)i * BLOCK_SIZE, BLOCK_SIZE);
+		}
+		// the head stays clean only if the new data follows it in the file
+		if(!rng->start.off) {
+			blk[0].foff = pos;
+		} else if(pos < 0 || blk[0].foff < 0 || blk[0].foff + rng->start.off != pos) {
+			blk[0].foff = -1;
+		}
+		for(int i = 1; i < nblk; i++) {
+			blk[i].foff = pos < 0 ? -1 : pos - rng->start.off + (int64_t)i * BLOCK_SIZE;
 		}
-		blk[i].len = len % BLOCK_SIZE;
 	} else {
 		nblk = 0;
 	}
 
-	return buffer_read_blocks(buffer, rng, blk, nblk, LEN(blk), len);
+	int ret = buffer_read_blocks(buffer, rng, blk, nblk, LEN(blk), len);
+	alloc_tag(tag);
+	return ret;
 }
 
 static size_t
@@ -1474,6 +1507,75 @@ TEST_count_chr(void)
 	return 0;
 }
 
+void
+BENCH_count_chr(bench_t *b)
+{
+	char buf[BLOCK_SIZE];
+	size_t n = 0;
+	for(size_t i = 0; i < sizeof buf; i++) {
+		buf[i] = i % 64 == 63 ? '\n' : 'x';
+	}
+
+	bench_start(b);
+	for(size_t i = 0; i < b->n; i++) {
+		n += count_chr(buf, '\n', sizeof buf);
+		bench_keep(&n);
+	}
+	bench_stop(b);
+}
+
+void
+BENCH_block_append(bench_t *b)
+{
+	char line[80];
+	block_t blk[2] = {{0}};
+	memset(line, 'x', sizeof line);
+	for(size_t i = 0; i < LEN(blk); i++) {
+		blk[i].p = xmalloc(1, sizeof blk[i].p[0]);
+	}
+
+	bench_start(b);
+	for(size_t i = 0; i < b->n; i++) {
+		if(blk[0].len > BLOCK_SIZE - (int)sizeof line) {
+			blk[0].len = 0;
+		}
+		block_append(blk, 1, LEN(blk), line, sizeof line);
+		bench_keep(blk[0].p);
+	}
+	bench_stop(b);
+
+	for(size_t i = 0; i < LEN(blk); i++) {
+		free(blk[i].p);
+	}
+}
+
+/* typing into the middle of a 64 block buffer */
+void
+BENCH_buffer_read_blocks(bench_t *b)
+{
+	char fill[BLOCK_SIZE / 2];
+	buffer_t buffer;
+	range_t rng = {{0, 0}, {0, 0}};
+	for(size_t i = 0; i < sizeof fill; i++) {
+		fill[i] = i % 64 == 63 ? '\n' : 'x';
+	}
+	buffer_init(&buffer, 1);
+	for(int i = 0; i < 128; i++) {
+		buffer_read(&buffer, &rng, fill, sizeof fill);
+		rng.start = rng.end;
+	}
+	address_t mid = {buffer.nblocks / 2, 100};
+
+	bench_start(b);
+	for(size_t i = 0; i < b->n; i++) {
+		rng.start = rng.end = mid;
+		buffer_read(&buffer, &rng, "x", 1);
+	}
+	bench_stop(b);
+
+	buffer_free(&buffer);
+}
+
 static size_t
 index_nrchr(const void *buf, int c, size_t len, size_t nr)
 {
@@ -1537,8 +1639,9 @@ buffer_read_blocks(buffer_t *buffer, range_t *rng, block_t *blk, int nmod, const
 	// copy the tail of the last selected block
 	block_t *last_sel = &buffer->block[rng->end.blk];
 	int tail_len = last_sel->len - rng->end.off;
-	nmod = block_append(blk, nmod, maxblk,
-		&last_sel->p->buf[rng->end.off], tail_len
+	nmod = block_append_at(blk, nmod, maxblk,
+		&last_sel->p->buf[rng->end.off], tail_len,
+		last_sel->foff < 0 ? -1 : last_sel->foff + rng->end.off
 	);
 
 	// if last modified block would be too small
@@ -1552,8 +1655,8 @@ buffer_read_blocks(buffer_t *buffer, range_t *rng, block_t *blk, int nmod, const
 			int next_back_len = (blk[nmod-1].len + next->len) / 2;
 			int next_front_len = next->len - next_back_len;
 			// take the front of the next block
-			nmod = block_append(blk, nmod, maxblk,
-				next->p->buf, next_front_len
+			nmod = block_append_at(blk, nmod, maxblk,
+				next->p->buf, next_front_len, next->foff
 			);
 			// shift the back of the next block
 			memmove(
@@ -1562,11 +1665,14 @@ buffer_read_blocks(buffer_t *buffer, range_t *rng, block_t *blk, int nmod, const
 				next_back_len
 			);
 			next->len = next_back_len;
+			if(next->foff >= 0) {
+				next->foff += next_front_len;
+			}
 			next->nlines = count_chr(next->p->buf, '\n', next->len);
 		} else {
 			// join the next block
-			nmod = block_append(blk, nmod, maxblk,
-				next->p->buf, next->len
+			nmod = block_append_at(blk, nmod, maxblk,
+				next->p->buf, next->len, next->foff
 			);
 			// FIXME: undo does not need the next buffer, for now it would be copied because nsel is incremented
 			next->len = 0;
@@ -1604,6 +1710,7 @@ buffer_read_blocks(buffer_t *buffer, range_t *rng, block_t *blk, int nmod, const
 		for(int i = sel_end; i < mod_end; i++) {
 			buffer->block[i].len = 0;
 			buffer->block[i].nlines = 0;
+			buffer->block[i].foff = -1;
 			buffer->block[i].p = xmalloc(1, BLOCK_SIZE);
 		}
 	}
@@ -1632,60 +1739,96 @@ out:
 	return len;
 }
 
+/* writes at most IOV_MAX blocks of the range with one writev, start is
+ * moved past the written bytes, returns 0 when the range is empty */
 int
 buffer_write_fd(buffer_t *buffer, range_t *rng, int fd)
 {
-	struct iovec iov[8];
-	int nsel = rng->end.blk - rng->start.blk + 1;
-	int niov = MIN(nsel, (int)LEN(iov));
-
-	iov[0].iov_base = &buffer->block[rng->start.blk].p->buf[rng->start.off];
-	if(nsel == 1) {
-		iov[0].iov_len = rng->end.off - rng->start.off;
-	} else {
-		iov[0].iov_len = buffer->block[rng->start.blk].len - rng->start.off;
-	}
-	for(int i = 1; i < niov; i++) {
-		iov[i].iov_base = buffer->block[rng->start.blk + i].p->buf;
-		iov[i].iov_len = buffer->block[rng->start.blk + i].len;
+	struct iovec iov[IOV_MAX];
+	int niov = 0;
+
+	address_t adr = rng->start;
+	for(; niov < (int)LEN(iov) && adr.blk <= rng->end.blk; adr.blk++, adr.off = 0) {
+		block_t *blk = &buffer->block[adr.blk];
+		int end = adr.blk == rng->end.blk ? rng->end.off : blk->len;
+		if(end > adr.off) {
+			iov[niov].iov_base = &blk->p->buf[adr.off];
+			iov[niov].iov_len = end - adr.off;
+			niov++;
+		}
 	}
-	if(nsel > 1 && nsel == niov) {
-		iov[nsel-1].iov_len = rng->end.off;
+	if(!niov) {
+		return 0;
 	}
+
 	ssize_t len = writev(fd, iov, niov);
 	if(len < 0) {
 		return -1;
 	}
 
-	int rest = len;
-	for(int i = 0; i < niov; i++) {
-		rest -= iov[i].iov_len;
-		if(rest <= 0) {
-			rng->start.blk += i;
-			if(i == 0) {
-				rest += rng->start.off;
-			}
-			rng->start.off = iov[i].iov_len + rest;
-			return len;
+	for(ssize_t rest = len; rest > 0; ) {
+		int left = buffer->block[rng->start.blk].len - rng->start.off;
+		if(rest < left || rng->start.blk == rng->end.blk) {
+			rng->start.off += rest;
+			break;
 		}
+		rest -= left;
+		rng->start.blk++;
+		rng->start.off = 0;
 	}
+	return len;
+}
 
-	// error?
-	return -2;
+int
+TEST_buffer_write_fd(void)
+{
+	enum { NBLOCKS = IOV_MAX * 2 + 1 };
+	char call[BUFSIZ];
+	char path[] = "/tmp/werf-test-XXXXXX";
+	buffer_t buffer;
+	int ret;
+
+	buffer_init(&buffer, NBLOCKS);
+	for(int i = 0; i < NBLOCKS; i++) {
+		buffer.block[i].len = i % 7 == 3 ? 0 : BLOCK_SIZE / 2;
+		memset(buffer.block[i].p->buf, 'a' + i % 26, buffer.block[i].len);
+	}
+	range_t rng = {{0, 10}, {NBLOCKS - 1, 5}};
+
+	int fd = mkstemp(path);
+	TEST_OP("%d", fd, >=, 0, "%s", "mkstemp");
+	unlink(path);
+
+	int total = 0;
+	int nwrites = 0;
+	do {
+		ret = TEST_CALL(call, sizeof(call), "%p, %p, %d",
+			buffer_write_fd, ((void*)&buffer, (void*)&rng, fd));
+		TEST_OP("%d", ret, >=, 0, "%s", call);
+		total += ret;
+		nwrites++;
+	} while(ret > 0);
+	TEST_OP("%d", nwrites, ==, 3, "%s", "IOV_MAX batches and the final 0");
+
+	int expect = -10;
+	for(int i = 0; i < NBLOCKS - 1; i++) {
+		expect += buffer.block[i].len;
+	}
+	expect += 5;
+	TEST_OP("%d", total, ==, expect, "%s", call);
+	TEST_OP("%d", (int)lseek(fd, 0, SEEK_CUR), ==, expect, "%s", call);
+
+	char buf[BLOCK_SIZE];
+	TEST_OP("%d", (int)pread(fd, buf, 3, 0), ==, 3, "%s", "pread");
+	TEST_OP("%d", buf[0], ==, 'a', "%s", "first written block");
+
+	close(fd);
+	buffer_free(&buffer);
+	return 0;
 }
 
-int64_t
-buffer_address_move_off(buffer_t *buffer, address_t *adr, int64_t move);
-void
-buffer_address_move_lines(buffer_t *buffer, address_t *adr, int64_t move);
-void
-buffer_nr_to_address(buffer_t *buffer, int64_t nr, address_t *adr);
-void
-buffer_nr_off_to_address(buffer_t *buffer, int64_t nr, int64_t off, address_t *adr);
 static int
 block_count_nl(char *buf, int len, int *nl_off);
-void
-buffer_address_to_nr_off(buffer_t *buffer, address_t *adr, int64_t *nr, int64_t *off);
 
 int
 TEST_blocks(void)
@@ -0,0 +1,38 @@
+#define BLOCK_SIZE 4096
+
+typedef struct {
+	int len; // 0..BLOCK_SIZE
+	int nlines; // 0..BLOCK_SIZE
+	struct blockbuf { char buf[BLOCK_SIZE]; } *p; // != NULL
+	int64_t foff; // offset in the file it was read from, -1 when edited
+} block_t;
+
+typedef struct {
+	int nblocks; // 1..INT_MAX
+	int64_t nlines; // 0..INT64_MAX
+	block_t *block; // != NULL
+} buffer_t;
+
+typedef struct {
+	int blk; // 0..INT_MAX
+	int off; // 0..BLOCK_SIZE
+} address_t;
+
+// for undo use buffer wide offsets
+typedef struct {
+	address_t start;
+	address_t end;
+} range_t;
+
+void buffer_init(buffer_t *buffer, int nblocks);
+void buffer_free(buffer_t *buffer);
+int buffer_read(buffer_t *buffer, range_t *rng, char *mod, int len);
+int buffer_read_fd(buffer_t *buffer, range_t *rng, int fd);
+int buffer_read_blocks(buffer_t *buffer, range_t *rng, block_t *blk, int nmod, const int maxblk, int len);
+int buffer_write_fd(buffer_t *buffer, range_t *rng, int fd);
+
+int64_t buffer_address_move_off(buffer_t *buffer, address_t *adr, int64_t move);
+void buffer_address_move_lines(buffer_t *buffer, address_t *adr, int64_t move);
+void buffer_nr_to_address(buffer_t *buffer, int64_t nr, address_t *adr);
+void buffer_nr_off_to_address(buffer_t *buffer, int64_t nr, int64_t off, address_t *adr);
+void buffer_address_to_nr_off(buffer_t *buffer, address_t *adr, int64_t *nr, int64_t *off);
@@ -1,3 +1,6 @@
+#include <stdint.h>
+#include <stdlib.h>
+
 #include <X11/Xlib.h>
 
 #include <cairo/cairo.h>
@@ -5,7 +8,9 @@
 #include "util.h"
 #include "array.h"
 
+#include "re.h"
 #include "edit.h"
+#include "wrap.h"
 #include "view.h"
 
 void
@@ -22,6 +27,16 @@ command_redo(view_t *v)
 	v->last_x = view_address_to_x(v, &v->range.start);
 }
 
+bool
+command_find(view_t *v, re_t *re, bool backward)
+{
+	if(!range_find(&v->range, re, backward)) {
+		return false;
+	}
+	v->last_x = view_address_to_x(v, &v->range.start);
+	return true;
+}
+
 void
 command_page_up(view_t *v)
 {
@@ -82,6 +97,31 @@ command_new_line(view_t *v)
 	v->last_x = view_address_to_x(v, &v->range.start);
 }
 
+/* a tab in front of every line of the selection, undone as one */
+void
+command_indent(view_t *v)
+{
+	range_t *rng = &v->range;
+	size_t last = rng->end.line;
+	if(last > rng->start.line && rng->end.offset == 0) {
+		last--;
+	}
+	size_t n = last - rng->start.line + 1;
+	edit_t *edits = xmalloc(n, sizeof edits[0]);
+	for(size_t i = 0; i < n; i++) {
+		address_t adr = {rng->start.line + i, 0};
+		edits[i] = (edit_t){adr, adr, "\t", 1};
+	}
+	file_push_batch(rng->file, edits, n);
+	free(edits);
+
+	rng->start.offset = 0;
+	if(rng->end.line == last) {
+		rng->end.offset++;
+	}
+	v->last_x = view_address_to_x(v, &v->range.start);
+}
+
 void
 command_left(view_t *v)
 {
@@ -1,5 +1,6 @@
 void command_undo(view_t *v);
 void command_redo(view_t *v);
+bool command_find(view_t *v, re_t *re, bool backward);
 void command_page_up(view_t *v);
 void command_page_down(view_t *v);
 void command_home(view_t *v);
@@ -7,6 +8,7 @@ void command_end(view_t *v);
 void command_backspace(view_t *v);
 void command_delete(view_t *v);
 void command_new_line(view_t *v);
+void command_indent(view_t *v);
 void command_left(view_t *v);
 void command_right(view_t *v);
 void command_up(view_t *v);
@@ -1,3 +1,6 @@
+#include <limits.h>
+#include <stdint.h>
+
 #include <cairo/cairo.h>
 
 #include <X11/Xlib.h>
@@ -5,15 +8,18 @@
 #include "util.h"
 #include "array.h"
 
+#include "re.h"
 #include "edit.h"
+#include "wrap.h"
 #include "view.h"
 #include "draw.h"
+#include "atlas.h"
+
+static atlas_t atlas;
 
 void
-draw_cursor(cairo_t *cr, view_t *v, address_t *adr)
+draw_cursor(cairo_t *cr, view_t *v, double x)
 {
-	double x = view_address_to_x(v, adr);
-
 	cairo_save(cr);
 	cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
 
@@ -37,40 +43,97 @@ draw_cursor(cairo_t *cr, view_t *v, address_t *adr)
 	cairo_restore(cr);
 }
 
+/* glyphs of the range on line nr, from s up to e, to the end of a row
+ * when it goes on past it; false when it is not on the line */
+static bool
+range_glyphs(glyphs_t *gl, range_t *rng, size_t nr, int *s, int *e)
+{
+	if(nr < rng->start.line || nr > rng->end.line) {
+		return false;
+	}
+	*s = nr == rng->start.line ? gl->offset_to_glyph[rng->start.offset] : 0;
+	*e = nr == rng->end.line ? gl->offset_to_glyph[rng->end.offset] : INT_MAX;
+	return true;
+}
+
+/* the part of row r from glyph s up to e, x0 is where the row starts */
+static void
+draw_span(cairo_t *cr, view_t *v, glyphs_t *gl, int r, int s, int e, double x0)
+{
+	int rs = gl->rows[r];
+	int re = r + 1 < gl->nrows ? gl->rows[r + 1] : gl->nmemb;
+	if(s >= re || e < rs) {
+		return;
+	}
+	double left = s <= rs ? 0 : v->left_margin + gl->data[s].x - x0;
+	double right = e >= re ? v->width : v->left_margin + gl->data[e].x - x0;
+	cairo_rectangle(cr, left, r * v->line_height, right - left, v->line_height);
+}
+
+/* marks are sorted and do not overlap, so by their ends too */
+static size_t
+marks_from(rangearray_t *marks, size_t nr)
+{
+	size_t lo = 0;
+	size_t hi = marks->nmemb;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(marks->data[mid].end.line < nr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* a shaped line, row by row, the view is not scrolled to it */
 void
 draw_line(cairo_t *cr, view_t *v, size_t nr)
 {
-	glyphs_t *gl = view_get_glyphs(v, nr);
+	glyphs_t *gl = &v->shaped.lines[nr - v->shaped.first];
+	range_t *rng = &v->range;
+	rangearray_t *marks = v->layout->marks;
+	size_t first_mark = marks ? marks_from(marks, nr) : 0;
+
+	int sel_s = gl->nmemb;
+	int sel_e = 0;
+	range_glyphs(gl, rng, nr, &sel_s, &sel_e);
 
 	cairo_save(cr);
 
 	cairo_translate(cr, 0, view_line_to_y(v, nr));
 
-	double sel_s = 0;
-	double sel_e = 0;
+	for(int r = 0; r < gl->nrows; r++) {
+		int rs = gl->rows[r];
+		int re = r + 1 < gl->nrows ? gl->rows[r + 1] : gl->nmemb;
+		double x0 = gl->data[rs].x;
+		int s, e;
 
-	if(nr == v->range.start.line) {
-		sel_s = view_address_to_x(v, &v->range.start);
-	}
-	if(nr == v->range.end.line) {
-		sel_e = view_address_to_x(v, &v->range.end);
-	} else if(nr >= v->range.start.line && nr < v->range.end.line) {
-		sel_e = v->width;
-	}
-
-	cairo_save(cr);
-	cairo_set_source_rgb(cr, 0.625, 0.75, 1);
-	cairo_rectangle(cr, sel_s, 0, sel_e - sel_s, v->line_height);
-	cairo_clip(cr);
-	cairo_paint(cr);
-	cairo_restore(cr);
+		cairo_save(cr);
+		for(size_t i = first_mark; marks && i < marks->nmemb &&
+				range_glyphs(gl, &marks->data[i], nr, &s, &e); i++) {
+			draw_span(cr, v, gl, r, s, e, x0);
+		}
+		cairo_set_source_rgb(cr, 1, 0.875, 0.5);
+		cairo_fill(cr);
+		draw_span(cr, v, gl, r, sel_s, sel_e, x0);
+		cairo_set_source_rgb(cr, 0.625, 0.75, 1);
+		cairo_fill(cr);
+		cairo_restore(cr);
 
-	if(nr == v->range.start.line && !address_cmp(&v->range.start, &v->range.end)) {
-		draw_cursor(cr, v, &v->range.start);
+		cairo_save(cr);
+		cairo_translate(cr, v->left_margin - x0, r * v->line_height + v->extents.ascent);
+		atlas_show_glyphs(&atlas, cr, gl->data + rs, re - rs);
+		cairo_restore(cr);
 	}
 
-	cairo_translate(cr, v->left_margin, v->extents.ascent);
-	cairo_show_glyphs(cr, gl->data, gl->nmemb);
+	if(nr == rng->start.line && !address_cmp(&rng->start, &rng->end)) {
+		int gi = gl->offset_to_glyph[rng->start.offset];
+		int r = glyphs_row(gl, gi);
+		cairo_translate(cr, 0, r * v->line_height);
+		draw_cursor(cr, v, v->left_margin + gl->data[gi].x - gl->data[gl->rows[r]].x);
+	}
 
 	cairo_restore(cr);
 }
@@ -83,7 +146,7 @@ draw_button(cairo_t *cr, view_t *v, button_t *btn)
 	cairo_save(cr);
 	{
 		cairo_translate(cr, 0, v->extents.ascent);
-		cairo_show_glyphs(cr, btn->glyphs.data, btn->glyphs.nmemb);
+		atlas_show_glyphs(&atlas, cr, btn->glyphs.data, btn->glyphs.nmemb);
 	}
 	cairo_restore(cr);
 
@@ -101,6 +164,28 @@ draw_button(cairo_t *cr, view_t *v, button_t *btn)
 	cairo_restore(cr);
 }
 
+/* kept between frames, made again only when the line height changes */
+static cairo_pattern_t *
+toolbar_shade(double height)
+{
+	static cairo_pattern_t *pat;
+	static double pat_height;
+
+	if(pat && pat_height == height) {
+		return pat;
+	}
+	if(pat) {
+		cairo_pattern_destroy(pat);
+	}
+	pat = cairo_pattern_create_linear(0.0, 0.0, 0.0, height);
+	cairo_pattern_add_color_stop_rgba(pat, 0, 0, 0, 0, 0.25);
+	cairo_pattern_add_color_stop_rgba(pat, 0.25, 0, 0, 0, 0);
+	cairo_pattern_add_color_stop_rgba(pat, 1-0.25, 0, 0, 0, 0);
+	cairo_pattern_add_color_stop_rgba(pat, 1, 0, 0, 0, 0.25);
+	pat_height = height;
+	return pat;
+}
+
 void
 draw_toolbar(cairo_t *cr, view_t *v, toolbar_t *bar, double y)
 {
@@ -130,15 +215,9 @@ draw_toolbar(cairo_t *cr, view_t *v, toolbar_t *bar, double y)
 
 		cairo_save(cr);
 		{
-			cairo_pattern_t *pat = cairo_pattern_create_linear(0.0, 0.0, 0.0, v->line_height);
-			cairo_pattern_add_color_stop_rgba(pat, 0, 0, 0, 0, 0.25);
-			cairo_pattern_add_color_stop_rgba(pat, 0.25, 0, 0, 0, 0);
-			cairo_pattern_add_color_stop_rgba(pat, 1-0.25, 0, 0, 0, 0);
-			cairo_pattern_add_color_stop_rgba(pat, 1, 0, 0, 0, 0.25);
 			cairo_rectangle(cr, 0, 0, v->width, v->line_height);
-			cairo_set_source(cr, pat);
+			cairo_set_source(cr, toolbar_shade(v->line_height));
 			cairo_fill(cr);
-			cairo_pattern_destroy(pat);
 		}
 		cairo_restore(cr);
 	}
@@ -153,8 +232,11 @@ draw_view(cairo_t *cr, view_t *v)
 	if(!v->nmemb) {
 		return;
 	}
-	size_t start = clampss(v->start, 0, v->range.file->content.nmemb - 1);
-	size_t end = view_clamp_start(v, v->start + v->nmemb - 1);
+	if(view_stale(v)) {
+		view_reshape(v);
+	}
+	size_t start = v->shaped.first;
+	size_t end = v->shaped.first + v->shaped.nlines - 1;
 
 	if(start == 0) {
 		cairo_save(cr);
@@ -184,3 +266,71 @@ draw_view(cairo_t *cr, view_t *v)
 		draw_toolbar(cr, v, &v->selbar_wrap.bar, view_line_to_y(v, v->selbar_wrap.line));
 	}
 }
+
+/* the glyph atlas goes with the fonts it references */
+void
+draw_free(void)
+{
+	atlas_free(&atlas);
+}
+
+/* four lanes, so the multiplies do not wait on each other */
+static uint64_t
+row_hash(const uint32_t *px, int n)
+{
+	const uint64_t k = UINT64_C(0x100000001B3);
+	uint64_t h[4] = {1, 2, 3, 4};
+	int i = 0;
+	for(; i + 4 <= n; i += 4) {
+		for(int j = 0; j < 4; j++) {
+			h[j] = (h[j] ^ px[i + j]) * k;
+		}
+	}
+	for(; i < n; i++) {
+		h[0] = (h[0] ^ px[i]) * k;
+	}
+	return h[0] ^ (h[1] << 16 | h[1] >> 48) ^ (h[2] << 32 | h[2] >> 32) ^
+		(h[3] << 48 | h[3] >> 16);
+}
+
+/* Rows of the frame in the image surface surf that differ from the
+ * frame before, by a hash of each row, as bands to present; with all,
+ * every row. Bands a few rows apart are joined, a request costs more
+ * than the rows between them. */
+void
+damage_find(damage_t *d, cairo_surface_t *surf, int width, int height, bool all)
+{
+	const uint8_t *data = cairo_image_surface_get_data(surf);
+	int stride = cairo_image_surface_get_stride(surf);
+
+	if(d->width != width || d->rowhash.nmemb != (size_t)height) {
+		d->width = width;
+		d->rowhash.nmemb = 0;
+		ARR_EXTEND(&d->rowhash, height);
+		all = true;
+	}
+	d->bands.nmemb = 0;
+	d->nrows = 0;
+	for(int y = 0; y < height; y++) {
+		uint64_t h = row_hash((const uint32_t*)(data + (size_t)y * stride), width);
+		if(!all && h == d->rowhash.data[y]) {
+			continue;
+		}
+		d->rowhash.data[y] = h;
+		d->nrows++;
+		band_t *b = d->bands.nmemb ? &d->bands.data[d->bands.nmemb - 1] : NULL;
+		if(b && y - (b->y + b->height) < DAMAGE_GAP) {
+			b->height = y + 1 - b->y;
+		} else {
+			ARR_EXTEND(&d->bands, 1);
+			d->bands.data[d->bands.nmemb - 1] = (band_t){y, 1};
+		}
+	}
+}
+
+void
+damage_free(damage_t *d)
+{
+	ARR_FREE(&d->rowhash);
+	ARR_FREE(&d->bands);
+}
@@ -1,5 +1,24 @@
-void draw_cursor(cairo_t *cr, view_t *v, address_t *adr);
+void draw_cursor(cairo_t *cr, view_t *v, double x);
 void draw_line(cairo_t *cr, view_t *v, size_t nr);
 void draw_button(cairo_t *cr, view_t *v, button_t *btn);
 void draw_toolbar(cairo_t *cr, view_t *v, toolbar_t *bar, double y);
 void draw_view(cairo_t *cr, view_t *v);
+void draw_free(void);
+
+enum { DAMAGE_GAP = 8 }; // unchanged rows a band may span
+
+typedef struct {
+	int y;
+	int height;
+} band_t;
+
+/* what changed between frames */
+typedef struct {
+	ARRAY(uint64_t) rowhash; // of the frame before
+	int width;
+	ARRAY(band_t) bands; // changed rows, top to bottom
+	size_t nrows; // changed
+} damage_t;
+
+void damage_find(damage_t *d, cairo_surface_t *surf, int width, int height, bool all);
+void damage_free(damage_t *d);
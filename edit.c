@@ -1,8 +1,15 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,25 +17,73 @@
 #include "util.h"
 #include "array.h"
 
+#include "re.h"
 #include "edit.h"
+#include "proto.h"
+#include "remote.h"
 #include "utf.h"
+#include "bench.h"
+#include "trace.h"
+#include "alloc.h"
+
+static void file_untrack(file_t *f);
+static void file_will_change(file_t *f);
+static void line_unshare(file_t *f, size_t line);
+static void lines_resize(file_t *f, size_t start, size_t end, size_t nmemb);
 
 void
 file_insert_line(file_t *f, size_t line, char *buf, size_t buf_len)
 {
-	ARR_FRAG_RESIZE(&f->content, line, line, 1);
-
-	memset(f->content.data + line, 0, sizeof f->content.data[0]);
-	ARR_RESIZE(&f->content.data[line], buf_len);
+	int tag = alloc_tag(ALLOC_DOCUMENT);
+	lines_resize(f, line, line, 1);
+	istr_resize(&f->content.data[line], buf_len);
 
-	memcpy(f->content.data[line].data, buf, buf_len);
+	if(buf_len) {
+		memcpy(istr_data(&f->content.data[line]), buf, buf_len);
+	}
+	alloc_tag(tag);
 }
 
 void
 file_free(file_t *f)
 {
-	ARR_FRAG_APPLY(&f->content, 0, f->content.nmemb, (array_memb_func_t)array_free);
+	file_save_wait(f);
+	ARR_FRAG_APPLY(&f->content, 0, f->content.nmemb, (array_memb_func_t)istr_free);
 	ARR_FREE(&f->content);
+	file_untrack(f);
+}
+
+/* lines start to old_end become new_end - start empty ones */
+void
+file_splice_lines(file_t *f, size_t start, size_t old_end, size_t new_end)
+{
+	int tag = alloc_tag(ALLOC_DOCUMENT);
+	lines_resize(f, start, old_end, new_end - start);
+	file_note_change(f, start, old_end, new_end);
+	alloc_tag(tag);
+}
+
+/* not recorded as a change, the caller notes the lines it set */
+void
+file_set_line(file_t *f, size_t line, char *buf, size_t buf_len)
+{
+	int tag = alloc_tag(ALLOC_DOCUMENT);
+	line_unshare(f, line);
+	istring_t *l = &f->content.data[line];
+	istr_resize(l, buf_len);
+	if(buf_len) {
+		memcpy(istr_data(l), buf, buf_len);
+	}
+	alloc_tag(tag);
+}
+
+/* lines about to be read, a mirror gets the ones it lacks */
+void
+file_fetch(file_t *f, size_t start, size_t end)
+{
+	if(f->remote) {
+		remote_fetch(f->remote, start, end);
+	}
 }
 
 int
@@ -74,10 +129,63 @@ range_fix_end(range_t *rng)
 	}
 }
 
+/* at most to the end of its line, before the newline */
+static void
+address_clamp(file_t *f, address_t *adr)
+{
+	if(adr->line >= f->content.nmemb) {
+		adr->line = f->content.nmemb - 1;
+		adr->offset = SIZE_MAX;
+	}
+	istring_t *line = &f->content.data[adr->line];
+	size_t len = istr_len(line);
+	if(len && istr_data(line)[len - 1] == '\n') {
+		len--;
+	}
+	adr->offset = MIN(adr->offset, len);
+}
+
+/* on a line that went, to the end of the last that replaced it */
+static void
+address_splice(address_t *adr, linechange_t *c)
+{
+	if(adr->line >= c->old_end) {
+		adr->line = adr->line - c->old_end + c->new_end;
+	} else if(adr->line >= c->new_end && c->new_end > c->start) {
+		adr->line = c->new_end - 1;
+		adr->offset = SIZE_MAX;
+	} else if(adr->line >= c->new_end) {
+		adr->line = c->start;
+		adr->offset = 0;
+	}
+}
+
+/* Moves a range kept across edits, as a view's selection, through the
+ * changes made to its file since gen, except those made through it. When
+ * more were made than the file keeps it is only put back in the file. */
+void
+range_follow(range_t *rng, uint64_t *gen)
+{
+	file_t *f = rng->file;
+	if(f->nchanges - *gen <= FILE_CHANGES) {
+		for(; *gen < f->nchanges; (*gen)++) {
+			linechange_t *c = &f->changes[*gen % FILE_CHANGES];
+			if(c->by != rng) {
+				address_splice(&rng->start, c);
+				address_splice(&rng->end, c);
+			}
+		}
+	}
+	*gen = f->nchanges;
+	address_clamp(f, &rng->start);
+	address_clamp(f, &rng->end);
+}
+
 static void
 range_mod_line(range_t *rng, char *mod_line, size_t mod_len)
 {
-	string_t *line = rng->file->content.data + rng->start.line;
+	line_unshare(rng->file, rng->start.line);
+	istring_t *line = rng->file->content.data + rng->start.line;
 
 	size_t end_offset;
 	size_t rest_len;
@@ -86,22 +194,30 @@ range_mod_line(range_t *rng, char *mod_line, size_t mod_len)
 	if(rng->start.line == rng->end.line) {
 		end_offset = rng->end.offset;
 	} else {
-		end_offset = line->nmemb;
+		end_offset = istr_len(line);
 	}
 
-	rest_len = line->nmemb - end_offset;
+	rest_len = istr_len(line) - end_offset;
 	insert_new_line = (rest_len > 0 || rng->start.line == rng->end.line) &&
 			mod_len > 0 && mod_line[mod_len - 1] == '\n';
 
 	if(insert_new_line) {
-		char *rest = line->data + end_offset;
+		// an inline line moves with the content array
+		char small[ISTR_INLINE];
+		char *rest = istr_data(line) + end_offset;
+		if(istr_is_inline(line)) {
+			memcpy(small, rest, rest_len);
+			rest = small;
+		}
 		file_insert_line(rng->file, rng->end.line+1, rest, rest_len);
 		line = rng->file->content.data + rng->start.line;
-		line->nmemb -= rest_len;
+		istr_resize(line, istr_len(line) - rest_len);
 	}
 
-	ARR_FRAG_RESIZE(line, rng->start.offset, end_offset, mod_len);
-	memcpy(line->data + rng->start.offset, mod_line, mod_len);
+	istr_fragment_resize(line, rng->start.offset, end_offset, mod_len);
+	if(mod_len) {
+		memcpy(istr_data(line) + rng->start.offset, mod_line, mod_len);
+	}
 
 	if(mod_len > 0 && mod_line[mod_len - 1] == '\n') {
 		rng->start.line++;
@@ -118,16 +234,16 @@ range_mod_line(range_t *rng, char *mod_line, size_t mod_len)
 			rng->end.line++;
 			rng->end.offset = 0;
 		}
-		string_t *rest_line = rng->file->content.data + rng->end.line;
-		char *rest = rest_line->data + rng->end.offset;
-		rest_len = rest_line->nmemb - rng->end.offset;
+		istring_t *rest_line = rng->file->content.data + rng->end.line;
+		rest_len = istr_len(rest_line) - rng->end.offset;
 
-		ARR_FRAG_RESIZE(line, rng->start.offset, line->nmemb, rest_len);
-		memcpy(line->data + rng->start.offset, rest, rest_len);
+		istr_fragment_resize(line, rng->start.offset, istr_len(line), rest_len);
+		if(rest_len) {
+			memcpy(istr_data(line) + rng->start.offset,
+				istr_data(rest_line) + rng->end.offset, rest_len);
+		}
 
-		ARR_FRAG_APPLY(&rng->file->content, rng->start.line+1, rng->end.line+1,
-				(array_memb_func_t)array_free);
-		ARR_FRAG_RESIZE(&rng->file->content, rng->start.line+1, rng->end.line+1, 0);
+		lines_resize(rng->file, rng->start.line+1, rng->end.line+1, 0);
 	}
 
 	rng->end.line = rng->start.line;
@@ -149,21 +265,169 @@ TEST_range_mod_line(void) {
 		char mod_line[] = "def";
 		range_mod_line(&rng, mod_line, sizeof(mod_line)-1);
 	}
-	assert(is_str_eq(file.content.data[0].data, file.content.data[0].nmemb,
+	assert(is_str_eq(istr_data(&file.content.data[0]), istr_len(&file.content.data[0]),
 		"1abc\n", 5));
-	assert(is_str_eq(file.content.data[1].data, file.content.data[0].nmemb,
+	assert(is_str_eq(istr_data(&file.content.data[1]), istr_len(&file.content.data[0]),
 		"def6\n", 5));
 	file_free(&file);
 
 	return 0;
 }
 
+/* Lines that differ from the file on disk, for saving in place. Each
+ * run of them knows how many bytes it took in the file, the lines between
+ * runs are as they were, so where everything is in the file follows from
+ * the lengths of the lines. Runs are kept apart by at least one line. */
+typedef struct {
+	size_t start; // lines as they are now
+	size_t end;
+	size_t old_len; // bytes the run replaces in the file
+} dirty_t;
+
+struct file_disk {
+	char *fname;
+	struct stat st; // as written or read, a file changed since is rewritten
+	ARRAY(dirty_t) dirty; // sorted
+	dirty_t next; // of the change being made, see file_dirty
+	bool lost; // a change not seen by file_dirty, no saving in place
+};
+
+static void
+file_track_stat(file_t *f, const char *fname, struct stat *st)
+{
+	struct file_disk *d = f->disk;
+	if(!d) {
+		d = f->disk = xmalloc(1, sizeof *d);
+		memset(d, 0, sizeof *d);
+	}
+	if(!d->fname || strcmp(d->fname, fname)) {
+		free(d->fname);
+		d->fname = strdup(fname);
+		DIEIF(!d->fname);
+	}
+	d->st = *st;
+	d->dirty.nmemb = 0;
+	d->next = (dirty_t){0};
+	d->lost = false;
+}
+
+/* f holds what fd, open on fname, holds; saves to fname will write only
+ * what was changed since */
+void
+file_track(file_t *f, const char *fname, int fd)
+{
+	struct stat st;
+	if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		return;
+	}
+	file_track_stat(f, fname, &st);
+}
+
+static void
+file_untrack(file_t *f)
+{
+	if(f->disk) {
+		free(f->disk->fname);
+		ARR_FREE(&f->disk->dirty);
+		free(f->disk);
+		f->disk = NULL;
+	}
+}
+
+/* first run that ends at or after line */
+static size_t
+dirty_search(struct file_disk *d, size_t line)
+{
+	size_t lo = 0, hi = d->dirty.nmemb;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(d->dirty.data[mid].end < line) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* Lines start to end are about to change, counted into the run of the
+ * change while their text is still there; runs it touches join it. A
+ * change may call it again for the lines right after, as it finds them,
+ * before file_note_change. */
+static void
+file_dirty(file_t *f, size_t start, size_t end)
+{
+	struct file_disk *d = f->disk;
+	if(!d || d->lost) {
+		return;
+	}
+	dirty_t *n = &d->next;
+	if(n->end == n->start) {
+		*n = (dirty_t){start, start, 0};
+	}
+	DIEIF(start < n->start || start > n->end);
+
+	size_t i = dirty_search(d, n->start);
+	for(;;) {
+		if(i < d->dirty.nmemb && d->dirty.data[i].start <= n->end) {
+			dirty_t *x = &d->dirty.data[i];
+			n->start = MIN(n->start, x->start);
+			n->end = MAX(n->end, x->end);
+			n->old_len += x->old_len;
+			ARR_FRAG_RESIZE(&d->dirty, i, i + 1, 0);
+			continue;
+		}
+		if(n->end >= end) {
+			break;
+		}
+		n->old_len += istr_len(&f->content.data[n->end]);
+		n->end++;
+	}
+}
+
+/* the run of the change goes in with the lines after it shifted */
+static void
+file_disk_note(struct file_disk *d, size_t start, size_t old_end, size_t new_end)
+{
+	dirty_t n = d->next;
+	d->next = (dirty_t){0};
+	if(d->lost) {
+		return;
+	}
+	if(n.end == n.start || start < n.start || old_end > n.end) {
+		d->lost = true;
+		return;
+	}
+	n.end = n.end - old_end + new_end;
+	size_t i = dirty_search(d, n.start);
+	for(size_t j = i; j < d->dirty.nmemb; j++) {
+		d->dirty.data[j].start = d->dirty.data[j].start - old_end + new_end;
+		d->dirty.data[j].end = d->dirty.data[j].end - old_end + new_end;
+	}
+	ARR_FRAG_RESIZE(&d->dirty, i, i, 1);
+	d->dirty.data[i] = n;
+}
+
+/* for views, lines added with file_insert_line alone are not recorded */
+void
+file_note_change(file_t *f, size_t start, size_t old_end, size_t new_end)
+{
+	f->changes[f->nchanges++ % FILE_CHANGES] = (linechange_t){start, old_end, new_end, f->editing};
+	if(f->disk) {
+		file_disk_note(f->disk, start, old_end, new_end);
+	}
+}
+
 static void
 range_mod(range_t *rng, char *mod, size_t mod_len)
 {
 	size_t rest = mod_len;
 	char *next;
+	size_t start = rng->start.line;
+	size_t old_end = rng->end.line + 1;
+	int tag = alloc_tag(ALLOC_DOCUMENT);
 
+	file_dirty(rng->file, start, old_end);
 	while(rest > 0) {
 		next = memchr(mod, '\n', rest);
 		if(next != NULL) {
@@ -179,6 +443,8 @@ range_mod(range_t *rng, char *mod, size_t mod_len)
 		rest -= mod_len;
 	}
 	range_mod_line(rng, "", 0);
+	file_note_change(rng->file, start, old_end, rng->end.line + 1);
+	alloc_tag(tag);
 }
 
 int
@@ -191,15 +457,127 @@ TEST_range_mod(void) {
 	};
 	char mod_line[] = "abc\ndef";
 	range_mod(&rng, mod_line, sizeof(mod_line)-1);
-	assert(is_str_eq(file.content.data[0].data, file.content.data[0].nmemb,
+	assert(is_str_eq(istr_data(&file.content.data[0]), istr_len(&file.content.data[0]),
 		"1abc\n", 5));
-	assert(is_str_eq(file.content.data[1].data, file.content.data[0].nmemb,
+	assert(is_str_eq(istr_data(&file.content.data[1]), istr_len(&file.content.data[0]),
 		"def6\n", 5));
 	file_free(&file);
 
 	return 0;
 }
 
+/* b is another view's selection, a the one edits are made through */
+int
+TEST_range_follow(void)
+{
+	file_t file = { 0 };
+	char text[16];
+	for(int i = 0; i < 10; i++) {
+		int len = snprintf(text, sizeof text, "line %d\n", i);
+		file_insert_line(&file, i, text, len);
+	}
+	range_t a = { {3, 0}, {8, 0}, &file };
+	range_t b = { {5, 2}, {6, 3}, &file };
+	uint64_t gen_a = file.nchanges, gen_b = file.nchanges;
+
+	// lines deleted under b, b goes to the end of what is left of them
+	range_push(&a, "", 0, OP_Replace);
+	range_follow(&a, &gen_a);
+	range_follow(&b, &gen_b);
+	assert(file.content.nmemb == 5);
+	assert(a.start.line == 3 && a.start.offset == 0 && a.end.line == 3 && a.end.offset == 0);
+	assert(b.start.line == 3 && b.start.offset == 6 && b.end.line == 3 && b.end.offset == 6);
+
+	// a shortened line
+	a = (range_t){ {3, 0}, {3, 5}, &file };
+	range_push(&a, "x", 1, OP_Replace);
+	range_follow(&b, &gen_b);
+	assert(b.start.line == 3 && b.start.offset == 2 && b.end.offset == 2);
+
+	// lines after an edit move along
+	b = (range_t){ {4, 1}, {4, 3}, &file };
+	a = (range_t){ {0, 0}, {1, 2}, &file };
+	range_push(&a, "y", 1, OP_Replace);
+	range_follow(&b, &gen_b);
+	assert(b.start.line == 3 && b.start.offset == 1 && b.end.line == 3 && b.end.offset == 3);
+
+	// more edits than the file keeps, b is only put back in the file
+	b = (range_t){ {3, 0}, {3, 4}, &file };
+	for(int i = 0; i <= FILE_CHANGES; i++) {
+		a = (range_t){ {1, 0}, {2, 0}, &file };
+		range_push(&a, "", 0, OP_Replace);
+		a = (range_t){ {0, 0}, {0, 0}, &file };
+		range_push(&a, i == FILE_CHANGES ? "z" : "z\n", i == FILE_CHANGES ? 1 : 2, OP_Char);
+	}
+	range_follow(&b, &gen_b);
+	assert(b.start.line < file.content.nmemb && b.end.line < file.content.nmemb);
+	assert(b.end.offset <= istr_len(&file.content.data[b.end.line]));
+
+	free(file.undobuf.first);
+	free(file.redobuf.first);
+	file_free(&file);
+	return 0;
+}
+
+int
+TEST_range_mod_inline(void) {
+	file_t file = { 0 };
+	file_insert_line(&file, 0, "ab\n", 3);
+	file_insert_line(&file, 1, "a line too long to be inline\n", 29);
+	assert(istr_is_inline(&file.content.data[0]));
+	assert(!istr_is_inline(&file.content.data[1]));
+
+	// splits the inline line
+	range_t rng = { {0, 1}, {0, 1}, &file };
+	range_mod(&rng, "\n", 1);
+	assert(file.content.nmemb == 3);
+	assert(is_str_eq(istr_data(&file.content.data[1]), istr_len(&file.content.data[1]),
+		"b\n", 2));
+
+	// joins the long line onto it, which moves it to the heap
+	rng = (range_t){ {1, 1}, {2, 0}, &file };
+	range_mod(&rng, "", 0);
+	assert(file.content.nmemb == 2);
+	assert(!istr_is_inline(&file.content.data[1]));
+
+	char buf[BUFSIZ];
+	rng = (range_t){ {0, 0}, {1, 30}, &file };
+	size_t len = range_copy(&rng, buf, sizeof(buf));
+	assert(is_str_eq(buf, len, "a\nba line too long to be inline\n", 32));
+
+	// and back
+	rng = (range_t){ {1, 2}, {1, 29}, &file };
+	range_mod(&rng, "", 0);
+	assert(istr_is_inline(&file.content.data[1]));
+	assert(is_str_eq(istr_data(&file.content.data[1]), istr_len(&file.content.data[1]),
+		"ba\n", 3));
+	file_free(&file);
+
+	return 0;
+}
+
+/* replaces one char in the middle of a thousand line file */
+void
+BENCH_range_mod(bench_t *b)
+{
+	file_t file = { 0 };
+	char line[] = "\tsome line of text, as long as a line of code\n";
+	for(size_t i = 0; i < 1000; i++) {
+		file_insert_line(&file, i, line, sizeof(line)-1);
+	}
+	range_t rng = { .file = &file };
+
+	bench_start(b);
+	for(size_t i = 0; i < b->n; i++) {
+		rng.start = (address_t){500, 10};
+		rng.end = (address_t){500, 11};
+		range_mod(&rng, "y", 1);
+	}
+	bench_stop(b);
+
+	file_free(&file);
+}
+
 int
 range_read(range_t *rng, int fd)
 {
@@ -215,6 +593,464 @@ range_read(range_t *rng, int fd)
 	return 0;
 }
 
+/* Adds what fd has left to read at the end of the file, as one change,
+ * so the wrap index only splices the last line; not recorded for undo,
+ * the text comes from whoever writes the file. Returns the bytes read. */
+ssize_t
+file_append_fd(file_t *f, int fd)
+{
+	string_t buf = {0};
+	ssize_t len;
+	do {
+		size_t start = buf.nmemb;
+		ARR_EXTEND(&buf, BUFSIZ);
+		len = read(fd, buf.data + start, BUFSIZ);
+		buf.nmemb = start + MAX(len, 0);
+	} while(len > 0);
+	if(len < 0 && errno != EAGAIN) {
+		ARR_FREE(&buf);
+		return -1;
+	}
+
+	size_t last = f->content.nmemb - 1;
+	address_t end = {last, istr_len(&f->content.data[last])};
+	if(buf.nmemb) {
+		file_will_change(f);
+		range_mod(&(range_t){end, end, f}, buf.data, buf.nmemb);
+	}
+	len = buf.nmemb;
+	ARR_FREE(&buf);
+	return len;
+}
+
+/* back to one empty line, with the history of the text that was */
+void
+file_clear(file_t *f)
+{
+	file_will_change(f);
+	file_splice_lines(f, 0, f->content.nmemb, 1);
+	f->undobuf.nsiz = 0;
+	f->undobuf.last = 0;
+	f->redobuf.nsiz = 0;
+	f->redobuf.last = 0;
+}
+
+/* first line that is not well-formed UTF-8, -1 when all are; such bytes
+ * are shown on their own, in hex */
+ssize_t
+file_check_utf8(file_t *f)
+{
+	for(size_t i = 0; i < f->content.nmemb; i++) {
+		istring_t *line = &f->content.data[i];
+		if(utf8valid(istr_data(line), istr_len(line)) != istr_len(line)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static size_t
+range_line_end(range_t *rng, size_t line)
+{
+	if(line == rng->end.line) {
+		return rng->end.offset;
+	}
+	return istr_len(&rng->file->content.data[line]);
+}
+
+/* writes the range straight from the lines, IOV_MAX of them per writev,
+ * returns the number of bytes written */
+ssize_t
+range_write(range_t *rng, int fd)
+{
+	struct iovec iov[IOV_MAX];
+	address_t adr = rng->start;
+	ssize_t total = 0;
+
+	while(address_cmp(&adr, &rng->end) < 0) {
+		int niov = 0;
+		address_t a = adr;
+		for(; niov < (int)LEN(iov) && a.line <= rng->end.line; a.line++, a.offset = 0) {
+			size_t end = range_line_end(rng, a.line);
+			if(end > a.offset) {
+				iov[niov].iov_base = istr_data(&rng->file->content.data[a.line]) + a.offset;
+				iov[niov].iov_len = end - a.offset;
+				niov++;
+			}
+		}
+		if(!niov) {
+			break;
+		}
+
+		ssize_t len = writev(fd, iov, niov);
+		if(len < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		total += len;
+
+		// partial writes continue in the middle of a line
+		while(len > 0) {
+			size_t left = range_line_end(rng, adr.line) - adr.offset;
+			if((size_t)len < left || adr.line == rng->end.line) {
+				adr.offset += len;
+				break;
+			}
+			len -= left;
+			adr.line++;
+			adr.offset = 0;
+		}
+	}
+	return total;
+}
+
+/* writes to a temporary file next to fname, syncs it and renames it over
+ * fname, so a crash leaves either the old or the new content */
+static ssize_t
+file_save_atomic(file_t *f, const char *fname)
+{
+	static const char suffix[] = ".XXXXXX";
+	size_t len = strlen(fname);
+	char *tmp = xmalloc(len + sizeof suffix, 1);
+	memcpy(tmp, fname, len);
+	memcpy(tmp + len, suffix, sizeof suffix);
+
+	int fd = mkstemp(tmp);
+	if(fd < 0) {
+		free(tmp);
+		return -1;
+	}
+
+	struct stat st;
+	if(!stat(fname, &st)) {
+		fchmod(fd, st.st_mode & 07777);
+	} else {
+		mode_t mask = umask(0);
+		umask(mask);
+		fchmod(fd, 0666 & ~mask);
+	}
+
+	size_t last = f->content.nmemb - 1;
+	range_t rng = {
+		{0, 0}, {last, istr_len(&f->content.data[last])}, f
+	};
+	ssize_t nbytes = range_write(&rng, fd);
+	bool fail = nbytes < 0 || fsync(fd) < 0 || fstat(fd, &st) < 0;
+	fail |= close(fd) < 0;
+	if(fail || rename(tmp, fname) < 0) {
+		int err = errno;
+		unlink(tmp);
+		errno = err;
+		nbytes = -1;
+	} else {
+		file_track_stat(f, fname, &st);
+	}
+	free(tmp);
+	return nbytes;
+}
+
+static bool
+stat_same(struct stat *a, struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+		a->st_size == b->st_size &&
+		a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+		a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static off_t
+lines_len(file_t *f, size_t start, size_t end)
+{
+	off_t len = 0;
+	for(size_t i = start; i < end; i++) {
+		len += istr_len(&f->content.data[i]);
+	}
+	return len;
+}
+
+static ssize_t
+lines_write(file_t *f, size_t start, size_t end, off_t off, int fd)
+{
+	if(start == end) {
+		return 0;
+	}
+	if(lseek(fd, off, SEEK_SET) < 0) {
+		return -1;
+	}
+	range_t rng = {
+		{start, 0}, {end - 1, istr_len(&f->content.data[end - 1])}, f
+	};
+	return range_write(&rng, fd);
+}
+
+/* Writes over the file f was read from or saved to: the runs of changed
+ * lines as long as what they replace each in its place, and from the
+ * first one that is not everything to the end. -1 when the file changed
+ * since or more than half of it would be written, for file_save to
+ * rewrite it; otherwise the bytes written. */
+static ssize_t
+file_save_in_place(file_t *f)
+{
+	struct file_disk *d = f->disk;
+	ARRAY(off_t) at = {0}; // of the runs before tail
+	size_t tail = d->dirty.nmemb;
+	off_t off = 0, old = 0, tail_off = 0, nbytes = 0;
+	size_t line = 0;
+
+	for(size_t i = 0; i < d->dirty.nmemb; i++) {
+		dirty_t *x = &d->dirty.data[i];
+		off_t clean = lines_len(f, line, x->start);
+		off_t len = lines_len(f, x->start, x->end);
+		off += clean;
+		old += clean;
+		if(i < tail && len != (off_t)x->old_len) {
+			tail = i;
+			tail_off = off;
+		}
+		if(i < tail) {
+			ARR_EXTEND(&at, 1);
+			at.data[i] = off;
+			nbytes += len;
+		}
+		off += len;
+		old += x->old_len;
+		line = x->end;
+	}
+	off_t rest = lines_len(f, line, f->content.nmemb);
+	off += rest;
+	old += rest;
+	if(tail < d->dirty.nmemb) {
+		nbytes += off - tail_off;
+	}
+
+	struct stat st;
+	int fd = -1;
+	if(nbytes > off / 2 || (fd = open(d->fname, O_WRONLY | O_CLOEXEC)) < 0 ||
+			fstat(fd, &st) < 0 || !stat_same(&d->st, &st) || st.st_size != old) {
+		if(fd >= 0) {
+			close(fd);
+		}
+		ARR_FREE(&at);
+		return -1;
+	}
+
+	bool fail = false;
+	for(size_t i = 0; i < tail && !fail; i++) {
+		dirty_t *x = &d->dirty.data[i];
+		fail = lines_write(f, x->start, x->end, at.data[i], fd) < 0;
+	}
+	if(tail < d->dirty.nmemb && !fail) {
+		fail = lines_write(f, d->dirty.data[tail].start, f->content.nmemb, tail_off, fd) < 0;
+	}
+	ARR_FREE(&at);
+	fail = fail || ftruncate(fd, off) < 0 || fsync(fd) < 0 || fstat(fd, &st) < 0;
+	fail |= close(fd) < 0;
+	if(fail) {
+		// what is on disk is not known any more
+		d->lost = true;
+		return -1;
+	}
+	file_track_stat(f, d->fname, &st);
+	return nbytes;
+}
+
+/* In place when only some lines changed since the file was read or
+ * saved, as file_save_in_place, otherwise through file_save_atomic.
+ * Returns the bytes written. */
+ssize_t
+file_save(file_t *f, const char *fname)
+{
+	if(f->disk && !f->disk->lost && !strcmp(f->disk->fname, fname)) {
+		ssize_t nbytes = file_save_in_place(f);
+		if(nbytes >= 0) {
+			return nbytes;
+		}
+	}
+	return file_save_atomic(f, fname);
+}
+
+struct file_saver {
+	pthread_t thread;
+	file_t snap; // the lines as they were when the save started
+	string_t shared; // per line of the file, whether snap holds its text too
+	strarray_t orphans; // text of lines changed since, only snap holds
+	uint64_t gen; // changes made to the file when the save started
+	char *fname;
+	ssize_t len;
+	atomic_bool done;
+};
+
+static void
+line_orphan(struct file_saver *s, istring_t *l)
+{
+	ARR_EXTEND(&s->orphans, 1);
+	s->orphans.data[s->orphans.nmemb - 1] = *l;
+	memset(l, 0, sizeof *l);
+}
+
+/* Line is about to change in place. While a save holds its text, the
+ * text stays as it is for the save and the file goes on with a copy. */
+static void
+line_unshare(file_t *f, size_t line)
+{
+	struct file_saver *s = f->saver;
+	if(!s || !s->shared.data[line]) {
+		return;
+	}
+	istring_t *l = &f->content.data[line];
+	size_t len = istr_len(l);
+	char *text = istr_data(l);
+	line_orphan(s, l);
+	istr_resize(l, len);
+	memcpy(istr_data(l), text, len);
+	s->shared.data[line] = 0;
+}
+
+/* lines start to end become nmemb empty ones, a save keeps what it holds */
+static void
+lines_resize(file_t *f, size_t start, size_t end, size_t nmemb)
+{
+	struct file_saver *s = f->saver;
+	for(size_t i = start; i < end; i++) {
+		if(s && s->shared.data[i]) {
+			line_orphan(s, &f->content.data[i]);
+		} else {
+			istr_free(&f->content.data[i]);
+		}
+	}
+	ARR_FRAG_RESIZE(&f->content, start, end, nmemb);
+	memset(f->content.data + start, 0, nmemb * sizeof f->content.data[0]);
+	if(s) {
+		ARR_FRAG_RESIZE(&s->shared, start, end, nmemb);
+		memset(s->shared.data + start, 0, nmemb);
+	}
+}
+
+static void *
+file_saver_run(void *usr)
+{
+	struct file_saver *s = usr;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ssize_t len = file_save(&s->snap, s->fname);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if(len < 0) {
+		fprintf(stderr, "Save: %s: %s\n", s->fname, strerror(errno));
+	} else {
+		double sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1E9;
+		fprintf(stderr, "Save: %s: %zd bytes, %.1f MB/s\n",
+			s->fname, len, sec > 0 ? len / sec / 1E6 : 0);
+	}
+	s->len = len;
+	atomic_store(&s->done, true);
+	return NULL;
+}
+
+static void
+file_saver_free(struct file_saver *s)
+{
+	ARR_FRAG_APPLY(&s->orphans, 0, s->orphans.nmemb, (array_memb_func_t)istr_free);
+	ARR_FREE(&s->orphans);
+	ARR_FREE(&s->shared);
+	ARR_FREE(&s->snap.content);
+	file_untrack(&s->snap);
+	free(s->fname);
+	free(s);
+}
+
+/* Saves f on a thread of its own, so the editor goes on drawing, reading
+ * and editing it meanwhile. The thread writes a snapshot of the line
+ * handles, 8 bytes a line; a line changed since leaves its old text to
+ * the snapshot, see line_unshare. -1 with EBUSY while the previous save
+ * of f runs. */
+int
+file_save_start(file_t *f, const char *fname)
+{
+	if(f->saver && !atomic_load(&f->saver->done)) {
+		errno = EBUSY;
+		return -1;
+	}
+	file_save_wait(f);
+	struct file_saver *s = xmalloc(1, sizeof *s);
+	memset(s, 0, sizeof *s);
+	size_t n = f->content.nmemb;
+	ARR_EXTEND(&s->snap.content, n);
+	memcpy(s->snap.content.data, f->content.data, n * sizeof f->content.data[0]);
+	ARR_EXTEND(&s->shared, n);
+	for(size_t i = 0; i < n; i++) {
+		istring_t *l = &f->content.data[i];
+		s->shared.data[i] = !istr_is_inline(l) && l->heap;
+	}
+	if(f->disk) {
+		struct file_disk *d = s->snap.disk = xmalloc(1, sizeof *d);
+		*d = *f->disk;
+		d->fname = strdup(f->disk->fname);
+		DIEIF(!d->fname);
+		memset(&d->dirty, 0, sizeof d->dirty);
+		ARR_EXTEND(&d->dirty, f->disk->dirty.nmemb);
+		memcpy(d->dirty.data, f->disk->dirty.data, d->dirty.nmemb * sizeof d->dirty.data[0]);
+	}
+	s->gen = f->nchanges;
+	s->fname = strdup(fname);
+	DIEIF(!s->fname);
+	atomic_init(&s->done, false);
+	int err = pthread_create(&s->thread, NULL, file_saver_run, s);
+	if(err) {
+		file_saver_free(s);
+		errno = err;
+		return -1;
+	}
+	if(f->disk) {
+		// from now on the runs are of changes to the snapshot
+		f->disk->dirty.nmemb = 0;
+		f->disk->lost = false;
+	}
+	f->saver = s;
+	return 0;
+}
+
+/* Once the save is done, the text only it held is freed and f is known
+ * to be on disk as the snapshot; when the save failed, what is on disk
+ * is not known. */
+void
+file_save_wait(file_t *f)
+{
+	struct file_saver *s = f->saver;
+	if(!s) {
+		return;
+	}
+	pthread_join(s->thread, NULL);
+	f->saver = NULL;
+	struct file_disk *d = s->snap.disk;
+	if(s->len >= 0 && !f->disk) {
+		f->disk = d;
+		s->snap.disk = NULL;
+		d->lost = f->nchanges != s->gen;
+	} else if(s->len >= 0) {
+		free(f->disk->fname);
+		f->disk->fname = d->fname;
+		d->fname = NULL;
+		f->disk->st = d->st;
+	} else if(f->disk) {
+		f->disk->lost = true;
+	}
+	file_saver_free(s);
+}
+
+/* a save done is reaped, threads reading the text stop */
+static void
+file_will_change(file_t *f)
+{
+	if(f->saver && atomic_load(&f->saver->done)) {
+		file_save_wait(f);
+	}
+	if(f->changing) {
+		f->changing(f->changing_usr);
+	}
+}
+
 size_t
 range_copy(range_t *rng, char *buf, size_t bufsiz)
 {
@@ -223,12 +1059,15 @@ range_copy(range_t *rng, char *buf, size_t bufsiz)
 	size_t len = 0;
 	bool normal = true;
 
+	// each line is at least its newline
+	file_fetch(rng->file, rng->start.line, MIN(rng->end.line, rng->start.line + bufsiz) + 1);
+
 	for(; len < bufsiz && rng->start.line <= rng->end.line; ) {
-		string_t *line = &rng->file->content.data[rng->start.line];
+		istring_t *line = &rng->file->content.data[rng->start.line];
 		if(rng->start.line == rng->end.line) {
 			siz = rng->end.offset - off;
 		} else {
-			siz = line->nmemb - off;
+			siz = istr_len(line) - off;
 		}
 		if(len + siz > bufsiz) {
 			siz = bufsiz - len;
@@ -236,7 +1075,9 @@ range_copy(range_t *rng, char *buf, size_t bufsiz)
 			normal = false;
 		}
 
-		memcpy(buf + len, line->data + off, siz);
+		if(siz) {
+			memcpy(buf + len, istr_data(line) + off, siz);
+		}
 		len += siz;
 		off = 0;
 
@@ -268,11 +1109,9 @@ TEST_range_copy(void) {
 		assert(!address_cmp(&rng.start, &rng.end));
 		file_free(&file);
 	} {
-		string_t lines[] = {
-			{.data = "123\n", .nmemb = 4 },
-			{.data = "456\n", .nmemb = 4 }
-		};
-		file_t file = { .content.data = lines, .content.nmemb = 2 };
+		file_t file = { 0 };
+		file_insert_line(&file, 0, "123\n", 4);
+		file_insert_line(&file, 1, "456\n", 4);
 		range_t rng = {
 			{0, 1}, {1, 2}, &file
 		};
@@ -280,6 +1119,7 @@ TEST_range_copy(void) {
 		size_t len = range_copy(&rng, buf, sizeof(buf));
 		assert(is_str_eq(buf, len, "23", 2));
 		assert(!address_cmp(&rng.start, &(address_t){0, 3}));
+		file_free(&file);
 	}
 	return 0;
 }
@@ -289,30 +1129,43 @@ opbuf_extend(opbuf_t *u, size_t ext)
 {
 	u->nsiz += ext;
 	if(u->nsiz > u->asiz) {
+		int tag = alloc_tag(ALLOC_UNDO);
 		u->asiz = next_size(u->nsiz, 128);
 		u->first = xrealloc(u->first, u->asiz, 1);
+		alloc_tag(tag);
 	}
 }
 
+/* a new last op, aligned after the text of the previous one */
+static op_t *
+opbuf_push(opbuf_t *u)
+{
+	size_t align = _Alignof(op_t);
+	size_t off = (u->nsiz + align - 1) & ~(align - 1);
+	opbuf_extend(u, off - u->nsiz + sizeof u->first[0]);
+
+	op_t *op = (op_t*)((char*)u->first + off);
+	memset(op, 0, sizeof op[0]);
+	op->prev = u->last;
+	u->last = off;
+	return op;
+}
+
 static void
 opbuf_next(opbuf_t *u, range_t *rng, optype_t type)
 {
 	op_t *last = (op_t*)((char*)u->first + u->last);
-	if(u->first != NULL && type != OP_Replace && type == last->type &&
+	if(u->nsiz != 0 && type != OP_Replace && type == last->type &&
+			last->group == rng->file->group &&
 			(type != OP_BackSpace ?
 				address_cmp(&last->dst.end, &rng->start) :
 				address_cmp(&rng->end, &last->dst.start) ) == 0 ) {
 		return;
 	}
 
-	size_t oldsiz = u->nsiz;
-	opbuf_extend(u, sizeof u->first[0]);
-
-	op_t *next = (op_t*)((char*)u->first + oldsiz);
-	memset(next, 0, sizeof next[0]);
-
-	next->prev = u->last;
+	op_t *next = opbuf_push(u);
 	next->type = type;
+	next->group = rng->file->group;
 
 	switch(type) {
 	case OP_BackSpace:
@@ -330,7 +1183,6 @@ opbuf_next(opbuf_t *u, range_t *rng, optype_t type)
 	}
 	next->dst.start = rng->start;
 	next->buf_len = 0;
-	u->last = (char*)next - (char*)u->first;
 }
 
 static void
@@ -342,21 +1194,22 @@ range_push_mod(range_t *rng, char *mod, size_t mod_len, opbuf_t *u, optype_t typ
 	size_t off = rng->start.offset;
 	size_t siz;
 	for(size_t i = rng->start.line; i <= rng->end.line; i++) {
-		string_t *line = &rng->file->content.data[i];
+		istring_t *line = &rng->file->content.data[i];
+		char *data = istr_data(line);
 		if(i == rng->end.line) {
 			siz = rng->end.offset - off;
 		} else {
-			siz = line->nmemb - off;
+			siz = istr_len(line) - off;
 		}
 		
 		opbuf_extend(u, siz);
 		last = (op_t*)((char*)u->first + u->last);
 
 		if(type != OP_BackSpace) {
-			memcpy(last->buf + last->buf_len, line->data + off, siz);
+			memcpy(last->buf + last->buf_len, data + off, siz);
 		} else {
 			memmove(last->buf + siz, last->buf, last->buf_len);
-			memcpy(last->buf, line->data + off, siz);
+			memcpy(last->buf, data + off, siz);
 		}
 		last->buf_len += siz;
 
@@ -369,42 +1222,665 @@ range_push_mod(range_t *rng, char *mod, size_t mod_len, opbuf_t *u, optype_t typ
 		last->dst.start = rng->start;
 	}
 	last->dst.end = rng->start;
+}
 
-	rng->file->dirty = true;
+/* ops pushed until the matching commit are undone and redone as one,
+ * groups nest into the outermost */
+void
+file_group_begin(file_t *f)
+{
+	if(f->group_depth++ == 0) {
+		f->group = ++f->ngroups;
+	}
 }
 
 void
-undo(opbuf_t *u, opbuf_t *r, range_t *rng)
+file_group_commit(file_t *f)
 {
-	if(u->nsiz == 0) {
-		return;
+	DIEIF(f->group_depth <= 0);
+	if(--f->group_depth == 0) {
+		f->group = 0;
 	}
+}
+
+static address_t
+address_after(address_t adr, char *buf, size_t len)
+{
+	for(char *nl; (nl = memchr(buf, '\n', len)) != NULL; ) {
+		adr.line++;
+		adr.offset = 0;
+		len -= nl + 1 - buf;
+		buf = nl + 1;
+	}
+	adr.offset += len;
+	return adr;
+}
+
+static void
+batch_flush(strarray_t *out, string_t *cur)
+{
+	ARR_EXTEND(out, 1);
+	istring_t *line = &out->data[out->nmemb - 1];
+	memset(line, 0, sizeof line[0]);
+	istr_resize(line, cur->nmemb);
+	if(cur->nmemb) {
+		memcpy(istr_data(line), cur->data, cur->nmemb);
+	}
+	cur->nmemb = 0;
+}
+
+static void
+batch_append(strarray_t *out, string_t *cur, char *buf, size_t len)
+{
+	while(len > 0) {
+		char *nl = memchr(buf, '\n', len);
+		size_t n = nl ? (size_t)(nl + 1 - buf) : len;
+		ARR_EXTEND(cur, n);
+		memcpy(cur->data + cur->nmemb - n, buf, n);
+		if(nl) {
+			batch_flush(out, cur);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* old text from pos up to upto, whole lines move over without a copy */
+static void
+batch_copy(file_t *f, strarray_t *out, string_t *cur, address_t *pos, address_t *upto)
+{
+	for(; pos->line < upto->line; pos->line++, pos->offset = 0) {
+		istring_t *line = &f->content.data[pos->line];
+		if(!cur->nmemb && !pos->offset) {
+			ARR_EXTEND(out, 1);
+			out->data[out->nmemb - 1] = *line;
+			memset(line, 0, sizeof line[0]);
+		} else {
+			batch_append(out, cur, istr_data(line) + pos->offset,
+				istr_len(line) - pos->offset);
+		}
+	}
+	istring_t *line = &f->content.data[pos->line];
+	batch_append(out, cur, istr_data(line) + pos->offset, upto->offset - pos->offset);
+	pos->offset = upto->offset;
+}
+
+static void
+batch_record(opbuf_t *u, file_t *f, edit_t *e, size_t batch)
+{
+	op_t *op = opbuf_push(u);
+	op->type = OP_Replace;
+	op->group = f->group;
+	op->batch = batch;
+
+	size_t off = e->start.offset;
+	for(size_t i = e->start.line; i <= e->end.line; i++) {
+		istring_t *line = &f->content.data[i];
+		size_t siz = (i == e->end.line ? e->end.offset : istr_len(line)) - off;
+		opbuf_extend(u, siz);
+		op = (op_t*)((char*)u->first + u->last);
+		memcpy(op->buf + op->buf_len, istr_data(line) + off, siz);
+		op->buf_len += siz;
+		off = 0;
+	}
+}
+
+/* Edits sorted and not overlapping, all addressed in the file as it is
+ * now. The lines they span are rebuilt in one pass and spliced in, so the
+ * cost follows that span, not the number of edits times the lines. Each op records where
+ * its text went, which is right for undoing them back to front, one at a
+ * time, as well as for undoing the whole batch in one pass again. */
+static void
+batch_apply(file_t *f, edit_t *edits, size_t nedits, opbuf_t *u)
+{
+	static string_t cur;
+	strarray_t out = {0};
+	int tag = alloc_tag(ALLOC_DOCUMENT);
+	size_t start = edits[0].start.line;
+	address_t pos = {start, 0};
+	file_dirty(f, start, edits[nedits - 1].end.line + 1);
+	for(size_t i = 0; i < nedits; i++) {
+		edit_t *e = &edits[i];
+		DIEIF(address_cmp(&e->start, &pos) < 0 || address_cmp(&e->start, &e->end) > 0);
+		batch_copy(f, &out, &cur, &pos, &e->start);
+		batch_record(u, f, e, i + 1);
+		pos = e->end;
+
+		op_t *op = (op_t*)((char*)u->first + u->last);
+		e->start = (address_t){start + out.nmemb, cur.nmemb};
+		e->end = address_after(e->start, e->mod, e->mod_len);
+		batch_append(&out, &cur, e->mod, e->mod_len);
+		op->src.start = e->start;
+		op->src.end = address_after(e->start, op->buf, op->buf_len);
+		op->dst.start = e->start;
+		op->dst.end = e->end;
+	}
+	// up to the end of the last line edited, and the lines after it as
+	// long as what was put in does not end in a new line
+	size_t last = f->content.nmemb - 1;
+	size_t end = pos.line;
+	batch_copy(f, &out, &cur, &pos,
+		&(address_t){end, istr_len(&f->content.data[end])});
+	while(cur.nmemb && end < last) {
+		end++;
+		file_dirty(f, end, end + 1);
+		batch_copy(f, &out, &cur, &pos,
+			&(address_t){end, istr_len(&f->content.data[end])});
+	}
+	if(end == last) {
+		batch_flush(&out, &cur);
+	}
+
+	file_splice_lines(f, start, end + 1, start + out.nmemb);
+	memcpy(f->content.data + start, out.data, out.nmemb * sizeof out.data[0]);
+	ARR_FREE(&out);
+	alloc_tag(tag);
+}
+
+static void
+undo_op(opbuf_t *u, opbuf_t *r, range_t *rng)
+{
 	op_t *last = (op_t*)((char*)u->first + u->last);
 	range_t dst = {last->dst.start, last->dst.end, rng->file};
 	range_push_mod(&dst, last->buf, last->buf_len, r, last->type);
 	rng->start = last->src.start;
 	rng->end = last->src.end;
 
-	u->nsiz -= sizeof last[0] + last->buf_len;
+	u->nsiz = u->last;
 	u->last = last->prev;
 }
 
+/* the whole batch in one pass, its ops are contiguous at the end of u */
+static void
+undo_batch(opbuf_t *u, opbuf_t *r, range_t *rng)
+{
+	op_t *last = (op_t*)((char*)u->first + u->last);
+	size_t n = last->batch;
+	edit_t *edits = xmalloc(n, sizeof edits[0]);
+	size_t off = u->last;
+	op_t *op = last;
+
+	for(size_t i = n; i-- > 0; ) {
+		op = (op_t*)((char*)u->first + off);
+		edits[i] = (edit_t){op->dst.start, op->dst.end, op->buf, op->buf_len};
+		off = op->prev;
+	}
+	batch_apply(rng->file, edits, n, r);
+	free(edits);
+
+	rng->start = op->src.start;
+	rng->end = op->src.end;
+	u->nsiz = (char*)op - (char*)u->first;
+	u->last = op->prev;
+}
+
+/* what gets pushed to r is grouped the same way */
+void
+undo(opbuf_t *u, opbuf_t *r, range_t *rng)
+{
+	if(u->nsiz == 0) {
+		return;
+	}
+	op_t *last = (op_t*)((char*)u->first + u->last);
+	size_t group = last->group;
+
+	file_will_change(rng->file);
+	file_group_begin(rng->file);
+	do {
+		if(last->batch) {
+			undo_batch(u, r, rng);
+		} else {
+			undo_op(u, r, rng);
+		}
+		last = (op_t*)((char*)u->first + u->last);
+	} while(group && u->nsiz && last->group == group);
+	file_group_commit(rng->file);
+}
+
 void
 range_push(range_t *rng, char *mod, size_t mod_len, optype_t type)
 {
-	rng->file->redobuf.nsiz = 0;
-	rng->file->redobuf.last = 0;
-	range_push_mod(rng, mod, mod_len, &rng->file->undobuf, type);
+	rng->file->editing = rng;
+	if(rng->file->remote) {
+		remote_push(rng->file->remote, rng, mod, mod_len, type);
+	} else {
+		file_will_change(rng->file);
+		uint64_t t = trace_now();
+		rng->file->redobuf.nsiz = 0;
+		rng->file->redobuf.last = 0;
+		range_push_mod(rng, mod, mod_len, &rng->file->undobuf, type);
+		trace_event(TRACE_EDIT, t, type);
+	}
+	rng->file->editing = NULL;
+}
+
+/* edits as for batch_apply, undone as one */
+void
+file_push_batch(file_t *f, edit_t *edits, size_t nedits)
+{
+	if(!nedits) {
+		return;
+	}
+	if(f->remote) {
+		remote_push_batch(f->remote, edits, nedits);
+		return;
+	}
+	file_will_change(f);
+	uint64_t t = trace_now();
+	f->redobuf.nsiz = 0;
+	f->redobuf.last = 0;
+	file_group_begin(f);
+	batch_apply(f, edits, nedits, &f->undobuf);
+	file_group_commit(f);
+	trace_event(TRACE_EDIT, t, OP_Replace);
 }
 
 void
 file_undo(range_t *rng)
 {
-	undo(&rng->file->undobuf, &rng->file->redobuf, rng);
+	rng->file->editing = rng;
+	if(rng->file->remote) {
+		remote_undo(rng->file->remote, rng, false);
+	} else {
+		undo(&rng->file->undobuf, &rng->file->redobuf, rng);
+	}
+	rng->file->editing = NULL;
 }
 
 void
 file_redo(range_t *rng)
 {
-	undo(&rng->file->redobuf, &rng->file->undobuf, rng);
+	rng->file->editing = rng;
+	if(rng->file->remote) {
+		remote_undo(rng->file->remote, rng, true);
+	} else {
+		undo(&rng->file->redobuf, &rng->file->undobuf, rng);
+	}
+	rng->file->editing = NULL;
+}
+
+static void
+file_to_string(file_t *f, string_t *s)
+{
+	size_t last = f->content.nmemb - 1;
+	range_t rng = {{0, 0}, {last, istr_len(&f->content.data[last])}, f};
+	s->nmemb = 0;
+	for(size_t i = 0; i <= last; i++) {
+		ARR_EXTEND(s, istr_len(&f->content.data[i]));
+	}
+	range_copy(&rng, s->data, s->nmemb);
+}
+
+int
+TEST_file_push_batch(void) {
+	file_t file = { 0 };
+	string_t s = { 0 };
+	char *lines[] = { "zero\n", "one\n", "two\n", "three\n", "four\n", "" };
+	for(size_t i = 0; i < LEN(lines); i++) {
+		file_insert_line(&file, i, lines[i], strlen(lines[i]));
+	}
+	const char orig[] = "zero\none\ntwo\nthree\nfour\n";
+	const char batch[] = "zero\n\tone\ntX\nY\nhree\nour\nend";
+	const char group[] = "0\none!!\ntwo\nthree\nfour\n";
+
+	edit_t edits[] = {
+		{ {1, 0}, {1, 0}, "\t", 1 },
+		{ {2, 1}, {3, 1}, "X\nY\n", 4 },
+		{ {4, 0}, {4, 1}, "", 0 },
+		{ {5, 0}, {5, 0}, "end", 3 }
+	};
+	file_push_batch(&file, edits, LEN(edits));
+	file_to_string(&file, &s);
+	assert(is_str_eq(s.data, s.nmemb, batch, sizeof(batch)-1));
+	assert(file.content.nmemb == 7);
+	assert(!address_cmp(&edits[1].start, &(address_t){2, 1}));
+	assert(!address_cmp(&edits[1].end, &(address_t){4, 0}));
+	assert(!address_cmp(&edits[3].end, &(address_t){6, 3}));
+
+	// one undo for the batch, one redo
+	range_t rng = { .file = &file };
+	file_undo(&rng);
+	file_to_string(&file, &s);
+	assert(is_str_eq(s.data, s.nmemb, orig, sizeof(orig)-1));
+	assert(file.undobuf.nsiz == 0);
+	assert(!address_cmp(&rng.start, &(address_t){1, 0}));
+	file_redo(&rng);
+	file_to_string(&file, &s);
+	assert(is_str_eq(s.data, s.nmemb, batch, sizeof(batch)-1));
+
+	// edits in a group go at once
+	file_undo(&rng);
+	file_group_begin(&file);
+	rng = (range_t){ {0, 0}, {0, 4}, &file };
+	range_push(&rng, "0", 1, OP_Replace);
+	rng = (range_t){ {1, 3}, {1, 3}, &file };
+	range_push(&rng, "!", 1, OP_Char);
+	range_push(&rng, "!", 1, OP_Char);
+	file_group_commit(&file);
+	file_undo(&rng);
+	file_to_string(&file, &s);
+	assert(is_str_eq(s.data, s.nmemb, orig, sizeof(orig)-1));
+	assert(file.undobuf.nsiz == 0);
+	file_redo(&rng);
+	file_to_string(&file, &s);
+	assert(is_str_eq(s.data, s.nmemb, group, sizeof(group)-1));
+
+	// only the lines edited are rebuilt, a removed new line joins the next
+	const char joined[] = "0\none!!two\nthree\nfour\n";
+	uint64_t nchanges = file.nchanges;
+	edit_t join = { {1, 5}, {1, 6}, "", 0 };
+	file_push_batch(&file, &join, 1);
+	file_to_string(&file, &s);
+	assert(is_str_eq(s.data, s.nmemb, joined, sizeof(joined)-1));
+	assert(file.nchanges == nchanges + 1);
+	linechange_t *c = &file.changes[nchanges % FILE_CHANGES];
+	assert(c->start == 1 && c->old_end == 3 && c->new_end == 2);
+	file_undo(&rng);
+	file_to_string(&file, &s);
+	assert(is_str_eq(s.data, s.nmemb, group, sizeof(group)-1));
+	c = &file.changes[(file.nchanges - 1) % FILE_CHANGES];
+	assert(c->start == 1 && c->old_end == 2 && c->new_end == 3);
+
+	ARR_FREE(&s);
+	free(file.undobuf.first);
+	free(file.redobuf.first);
+	file_free(&file);
+	return 0;
+}
+
+/* indents every tenth line of a 10k line file, and undoes it */
+void
+BENCH_file_push_batch(bench_t *b)
+{
+	enum { NLINES = 10000 };
+	file_t file = { 0 };
+	char line[] = "\tsome line of text, as long as a line of code\n";
+	for(size_t i = 0; i < NLINES; i++) {
+		file_insert_line(&file, i, line, sizeof(line)-1);
+	}
+	file_insert_line(&file, NLINES, "", 0);
+	edit_t *edits = xmalloc(NLINES / 10, sizeof edits[0]);
+	range_t rng = { .file = &file };
+
+	bench_start(b);
+	for(size_t i = 0; i < b->n; i++) {
+		for(size_t j = 0; j < NLINES / 10; j++) {
+			edits[j] = (edit_t){ {j * 10, 0}, {j * 10, 0}, "\t", 1 };
+		}
+		file_push_batch(&file, edits, NLINES / 10);
+		file_undo(&rng);
+	}
+	bench_stop(b);
+
+	free(edits);
+	free(file.undobuf.first);
+	free(file.redobuf.first);
+	file_free(&file);
+}
+
+/* indents one line of a 1M line file, and undoes it */
+void
+BENCH_file_push_batch_line(bench_t *b)
+{
+	enum { NLINES = 1000000 };
+	file_t file = { 0 };
+	char line[] = "\tsome line of text, as long as a line of code\n";
+	for(size_t i = 0; i < NLINES; i++) {
+		file_insert_line(&file, i, line, sizeof(line)-1);
+	}
+	file_insert_line(&file, NLINES, "", 0);
+	range_t rng = { .file = &file };
+
+	bench_start(b);
+	for(size_t i = 0; i < b->n; i++) {
+		edit_t edit = { {NLINES / 2, 0}, {NLINES / 2, 0}, "\t", 1 };
+		file_push_batch(&file, &edit, 1);
+		file_undo(&rng);
+	}
+	bench_stop(b);
+
+	free(file.undobuf.first);
+	free(file.redobuf.first);
+	file_free(&file);
+}
+
+/* the lines of a file as chunks for re_find, usr is the file */
+const char *
+line_chunk(void *usr, int64_t idx, size_t *len)
+{
+	file_t *f = usr;
+	if(idx < 0 || (size_t)idx >= f->content.nmemb) {
+		return NULL;
+	}
+	*len = istr_len(&f->content.data[idx]);
+	return *len ? istr_data(&f->content.data[idx]) : "";
+}
+
+/* the end of a line is the start of the next */
+void
+pos_to_address(file_t *f, re_pos_t *pos, address_t *adr)
+{
+	adr->line = pos->chunk;
+	adr->offset = pos->off;
+	if(adr->offset == istr_len(&f->content.data[adr->line]) &&
+			adr->line + 1 < f->content.nmemb) {
+		adr->line++;
+		adr->offset = 0;
+	}
+}
+
+/* selects next match after the range or the previous one before it,
+ * wraps around the file */
+bool
+range_find(range_t *rng, re_t *re, bool backward)
+{
+	file_t *f = rng->file;
+	re_src_t src = {line_chunk, f};
+	re_match_t m;
+	bool found;
+
+	if(f->remote) {
+		return remote_find(f->remote, rng, re, backward);
+	}
+	if(backward) {
+		re_pos_t pos = {rng->start.line, rng->start.offset};
+		found = re_rfind(re, &src, &pos, &m);
+		if(!found) {
+			size_t last = f->content.nmemb - 1;
+			pos = (re_pos_t){last, istr_len(&f->content.data[last])};
+			found = re_rfind(re, &src, &pos, &m);
+		}
+	} else {
+		re_pos_t pos = {rng->end.line, rng->end.offset};
+		found = re_find(re, &src, &pos, -1, &m);
+		if(!found) {
+			pos = (re_pos_t){0, 0};
+			found = re_find(re, &src, &pos, -1, &m);
+		}
+	}
+	if(!found) {
+		return false;
+	}
+
+	pos_to_address(f, &m.start, &rng->start);
+	pos_to_address(f, &m.end, &rng->end);
+	return true;
+}
+
+int
+TEST_range_find(void) {
+	file_t file = { 0 };
+	file_insert_line(&file, 0, "ab\n", 3);
+	file_insert_line(&file, 1, "cab\n", 4);
+	file_insert_line(&file, 2, "", 0);
+	range_t rng = {
+		{0, 0}, {0, 0}, &file
+	};
+	re_t re;
+	re_compile(&re, "b\n", 2, 0);
+
+	assert(range_find(&rng, &re, false));
+	assert(!address_cmp(&rng.start, &(address_t){0, 1}));
+	assert(!address_cmp(&rng.end, &(address_t){1, 0}));
+	assert(range_find(&rng, &re, false));
+	assert(!address_cmp(&rng.start, &(address_t){1, 2}));
+	assert(!address_cmp(&rng.end, &(address_t){2, 0}));
+	assert(range_find(&rng, &re, false));
+	assert(!address_cmp(&rng.start, &(address_t){0, 1}));
+	assert(range_find(&rng, &re, true));
+	assert(!address_cmp(&rng.start, &(address_t){1, 2}));
+
+	re_free(&re);
+	file_free(&file);
+	return 0;
+}
+
+int
+TEST_file_save(void)
+{
+	enum { NLINES = IOV_MAX * 2 + 3 };
+	char fname[64];
+	file_t file = { 0 };
+	string_t expect = { 0 };
+	char line[32];
+
+	for(size_t i = 0; i < NLINES; i++) {
+		int len = snprintf(line, sizeof line, "line %zu\n", i);
+		file_insert_line(&file, i, line, len);
+		ARR_EXTEND(&expect, len);
+		memcpy(expect.data + expect.nmemb - len, line, len);
+	}
+	file_insert_line(&file, NLINES, "", 0);
+
+	snprintf(fname, sizeof fname, "/tmp/werf-test-save-%d", (int)getpid());
+	assert(file_save(&file, fname) == (ssize_t)expect.nmemb);
+
+	// edits go on while a save runs, which writes the text as it was
+	assert(file_save_start(&file, fname) == 0);
+	range_t rng = { {0, 0}, {0, 0}, &file };
+	range_push(&rng, "x", 1, OP_Char);
+	rng = (range_t){ {20, 3}, {22, 1}, &file };
+	range_push(&rng, "joined and longer than a pool slot", 34, OP_Replace);
+	rng = (range_t){ {NLINES - 2, 0}, {NLINES, 0}, &file };
+	range_push(&rng, "", 0, OP_Delete);
+	file_save_wait(&file);
+
+	int fd = open(fname, O_RDONLY);
+	assert(fd >= 0);
+	string_t got = { 0 };
+	ARR_EXTEND(&got, expect.nmemb + 1);
+	ssize_t len = read(fd, got.data, got.nmemb);
+	close(fd);
+	assert(is_str_eq(got.data, len, expect.data, expect.nmemb));
+
+	// and the next save writes what changed since
+	string_t want = { 0 };
+	file_to_string(&file, &want);
+	assert(file_save(&file, fname) > 0);
+	fd = open(fname, O_RDONLY);
+	assert(fd >= 0);
+	unlink(fname);
+	got.nmemb = 0;
+	ARR_EXTEND(&got, want.nmemb + 1);
+	len = read(fd, got.data, got.nmemb);
+	close(fd);
+	assert(is_str_eq(got.data, len, want.data, want.nmemb));
+
+	ARR_FREE(&want);
+	ARR_FREE(&got);
+	ARR_FREE(&expect);
+	free(file.undobuf.first);
+	file_free(&file);
+	return 0;
+}
+
+/* the file holds the text, written in place or, when ino differs, anew */
+static bool
+test_saved(file_t *f, const char *fname, ino_t ino)
+{
+	string_t want = { 0 }, got = { 0 };
+	struct stat st;
+	file_to_string(f, &want);
+	int fd = open(fname, O_RDONLY);
+	assert(fd >= 0 && !fstat(fd, &st));
+	ARR_EXTEND(&got, want.nmemb + 1);
+	ssize_t len = read(fd, got.data, got.nmemb);
+	close(fd);
+	assert(is_str_eq(got.data, len, want.data, want.nmemb));
+	assert(f->disk && !f->disk->dirty.nmemb);
+	ARR_FREE(&want);
+	ARR_FREE(&got);
+	return st.st_ino == ino;
+}
+
+int
+TEST_file_save_in_place(void)
+{
+	enum { NLINES = 1000 };
+	char fname[64];
+	file_t file = { 0 };
+	char line[32];
+	struct stat st;
+
+	snprintf(fname, sizeof fname, "/tmp/werf-test-inplace-%d", (int)getpid());
+	int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	assert(fd >= 0);
+	for(size_t i = 0; i < NLINES; i++) {
+		int len = snprintf(line, sizeof line, "line %zu\n", i);
+		assert(write(fd, line, len) == len);
+	}
+	lseek(fd, 0, SEEK_SET);
+	file_insert_line(&file, 0, "", 0);
+	assert(!range_read(&(range_t){.file = &file}, fd));
+	file_track(&file, fname, fd);
+	assert(!fstat(fd, &st));
+	close(fd);
+
+	// same length, only the line
+	range_t rng = { {500, 0}, {500, 1}, &file };
+	range_push(&rng, "L", 1, OP_Char);
+	assert(file_save(&file, fname) == (ssize_t)istr_len(&file.content.data[500]));
+	assert(test_saved(&file, fname, st.st_ino));
+
+	// longer, from the line to the end
+	rng = (range_t){ {900, 0}, {900, 0}, &file };
+	range_push(&rng, "xx", 2, OP_Char);
+	ssize_t tail = lines_len(&file, 900, file.content.nmemb);
+	assert(file_save(&file, fname) == tail);
+	assert(test_saved(&file, fname, st.st_ino));
+
+	// a batch and its undo, the lines it spans
+	edit_t edits[] = {
+		{ {100, 0}, {100, 1}, "L", 1 },
+		{ {200, 0}, {200, 1}, "L", 1 },
+	};
+	file_push_batch(&file, edits, LEN(edits));
+	ssize_t span = lines_len(&file, 100, 201);
+	assert(file_save(&file, fname) == span);
+	assert(test_saved(&file, fname, st.st_ino));
+	file_undo(&rng);
+	assert(file_save(&file, fname) == span);
+	assert(test_saved(&file, fname, st.st_ino));
+
+	// shifting most of the file rewrites it
+	rng = (range_t){ {0, 0}, {0, 0}, &file };
+	range_push(&rng, "x", 1, OP_Char);
+	assert(file_save(&file, fname) > 0);
+	assert(!test_saved(&file, fname, st.st_ino));
+	assert(!stat(fname, &st));
+
+	// as does a file changed by someone else
+	fd = open(fname, O_WRONLY | O_APPEND);
+	assert(fd >= 0 && write(fd, "more\n", 5) == 5);
+	close(fd);
+	rng = (range_t){ {500, 0}, {500, 1}, &file };
+	range_push(&rng, "l", 1, OP_Char);
+	assert(file_save(&file, fname) > 0);
+	assert(!test_saved(&file, fname, st.st_ino));
+
+	unlink(fname);
+	free(file.undobuf.first);
+	free(file.redobuf.first);
+	file_free(&file);
+	return 0;
 }
@@ -1,4 +1,4 @@
-typedef ARRAY(string_t) strarray_t;
+typedef ARRAY(istring_t) strarray_t;
 
 typedef struct {
 	size_t line;
@@ -16,6 +16,8 @@ typedef enum {
 typedef struct {
 	size_t prev;
 	optype_t type;
+	size_t group; // ops of one group are undone together, 0 for none
+	size_t batch; // position in a batch applied in one pass, from 1, 0 for none
 	struct {
 		address_t start;
 		address_t end;
@@ -31,31 +33,80 @@ typedef struct {
 	size_t last;
 } opbuf_t;
 
+typedef struct {
+	size_t start; // first line changed
+	size_t old_end; // past the last one, before the change
+	size_t new_end; // and after it
+	struct range_t *by; // the edit was made through, it is moved already
+} linechange_t;
+
+enum { FILE_CHANGES = 64 }; // last changes kept for views to catch up
+
 typedef struct {
 	strarray_t content;
 	opbuf_t undobuf;
 	opbuf_t redobuf;
-	bool dirty;
+	size_t group; // of ops pushed now
+	size_t ngroups;
+	int group_depth;
+	linechange_t changes[FILE_CHANGES];
+	uint64_t nchanges; // ever made
+	struct remote_t *remote; // when a mirror of a backend's file, see remote.c
+	struct file_saver *saver; // a save running, see file_save_start
+	struct file_disk *disk; // what was read or saved last, see file_track
+	void (*changing)(void *usr); // before the text changes, as for threads reading it to stop
+	void *changing_usr;
+	struct range_t *editing; // an edit is made through, see range_follow
 } file_t;
 
+/* one replacement of a batch, afterwards the range of the new text */
 typedef struct {
+	address_t start;
+	address_t end;
+	char *mod;
+	size_t mod_len;
+} edit_t;
+
+typedef struct range_t {
 	address_t start;
 	address_t end;
 	file_t *file;
 } range_t;
 
+typedef ARRAY(range_t) rangearray_t;
+
 void file_insert_line(file_t *f, size_t line, char *buf, size_t buf_len);
 void file_free(file_t *f);
+void file_note_change(file_t *f, size_t start, size_t old_end, size_t new_end);
+void file_splice_lines(file_t *f, size_t start, size_t old_end, size_t new_end);
+void file_set_line(file_t *f, size_t line, char *buf, size_t buf_len);
+void file_fetch(file_t *f, size_t start, size_t end);
 
 int address_cmp(address_t *a1, address_t *a2);
 
 int range_from_addresses(range_t *rng, address_t *a1, address_t *a2);
 void range_fix_start(range_t *rng);
 void range_fix_end(range_t *rng);
+void range_follow(range_t *rng, uint64_t *gen);
 int range_read(range_t *rng, int fd);
+ssize_t file_append_fd(file_t *f, int fd);
+void file_clear(file_t *f);
+ssize_t file_check_utf8(file_t *f);
+ssize_t range_write(range_t *rng, int fd);
+void file_track(file_t *f, const char *fname, int fd);
+ssize_t file_save(file_t *f, const char *fname);
+int file_save_start(file_t *f, const char *fname);
+void file_save_wait(file_t *f);
 size_t range_copy(range_t *rng, char *buf, size_t bufsiz);
 
 void range_push(range_t *rng, char *mod, size_t mod_len, optype_t type);
+void file_push_batch(file_t *f, edit_t *edits, size_t nedits);
+
+void file_group_begin(file_t *f);
+void file_group_commit(file_t *f);
 
 void file_undo(range_t *rng);
 void file_redo(range_t *rng);
+const char *line_chunk(void *usr, int64_t idx, size_t *len);
+void pos_to_address(file_t *f, re_pos_t *pos, address_t *adr);
+bool range_find(range_t *rng, re_t *re, bool backward);
@@ -0,0 +1,307 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "array.h"
+#include "test.h"
+
+#include "filter.h"
+
+/* built-in filters, run in-process by the editor on the selection or as
+ * standalone programs when werf is invoked through a symlink */
+
+typedef struct {
+	const char *data;
+	size_t len;
+} slice_t;
+
+typedef ARRAY(slice_t) slicearray_t;
+
+static void
+split_lines(slicearray_t *lines, const char *in, size_t len)
+{
+	const char *end = in + len;
+	while(in < end) {
+		const char *nl = memchr(in, '\n', end - in);
+		size_t linelen = nl ? (size_t)(nl - in) : (size_t)(end - in);
+		ARR_EXTEND(lines, 1);
+		lines->data[lines->nmemb - 1] = (slice_t){in, linelen};
+		in += linelen + !!nl;
+	}
+}
+
+static void
+join_lines(string_t *out, slicearray_t *lines, bool final_nl)
+{
+	for(size_t i = 0; i < lines->nmemb; i++) {
+		size_t start = out->nmemb;
+		bool nl = i + 1 < lines->nmemb || final_nl;
+		ARR_EXTEND(out, lines->data[i].len + nl);
+		memcpy(out->data + start, lines->data[i].data, lines->data[i].len);
+		if(nl) {
+			out->data[out->nmemb - 1] = '\n';
+		}
+	}
+}
+
+static int
+slice_cmp(const void *p1, const void *p2)
+{
+	const slice_t *s1 = p1;
+	const slice_t *s2 = p2;
+	int cmp = memcmp(s1->data, s2->data, MIN(s1->len, s2->len));
+	if(cmp) {
+		return cmp;
+	}
+	return (s1->len > s2->len) - (s1->len < s2->len);
+}
+
+static int
+filter_sort(string_t *out, const char *in, size_t len, int argc, char *argv[])
+{
+	(void)argv;
+	if(argc > 1) {
+		return -1;
+	}
+	slicearray_t lines = {0};
+	split_lines(&lines, in, len);
+	if(!lines.nmemb) {
+		return 0;
+	}
+	qsort(lines.data, lines.nmemb, sizeof lines.data[0], slice_cmp);
+	join_lines(out, &lines, len > 0 && in[len - 1] == '\n');
+	ARR_FREE(&lines);
+	return 0;
+}
+
+static int
+filter_uniq(string_t *out, const char *in, size_t len, int argc, char *argv[])
+{
+	(void)argv;
+	if(argc > 1) {
+		return -1;
+	}
+	slicearray_t lines = {0};
+	split_lines(&lines, in, len);
+	if(!lines.nmemb) {
+		return 0;
+	}
+	size_t n = 0;
+	for(size_t i = 0; i < lines.nmemb; i++) {
+		if(n == 0 || slice_cmp(&lines.data[n - 1], &lines.data[i])) {
+			lines.data[n++] = lines.data[i];
+		}
+	}
+	lines.nmemb = n;
+	join_lines(out, &lines, len > 0 && in[len - 1] == '\n');
+	ARR_FREE(&lines);
+	return 0;
+}
+
+/* expands "a-z" style ranges, returns the length of the expanded set */
+static size_t
+tr_set(uchar set[256], const char *spec)
+{
+	size_t n = 0;
+	for(const uchar *s = (const uchar*)spec; *s; s++) {
+		if(s[1] == '-' && s[2] && s[2] >= s[0]) {
+			for(unsigned c = s[0]; c <= s[2]; c++) {
+				set[n++ % 256] = c;
+			}
+			s += 2;
+		} else {
+			set[n++ % 256] = *s;
+		}
+	}
+	return MIN(n, 256);
+}
+
+static void
+tr_map(string_t *out, const char *in, size_t len, const uchar map[256])
+{
+	size_t start = out->nmemb;
+	ARR_EXTEND(out, len);
+	for(size_t i = 0; i < len; i++) {
+		out->data[start + i] = map[(uchar)in[i]];
+	}
+}
+
+static int
+filter_tr(string_t *out, const char *in, size_t len, int argc, char *argv[])
+{
+	if(argc != 3) {
+		return -1;
+	}
+	uchar from[256];
+	uchar to[256];
+	size_t nfrom = tr_set(from, argv[1]);
+	size_t nto = tr_set(to, argv[2]);
+	if(nto == 0 && nfrom > 0) {
+		return -1;
+	}
+
+	uchar map[256];
+	for(unsigned c = 0; c < LEN(map); c++) {
+		map[c] = c;
+	}
+	for(size_t i = 0; i < nfrom; i++) {
+		map[from[i]] = to[MIN(i, nto - 1)];
+	}
+	tr_map(out, in, len, map);
+	return 0;
+}
+
+/* ASCII only, so multibyte UTF-8 sequences pass through untouched */
+static int
+filter_case(string_t *out, const char *in, size_t len, int (*conv)(int))
+{
+	uchar map[256];
+	for(unsigned c = 0; c < LEN(map); c++) {
+		map[c] = c < 0x80 ? (unsigned)conv(c) : c;
+	}
+	tr_map(out, in, len, map);
+	return 0;
+}
+
+static int
+filter_upper(string_t *out, const char *in, size_t len, int argc, char *argv[])
+{
+	(void)argv;
+	return argc > 1 ? -1 : filter_case(out, in, len, toupper);
+}
+
+static int
+filter_lower(string_t *out, const char *in, size_t len, int argc, char *argv[])
+{
+	(void)argv;
+	return argc > 1 ? -1 : filter_case(out, in, len, tolower);
+}
+
+static const filter_t filters[] = {
+	{"Sort", filter_sort, "Sort"},
+	{"Uniq", filter_uniq, "Uniq"},
+	{"Tr", filter_tr, "Tr set1 set2"},
+	{"Upper", filter_upper, "Upper"},
+	{"Lower", filter_lower, "Lower"},
+};
+
+const filter_t *
+filter_find(const char *name, size_t len)
+{
+	for(size_t i = 0; i < LEN(filters); i++) {
+		if(is_str_eq(filters[i].name, strlen(filters[i].name), name, len)) {
+			return &filters[i];
+		}
+	}
+	return NULL;
+}
+
+int
+filter_run(const filter_t *f, string_t *out, const char *in, size_t len,
+		int argc, char *argv[])
+{
+	if(f->func(out, in, len, argc, argv) < 0) {
+		fprintf(stderr, "usage: %s\n", f->usage);
+		return -1;
+	}
+	return 0;
+}
+
+int
+filter_main(const filter_t *f, int argc, char *argv[])
+{
+	string_t in = {0};
+	string_t out = {0};
+	ssize_t len;
+
+	do {
+		size_t start = in.nmemb;
+		ARR_EXTEND(&in, BUFSIZ);
+		len = read(STDIN_FILENO, in.data + start, BUFSIZ);
+		if(len < 0 && errno == EINTR) {
+			len = 1;
+			in.nmemb = start;
+			continue;
+		}
+		in.nmemb = start + MAX(len, 0);
+	} while(len > 0);
+
+	int ret = len < 0 ? -1 : filter_run(f, &out, in.data, in.nmemb, argc, argv);
+	if(len < 0) {
+		perror("read failed");
+	}
+
+	for(size_t off = 0; !ret && off < out.nmemb; ) {
+		len = write(STDOUT_FILENO, out.data + off, out.nmemb - off);
+		if(len < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			perror("write failed");
+			ret = -1;
+			break;
+		}
+		off += len;
+	}
+
+	ARR_FREE(&in);
+	ARR_FREE(&out);
+	return ret < 0 ? 1 : 0;
+}
+
+static int
+test_filter_out(string_t *out, const char *name, int argc, char *argv[],
+		const char *in, const char *expected)
+{
+	const filter_t *f = filter_find(name, strlen(name));
+	TEST_OP("%p", (void*)f, !=, NULL, "%s", name);
+	int ret = f->func(out, in, strlen(in), argc, argv);
+	TEST_OP("%d", ret, ==, 0, "%s", name);
+	TEST_OP("%zu", out->nmemb, ==, strlen(expected), "%s", name);
+	if(out->nmemb) {
+		TEST_MEMCMP_OP(out->data, ==, expected, out->nmemb, "%s", name);
+	}
+	return 0;
+}
+
+static int
+test_filter(const char *name, int argc, char *argv[], const char *in,
+		const char *expected)
+{
+	string_t out = {0};
+	int ret = test_filter_out(&out, name, argc, argv, in, expected);
+	ARR_FREE(&out);
+	return ret;
+}
+
+int
+TEST_filters(void)
+{
+	char *noargs[] = {"", NULL};
+	char *tr[] = {"Tr", "a-c", "x", NULL};
+
+	if(test_filter("Sort", 1, noargs, "b\nc\na\n", "a\nb\nc\n") ||
+	test_filter("Sort", 1, noargs, "b\nab\na", "a\nab\nb") ||
+	test_filter("Sort", 1, noargs, "", "") ||
+	test_filter("Uniq", 1, noargs, "", "") ||
+	test_filter("Uniq", 1, noargs, "a\na\nb\na\n", "a\nb\na\n") ||
+	test_filter("Uniq", 1, noargs, "a\na", "a") ||
+	test_filter("Tr", 3, tr, "abcd", "xxxd") ||
+	test_filter("Upper", 1, noargs, "aZ\xc5\xbc", "AZ\xc5\xbc") ||
+	test_filter("Lower", 1, noargs, "aZ", "az")) {
+		return -1;
+	}
+
+	char call[BUFSIZ];
+	const filter_t *f;
+	f = TEST_CALL(call, sizeof(call), "\"%s\", %d", filter_find, ("Sortx", 5));
+	TEST_OP("%p", (void*)f, ==, NULL, "%s", call);
+	f = TEST_CALL(call, sizeof(call), "\"%s\", %d", filter_find, ("Sortx", 4));
+	TEST_OP("%p", (void*)f, !=, NULL, "%s", call);
+	return 0;
+}
@@ -0,0 +1,13 @@
+typedef int (*filter_func_t)(string_t *out, const char *in, size_t len,
+		int argc, char *argv[]);
+
+typedef struct {
+	const char *name;
+	filter_func_t func;
+	const char *usage;
+} filter_t;
+
+const filter_t *filter_find(const char *name, size_t len);
+int filter_run(const filter_t *f, string_t *out, const char *in, size_t len,
+		int argc, char *argv[]);
+int filter_main(const filter_t *f, int argc, char *argv[]);
@@ -0,0 +1,253 @@
+#include <sys/types.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "array.h"
+#include "test.h"
+
+#include "re.h"
+#include "edit.h"
+#include "follow.h"
+
+/* The file is watched for writes and for going away, its directory for
+ * one of its name coming in. A rotated file is read to its end before
+ * the new one is taken, which may come later than the old one went. */
+
+static const char *
+follow_name(follow_t *fw)
+{
+	char *slash = strrchr(fw->filename, '/');
+	return slash ? slash + 1 : fw->filename;
+}
+
+/* false when there is no file yet, it is empty until there is */
+static bool
+follow_reopen(follow_t *fw)
+{
+	if(fw->fd >= 0) {
+		close(fw->fd);
+		inotify_rm_watch(fw->notify, fw->wd);
+	}
+	fw->offset = 0;
+	fw->fd = open(fw->filename, O_RDONLY | O_CLOEXEC);
+	if(fw->fd < 0) {
+		return false;
+	}
+	fw->wd = inotify_add_watch(fw->notify, fw->filename,
+			IN_MODIFY | IN_MOVE_SELF | IN_DELETE_SELF);
+	return true;
+}
+
+/* what is at the name is not what is read, after a rename or delete */
+static bool
+follow_replaced(follow_t *fw)
+{
+	struct stat now, read;
+	if(stat(fw->filename, &now) < 0) {
+		return false;
+	}
+	return fw->fd < 0 || fstat(fw->fd, &read) < 0 ||
+		now.st_dev != read.st_dev || now.st_ino != read.st_ino;
+}
+
+static int
+follow_read(follow_t *fw)
+{
+	int ret = FOLLOW_SAME;
+	struct stat st;
+	if(fw->fd < 0) {
+		return ret;
+	}
+	if(fstat(fw->fd, &st) < 0) {
+		return -1;
+	}
+	if(st.st_size < fw->offset) {
+		file_clear(fw->file);
+		lseek(fw->fd, 0, SEEK_SET);
+		fw->offset = 0;
+		ret = FOLLOW_RESET;
+	}
+	ssize_t len = file_append_fd(fw->file, fw->fd);
+	if(len < 0) {
+		return -1;
+	}
+	fw->offset += len;
+	return len && ret == FOLLOW_SAME ? FOLLOW_GREW : ret;
+}
+
+/* reads the whole file into f, which has one empty line */
+int
+follow_open(follow_t *fw, file_t *f, char *fname)
+{
+	memset(fw, 0, sizeof *fw);
+	fw->file = f;
+	fw->fd = -1;
+	fw->filename = strdup(fname);
+	DIEIF(!fw->filename);
+
+	char *dir = strdup(fname);
+	DIEIF(!dir);
+	char *slash = strrchr(dir, '/');
+	if(slash) {
+		slash[slash == dir] = '\0';
+	}
+	fw->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(fw->notify >= 0) {
+		fw->dir_wd = inotify_add_watch(fw->notify, slash ? dir : ".",
+				IN_CREATE | IN_MOVED_TO);
+	}
+	free(dir);
+	if(fw->notify < 0 || fw->dir_wd < 0 ||
+	(!follow_reopen(fw) && errno != ENOENT) || follow_read(fw) < 0) {
+		int err = errno;
+		follow_close(fw);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/* FOLLOW_SAME, GREW or RESET by what happened since, -1 on error */
+int
+follow_update(follow_t *fw)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const char *name = follow_name(fw);
+	bool moved = false;
+	ssize_t len;
+
+	while( (len = read(fw->notify, buf, sizeof buf)) > 0 ) {
+		for(char *p = buf; p < buf + len; ) {
+			struct inotify_event *ev = (struct inotify_event*)p;
+			if(ev->wd == fw->dir_wd ? ev->len && !strcmp(ev->name, name) :
+					ev->wd == fw->wd && ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+				moved = true;
+			}
+			p += sizeof *ev + ev->len;
+		}
+	}
+	if(len < 0 && errno != EAGAIN) {
+		return -1;
+	}
+
+	int ret = follow_read(fw);
+	if(ret >= 0 && moved && follow_replaced(fw)) {
+		follow_reopen(fw);
+		file_clear(fw->file);
+		ret = follow_read(fw) < 0 ? -1 : FOLLOW_RESET;
+	}
+	return ret;
+}
+
+void
+follow_close(follow_t *fw)
+{
+	if(fw->fd >= 0) {
+		close(fw->fd);
+	}
+	if(fw->notify >= 0) {
+		close(fw->notify);
+	}
+	free(fw->filename);
+	memset(fw, 0, sizeof *fw);
+	fw->fd = -1;
+	fw->notify = -1;
+}
+
+static int
+test_line(file_t *f, size_t line, const char *text)
+{
+	istring_t *l = &f->content.data[line];
+	TEST_OP("%zu", istr_len(l), ==, strlen(text), "line %zu", line);
+	TEST_MEMCMP_OP(istr_data(l), ==, text, strlen(text), "line %zu", line);
+	return 0;
+}
+
+static void
+test_write(const char *path, int flags, const char *text)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | flags, 0600);
+	DIEIF(fd < 0 || write(fd, text, strlen(text)) < 0);
+	close(fd);
+}
+
+int
+TEST_follow(void)
+{
+	char dir[] = "/tmp/werf-test-XXXXXX";
+	char path[sizeof dir + 8], rotated[sizeof dir + 8];
+	char call[BUFSIZ];
+	file_t f = {0};
+	follow_t fw;
+
+	DIEIF(!mkdtemp(dir));
+	snprintf(path, sizeof path, "%s/log", dir);
+	snprintf(rotated, sizeof rotated, "%s/log.1", dir);
+	test_write(path, 0, "a\nb");
+	file_insert_line(&f, 0, "", 0);
+
+	int ret = TEST_CALL(call, sizeof(call), "%p, %p, \"%s\"", follow_open,
+			((void*)&fw, (void*)&f, path));
+	TEST_OP("%d", ret, ==, 0, "%s", call);
+	TEST_OP("%zu", f.content.nmemb, ==, (size_t)2, "%s", call);
+	if(test_line(&f, 1, "b")) {
+		return -1;
+	}
+
+	// the last line goes on, the rest are added, all in one change
+	uint64_t nchanges = f.nchanges;
+	test_write(path, O_APPEND, "c\nd\n");
+	ret = follow_update(&fw);
+	TEST_OP("%d", ret, ==, FOLLOW_GREW, "%s", "append");
+	TEST_OP("%zu", f.content.nmemb, ==, (size_t)4, "%s", "append");
+	TEST_OP("%llu", (unsigned long long)f.nchanges, ==,
+			(unsigned long long)nchanges + 1, "%s", "append");
+	linechange_t *c = &f.changes[nchanges % FILE_CHANGES];
+	TEST_OP("%zu", c->start, ==, (size_t)1, "%s", "append");
+	TEST_OP("%zu", c->old_end, ==, (size_t)2, "%s", "append");
+	TEST_OP("%zu", c->new_end, ==, (size_t)4, "%s", "append");
+	if(test_line(&f, 1, "bc\n") || test_line(&f, 2, "d\n")) {
+		return -1;
+	}
+
+	ret = follow_update(&fw);
+	TEST_OP("%d", ret, ==, FOLLOW_SAME, "%s", "nothing new");
+
+	test_write(path, O_TRUNC, "x\n");
+	ret = follow_update(&fw);
+	TEST_OP("%d", ret, ==, FOLLOW_RESET, "%s", "truncated");
+	TEST_OP("%zu", f.content.nmemb, ==, (size_t)2, "%s", "truncated");
+	if(test_line(&f, 0, "x\n")) {
+		return -1;
+	}
+
+	// the old file is read on until one comes in its place
+	DIEIF(rename(path, rotated) < 0);
+	test_write(rotated, O_APPEND, "y\n");
+	ret = follow_update(&fw);
+	TEST_OP("%d", ret, ==, FOLLOW_GREW, "%s", "rotated away");
+	test_write(path, 0, "new");
+	ret = follow_update(&fw);
+	TEST_OP("%d", ret, ==, FOLLOW_RESET, "%s", "rotated");
+	TEST_OP("%zu", f.content.nmemb, ==, (size_t)1, "%s", "rotated");
+	if(test_line(&f, 0, "new")) {
+		return -1;
+	}
+
+	follow_close(&fw);
+	file_free(&f);
+	unlink(path);
+	unlink(rotated);
+	rmdir(dir);
+	return 0;
+}
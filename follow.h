@@ -0,0 +1,22 @@
+enum {
+	FOLLOW_SAME, // nothing new
+	FOLLOW_GREW, // text was added at the end
+	FOLLOW_RESET // the file was truncated or replaced, read again
+};
+
+/* A file read as it is written to, as a log is. What is added to it is
+ * appended, a file truncated or put in its place by rotation is read
+ * from the start. notify is readable when there may be something new. */
+typedef struct {
+	file_t *file;
+	char *filename;
+	int fd; // read up to its end, -1 while there is no file
+	int notify; // inotify
+	int wd; // of the file
+	int dir_wd; // of its directory, for a file created in its place
+	off_t offset; // of fd
+} follow_t;
+
+int follow_open(follow_t *fw, file_t *f, char *fname);
+int follow_update(follow_t *fw);
+void follow_close(follow_t *fw);
@@ -1,7 +1,9 @@
 #include <ctype.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include "util.h"
 
 #include "font.h"
@@ -11,17 +13,15 @@
 #include <cairo/cairo-ft.h>
 
 #include "utf.h"
+#include "bench.h"
+#include "alloc.h"
 
 static cairo_scaled_font_t *
-fontset_get_font(fontset_t *f, unsigned int index)
+fontset_load_font(fontset_t *f, unsigned int index)
 {
 	cairo_font_face_t *face;
 	cairo_matrix_t mat;
 
-	if(f->cache[index] != NULL) {
-		return f->cache[index];
-	}
-
 	face = cairo_ft_font_face_create_for_pattern(f->set->fonts[index]);
 	if(!face) {
 		fputs("cairo_ft_font_face_create_for_pattern failed\n", stderr);
@@ -30,15 +30,30 @@ fontset_get_font(fontset_t *f, unsigned int index)
 
 	cairo_matrix_init_identity(&mat);
 	cairo_font_options_t *opts = cairo_font_options_create();
-	f->cache[index] = cairo_scaled_font_create(face, &mat, &mat, opts);
+	cairo_scaled_font_t *font = cairo_scaled_font_create(face, &mat, &mat, opts);
 	cairo_font_options_destroy(opts);
 	cairo_font_face_destroy(face);
 
-	if(f->cache[index] == NULL) {
+	if(font == NULL) {
 		fputs("cairo_scaled_font_create failed\n", stderr);
 		return NULL;
 	}
-	return f->cache[index];
+	FT_Face ft = cairo_ft_scaled_font_lock_face(font);
+	f->kerning[index] = ft && FT_HAS_KERNING(ft);
+	cairo_ft_scaled_font_unlock_face(font);
+	return font;
+}
+
+static cairo_scaled_font_t *
+fontset_get_font(fontset_t *f, unsigned int index)
+{
+	pthread_mutex_lock(&f->lock);
+	if(f->cache[index] == NULL) {
+		f->cache[index] = fontset_load_font(f, index);
+	}
+	cairo_scaled_font_t *font = f->cache[index];
+	pthread_mutex_unlock(&f->lock);
+	return font;
 }
 
 int
@@ -56,7 +71,12 @@ fontset_init(fontset_t *f, FcPattern *pattern)
 		return -1;
 	}
 
+	int tag = alloc_tag(ALLOC_FONTS);
 	f->cache = xcalloc(f->set->nfont, sizeof f->cache[0]);
+	f->kerning = xcalloc(f->set->nfont, sizeof f->kerning[0]);
+	f->glyphs = xcalloc(FONTSET_CACHED, sizeof f->glyphs[0]);
+	alloc_tag(tag);
+	pthread_mutex_init(&f->lock, NULL);
 
 	f->pattern = pattern;
 	fontset_get_font(f, 0);
@@ -90,6 +110,9 @@ fontset_free(fontset_t *f)
 		}
 	}
 	free(f->cache);
+	free(f->kerning);
+	free((void *)f->glyphs);
+	pthread_mutex_destroy(&f->lock);
 	FcFontSetDestroy(f->set);
 	FcPatternDestroy(f->pattern);
 	if(f->onheap) {
@@ -339,34 +362,70 @@ face_get_advance(FT_Face face, unsigned long glyph)
 	return (double)v / (1<<16);
 }
 
+/* Entries are stored with release and loaded with acquire, so a thread
+ * that finds one also sees the font it names loaded, with its kerning. */
 static size_t
-utf8glyph(fontset_t *fset, const char *utf8, size_t utf8_len, FT_Face *face, unsigned long *glyph)
+utf8glyph(fontset_t *fset, const char *utf8, size_t utf8_len, unsigned long *glyph, double *adv)
 {
-	long codepoint;
-	size_t chsiz = utf8decode(utf8, &codepoint, utf8_len);
+	long codepoint = (uchar)utf8[0];
+	size_t chsiz = codepoint < 0x80 ? 1 : utf8scan(utf8, utf8_len, &codepoint);
 	if( codepoint == '\t' || codepoint == '\n' || codepoint == UTF_INVALID ||
 			(chsiz == 1 && !isprint(utf8[0])) ) {
 		*glyph = make_cr_glyph(FONTIDX_MAX, (uchar)utf8[0]);
-		*face = NULL;
+		*adv = face_get_advance(NULL, *glyph);
 		return 1;
 	}
 
+	_Atomic uint64_t *slot = codepoint < FONTSET_CACHED ? &fset->glyphs[codepoint] : NULL;
+	uint64_t entry = slot ? atomic_load_explicit(slot, memory_order_acquire) : 0;
+	uint32_t bits;
+	float f;
+	if(entry) {
+		bits = entry >> 32;
+		memcpy(&f, &bits, sizeof f);
+		*glyph = (uint32_t)entry;
+		*adv = f;
+		return chsiz;
+	}
+
 	fontidx_t fontidx = fontset_match_codepoint(fset, codepoint);
 	if(fontidx == FONTIDX_MAX) {
 		*glyph = make_cr_glyph(FONTIDX_MAX, codepoint | CODEPOINT_NOT_FOUND);
-		*face = NULL;
-		return chsiz;
+		*adv = face_get_advance(NULL, *glyph);
+	} else {
+		cairo_scaled_font_t *font = fontset_get_font(fset, fontidx);
+		FT_Face face = cairo_ft_scaled_font_lock_face(font);
+		uint32_t glyphidx = face_get_char_index(face, codepoint);
+		if(glyphidx == 0) {
+			printf("0: %lu @ %u\n", codepoint, fontidx);
+		}
+		*glyph = make_cr_glyph(fontidx, glyphidx);
+		*adv = face_get_advance(face, *glyph);
+		cairo_ft_scaled_font_unlock_face(font);
 	}
-
-	*face = cairo_ft_scaled_font_lock_face(fontset_get_font(fset, fontidx));
-	uint32_t glyphidx = face_get_char_index(*face, codepoint);
-	if(glyphidx == 0) {
-		printf("0: %lu @ %u\n", codepoint, fontidx);
+	if(slot) {
+		// advances are 16.16 fixed point, exact in a float
+		f = *adv;
+		memcpy(&bits, &f, sizeof bits);
+		atomic_store_explicit(slot, (uint64_t)bits << 32 | (uint32_t)*glyph,
+			memory_order_release);
 	}
-	*glyph = make_cr_glyph(fontidx, glyphidx);
 	return chsiz;
 }
 
+static double
+fontset_kerning(fontset_t *fset, unsigned long left, unsigned long right)
+{
+	fontidx_t fontidx = get_fontidx(right);
+	if(fontidx == FONTIDX_MAX || get_fontidx(left) != fontidx || !fset->kerning[fontidx]) {
+		return 0;
+	}
+	cairo_scaled_font_t *font = fset->cache[fontidx];
+	double k = face_get_kerning(cairo_ft_scaled_font_lock_face(font), left, right);
+	cairo_ft_scaled_font_unlock_face(font);
+	return k;
+}
+
 cairo_status_t
 font_text_to_glyphs(cairo_scaled_font_t *scaled_font,
 		const char *utf8, int utf8_len,
@@ -385,8 +444,7 @@ font_text_to_glyphs(cairo_scaled_font_t *scaled_font,
 
 	cairo_glyph_t glyph = {0};
 	unsigned long prev_glyph_idx;
-
-	FT_Face face;
+	double adv;
 
 	for(int off = 0; off < utf8_len; off += chsiz, i++) {
 		if(i == max_num_glyphs) {
@@ -397,16 +455,13 @@ font_text_to_glyphs(cairo_scaled_font_t *scaled_font,
 		}
 
 		prev_glyph_idx = glyph.index;
-		chsiz = utf8glyph(fset, utf8+off, utf8_len-off, &face, &glyph.index);
-
-		glyph.x += face_get_kerning(face, prev_glyph_idx, glyph.index);
-		glyphs[i] = glyph;
-		glyph.x += face_get_advance(face, glyph.index);
+		chsiz = utf8glyph(fset, utf8+off, utf8_len-off, &glyph.index, &adv);
 
-		if(face != NULL) {
-			cairo_ft_scaled_font_unlock_face( fontset_get_font(
-					fset, get_fontidx(glyph.index)) );
+		if(i) {
+			glyph.x += fontset_kerning(fset, prev_glyph_idx, glyph.index);
 		}
+		glyphs[i] = glyph;
+		glyph.x += adv;
 	}
 
 	*out_glyphs = glyphs;
@@ -439,3 +494,43 @@ font_cairo_font_face_create(fontset_t *fontset)
 
 	return uface;
 }
+
+/* one line of code, as reshaping a view line does it */
+void
+BENCH_font_text_to_glyphs(bench_t *b)
+{
+	static const char text[] = "\tint len = Xutf8LookupString(win->xic, e, buf, sizeof buf, &keysym, &status);\n";
+	FT_Library ftlib;
+	fontset_t fontset = {0};
+	cairo_glyph_t *glyphs = NULL;
+	int nglyphs = 0;
+
+	FT_Init_FreeType(&ftlib);
+	DIEIF(!FcInit());
+	DIEIF( fontset_init(&fontset, FcNameParse((FcChar8*)"DroidSans")) );
+	cairo_font_face_t *face = font_cairo_font_face_create(&fontset);
+	cairo_surface_t *surf = cairo_image_surface_create(CAIRO_FORMAT_RGB24, 1, 1);
+	cairo_t *cr = cairo_create(surf);
+	cairo_set_font_face(cr, face);
+	cairo_set_font_size(cr, 15.0);
+	cairo_scaled_font_t *font = cairo_get_scaled_font(cr);
+
+	bench_start(b);
+	for(size_t i = 0; i < b->n; i++) {
+		cairo_glyph_t *initial = glyphs;
+		font_text_to_glyphs(font, text, sizeof(text) - 1,
+				&glyphs, &nglyphs, NULL, NULL, NULL);
+		if(glyphs != initial) {
+			free(initial);
+		}
+		bench_keep(glyphs);
+	}
+	bench_stop(b);
+
+	free(glyphs);
+	cairo_destroy(cr);
+	cairo_surface_destroy(surf);
+	fontset_free(&fontset);
+	FcFini();
+	FT_Done_FreeType(ftlib);
+}
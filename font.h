@@ -1,3 +1,5 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 
 #include <ft2build.h>
@@ -7,14 +9,21 @@
 
 #include <cairo/cairo.h>
 
+enum { FONTSET_CACHED = 0x10000 }; // codepoints with glyphs cached, the BMP
+
+/* Shaping threads share a fontset: fonts are loaded under its lock and
+ * glyphs and advances are cached by codepoint, so a face is locked once
+ * per codepoint and for kerning in fonts that have it. */
 typedef struct {
 	FcPattern *pattern;
 	FcFontSet *set;
 	cairo_scaled_font_t **cache;
+	bool *kerning; // of fonts in cache
+	_Atomic uint64_t *glyphs; // advance as float bits, then glyph; 0 for none yet
+	pthread_mutex_t lock; // for cache and kerning
 	bool onheap;
 } fontset_t;
 
-int fontset_load_font(fontset_t *f, unsigned int index);
 int fontset_init(fontset_t *f, FcPattern *pattern);
 void fontset_free(fontset_t *f);
 
@@ -0,0 +1,17 @@
+#!/usr/bin/awk -f
+BEGIN {
+}
+
+match($0, /^BENCH_[A-Za-z0-9_]+/) {
+	name = substr($0, RSTART, RLENGTH)
+	print "void " name "(bench_t *b);"
+	benches = benches "\t{" name ", \"" name "\"},\n"
+}
+
+END {
+    print "\nstruct {"
+    print "\tvoid (*func)(bench_t *b);"
+    print "\tconst char *name;"
+    print "} BENCHES[] = {"
+    print benches "};"
+}
@@ -0,0 +1,284 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <X11/keysym.h>
+#include <X11/Xlib.h>
+
+#include <cairo/cairo.h>
+
+#include "util.h"
+#include "array.h"
+
+#include "utf.h"
+#include "font.h"
+#include "re.h"
+#include "edit.h"
+#include "wrap.h"
+#include "view.h"
+#include "draw.h"
+#include "alloc.h"
+#include "trace.h"
+
+/* Renders the view into an image surface and replays a script, one
+ * frame per input. Script commands, one per line:
+ *
+ *	resize W H
+ *	scroll N		lines, negative scrolls up
+ *	type TEXT		a frame per character
+ *	key NAME		X keysym name, e.g. Down or BackSpace
+ *	press X Y / motion X Y / release X Y
+ *	frames N		redraw without input
+ *	idle N			up to N ms of idle pre-shaping, in slices, no frame
+ *
+ * Per-frame timings go to stdout as CSV, with the mallocs made for
+ * glyphs, which stay at 0 once warm in a build with ALLOC_STATS. The
+ * blit is the whole frame, as the pixmap path of window.c copies it, the
+ * damage the rows the MIT-SHM path finds changed and puts. */
+
+typedef struct {
+	int width;
+	int height;
+	cairo_surface_t *surf;
+	cairo_t *cr;
+	cairo_surface_t *screen_surf;
+	cairo_t *screen;
+	cairo_font_face_t *font;
+	view_t *view;
+	damage_t damage;
+	size_t frame;
+} headless_t;
+
+static file_t file;
+static layout_t layout;
+static view_t view;
+
+static double
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1E6 + ts.tv_nsec / 1E3;
+}
+
+static void
+headless_resize(headless_t *h, int width, int height)
+{
+	if(h->cr) {
+		cairo_destroy(h->cr);
+		cairo_surface_destroy(h->surf);
+		cairo_destroy(h->screen);
+		cairo_surface_destroy(h->screen_surf);
+	}
+	h->width = width;
+	h->height = height;
+	h->surf = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	h->cr = cairo_create(h->surf);
+	// stands in for the window the pixmap is copied to
+	h->screen_surf = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	h->screen = cairo_create(h->screen_surf);
+
+	cairo_set_font_face(h->cr, h->font);
+	cairo_set_font_size(h->cr, 15.0);
+	cairo_font_extents(h->cr, &h->view->extents);
+	h->view->font = cairo_get_scaled_font(h->cr);
+	h->view->dirty = true;
+	view_resize(h->view, width, height);
+}
+
+/* same steps as window_redraw, with reshape timed on its own */
+static void
+headless_frame(headless_t *h, const char *cmd)
+{
+	view_t *v = h->view;
+	alloc_stats_t before[ALLOC_NTAGS], after[ALLOC_NTAGS];
+	alloc_stats(before);
+	double t0 = now_us();
+	if(view_stale(v)) {
+		view_reshape(v);
+	}
+	double t1 = now_us();
+
+	cairo_identity_matrix(h->cr);
+	cairo_set_source_rgb(h->cr, 1, 1, 1);
+	cairo_paint(h->cr);
+	cairo_set_source_rgba(h->cr, 0, 0, 0, 1);
+	draw_view(h->cr, v);
+	cairo_surface_flush(h->surf);
+	double t2 = now_us();
+
+	cairo_set_source_surface(h->screen, h->surf, 0, 0);
+	cairo_paint(h->screen);
+	cairo_surface_flush(h->screen_surf);
+	double t3 = now_us();
+
+	damage_find(&h->damage, h->surf, h->width, h->height, false);
+	cairo_save(h->screen);
+	for(size_t i = 0; i < h->damage.bands.nmemb; i++) {
+		band_t *b = &h->damage.bands.data[i];
+		cairo_rectangle(h->screen, 0, b->y, h->width, b->height);
+	}
+	cairo_clip(h->screen);
+	cairo_set_source_surface(h->screen, h->surf, 0, 0);
+	cairo_paint(h->screen);
+	cairo_restore(h->screen);
+	cairo_surface_flush(h->screen_surf);
+	double t4 = now_us();
+
+	alloc_stats(after);
+
+	printf("%zu,%s,%.1f,%.1f,%.1f,%.1f,%zu,%llu\n", h->frame++, cmd,
+		t1 - t0, t2 - t1, t3 - t2, t4 - t3, h->damage.nrows,
+		(unsigned long long)(after[ALLOC_GLYPHS].nalloc - before[ALLOC_GLYPHS].nalloc));
+}
+
+static int
+headless_cmd(headless_t *h, char *line)
+{
+	view_t *v = h->view;
+	char name[64];
+	int a, b;
+
+	line[strcspn(line, "\n")] = '\0';
+	if(!*line || *line == '#') {
+		return 0;
+	}
+	char *arg = line + strcspn(line, " \t");
+	arg += strspn(arg, " \t");
+
+	if(sscanf(line, "resize %d %d", &a, &b) == 2) {
+		headless_resize(h, a, b);
+		headless_frame(h, "resize");
+	} else if(sscanf(line, "scroll %d", &a) == 1) {
+		for(int i = 0; i < ABS(a); i++) {
+			view_mouse_press(v, a < 0 ? Button4 : Button5, 0, 0);
+			headless_frame(h, "scroll");
+		}
+	} else if(!strncmp(line, "type ", 5)) {
+		for(size_t len; *arg; arg += len) {
+			len = MAX(utf8chsiz(arg, strlen(arg)), 1);
+			view_keypress(v, NoSymbol, arg, len);
+			headless_frame(h, "type");
+		}
+	} else if(sscanf(line, "key %63s", name) == 1) {
+		KeySym keysym = XStringToKeysym(name);
+		if(keysym == NoSymbol) {
+			fprintf(stderr, "unknown key: %s\n", name);
+			return -1;
+		}
+		view_keypress(v, keysym, "", 0);
+		headless_frame(h, "key");
+	} else if(sscanf(line, "press %d %d", &a, &b) == 2) {
+		view_mouse_press(v, Button1, a, b);
+		headless_frame(h, "press");
+	} else if(sscanf(line, "motion %d %d", &a, &b) == 2) {
+		view_mouse_motion(v, Button1Mask, a, b, 0, 0);
+		headless_frame(h, "motion");
+	} else if(sscanf(line, "release %d %d", &a, &b) == 2) {
+		view_mouse_release(v, Button1, a, b);
+		headless_frame(h, "release");
+	} else if(sscanf(line, "idle %d", &a) == 1) {
+		uint64_t end = trace_now() + a * UINT64_C(1000000);
+		// in 2 ms slices, as window_idle
+		while(trace_now() < end && view_preshape(v, MIN(end, trace_now() + 2000000))) {
+		}
+	} else if(sscanf(line, "frames %d", &a) == 1) {
+		for(int i = 0; i < a; i++) {
+			headless_frame(h, "idle");
+		}
+	} else {
+		fprintf(stderr, "unknown command: %s\n", line);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-W width] [-H height] [-s script] file\n", argv0);
+	exit(1);
+}
+
+int
+__wrap_main(int argc, char *argv[])
+{
+	headless_t h = { .view = &view };
+	int width = 800;
+	int height = 600;
+	char *script = NULL;
+	int opt;
+
+	while((opt = getopt(argc, argv, "W:H:s:")) != -1) {
+		switch(opt) {
+		case 'W': width = atoi(optarg); break;
+		case 'H': height = atoi(optarg); break;
+		case 's': script = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1) {
+		usage(argv[0]);
+	}
+
+	setlocale(LC_CTYPE, "");
+	file_insert_line(&file, 0, "", 0);
+	int fd = open(argv[optind], O_RDONLY);
+	if(fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	range_read(&(range_t){.file = &file}, fd);
+	close(fd);
+	layout_init(&layout, &file);
+	view_attach(&view, &layout);
+
+	FT_Library ftlib;
+	FT_Init_FreeType(&ftlib);
+	DIEIF(!FcInit());
+	fontset_t fontset = {0};
+	DIEIF( fontset_init(&fontset, FcNameParse((FcChar8*)"DroidSans")) );
+	h.font = font_cairo_font_face_create(&fontset);
+	char *threads = getenv("WERF_THREADS");
+	view_threads(threads ? atoi(threads) : -1);
+
+	headless_resize(&h, width, height);
+	printf("frame,input,shape_us,draw_us,blit_us,damage_us,damage_rows,glyph_allocs\n");
+	headless_frame(&h, "first");
+
+	FILE *in = script ? fopen(script, "r") : NULL;
+	if(script && !in) {
+		perror(script);
+		return 1;
+	}
+	char line[BUFSIZ];
+	int ret = 0;
+	while(in && !ret && fgets(line, sizeof line, in)) {
+		ret = headless_cmd(&h, line);
+	}
+	if(in) {
+		fclose(in);
+	}
+
+	cairo_destroy(h.cr);
+	cairo_surface_destroy(h.surf);
+	cairo_destroy(h.screen);
+	cairo_surface_destroy(h.screen_surf);
+	damage_free(&h.damage);
+	view_threads_free();
+	draw_free();
+	fontset_free(&fontset);
+	FcFini();
+	FT_Done_FreeType(ftlib);
+
+	view_free(&view);
+	layout_free(&layout);
+	file_free(&file);
+	return ret ? 1 : 0;
+}
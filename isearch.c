@@ -0,0 +1,438 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "array.h"
+#include "test.h"
+
+#include "re.h"
+#include "edit.h"
+#include "isearch.h"
+
+/* Every typed character only filters the candidates of the previous
+ * prefix. The first character scans visible lines, the rest of the file
+ * is scanned in steps with isearch_scan until ISEARCH_CAP candidates are
+ * kept; past that, matches are found by a plain search on every look.
+ * Edits are caught up with from the file's log of changes, only the
+ * lines they touch are scanned again. */
+
+enum { ISEARCH_CAP = 1 << 16 }; // candidates of the first char kept, 1 MB
+
+/* k bytes on from adr, at most to the end of the last line */
+static address_t
+addr_advance(file_t *f, address_t adr, size_t k)
+{
+	adr.offset += k;
+	while(adr.line + 1 < f->content.nmemb &&
+			adr.offset >= istr_len(&f->content.data[adr.line])) {
+		adr.offset -= istr_len(&f->content.data[adr.line]);
+		adr.line++;
+	}
+	return adr;
+}
+
+static int
+byte_at(file_t *f, address_t adr, size_t k)
+{
+	adr = addr_advance(f, adr, k);
+	istring_t *line = &f->content.data[adr.line];
+	return adr.offset < istr_len(line) ? (uchar)istr_data(line)[adr.offset] : -1;
+}
+
+static void
+addr_push(addrarray_t *arr, address_t adr)
+{
+	ARR_EXTEND(arr, 1);
+	arr->data[arr->nmemb - 1] = adr;
+}
+
+static void
+scan_line(isearch_t *s, size_t nr)
+{
+	istring_t *line = &s->file->content.data[nr];
+	const char *text = istr_data(line);
+	const char *p = text;
+	const char *end = p + istr_len(line);
+
+	while(p < end && (p = memchr(p, s->query.data[0], end - p))) {
+		address_t adr = {nr, p - text};
+		addr_push(&s->levels.data[0], adr);
+		for(size_t k = 1; k < s->query.nmemb; k++) {
+			if(byte_at(s->file, adr, k) != (uchar)s->query.data[k]) {
+				break;
+			}
+			addr_push(&s->levels.data[k], adr);
+		}
+		p++;
+	}
+	s->scanned.data[nr] = 1;
+	s->unscanned--;
+}
+
+static void
+scan_reset(isearch_t *s)
+{
+	for(size_t i = 0; i < s->levels.nmemb; i++) {
+		s->levels.data[i].nmemb = 0;
+	}
+	s->scanned.nmemb = 0;
+	ARR_EXTEND(&s->scanned, s->file->content.nmemb);
+	memset(s->scanned.data, 0, s->scanned.nmemb);
+	s->unscanned = s->scanned.nmemb;
+	s->cursor = MIN(s->cursor, s->scanned.nmemb - 1);
+}
+
+/* drops candidates of the replaced lines and of those before them a
+ * match may start on and reach into the edit, as many as the query has
+ * newlines */
+static void
+isearch_changed(isearch_t *s, linechange_t *c)
+{
+	size_t nl = 0;
+	for(size_t k = 0; k < s->query.nmemb; k++) {
+		nl += s->query.data[k] == '\n';
+	}
+	size_t first = c->start - MIN(c->start, nl);
+	size_t nnew = c->new_end - c->start;
+
+	for(size_t i = 0; i < s->levels.nmemb; i++) {
+		addrarray_t *lvl = &s->levels.data[i];
+		size_t n = 0;
+		for(size_t j = 0; j < lvl->nmemb; j++) {
+			address_t adr = lvl->data[j];
+			if(adr.line >= c->old_end) {
+				adr.line = adr.line - c->old_end + c->new_end;
+			} else if(adr.line >= first) {
+				continue;
+			}
+			lvl->data[n++] = adr;
+		}
+		lvl->nmemb = n;
+	}
+
+	for(size_t i = c->start; i < c->old_end; i++) {
+		s->unscanned -= !s->scanned.data[i];
+	}
+	ARR_FRAG_RESIZE(&s->scanned, c->start, c->old_end, nnew);
+	memset(s->scanned.data + c->start, 0, nnew);
+	s->unscanned += nnew;
+	for(size_t i = first; i < c->start; i++) {
+		s->unscanned += s->scanned.data[i];
+		s->scanned.data[i] = 0;
+	}
+
+	if(s->cursor >= c->old_end) {
+		s->cursor = s->cursor - c->old_end + c->new_end;
+	} else if(s->cursor > first) {
+		s->cursor = first;
+	}
+}
+
+/* catches up with the edits made since the last look, a scan starts
+ * over when more of them were made than the file keeps */
+static void
+isearch_sync(isearch_t *s)
+{
+	file_t *f = s->file;
+	if(s->query.nmemb && f->nchanges - s->gen > FILE_CHANGES) {
+		scan_reset(s);
+	} else if(s->query.nmemb) {
+		for(; s->gen < f->nchanges; s->gen++) {
+			isearch_changed(s, &f->changes[s->gen % FILE_CHANGES]);
+		}
+	}
+	s->gen = f->nchanges;
+}
+
+void
+isearch_init(isearch_t *s, file_t *f)
+{
+	memset(s, 0, sizeof s[0]);
+	s->file = f;
+	s->gen = f->nchanges;
+}
+
+void
+isearch_free(isearch_t *s)
+{
+	for(size_t i = 0; i < s->levels.nmemb; i++) {
+		ARR_FREE(&s->levels.data[i]);
+	}
+	ARR_FREE(&s->levels);
+	ARR_FREE(&s->query);
+	ARR_FREE(&s->scanned);
+}
+
+/* lines vis_first..vis_last are scanned at once for the first char,
+ * isearch_scan goes on after them */
+void
+isearch_push(isearch_t *s, char c, size_t vis_first, size_t vis_last)
+{
+	isearch_sync(s);
+	ARR_EXTEND(&s->query, 1);
+	s->query.data[s->query.nmemb - 1] = c;
+	ARR_EXTEND(&s->levels, 1);
+	memset(&s->levels.data[s->levels.nmemb - 1], 0, sizeof s->levels.data[0]);
+
+	if(s->query.nmemb == 1) {
+		scan_reset(s);
+		vis_last = MIN(vis_last, s->scanned.nmemb - 1);
+		for(size_t i = vis_first; i <= vis_last; i++) {
+			scan_line(s, i);
+		}
+		s->cursor = vis_last + 1 < s->scanned.nmemb ? vis_last + 1 : 0;
+		return;
+	}
+
+	size_t k = s->query.nmemb - 1;
+	addrarray_t *prev = &s->levels.data[k - 1];
+	addrarray_t *cur = &s->levels.data[k];
+	for(size_t i = 0; i < prev->nmemb; i++) {
+		if(byte_at(s->file, prev->data[i], k) == (uchar)c) {
+			addr_push(cur, prev->data[i]);
+		}
+	}
+}
+
+/* backspace, the shorter prefix still has its candidates */
+void
+isearch_pop(isearch_t *s)
+{
+	if(!s->query.nmemb) {
+		return;
+	}
+	isearch_sync(s);
+	s->query.nmemb--;
+	s->levels.nmemb--;
+	ARR_FREE(&s->levels.data[s->levels.nmemb]);
+}
+
+/* lines are left unscanned, there are as many candidates as are kept */
+static bool
+scan_capped(isearch_t *s)
+{
+	return s->unscanned && s->levels.data[0].nmemb >= ISEARCH_CAP;
+}
+
+/* scans at most nlines of not yet scanned lines, from the cursor on and
+ * around the end, returns true when the whole file is done or no more
+ * candidates are kept */
+bool
+isearch_scan(isearch_t *s, size_t nlines)
+{
+	isearch_sync(s);
+	if(!s->query.nmemb) {
+		return true;
+	}
+	for(; s->unscanned && nlines > 0 && !scan_capped(s); s->cursor++) {
+		if(s->cursor >= s->scanned.nmemb) {
+			s->cursor = 0;
+		}
+		if(!s->scanned.data[s->cursor]) {
+			scan_line(s, s->cursor);
+			nlines--;
+		}
+	}
+	return s->unscanned == 0 || scan_capped(s);
+}
+
+/* the match nearest at or after from, else the first, by a search over
+ * the lines, for when not all candidates are kept */
+static bool
+stream_next(isearch_t *s, address_t *from, range_t *match)
+{
+	re_t re;
+	re_src_t src = {line_chunk, s->file};
+	re_pos_t pos = {from->line, from->offset};
+	re_match_t m;
+
+	re_compile(&re, s->query.data, s->query.nmemb, RE_LITERAL);
+	bool found = re_find(&re, &src, &pos, -1, &m);
+	if(!found) {
+		pos = (re_pos_t){0, 0};
+		found = re_find(&re, &src, &pos, -1, &m);
+	}
+	re_free(&re);
+	if(found) {
+		match->file = s->file;
+		pos_to_address(s->file, &m.start, &match->start);
+		pos_to_address(s->file, &m.end, &match->end);
+	}
+	return found;
+}
+
+/* nearest match of the whole query starting at or after from, else the
+ * first in the file; only scanned lines are considered while the scan
+ * goes on, all of them once it stopped at the cap */
+bool
+isearch_next(isearch_t *s, address_t *from, range_t *match)
+{
+	isearch_sync(s);
+	if(!s->query.nmemb) {
+		return false;
+	}
+	if(scan_capped(s)) {
+		return stream_next(s, from, match);
+	}
+	addrarray_t *top = &s->levels.data[s->levels.nmemb - 1];
+	address_t *after = NULL, *first = NULL;
+	for(size_t i = 0; i < top->nmemb; i++) {
+		address_t *adr = &top->data[i];
+		if(address_cmp(adr, from) >= 0 && (!after || address_cmp(adr, after) < 0)) {
+			after = adr;
+		}
+		if(!first || address_cmp(adr, first) < 0) {
+			first = adr;
+		}
+	}
+	if(!first) {
+		return false;
+	}
+	match->file = s->file;
+	match->start = after ? *after : *first;
+	match->end = addr_advance(s->file, match->start, s->query.nmemb);
+	return true;
+}
+
+static size_t
+count_find(file_t *f, const char *pat)
+{
+	re_t re;
+	re_src_t src = {line_chunk, f};
+	re_pos_t pos = {0, 0};
+	re_match_t m;
+	size_t n = 0;
+
+	re_compile(&re, pat, strlen(pat), RE_LITERAL);
+	while(re_find(&re, &src, &pos, -1, &m)) {
+		pos = m.end;
+		n++;
+	}
+	re_free(&re);
+	return n;
+}
+
+static void
+push_str(isearch_t *s, const char *str)
+{
+	for(; *str; str++) {
+		isearch_push(s, *str, 0, 0);
+	}
+}
+
+int
+TEST_isearch_push(void)
+{
+	enum { NLINES = 64 };
+	char line[128];
+	char call[BUFSIZ];
+	file_t file = {0};
+	isearch_t s;
+
+	for(int i = 0; i < NLINES; i++) {
+		int len = 40 + i;
+		memset(line, 'x', len);
+		memcpy(line + i % 16, "needle nest", 11);
+		line[len - 1] = '\n';
+		file_insert_line(&file, i, line, len);
+	}
+	// a prefix only
+	memcpy(istr_data(&file.content.data[3]) + istr_len(&file.content.data[3]) - 4, "nee", 3);
+	file_insert_line(&file, NLINES, "end", 3);
+
+	isearch_init(&s, &file);
+	isearch_push(&s, 'n', 2, 3);
+	TEST_OP("%zu", s.levels.data[0].nmemb, ==, (size_t)2 * 2 + 1, "%s", "visible first");
+	TEST_OP("%zu", s.unscanned, ==, (size_t)NLINES + 1 - 2, "%s", "visible first");
+
+	bool done = TEST_CALL(call, sizeof(call), "%p, %d",
+		isearch_scan, ((void*)&s, NLINES + 1));
+	TEST_OP("%d", done, ==, true, "%s", call);
+	TEST_OP("%zu", s.levels.data[0].nmemb, ==, count_find(&file, "n"), "%s", call);
+
+	push_str(&s, "eedle");
+	TEST_OP("%zu", s.levels.data[5].nmemb, ==, (size_t)NLINES, "%s", "needle");
+	isearch_pop(&s);
+	isearch_pop(&s);
+	isearch_pop(&s);
+	push_str(&s, "s");
+	TEST_OP("%zu", s.levels.data[3].nmemb, ==, (size_t)0, "%s", "nees");
+	isearch_pop(&s);
+	push_str(&s, "dle");
+	TEST_OP("%zu", s.levels.data[5].nmemb, ==, count_find(&file, "needle"), "%s", "needle again");
+
+	address_t from = {3, 10};
+	range_t match;
+	TEST_OP("%d", isearch_next(&s, &from, &match), ==, true, "%s", "isearch_next");
+	TEST_OP("%zu", match.start.line, ==, (size_t)4, "%s", "isearch_next");
+	TEST_OP("%zu", match.start.offset, ==, (size_t)4, "%s", "isearch_next");
+	TEST_OP("%zu", match.end.offset, ==, (size_t)10, "%s", "isearch_next");
+	from = (address_t){NLINES, 0};
+	isearch_next(&s, &from, &match);
+	TEST_OP("%zu", match.start.line, ==, (size_t)0, "%s", "around the end");
+
+	// an edit only rescans the lines it touched
+	range_t rng = {{8, 0}, {9, 3}, &file};
+	range_push(&rng, "needle\nneedle needle", 20, OP_Replace);
+	isearch_scan(&s, 0);
+	TEST_OP("%zu", s.unscanned, ==, (size_t)2, "%s", "after edit");
+	isearch_scan(&s, NLINES + 1);
+	TEST_OP("%zu", s.levels.data[5].nmemb, ==, count_find(&file, "needle"), "%s", "after edit");
+
+	// more edits than the file keeps scan it all again
+	for(int i = 0; i <= FILE_CHANGES; i++) {
+		rng = (range_t){{20, 0}, {20, 0}, &file};
+		range_push(&rng, "needle", 6, OP_Replace);
+	}
+	isearch_scan(&s, 0);
+	TEST_OP("%zu", s.unscanned, ==, file.content.nmemb, "%s", "far behind");
+	isearch_scan(&s, file.content.nmemb);
+	TEST_OP("%zu", s.levels.data[5].nmemb, ==, count_find(&file, "needle"), "%s", "far behind");
+
+	isearch_free(&s);
+	file_free(&file);
+	free(file.undobuf.first);
+	free(file.redobuf.first);
+	return 0;
+}
+
+int
+TEST_isearch_cap(void)
+{
+	enum { NLINES = 2000, LEN = 64 };
+	char line[LEN];
+	char call[BUFSIZ];
+	file_t file = {0};
+	isearch_t s;
+
+	memset(line, 'x', LEN - 1);
+	line[LEN - 1] = '\n';
+	for(int i = 0; i < NLINES; i++) {
+		file_insert_line(&file, i, line, LEN);
+	}
+	memcpy(istr_data(&file.content.data[NLINES - 10]) + 20, "xxy", 3);
+
+	isearch_init(&s, &file);
+	isearch_push(&s, 'x', 0, 0);
+	bool done = TEST_CALL(call, sizeof(call), "%p, %d",
+		isearch_scan, ((void*)&s, NLINES));
+	TEST_OP("%d", done, ==, true, "%s", call);
+	TEST_OP("%zu", s.levels.data[0].nmemb, <, (size_t)ISEARCH_CAP + LEN, "%s", call);
+	TEST_OP("%zu", s.unscanned, >, (size_t)0, "%s", call);
+
+	// matches past the kept candidates are still found
+	push_str(&s, "xy");
+	address_t from = {0, 0};
+	range_t match;
+	TEST_OP("%d", isearch_next(&s, &from, &match), ==, true, "%s", "xxy");
+	TEST_OP("%zu", match.start.line, ==, (size_t)NLINES - 10, "%s", "xxy");
+	TEST_OP("%zu", match.start.offset, ==, (size_t)20, "%s", "xxy");
+	TEST_OP("%zu", match.end.offset, ==, (size_t)23, "%s", "xxy");
+
+	isearch_free(&s);
+	file_free(&file);
+	return 0;
+}
@@ -0,0 +1,19 @@
+typedef ARRAY(address_t) addrarray_t;
+
+/* literal search refined as the query is typed */
+typedef struct {
+	file_t *file;
+	uint64_t gen; // changes to the file caught up with
+	string_t query;
+	ARRAY(addrarray_t) levels; // match starts for every prefix of query
+	string_t scanned; // per line, its matches are in levels
+	size_t unscanned;
+	size_t cursor; // line isearch_scan goes on from
+} isearch_t;
+
+void isearch_init(isearch_t *s, file_t *f);
+void isearch_free(isearch_t *s);
+void isearch_push(isearch_t *s, char c, size_t vis_first, size_t vis_last);
+void isearch_pop(isearch_t *s);
+bool isearch_scan(isearch_t *s, size_t nlines);
+bool isearch_next(isearch_t *s, address_t *from, range_t *match);
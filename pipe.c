@@ -1,16 +1,20 @@
 #include <sys/types.h>
 #include <sys/select.h>
+#include <spawn.h>
 #include <unistd.h>
 
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "util.h"
 #include "array.h"
+#include "test.h"
 
 #include "pipe.h"
+#include "alloc.h"
 
 int
 pipe_init(pipe_t *p, size_t num, int write)
@@ -39,38 +43,134 @@ pipe_init(pipe_t *p, size_t num, int write)
 	return 0;
 }
 
-int
-pipe_set_env(pipe_t *p, size_t num)
+static bool
+env_has_name(char **env, size_t num, const char *var)
+{
+	size_t len = strcspn(var, "=");
+	for(size_t i = 0; i < num; i++) {
+		if(!strncmp(env[i], var, len) && env[i][len] == '=') {
+			return true;
+		}
+	}
+	return false;
+}
+
+ssize_t
+pipe_set_env(pipe_t *p, size_t num, char **env)
 {
 	#define DEVFD "/dev/fd/"
-	static char buf[sizeof(DEVFD) + (sizeof(int) * 5 + 1) / 2] = DEVFD;
-	static char *bufend = buf + sizeof(DEVFD) - 1;
+	size_t n = 0;
 
 	for(size_t i = 0; i < num; i++) {
 		if(p[i].child.name) {
-			if(sprintf(bufend, "%d", p[i].child.fd) < 0 ||
-			setenv(p[i].child.name, buf, 1) < 0) {
+			size_t siz = strlen(p[i].child.name) + sizeof("=" DEVFD) +
+					(sizeof(int) * 5 + 1) / 2;
+			env[n] = xmalloc(siz, 1);
+			if(snprintf(env[n], siz, "%s=" DEVFD "%d",
+					p[i].child.name, p[i].child.fd) < 0) {
+				free(env[n]);
+				for(; n > 0; n--) {
+					free(env[n-1]);
+				}
 				return -1;
 			}
+			n++;
 		}
 	}
+	return n;
+}
+
+static int
+test_set_env(pipe_t *p, size_t num, char *env[], ssize_t *n)
+{
+	char call[BUFSIZ];
+
+	*n = TEST_CALL(call, sizeof(call), "%p, %zu, %p", pipe_set_env,
+			((void*)p, num, (void*)env));
+	TEST_OP("%zd", *n, ==, (ssize_t)2, "%s", call);
+	TEST_MEMCMP_OP(env[0], ==, "werf_control_W=/dev/fd/7", 25, "%s", call);
+	TEST_MEMCMP_OP(env[1], ==, "werf_x=/dev/fd/123", 19, "%s", call);
+	TEST_OP("%d", env_has_name(env, *n, "werf_x=1"), ==, true, "%s", "werf_x=1");
+	TEST_OP("%d", env_has_name(env, *n, "werf=1"), ==, false, "%s", "werf=1");
 	return 0;
 }
 
 int
-pipe_cmd_exec(pipe_t *p, size_t num, char *argv[])
+TEST_pipe_set_env(void)
 {
-	for(size_t i = 0; i < num; i++) {
-		close(p[i].fd);
+	pipe_t p[] = {
+		{.child = {.name = "werf_control_W", .fd = 7}},
+		{.child = {.fd = 8}},
+		{.child = {.name = "werf_x", .fd = 123}}
+	};
+	char *env[LEN(p)];
+	ssize_t n;
+
+	int ret = test_set_env(p, LEN(p), env, &n);
+	for(ssize_t i = 0; i < n; i++) {
+		free(env[i]);
 	}
+	return ret;
+}
 
-	if(setenv("TERM", "dumb", 1) < 0 ||
-	pipe_set_env(p, num) < 0) {
+/* posix_spawn instead of fork: the editor may hold gigabytes of document,
+ * duplicating its page tables for a short lived filter is what made
+ * commands slow to start */
+int
+pipe_cmd_exec(pid_t *pid, pipe_t *p, size_t num, int fd_in, int fd_out,
+		char *argv[])
+{
+	extern char **environ;
+	static char term[] = "TERM=dumb";
+
+	size_t nenv = 0;
+	while(environ[nenv]) {
+		nenv++;
+	}
+	char **env = xcalloc(num + nenv + 2, sizeof env[0]);
+
+	ssize_t nset = pipe_set_env(p, num, env);
+	if(nset < 0) {
+		free(env);
 		return -1;
 	}
+	size_t n = nset;
+	env[n++] = term;
+	for(size_t i = 0; i < nenv; i++) {
+		if(!env_has_name(env, n, environ[i])) {
+			env[n++] = environ[i];
+		}
+	}
+	env[n] = NULL;
+
+	int err;
+	posix_spawn_file_actions_t fa;
+	if( (err = posix_spawn_file_actions_init(&fa)) ) {
+		goto out_env;
+	}
+	for(size_t i = 0; i < num && !err; i++) {
+		err = posix_spawn_file_actions_addclose(&fa, p[i].fd);
+	}
+	if(err ||
+	(err = posix_spawn_file_actions_adddup2(&fa, fd_in, STDIN_FILENO)) ||
+	(err = posix_spawn_file_actions_adddup2(&fa, fd_out, STDOUT_FILENO)) ) {
+		goto out_fa;
+	}
+
+	err = posix_spawnp(pid, argv[0], &fa, NULL, argv, env);
 
-	execvp(argv[0], argv);
-	return -1;
+out_fa:
+	posix_spawn_file_actions_destroy(&fa);
+out_env:
+	for(ssize_t i = 0; i < nset; i++) {
+		free(env[i]);
+	}
+	free(env);
+	if(err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
 }
 
 int
@@ -145,7 +245,9 @@ pipe_recv(pipe_t *p, control_t *ctl)
 	enum { PIPE_BUF_SIZE = BUFSIZ * 2 };
 
 	size_t start = p->buf.nmemb;
+	int tag = alloc_tag(ALLOC_PIPES);
 	ARR_EXTEND(&p->buf, PIPE_BUF_SIZE);
+	alloc_tag(tag);
 
 	ssize_t len = read(p->fd, p->buf.data + start, PIPE_BUF_SIZE);
 
@@ -26,8 +26,9 @@ typedef struct {
 } pipe_t;
 
 int pipe_init(pipe_t *p, size_t num, int write);
-int pipe_set_env(pipe_t *p, size_t num);
-int pipe_cmd_exec(pipe_t *p, size_t num, char *argv[]);
+ssize_t pipe_set_env(pipe_t *p, size_t num, char **env);
+int pipe_cmd_exec(pid_t *pid, pipe_t *p, size_t num, int fd_in, int fd_out,
+		char *argv[]);
 int pipe_select(control_t *control, fd_set *rfd, fd_set *wfd,
 		pipe_t *r, size_t num_r, pipe_t *w, size_t num_w);
 void pipe_send(pipe_t *p, control_t *ctl);
@@ -0,0 +1,164 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "test.h"
+
+#include "pool.h"
+
+static void
+pool_work(pool_t *p, pool_job_t job, void *usr, size_t n)
+{
+	size_t i;
+	while((i = atomic_fetch_add_explicit(&p->next, 1, memory_order_relaxed)) < n) {
+		job(usr, i);
+	}
+}
+
+/* a worker woken late finds the job taken and waits for the next */
+static void *
+pool_worker(void *arg)
+{
+	pool_t *p = arg;
+	uint64_t round = 0;
+
+	pthread_mutex_lock(&p->lock);
+	for(;;) {
+		while(!p->quit && p->round == round) {
+			pthread_cond_wait(&p->wake, &p->lock);
+		}
+		if(p->quit) {
+			break;
+		}
+		round = p->round;
+		pool_job_t job = p->job;
+		void *usr = p->usr;
+		size_t n = p->n;
+		p->busy++;
+		pthread_mutex_unlock(&p->lock);
+
+		pool_work(p, job, usr, n);
+
+		pthread_mutex_lock(&p->lock);
+		if(!--p->busy) {
+			pthread_cond_broadcast(&p->idle);
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/* nthreads < 0 for one per processor but the one running jobs, 0 for
+ * none; -1 when not even one could be made */
+int
+pool_init(pool_t *p, int nthreads)
+{
+	memset(p, 0, sizeof p[0]);
+	atomic_init(&p->next, 0);
+	if(nthreads < 0) {
+		nthreads = MAX(sysconf(_SC_NPROCESSORS_ONLN) - 1, 0);
+	}
+	if(!nthreads) {
+		return 0;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wake, NULL);
+	pthread_cond_init(&p->idle, NULL);
+
+	p->thread = xmalloc(nthreads, sizeof p->thread[0]);
+	for(; p->nthreads < nthreads; p->nthreads++) {
+		if(pthread_create(&p->thread[p->nthreads], NULL, pool_worker, p)) {
+			break;
+		}
+	}
+	return p->nthreads ? 0 : -1;
+}
+
+/* returns once job ran for every index, what it wrote is seen then */
+void
+pool_run(pool_t *p, pool_job_t job, void *usr, size_t n)
+{
+	if(!p->nthreads || n < 2) {
+		for(size_t i = 0; i < n; i++) {
+			job(usr, i);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	while(p->busy) {
+		pthread_cond_wait(&p->idle, &p->lock);
+	}
+	p->job = job;
+	p->usr = usr;
+	p->n = n;
+	atomic_store(&p->next, 0);
+	p->round++;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+
+	pool_work(p, job, usr, n);
+
+	pthread_mutex_lock(&p->lock);
+	while(p->busy) {
+		pthread_cond_wait(&p->idle, &p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+void
+pool_free(pool_t *p)
+{
+	if(p->thread) {
+		pthread_mutex_lock(&p->lock);
+		p->quit = true;
+		pthread_cond_broadcast(&p->wake);
+		pthread_mutex_unlock(&p->lock);
+		for(int i = 0; i < p->nthreads; i++) {
+			pthread_join(p->thread[i], NULL);
+		}
+		free(p->thread);
+		pthread_mutex_destroy(&p->lock);
+		pthread_cond_destroy(&p->wake);
+		pthread_cond_destroy(&p->idle);
+	}
+	memset(p, 0, sizeof p[0]);
+}
+
+static void
+count_job(void *usr, size_t i)
+{
+	atomic_int *hits = usr;
+	atomic_fetch_add(&hits[i], 1);
+}
+
+int
+TEST_pool_run(void)
+{
+	enum { N = 1000 };
+	static atomic_int hits[N];
+	char call[BUFSIZ];
+	pool_t p;
+
+	for(int nthreads = 0; nthreads <= 4; nthreads += 4) {
+		int ret = TEST_CALL(call, sizeof(call), "%p, %d", pool_init, ((void*)&p, nthreads));
+		TEST_OP("%d", ret, ==, 0, "%s", call);
+		for(int round = 0; round < 50; round++) {
+			for(int i = 0; i < N; i++) {
+				atomic_init(&hits[i], 0);
+			}
+			pool_run(&p, count_job, hits, N);
+			for(int i = 0; i < N; i++) {
+				TEST_OP("%d", atomic_load(&hits[i]), ==, 1, "%s", call);
+			}
+		}
+		pool_free(&p);
+	}
+	return 0;
+}
@@ -0,0 +1,23 @@
+typedef void (*pool_job_t)(void *usr, size_t i);
+
+/* Threads kept waiting for jobs, each run over indices 0 to n - 1, taken
+ * one at a time by the workers and the thread that runs it. A pool with
+ * no threads, as when none could be made, runs jobs on that thread. */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wake; // a job is given, or quit
+	pthread_cond_t idle; // no worker is in a job
+	pool_job_t job;
+	void *usr;
+	size_t n;
+	atomic_size_t next;
+	uint64_t round; // jobs given, a worker joins each once
+	int busy; // workers in a job
+	bool quit;
+	int nthreads;
+	pthread_t *thread;
+} pool_t;
+
+int pool_init(pool_t *p, int nthreads);
+void pool_run(pool_t *p, pool_job_t job, void *usr, size_t n);
+void pool_free(pool_t *p);
@@ -0,0 +1,286 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "array.h"
+#include "test.h"
+
+#include "re.h"
+#include "edit.h"
+#include "proto.h"
+
+enum { VARINT_MAX = 10 };
+
+static size_t
+varint_encode(uint8_t *p, uint64_t v)
+{
+	size_t n = 0;
+	for(; v >= 0x80; v >>= 7) {
+		p[n++] = v | 0x80;
+	}
+	p[n++] = v;
+	return n;
+}
+
+/* bytes taken, 0 when p ends before the varint does */
+static size_t
+varint_decode(const uint8_t *p, size_t len, uint64_t *v)
+{
+	*v = 0;
+	for(size_t i = 0; i < len && i < VARINT_MAX; i++) {
+		*v |= (uint64_t)(p[i] & 0x7F) << (7 * i);
+		if(!(p[i] & 0x80)) {
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+void
+proto_begin(proto_msg_t *m, int type)
+{
+	m->buf.nmemb = 0;
+	m->pos = 0;
+	m->err = false;
+	proto_put(m, type);
+}
+
+void
+proto_put(proto_msg_t *m, uint64_t v)
+{
+	ARR_EXTEND(&m->buf, VARINT_MAX);
+	m->buf.nmemb -= VARINT_MAX;
+	m->buf.nmemb += varint_encode((uint8_t*)m->buf.data + m->buf.nmemb, v);
+}
+
+/* zigzag, so small negative numbers stay short */
+void
+proto_put_int(proto_msg_t *m, int64_t v)
+{
+	proto_put(m, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+void
+proto_put_text(proto_msg_t *m, const char *text, size_t len)
+{
+	proto_put(m, len);
+	ARR_EXTEND(&m->buf, len);
+	if(len) {
+		memcpy(m->buf.data + m->buf.nmemb - len, text, len);
+	}
+}
+
+void
+proto_put_range(proto_msg_t *m, range_t *rng)
+{
+	proto_put(m, rng->start.line);
+	proto_put(m, rng->start.offset);
+	proto_put(m, rng->end.line);
+	proto_put(m, rng->end.offset);
+}
+
+uint64_t
+proto_get(proto_msg_t *m)
+{
+	uint64_t v;
+	size_t n = varint_decode((uint8_t*)m->buf.data + m->pos, m->buf.nmemb - m->pos, &v);
+	if(!n) {
+		m->err = true;
+		return 0;
+	}
+	m->pos += n;
+	return v;
+}
+
+int64_t
+proto_get_int(proto_msg_t *m)
+{
+	uint64_t v = proto_get(m);
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/* points into the message, valid until it is reused */
+char *
+proto_get_text(proto_msg_t *m, size_t *len)
+{
+	*len = proto_get(m);
+	if(m->err || *len > m->buf.nmemb - m->pos) {
+		m->err = true;
+		*len = 0;
+		return "";
+	}
+	char *text = m->buf.data + m->pos;
+	m->pos += *len;
+	return text;
+}
+
+void
+proto_get_range(proto_msg_t *m, range_t *rng)
+{
+	rng->start.line = proto_get(m);
+	rng->start.offset = proto_get(m);
+	rng->end.line = proto_get(m);
+	rng->end.offset = proto_get(m);
+}
+
+int
+proto_send(proto_conn_t *c, proto_msg_t *m)
+{
+	uint8_t hdr[VARINT_MAX];
+	struct iovec iov[2] = {
+		{hdr, varint_encode(hdr, m->buf.nmemb)},
+		{m->buf.data, m->buf.nmemb}
+	};
+	size_t total = iov[0].iov_len + iov[1].iov_len;
+
+	for(int i = 0; i < 2; ) {
+		ssize_t n = writev(c->out, iov + i, 2 - i);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		for(; i < 2 && (size_t)n >= iov[i].iov_len; i++) {
+			n -= iov[i].iov_len;
+		}
+		if(i < 2) {
+			iov[i].iov_base = (char*)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+	c->sent += total;
+	return 0;
+}
+
+/* Reads ahead as much as there is. Returns the type of the message read
+ * into m, 0 at the end of input, -1 on errors. */
+int
+proto_recv(proto_conn_t *c, proto_msg_t *m)
+{
+	for(;;) {
+		uint8_t *p = (uint8_t*)c->rbuf.data + c->rpos;
+		size_t avail = c->rbuf.nmemb - c->rpos;
+		uint64_t len;
+		size_t hdr = varint_decode(p, avail, &len);
+		if(hdr && avail - hdr >= len) {
+			m->buf.nmemb = 0;
+			ARR_EXTEND(&m->buf, len);
+			memcpy(m->buf.data, p + hdr, len);
+			m->pos = 0;
+			m->err = false;
+			c->rpos += hdr + len;
+			c->received += hdr + len;
+			int type = proto_get(m);
+			return m->err || type <= 0 || type >= PROTO_NTYPES ? -1 : type;
+		}
+		if(!hdr && avail >= VARINT_MAX) {
+			return -1;
+		}
+
+		// the rest to the front, room for at least the whole message
+		if(avail) {
+			memmove(c->rbuf.data, c->rbuf.data + c->rpos, avail);
+		}
+		c->rbuf.nmemb = avail;
+		c->rpos = 0;
+		size_t want = hdr ? hdr + len - avail : 0;
+		ARR_EXTEND(&c->rbuf, MAX(want, (size_t)BUFSIZ * 8));
+		c->rbuf.nmemb = avail;
+
+		ssize_t n = read(c->in, c->rbuf.data + avail, c->rbuf.amemb - avail);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			return n < 0 ? -1 : 0;
+		}
+		c->rbuf.nmemb += n;
+	}
+}
+
+void
+proto_close(proto_conn_t *c)
+{
+	close(c->in);
+	if(c->out != c->in) {
+		close(c->out);
+	}
+	ARR_FREE(&c->rbuf);
+}
+
+int
+TEST_proto_recv(void)
+{
+	char call[BUFSIZ];
+	int fds[2];
+	DIEIF(pipe(fds) < 0);
+	proto_conn_t w = {.in = -1, .out = fds[1]};
+	proto_conn_t r = {.in = fds[0], .out = -1};
+	proto_msg_t m = {0};
+	uint64_t nums[] = {0, 1, 127, 128, 300, UINT64_MAX};
+
+	proto_begin(&m, PROTO_CHANGE);
+	for(size_t i = 0; i < LEN(nums); i++) {
+		proto_put(&m, nums[i]);
+	}
+	proto_put_int(&m, -1);
+	proto_put_int(&m, INT64_MIN);
+	proto_put_text(&m, "ab\n", 3);
+	proto_send(&w, &m);
+	TEST_OP("%zu", m.buf.nmemb, ==, (size_t)1 + 3 + 2 + 2 + 10 + 1 + 10 + 4, "%s", "proto_put");
+
+	// a big one, more than is read at once
+	proto_begin(&m, PROTO_LINES);
+	string_t big = {0};
+	ARR_RESIZE(&big, BUFSIZ * 20);
+	memset(big.data, 'x', big.nmemb);
+	proto_put_text(&m, big.data, big.nmemb);
+	pid_t pid = fork();
+	if(pid == 0) {
+		proto_send(&w, &m);
+		_exit(0);
+	}
+	close(fds[1]);
+
+	int type = TEST_CALL(call, sizeof(call), "%p, %p", proto_recv, ((void*)&r, (void*)&m));
+	TEST_OP("%d", type, ==, PROTO_CHANGE, "%s", call);
+	for(size_t i = 0; i < LEN(nums); i++) {
+		uint64_t v = proto_get(&m);
+		TEST_OP("%llu", (unsigned long long)v, ==, (unsigned long long)nums[i], "%s", call);
+	}
+	int64_t neg = proto_get_int(&m);
+	TEST_OP("%lld", (long long)neg, ==, -1LL, "%s", call);
+	neg = proto_get_int(&m);
+	TEST_OP("%lld", (long long)neg, ==, (long long)INT64_MIN, "%s", call);
+	size_t len;
+	char *text = proto_get_text(&m, &len);
+	TEST_OP("%zu", len, ==, (size_t)3, "%s", call);
+	TEST_MEMCMP_OP(text, ==, "ab\n", 3, "%s", call);
+	proto_get(&m);
+	TEST_OP("%d", m.err, ==, true, "%s", "read past the end");
+
+	type = proto_recv(&r, &m);
+	TEST_OP("%d", type, ==, PROTO_LINES, "%s", call);
+	text = proto_get_text(&m, &len);
+	TEST_OP("%zu", len, ==, big.nmemb, "%s", call);
+	TEST_OP("%d", m.err, ==, false, "%s", call);
+	type = proto_recv(&r, &m);
+	TEST_OP("%d", type, ==, 0, "%s", "end of input");
+
+	waitpid(pid, NULL, 0);
+	close(fds[0]);
+	ARR_FREE(&r.rbuf);
+	ARR_FREE(&m.buf);
+	ARR_FREE(&big);
+	return 0;
+}
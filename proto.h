@@ -0,0 +1,51 @@
+/* Messages between a backend, which has the file, and a frontend, which
+ * mirrors the lines its views show. A message is the length of the rest,
+ * then its type and fields, all LEB128 varints; text is a length and the
+ * bytes, a range its four numbers. A request is answered by any number
+ * of replies and then PROTO_DONE. */
+enum {
+	PROTO_HELLO = 1, // lines; the backend's first words
+	PROTO_FETCH, // start end
+	PROTO_LINES, // start n, then n texts
+	PROTO_PUSH, // range type text
+	PROTO_BATCH, // n, then n ranges and texts
+	PROTO_UNDO, // range redo
+	PROTO_FIND, // range backward, then a compiled re_t
+	PROTO_SAVE, // file name, empty for the one the backend opened
+	PROTO_CHANGE, // start old_end new_end, as in linechange_t
+	PROTO_RANGE, // range after a push, undo or find
+	PROTO_EDITS, // n, then n ranges of a batch after it
+	PROTO_DONE, // status
+	PROTO_NTYPES
+};
+
+enum { PROTO_EAGER = 256 }; // changed lines sent along with an edit
+
+typedef struct {
+	string_t buf; // type and fields
+	size_t pos; // read so far
+	bool err; // read past the end
+} proto_msg_t;
+
+typedef struct {
+	int in;
+	int out;
+	string_t rbuf; // read ahead
+	size_t rpos;
+	uint64_t sent; // bytes
+	uint64_t received;
+} proto_conn_t;
+
+void proto_begin(proto_msg_t *m, int type);
+void proto_put(proto_msg_t *m, uint64_t v);
+void proto_put_int(proto_msg_t *m, int64_t v);
+void proto_put_text(proto_msg_t *m, const char *text, size_t len);
+void proto_put_range(proto_msg_t *m, range_t *rng);
+uint64_t proto_get(proto_msg_t *m);
+int64_t proto_get_int(proto_msg_t *m);
+char *proto_get_text(proto_msg_t *m, size_t *len);
+void proto_get_range(proto_msg_t *m, range_t *rng);
+
+int proto_send(proto_conn_t *c, proto_msg_t *m);
+int proto_recv(proto_conn_t *c, proto_msg_t *m);
+void proto_close(proto_conn_t *c);
@@ -0,0 +1,884 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "array.h"
+#include "test.h"
+
+#include "re.h"
+
+/* Thompson NFA simulated like Pike VM with leftmost-longest semantics.
+ * Text is fed chunk by chunk so matches can cross block and line
+ * boundaries without copying the text. Empty matches are not reported.
+ *
+ * Syntax: literals, . [] [^] * + ? | () ^ $ and escapes \n \t \d \w \s.
+ * '.' and negated classes do not match a new line. Classes are byte based,
+ * '.' consumes a whole UTF-8 sequence. */
+
+enum {
+	I_CHAR,
+	I_ANY,
+	I_CLASS,
+	I_BOL,
+	I_EOL,
+	I_SPLIT,
+	I_JMP,
+	I_MATCH
+};
+
+enum {
+	N_EMPTY,
+	N_CHAR,
+	N_ANY,
+	N_CLASS,
+	N_BOL,
+	N_EOL,
+	N_CAT,
+	N_ALT,
+	N_STAR,
+	N_PLUS,
+	N_QUEST
+};
+
+typedef struct {
+	int type;
+	int c;
+	int l;
+	int r;
+} node_t;
+
+typedef struct {
+	re_t *re;
+	const char *s;
+	const char *end;
+	ARRAY(node_t) nodes;
+	int depth;
+} parser_t;
+
+static int parse_alt(parser_t *p);
+
+static int
+node_new(parser_t *p, int type, int c, int l, int r)
+{
+	ARR_EXTEND(&p->nodes, 1);
+	p->nodes.data[p->nodes.nmemb - 1] = (node_t){type, c, l, r};
+	return p->nodes.nmemb - 1;
+}
+
+static void
+class_set(re_class_t *cls, uchar c)
+{
+	cls->bits[c / 32] |= 1u << (c % 32);
+}
+
+static bool
+class_has(const re_class_t *cls, uchar c)
+{
+	return cls->bits[c / 32] & (1u << (c % 32));
+}
+
+static void
+class_set_range(re_class_t *cls, uchar from, uchar to)
+{
+	for(unsigned c = from; c <= to; c++) {
+		class_set(cls, c);
+	}
+}
+
+static int
+class_new(parser_t *p)
+{
+	ARR_EXTEND(&p->re->classes, 1);
+	memset(&p->re->classes.data[p->re->classes.nmemb - 1], 0,
+			sizeof p->re->classes.data[0]);
+	return p->re->classes.nmemb - 1;
+}
+
+/* \d \w \s, returns false for other escapes */
+static bool
+class_escape(re_class_t *cls, char c)
+{
+	switch(c) {
+	case 'd':
+		class_set_range(cls, '0', '9');
+		return true;
+	case 'w':
+		class_set_range(cls, '0', '9');
+		class_set_range(cls, 'a', 'z');
+		class_set_range(cls, 'A', 'Z');
+		class_set(cls, '_');
+		return true;
+	case 's':
+		class_set(cls, ' ');
+		class_set_range(cls, '\t', '\r');
+		return true;
+	}
+	return false;
+}
+
+static uchar
+escape_char(char c)
+{
+	switch(c) {
+	case 'n':
+		return '\n';
+	case 't':
+		return '\t';
+	}
+	return c;
+}
+
+static int
+parse_class(parser_t *p)
+{
+	int idx = class_new(p);
+	re_class_t cls = {0};
+	bool negate = false;
+
+	if(p->s < p->end && *p->s == '^') {
+		negate = true;
+		p->s++;
+	}
+	for(bool first = true; p->s < p->end && (first || *p->s != ']');
+			first = false) {
+		uchar from = *p->s++;
+		if(from == '\\' && p->s < p->end) {
+			if(class_escape(&cls, *p->s)) {
+				p->s++;
+				continue;
+			}
+			from = escape_char(*p->s++);
+		}
+		uchar to = from;
+		if(p->s + 1 < p->end && p->s[0] == '-' && p->s[1] != ']') {
+			to = p->s[1];
+			p->s += 2;
+			if(to == '\\' && p->s < p->end) {
+				to = escape_char(*p->s++);
+			}
+			if(to < from) {
+				p->re->err = "invalid class range";
+				return -1;
+			}
+		}
+		class_set_range(&cls, from, to);
+	}
+	if(p->s >= p->end) {
+		p->re->err = "missing ]";
+		return -1;
+	}
+	p->s++;
+
+	if(negate) {
+		for(size_t i = 0; i < LEN(cls.bits); i++) {
+			cls.bits[i] = ~cls.bits[i];
+		}
+		cls.bits['\n' / 32] &= ~(1u << ('\n' % 32));
+	}
+	p->re->classes.data[idx] = cls;
+	return node_new(p, N_CLASS, idx, -1, -1);
+}
+
+static int
+parse_atom(parser_t *p)
+{
+	char c = *p->s++;
+	switch(c) {
+	case '(': {
+		if(++p->depth > 1000) {
+			p->re->err = "nesting too deep";
+			return -1;
+		}
+		int n = parse_alt(p);
+		p->depth--;
+		if(n < 0) {
+			return -1;
+		}
+		if(p->s >= p->end || *p->s != ')') {
+			p->re->err = "missing )";
+			return -1;
+		}
+		p->s++;
+		return n;
+	}
+	case '[':
+		return parse_class(p);
+	case '.':
+		return node_new(p, N_ANY, 0, -1, -1);
+	case '^':
+		return node_new(p, N_BOL, 0, -1, -1);
+	case '$':
+		return node_new(p, N_EOL, 0, -1, -1);
+	case '*': /* FALL THROUGH */
+	case '+':
+	case '?':
+		p->re->err = "missing operand";
+		return -1;
+	case '\\': {
+		if(p->s >= p->end) {
+			p->re->err = "trailing \\";
+			return -1;
+		}
+		re_class_t cls = {0};
+		if(class_escape(&cls, *p->s)) {
+			p->s++;
+			int idx = class_new(p);
+			p->re->classes.data[idx] = cls;
+			return node_new(p, N_CLASS, idx, -1, -1);
+		}
+		return node_new(p, N_CHAR, escape_char(*p->s++), -1, -1);
+	}
+	}
+	return node_new(p, N_CHAR, (uchar)c, -1, -1);
+}
+
+static int
+parse_repeat(parser_t *p)
+{
+	int n = parse_atom(p);
+	while(n >= 0 && p->s < p->end) {
+		int type;
+		switch(*p->s) {
+		case '*':
+			type = N_STAR;
+			break;
+		case '+':
+			type = N_PLUS;
+			break;
+		case '?':
+			type = N_QUEST;
+			break;
+		default:
+			return n;
+		}
+		p->s++;
+		n = node_new(p, type, 0, n, -1);
+	}
+	return n;
+}
+
+static int
+parse_cat(parser_t *p)
+{
+	int n = node_new(p, N_EMPTY, 0, -1, -1);
+	while(p->s < p->end && *p->s != '|' && *p->s != ')') {
+		int r = parse_repeat(p);
+		if(r < 0) {
+			return -1;
+		}
+		n = node_new(p, N_CAT, 0, n, r);
+	}
+	return n;
+}
+
+static int
+parse_alt(parser_t *p)
+{
+	int n = parse_cat(p);
+	while(n >= 0 && p->s < p->end && *p->s == '|') {
+		p->s++;
+		int r = parse_cat(p);
+		if(r < 0) {
+			return -1;
+		}
+		n = node_new(p, N_ALT, 0, n, r);
+	}
+	return n;
+}
+
+static int
+emit(re_t *re, int op, int c, int x, int y)
+{
+	ARR_EXTEND(&re->prog, 1);
+	re->prog.data[re->prog.nmemb - 1] = (re_inst_t){op, c, x, y};
+	return re->prog.nmemb - 1;
+}
+
+static void
+compile_node(re_t *re, node_t *nodes, int n)
+{
+	node_t *node = &nodes[n];
+	int split;
+	int jmp;
+
+	switch(node->type) {
+	case N_EMPTY:
+		break;
+	case N_CHAR:
+		emit(re, I_CHAR, node->c, 0, 0);
+		break;
+	case N_ANY: {
+		int cont = re->classes.nmemb;
+		ARR_EXTEND(&re->classes, 1);
+		re_class_t *cls = &re->classes.data[cont];
+		memset(cls, 0, sizeof cls[0]);
+		class_set_range(cls, 0x80, 0xBF);
+
+		emit(re, I_ANY, 0, 0, 0);
+		split = emit(re, I_SPLIT, 0, 0, 0);
+		int tail = emit(re, I_CLASS, 0, cont, 0); // emit may move prog
+		re->prog.data[split].x = tail;
+		emit(re, I_JMP, 0, split, 0);
+		re->prog.data[split].y = re->prog.nmemb;
+		break;
+	}
+	case N_CLASS:
+		emit(re, I_CLASS, 0, node->c, 0);
+		break;
+	case N_BOL:
+		emit(re, I_BOL, 0, 0, 0);
+		break;
+	case N_EOL:
+		emit(re, I_EOL, 0, 0, 0);
+		break;
+	case N_CAT: {
+		// concatenations chain down the left, one per byte of a literal,
+		// so the chain is walked instead of recursed into
+		ARRAY(int) right = {0};
+		for(; nodes[n].type == N_CAT; n = nodes[n].l) {
+			ARR_EXTEND(&right, 1);
+			right.data[right.nmemb - 1] = nodes[n].r;
+		}
+		compile_node(re, nodes, n);
+		for(size_t i = right.nmemb; i-- > 0; ) {
+			compile_node(re, nodes, right.data[i]);
+		}
+		ARR_FREE(&right);
+		break;
+	}
+	case N_ALT:
+		split = emit(re, I_SPLIT, 0, 0, 0);
+		re->prog.data[split].x = re->prog.nmemb;
+		compile_node(re, nodes, node->l);
+		jmp = emit(re, I_JMP, 0, 0, 0);
+		re->prog.data[split].y = re->prog.nmemb;
+		compile_node(re, nodes, node->r);
+		re->prog.data[jmp].x = re->prog.nmemb;
+		break;
+	case N_STAR:
+		split = emit(re, I_SPLIT, 0, 0, 0);
+		re->prog.data[split].x = re->prog.nmemb;
+		compile_node(re, nodes, node->l);
+		emit(re, I_JMP, 0, split, 0);
+		re->prog.data[split].y = re->prog.nmemb;
+		break;
+	case N_PLUS: {
+		int start = re->prog.nmemb;
+		compile_node(re, nodes, node->l);
+		split = emit(re, I_SPLIT, 0, start, 0);
+		re->prog.data[split].y = re->prog.nmemb;
+		break;
+	}
+	case N_QUEST:
+		split = emit(re, I_SPLIT, 0, 0, 0);
+		re->prog.data[split].x = re->prog.nmemb;
+		compile_node(re, nodes, node->l);
+		re->prog.data[split].y = re->prog.nmemb;
+		break;
+	}
+}
+
+/* the byte every match has to start with, used to skip with memchr */
+static int
+first_literal(re_t *re, int pc, char *seen)
+{
+	if(seen[pc]) {
+		return -2;
+	}
+	seen[pc] = 1;
+
+	re_inst_t *inst = &re->prog.data[pc];
+	switch(inst->op) {
+	case I_CHAR:
+		return inst->c;
+	case I_JMP:
+		return first_literal(re, inst->x, seen);
+	case I_SPLIT: {
+		int x = first_literal(re, inst->x, seen);
+		int y = first_literal(re, inst->y, seen);
+		if(x == -1 || y == -1 || (x >= 0 && y >= 0 && x != y)) {
+			return -1;
+		}
+		return x >= 0 ? x : y;
+	}
+	}
+	return -1;
+}
+
+int
+re_compile(re_t *re, const char *pat, size_t len, int flags)
+{
+	memset(re, 0, sizeof re[0]);
+
+	parser_t p = {.re = re, .s = pat, .end = pat + len};
+	int root;
+	if(flags & RE_LITERAL) {
+		root = node_new(&p, N_EMPTY, 0, -1, -1);
+		for(size_t i = 0; i < len; i++) {
+			int c = node_new(&p, N_CHAR, (uchar)pat[i], -1, -1);
+			root = node_new(&p, N_CAT, 0, root, c);
+		}
+	} else {
+		root = parse_alt(&p);
+		if(root >= 0 && p.s < p.end) {
+			re->err = "unmatched )";
+			root = -1;
+		}
+	}
+
+	if(root < 0) {
+		ARR_FREE(&p.nodes);
+		ARR_FREE(&re->classes);
+		return -1;
+	}
+
+	compile_node(re, p.nodes.data, root);
+	emit(re, I_MATCH, 0, 0, 0);
+	ARR_FREE(&p.nodes);
+
+	char *seen = xcalloc(re->prog.nmemb, 1);
+	re->lit = first_literal(re, 0, seen);
+	if(re->lit < 0) {
+		re->lit = -1;
+	}
+	free(seen);
+	return 0;
+}
+
+void
+re_free(re_t *re)
+{
+	ARR_FREE(&re->prog);
+	ARR_FREE(&re->classes);
+}
+
+/* a program not compiled here, as one sent to a backend, is checked
+ * before it is run */
+int
+re_check(re_t *re)
+{
+	size_t n = re->prog.nmemb;
+	if(!n || re->prog.data[n - 1].op != I_MATCH) {
+		return -1;
+	}
+	for(size_t i = 0; i < n; i++) {
+		re_inst_t *inst = &re->prog.data[i];
+		switch(inst->op) {
+		case I_SPLIT:
+			if(inst->y < 0 || (size_t)inst->y >= n) {
+				return -1;
+			}
+			/* fall through */
+		case I_JMP:
+			if(inst->x < 0 || (size_t)inst->x >= n) {
+				return -1;
+			}
+			break;
+		case I_CLASS:
+			if(inst->x < 0 || (size_t)inst->x >= re->classes.nmemb) {
+				return -1;
+			}
+			break;
+		case I_CHAR:
+		case I_ANY:
+		case I_BOL:
+		case I_EOL:
+		case I_MATCH:
+			break;
+		default:
+			return -1;
+		}
+	}
+	return 0;
+}
+
+typedef struct {
+	int pc;
+	int64_t start;
+	re_pos_t spos;
+} thread_t;
+
+typedef struct {
+	re_t *re;
+	thread_t *cur;
+	thread_t *next;
+	thread_t *list;
+	int ncur;
+	int nnext;
+	int nlist;
+	unsigned *seen;
+	unsigned gen;
+
+	int prev;
+	int64_t abs;
+	int64_t limit;
+
+	bool matched;
+	int64_t mstart;
+	int64_t mend;
+	re_match_t m;
+} run_t;
+
+static void
+run_init(run_t *r, re_t *re)
+{
+	memset(r, 0, sizeof r[0]);
+	r->re = re;
+	r->cur = xmalloc(re->prog.nmemb, sizeof r->cur[0]);
+	r->next = xmalloc(re->prog.nmemb, sizeof r->next[0]);
+	r->list = xmalloc(re->prog.nmemb, sizeof r->list[0]);
+	r->seen = xcalloc(re->prog.nmemb, sizeof r->seen[0]);
+}
+
+static void
+run_reset(run_t *r, int prev, int64_t limit)
+{
+	r->ncur = 0;
+	r->prev = prev;
+	r->abs = 0;
+	r->limit = limit;
+	r->matched = false;
+}
+
+static void
+run_free(run_t *r)
+{
+	free(r->cur);
+	free(r->next);
+	free(r->list);
+	free(r->seen);
+}
+
+static void
+add_thread(run_t *r, int pc, thread_t *t, int c)
+{
+	if(r->seen[pc] == r->gen) {
+		return;
+	}
+	r->seen[pc] = r->gen;
+
+	re_inst_t *inst = &r->re->prog.data[pc];
+	switch(inst->op) {
+	case I_JMP:
+		add_thread(r, inst->x, t, c);
+		return;
+	case I_SPLIT:
+		add_thread(r, inst->x, t, c);
+		add_thread(r, inst->y, t, c);
+		return;
+	case I_BOL:
+		if(r->prev < 0 || r->prev == '\n') {
+			add_thread(r, pc + 1, t, c);
+		}
+		return;
+	case I_EOL:
+		if(c < 0 || c == '\n') {
+			add_thread(r, pc + 1, t, c);
+		}
+		return;
+	}
+	r->list[r->nlist] = *t;
+	r->list[r->nlist].pc = pc;
+	r->nlist++;
+}
+
+/* c < 0 for the end of text, returns true when the search is decided */
+static bool
+run_step(run_t *r, int c, re_pos_t *pos)
+{
+	r->gen++;
+	if(r->gen == 0) {
+		memset(r->seen, 0, r->re->prog.nmemb * sizeof r->seen[0]);
+		r->gen++;
+	}
+	r->nlist = 0;
+	for(int i = 0; i < r->ncur; i++) {
+		if(!r->matched || r->cur[i].start <= r->mstart) {
+			add_thread(r, r->cur[i].pc, &r->cur[i], c);
+		}
+	}
+	if(!r->matched && (r->limit < 0 || r->abs < r->limit) && c >= 0) {
+		add_thread(r, 0, &(thread_t){.start = r->abs, .spos = *pos}, c);
+	}
+
+	r->nnext = 0;
+	for(int i = 0; i < r->nlist; i++) {
+		thread_t *t = &r->list[i];
+		re_inst_t *inst = &r->re->prog.data[t->pc];
+		if(r->matched && t->start > r->mstart) {
+			continue;
+		}
+		bool step = false;
+		switch(inst->op) {
+		case I_MATCH:
+			if(t->start < r->abs && (!r->matched || t->start < r->mstart ||
+					(t->start == r->mstart && r->abs > r->mend))) {
+				r->matched = true;
+				r->mstart = t->start;
+				r->mend = r->abs;
+				r->m.start = t->spos;
+				r->m.end = *pos;
+			}
+			break;
+		case I_CHAR:
+			step = c == inst->c;
+			break;
+		case I_ANY:
+			step = c >= 0 && c != '\n' && (c < 0x80 || c > 0xBF);
+			break;
+		case I_CLASS:
+			step = c >= 0 && class_has(&r->re->classes.data[inst->x], c);
+			break;
+		}
+		if(step) {
+			r->next[r->nnext] = *t;
+			r->next[r->nnext].pc = t->pc + 1;
+			r->nnext++;
+		}
+	}
+
+	thread_t *tmp = r->cur;
+	r->cur = r->next;
+	r->next = tmp;
+	r->ncur = r->nnext;
+
+	r->prev = c;
+	r->abs++;
+
+	if(r->ncur == 0) {
+		return r->matched || c < 0 || (r->limit >= 0 && r->abs >= r->limit);
+	}
+	return c < 0;
+}
+
+static int
+chunk_prev_byte(re_src_t *src, re_pos_t *pos)
+{
+	size_t len;
+	const char *buf;
+	if(pos->off > 0) {
+		buf = src->chunk(src->usr, pos->chunk, &len);
+		return buf && pos->off <= len ? (uchar)buf[pos->off - 1] : -1;
+	}
+	for(int64_t i = pos->chunk - 1; i >= 0; i--) {
+		buf = src->chunk(src->usr, i, &len);
+		if(!buf) {
+			return -1;
+		}
+		if(len > 0) {
+			return (uchar)buf[len - 1];
+		}
+	}
+	return -1;
+}
+
+static bool
+run_find(run_t *r, re_src_t *src, re_pos_t *from, int64_t limit)
+{
+	run_reset(r, chunk_prev_byte(src, from), limit);
+
+	re_pos_t pos = *from;
+	for(;; pos.chunk++, pos.off = 0) {
+		size_t len;
+		const char *buf = src->chunk(src->usr, pos.chunk, &len);
+		if(!buf) {
+			pos.chunk--;
+			buf = src->chunk(src->usr, pos.chunk, &len);
+			pos.off = buf ? len : 0;
+			run_step(r, -1, &pos);
+			break;
+		}
+
+		while(pos.off < len) {
+			if(r->ncur == 0 && !r->matched && r->re->lit >= 0) {
+				const char *p = memchr(buf + pos.off, r->re->lit,
+						len - pos.off);
+				size_t skip = (p ? (size_t)(p - buf) : len) - pos.off;
+				if(skip > 0) {
+					r->abs += skip;
+					pos.off += skip;
+					r->prev = (uchar)buf[pos.off - 1];
+					if(r->limit >= 0 && r->abs >= r->limit) {
+						return false;
+					}
+					continue;
+				}
+			}
+			if(run_step(r, (uchar)buf[pos.off], &pos)) {
+				return r->matched;
+			}
+			pos.off++;
+		}
+	}
+	return r->matched;
+}
+
+/* finds the leftmost-longest match that starts at most limit bytes after
+ * from, limit < 0 for no limit */
+bool
+re_find(re_t *re, re_src_t *src, re_pos_t *from, int64_t limit,
+		re_match_t *m)
+{
+	run_t r;
+	run_init(&r, re);
+	bool found = run_find(&r, src, from, limit);
+	if(found) {
+		*m = r.m;
+	}
+	run_free(&r);
+	return found;
+}
+
+/* Finds the last match starting before from. Windows of chunks before
+ * it, twice as many as the last one each time, are searched forwards
+ * match after match, each from the end of the one before; the first
+ * window with a match has the last one. A match far back then costs
+ * about the bytes in between, not a forward search from every chunk. */
+bool
+re_rfind(re_t *re, re_src_t *src, re_pos_t *from, re_match_t *m)
+{
+	run_t r;
+	run_init(&r, re);
+
+	size_t len;
+	re_pos_t hi = *from;
+	hi.off = src->chunk(src->usr, hi.chunk, &len) ? MIN(hi.off, len) : 0;
+	bool found = false;
+	for(int64_t n = 0; !found; n = MAX(n * 2, 1)) {
+		int64_t lo = MAX(hi.chunk - n, 0);
+		int64_t left = hi.off;
+		for(int64_t i = lo; i < hi.chunk; i++) {
+			if(src->chunk(src->usr, i, &len)) {
+				left += len;
+			}
+		}
+		re_pos_t pos = {lo, 0};
+		while(left > 0 && run_find(&r, src, &pos, left)) {
+			*m = r.m;
+			found = true;
+			left -= r.mend;
+			pos = r.m.end;
+		}
+		if(lo == 0) {
+			break;
+		}
+		hi = (re_pos_t){lo, 0};
+	}
+
+	run_free(&r);
+	return found;
+}
+
+typedef struct {
+	const char **chunks;
+	size_t n;
+} test_src_t;
+
+static const char *
+test_chunk(void *usr, int64_t idx, size_t *len)
+{
+	test_src_t *t = usr;
+	if(idx < 0 || (size_t)idx >= t->n) {
+		return NULL;
+	}
+	*len = strlen(t->chunks[idx]);
+	return t->chunks[idx];
+}
+
+static int
+test_find(const char *pat, int flags, const char **chunks, size_t n,
+		re_pos_t from, bool backward, re_match_t *expected)
+{
+	char call[BUFSIZ];
+	re_t re;
+	re_match_t m;
+	test_src_t t = {chunks, n};
+	re_src_t src = {test_chunk, &t};
+
+	int ret = TEST_CALL(call, sizeof(call), "%p, \"%s\", %zu, %d",
+		re_compile, ((void*)&re, pat, strlen(pat), flags));
+	TEST_OP("%d", ret, ==, 0, "%s", call);
+	bool found = backward ? re_rfind(&re, &src, &from, &m) :
+			re_find(&re, &src, &from, -1, &m);
+	re_free(&re);
+
+	TEST_OP("%d", found, ==, expected != NULL, "%s", pat);
+	if(expected) {
+		TEST_OP("%ld", m.start.chunk, ==, expected->start.chunk, "%s", pat);
+		TEST_OP("%zu", m.start.off, ==, expected->start.off, "%s", pat);
+		TEST_OP("%ld", m.end.chunk, ==, expected->end.chunk, "%s", pat);
+		TEST_OP("%zu", m.end.off, ==, expected->end.off, "%s", pat);
+	}
+	return 0;
+}
+
+int
+TEST_re_find(void)
+{
+	const char *text[] = {"int ma", "in(void)\n", "{\n", "\treturn 0;\n", "}\n"};
+	size_t n = LEN(text);
+	re_pos_t start = {0, 0};
+
+	if(test_find("main", 0, text, n, start, false, &(re_match_t){{0, 4}, {1, 2}}) ||
+	test_find("ma.n\\(", 0, text, n, start, false, &(re_match_t){{0, 4}, {1, 3}}) ||
+	test_find("a+", 0, text, n, start, false, &(re_match_t){{0, 5}, {1, 0}}) ||
+	test_find("^[{}]$", 0, text, n, start, false, &(re_match_t){{2, 0}, {2, 1}}) ||
+	test_find("^}", 0, text, n, (re_pos_t){2, 1}, false, &(re_match_t){{4, 0}, {4, 1}}) ||
+	test_find("\\d;|void", 0, text, n, start, false, &(re_match_t){{1, 3}, {1, 7}}) ||
+	test_find("(re|in)+", 0, text, n, (re_pos_t){0, 1}, false, &(re_match_t){{1, 0}, {1, 2}}) ||
+	test_find("x*", 0, text, n, start, false, NULL) ||
+	test_find("n(", RE_LITERAL, text, n, start, false, &(re_match_t){{1, 1}, {1, 3}}) ||
+	test_find("[^\n]+\n", 0, text, n, (re_pos_t){3, 11}, false, &(re_match_t){{4, 0}, {4, 2}}) ||
+	test_find("\xc5\xbc.b", 0, (const char*[]){"a\xc5\xbc\xc5\xbc", "b"}, 2, start, false,
+			&(re_match_t){{0, 1}, {1, 1}}) ||
+	test_find("in", 0, text, n, (re_pos_t){3, 0}, true, &(re_match_t){{1, 0}, {1, 2}}) ||
+	test_find("n", 0, text, n, (re_pos_t){1, 1}, true, &(re_match_t){{0, 1}, {0, 2}}) ||
+	test_find("main", 0, text, n, (re_pos_t){0, 4}, true, NULL) ||
+	test_find("a+", 0, text, n, (re_pos_t){3, 0}, true, &(re_match_t){{0, 5}, {1, 0}}) ||
+	test_find("^[{}]$", 0, text, n, (re_pos_t){4, 2}, true, &(re_match_t){{4, 0}, {4, 1}})) {
+		return -1;
+	}
+
+	// a match that never ends is not searched for again from every line
+	enum { NLINES = 1 << 14 };
+	const char **lines = xmalloc(NLINES, sizeof lines[0]);
+	for(size_t i = 0; i < NLINES; i++) {
+		lines[i] = "x\n";
+	}
+	int ret = test_find("x[^y]*y", 0, lines, NLINES, (re_pos_t){NLINES - 1, 2}, true, NULL) ||
+		test_find("x\n", 0, lines, NLINES, (re_pos_t){NLINES - 1, 0}, true,
+			&(re_match_t){{NLINES - 2, 0}, {NLINES - 1, 0}});
+	free(lines);
+	if(ret) {
+		return -1;
+	}
+
+	// a selection searched for as it is may be megabytes long
+	enum { BIG = 1 << 20 };
+	char *big = xmalloc(BIG + 1, 1);
+	char *hay = xmalloc(BIG + 3, 1);
+	uint32_t x = 1;
+	for(size_t i = 0; i < BIG; i++) {
+		x = x * 1103515245 + 12345;
+		big[i] = 'a' + (x >> 16) % 26;
+	}
+	big[BIG] = '\0';
+	memcpy(hay, "zz", 2);
+	memcpy(hay + 2, big, BIG + 1);
+	ret = test_find(big, RE_LITERAL, (const char*[]){hay}, 1, start, false,
+			&(re_match_t){{0, 2}, {0, BIG + 2}});
+	free(big);
+	free(hay);
+	if(ret) {
+		return -1;
+	}
+
+	re_t re;
+	const char *bad[] = {"(a", "a)", "[a", "*a", "a\\", "[z-a]"};
+	for(size_t i = 0; i < LEN(bad); i++) {
+		TEST_OP("%d", re_compile(&re, bad[i], strlen(bad[i]), 0), ==, -1, "%s", bad[i]);
+	}
+	return 0;
+}
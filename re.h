@@ -0,0 +1,47 @@
+enum {
+	RE_LITERAL = 1 << 0
+};
+
+typedef struct {
+	uint8_t op;
+	uint8_t c;
+	int x;
+	int y;
+} re_inst_t;
+
+typedef struct {
+	uint32_t bits[256 / 32];
+} re_class_t;
+
+typedef struct {
+	ARRAY(re_inst_t) prog;
+	ARRAY(re_class_t) classes;
+	int lit; // first byte of every match or -1
+	const char *err;
+} re_t;
+
+/* position as chunk index and offset within the chunk */
+typedef struct {
+	int64_t chunk;
+	size_t off;
+} re_pos_t;
+
+/* chunks are blocks or lines, matches may span them,
+ * returns NULL for indices out of range */
+typedef struct {
+	const char *(*chunk)(void *usr, int64_t idx, size_t *len);
+	void *usr;
+} re_src_t;
+
+typedef struct {
+	re_pos_t start;
+	re_pos_t end;
+} re_match_t;
+
+int re_compile(re_t *re, const char *pat, size_t len, int flags);
+void re_free(re_t *re);
+int re_check(re_t *re);
+
+bool re_find(re_t *re, re_src_t *src, re_pos_t *from, int64_t limit,
+		re_match_t *m);
+bool re_rfind(re_t *re, re_src_t *src, re_pos_t *from, re_match_t *m);
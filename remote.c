@@ -0,0 +1,526 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <unistd.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "array.h"
+#include "test.h"
+#include "bench.h"
+
+#include "re.h"
+#include "edit.h"
+#include "proto.h"
+#include "remote.h"
+#include "backend.h"
+#include "trace.h"
+
+/* A file mirrored from a backend has all its lines, but only those some
+ * view asked for have text; the rest are empty until fetched. Edits are
+ * sent and applied as the backend says they went, so the mirror never
+ * guesses. */
+
+/* lines start to end are gone and new_end - start are in their place */
+static void
+have_cut(remote_t *r, size_t start, size_t end, size_t new_end)
+{
+	spanarray_t out = {0};
+	r->nhave = 0;
+	for(size_t i = 0; i < r->have.nmemb; i++) {
+		remote_span_t *s = &r->have.data[i];
+		remote_span_t parts[2] = {
+			{s->start, MIN(s->end, start), s->tick},
+			{MAX(s->start, end) - end + new_end, s->end - end + new_end, s->tick}
+		};
+		for(size_t j = 0; j < LEN(parts); j++) {
+			if(parts[j].start >= parts[j].end || (j && s->end <= end)) {
+				continue;
+			}
+			ARR_EXTEND(&out, 1);
+			out.data[out.nmemb - 1] = parts[j];
+			r->nhave += parts[j].end - parts[j].start;
+		}
+	}
+	ARR_FREE(&r->have);
+	r->have = out;
+}
+
+static void
+have_add(remote_t *r, size_t start, size_t end)
+{
+	if(start >= end) {
+		return;
+	}
+	have_cut(r, start, end, end);
+	size_t i = 0;
+	while(i < r->have.nmemb && r->have.data[i].start < start) {
+		i++;
+	}
+	ARR_FRAG_RESIZE(&r->have, i, i, 1);
+	r->have.data[i] = (remote_span_t){start, end, r->tick};
+	r->nhave += end - start;
+}
+
+/* the text of lines fetched longest ago is dropped, the latest stay */
+static void
+remote_evict(remote_t *r)
+{
+	while(r->nhave > REMOTE_KEEP && r->have.nmemb > 1) {
+		size_t old = 0;
+		for(size_t i = 1; i < r->have.nmemb; i++) {
+			if(r->have.data[i].tick < r->have.data[old].tick) {
+				old = i;
+			}
+		}
+		remote_span_t s = r->have.data[old];
+		for(size_t i = s.start; i < s.end; i++) {
+			file_set_line(r->file, i, "", 0);
+		}
+		file_note_change(r->file, s.start, s.end, s.end);
+		r->nhave -= s.end - s.start;
+		ARR_FRAG_RESIZE(&r->have, old, old + 1, 0);
+	}
+}
+
+static void
+remote_apply(remote_t *r, int type, range_t *rng, edit_t *edits, size_t nedits)
+{
+	proto_msg_t *m = &r->msg;
+	file_t *f = r->file;
+	size_t start, end, new_end, n;
+
+	switch(type) {
+	case PROTO_CHANGE:
+		start = proto_get(m);
+		end = proto_get(m);
+		new_end = proto_get(m);
+		if(m->err || start > end || end > f->content.nmemb || new_end < start) {
+			m->err = true;
+			break;
+		}
+		file_splice_lines(f, start, end, new_end);
+		have_cut(r, start, end, new_end);
+		break;
+	case PROTO_LINES:
+		start = proto_get(m);
+		n = proto_get(m);
+		if(m->err || start > f->content.nmemb || n > f->content.nmemb - start) {
+			m->err = true;
+			break;
+		}
+		for(size_t i = 0; i < n && !m->err; i++) {
+			size_t len;
+			char *text = proto_get_text(m, &len);
+			file_set_line(f, start + i, text, len);
+		}
+		file_note_change(f, start, start + n, start + n);
+		have_add(r, start, start + n);
+		break;
+	case PROTO_RANGE:
+		if(rng) {
+			proto_get_range(m, rng);
+		}
+		break;
+	case PROTO_EDITS:
+		n = proto_get(m);
+		for(size_t i = 0; i < n && i < nedits; i++) {
+			range_t e = {0};
+			proto_get_range(m, &e);
+			edits[i].start = e.start;
+			edits[i].end = e.end;
+		}
+		break;
+	default:
+		m->err = true;
+		break;
+	}
+}
+
+/* Sends the request in r->msg and applies the replies to it. Returns
+ * the status the backend answered with or -EIO when it is gone. */
+static int64_t
+remote_call(remote_t *r, range_t *rng, edit_t *edits, size_t nedits)
+{
+	if(r->dead) {
+		return -EIO;
+	}
+	uint64_t t = trace_now();
+	int64_t status = -EIO;
+	if(proto_send(&r->conn, &r->msg) < 0) {
+		r->dead = true;
+	}
+	while(!r->dead) {
+		int type = proto_recv(&r->conn, &r->msg);
+		if(type == PROTO_DONE) {
+			status = proto_get_int(&r->msg);
+			break;
+		}
+		if(type > 0) {
+			remote_apply(r, type, rng, edits, nedits);
+		}
+		r->dead = type <= 0 || r->msg.err;
+	}
+	if(r->dead) {
+		fprintf(stderr, "werf: lost the backend, edits are not saved\n");
+	}
+	t = trace_now() - t;
+	r->nrequests++;
+	r->wait_ns += t;
+	r->max_ns = MAX(r->max_ns, t);
+	return status;
+}
+
+/* the file is empty, it gets as many lines as the backend has */
+int
+remote_open(remote_t *r, file_t *f, int in, int out)
+{
+	memset(r, 0, sizeof *r);
+	r->conn.in = in;
+	r->conn.out = out;
+	r->file = f;
+	if(proto_recv(&r->conn, &r->msg) != PROTO_HELLO) {
+		ARR_FREE(&r->conn.rbuf);
+		ARR_FREE(&r->msg.buf);
+		errno = EPROTO;
+		return -1;
+	}
+	size_t n = proto_get(&r->msg);
+	file_splice_lines(f, 0, f->content.nmemb, MAX(n, 1));
+	f->remote = r;
+	return 0;
+}
+
+/* cmd runs a backend, as "ssh host werf -s file", through sh */
+int
+remote_spawn(remote_t *r, file_t *f, char *cmd)
+{
+	extern char **environ;
+	char *argv[] = {"sh", "-c", cmd, NULL};
+	int sv[2];
+	// neither end goes to commands spawned later, the backend gets its
+	// through dup2, so closing the doc is the end of its input
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		return -1;
+	}
+
+	pid_t pid;
+	int err;
+	posix_spawn_file_actions_t fa;
+	if( (err = posix_spawn_file_actions_init(&fa)) ) {
+		goto out;
+	}
+	if( !(err = posix_spawn_file_actions_adddup2(&fa, sv[1], STDIN_FILENO)) &&
+	!(err = posix_spawn_file_actions_adddup2(&fa, sv[1], STDOUT_FILENO)) ) {
+		err = posix_spawn(&pid, "/bin/sh", &fa, NULL, argv, environ);
+	}
+	posix_spawn_file_actions_destroy(&fa);
+out:
+	close(sv[1]);
+	if(err) {
+		close(sv[0]);
+		errno = err;
+		return -1;
+	}
+	if(remote_open(r, f, sv[0], sv[0]) < 0) {
+		err = errno;
+		close(sv[0]);
+		waitpid(pid, NULL, 0);
+		errno = err;
+		return -1;
+	}
+	r->pid = pid;
+	return 0;
+}
+
+/* the backend sees the end of its input and exits */
+void
+remote_close(remote_t *r)
+{
+	proto_close(&r->conn);
+	if(r->pid > 0) {
+		waitpid(r->pid, NULL, 0);
+	}
+	ARR_FREE(&r->msg.buf);
+	ARR_FREE(&r->have);
+	r->file->remote = NULL;
+}
+
+/* lines start to end are about to be shown, those not had yet are got
+ * with one request */
+void
+remote_fetch(remote_t *r, size_t start, size_t end)
+{
+	end = MIN(end, r->file->content.nmemb);
+	if(start >= end || r->dead) {
+		return;
+	}
+	size_t lo = start, hi = end;
+	for(size_t i = 0; i < r->have.nmemb; i++) {
+		remote_span_t *s = &r->have.data[i];
+		if(s->start <= lo && lo < s->end) {
+			lo = s->end;
+		}
+	}
+	for(size_t i = r->have.nmemb; i > 0; i--) {
+		remote_span_t *s = &r->have.data[i - 1];
+		if(s->start < hi && hi <= s->end) {
+			hi = s->start;
+		}
+	}
+
+	r->tick++;
+	if(lo < hi) {
+		proto_begin(&r->msg, PROTO_FETCH);
+		proto_put(&r->msg, lo);
+		proto_put(&r->msg, hi);
+		if(remote_call(r, NULL, NULL, 0) < 0) {
+			return;
+		}
+	}
+	have_add(r, start, end);
+	remote_evict(r);
+}
+
+void
+remote_push(remote_t *r, range_t *rng, char *mod, size_t mod_len, optype_t type)
+{
+	proto_begin(&r->msg, PROTO_PUSH);
+	proto_put_range(&r->msg, rng);
+	proto_put(&r->msg, type);
+	proto_put_text(&r->msg, mod, mod_len);
+	remote_call(r, rng, NULL, 0);
+}
+
+void
+remote_push_batch(remote_t *r, edit_t *edits, size_t nedits)
+{
+	proto_begin(&r->msg, PROTO_BATCH);
+	proto_put(&r->msg, nedits);
+	for(size_t i = 0; i < nedits; i++) {
+		proto_put_range(&r->msg, &(range_t){edits[i].start, edits[i].end});
+		proto_put_text(&r->msg, edits[i].mod, edits[i].mod_len);
+	}
+	remote_call(r, NULL, edits, nedits);
+}
+
+void
+remote_undo(remote_t *r, range_t *rng, bool redo)
+{
+	proto_begin(&r->msg, PROTO_UNDO);
+	proto_put_range(&r->msg, rng);
+	proto_put(&r->msg, redo);
+	remote_call(r, rng, NULL, 0);
+}
+
+/* the compiled program is sent, so the backend never parses patterns */
+bool
+remote_find(remote_t *r, range_t *rng, re_t *re, bool backward)
+{
+	proto_begin(&r->msg, PROTO_FIND);
+	proto_put_range(&r->msg, rng);
+	proto_put(&r->msg, backward);
+	proto_put_int(&r->msg, re->lit);
+	proto_put(&r->msg, re->prog.nmemb);
+	for(size_t i = 0; i < re->prog.nmemb; i++) {
+		re_inst_t *inst = &re->prog.data[i];
+		proto_put(&r->msg, inst->op);
+		proto_put(&r->msg, inst->c);
+		proto_put_int(&r->msg, inst->x);
+		proto_put_int(&r->msg, inst->y);
+	}
+	proto_put(&r->msg, re->classes.nmemb);
+	for(size_t i = 0; i < re->classes.nmemb; i++) {
+		for(size_t j = 0; j < LEN(re->classes.data[i].bits); j++) {
+			proto_put(&r->msg, re->classes.data[i].bits[j]);
+		}
+	}
+	return remote_call(r, rng, NULL, 0) > 0;
+}
+
+/* saved by the backend, to the file it opened when fname is NULL */
+ssize_t
+remote_save(remote_t *r, const char *fname)
+{
+	proto_begin(&r->msg, PROTO_SAVE);
+	proto_put_text(&r->msg, fname ? fname : "", fname ? strlen(fname) : 0);
+	int64_t status = remote_call(r, NULL, NULL, 0);
+	if(status < 0) {
+		errno = -status;
+		return -1;
+	}
+	return status;
+}
+
+void
+remote_report(remote_t *r, FILE *f)
+{
+	fprintf(f, "requests %llu, sent %.1f KiB, received %.1f KiB\n",
+		(unsigned long long)r->nrequests,
+		r->conn.sent / 1024.0, r->conn.received / 1024.0);
+	fprintf(f, "wait mean %.3f ms, max %.3f ms\n",
+		r->nrequests ? r->wait_ns / 1E6 / r->nrequests : 0, r->max_ns / 1E6);
+	fprintf(f, "lines with text %zu of %zu%s\n", r->nhave,
+		r->file->content.nmemb, r->dead ? ", backend lost" : "");
+}
+
+static void *
+serve_thread(void *usr)
+{
+	backend_serve(usr);
+	return NULL;
+}
+
+/* a backend in a thread of this process, over a socket pair */
+static void
+remote_local(remote_t *r, file_t *mirror, backend_t *b, file_t *f, pthread_t *th)
+{
+	int sv[2];
+	DIEIF(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0);
+	memset(b, 0, sizeof *b);
+	b->file = f;
+	b->conn = (proto_conn_t){.in = sv[0], .out = sv[0]};
+	DIEIF(pthread_create(th, NULL, serve_thread, b));
+	file_insert_line(mirror, 0, "", 0);
+	DIEIF(remote_open(r, mirror, sv[1], sv[1]) < 0);
+}
+
+static void
+remote_local_close(remote_t *r, backend_t *b, pthread_t th)
+{
+	remote_close(r);
+	pthread_join(th, NULL);
+	proto_close(&b->conn);
+}
+
+static bool
+mirror_equal(file_t *mirror, file_t *f, size_t start, size_t end)
+{
+	for(size_t i = start; i < end; i++) {
+		istring_t *a = &mirror->content.data[i];
+		istring_t *b = &f->content.data[i];
+		if(istr_len(a) != istr_len(b) || memcmp(istr_data(a), istr_data(b), istr_len(a))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int
+TEST_remote_fetch(void)
+{
+	enum { N = 100000 };
+	char call[BUFSIZ];
+	char line[64];
+	file_t f = {0}, mirror = {0};
+	backend_t b;
+	remote_t r;
+	pthread_t th;
+
+	for(size_t i = 0; i < N; i++) {
+		int len = snprintf(line, sizeof line, "line %zu\n", i);
+		file_insert_line(&f, i, line, len);
+	}
+	file_insert_line(&f, N, "", 0);
+	remote_local(&r, &mirror, &b, &f, &th);
+	TEST_OP("%zu", mirror.content.nmemb, ==, f.content.nmemb, "%s", "remote_open");
+	TEST_OP("%llu", (unsigned long long)r.conn.received, <, 16ULL, "%s", "remote_open");
+
+	// a screenful costs about its text
+	uint64_t before = r.conn.received;
+	TEST_CALL(call, sizeof(call), "%p, %d, %d", remote_fetch, ((void*)&r, 5000, 5050));
+	TEST_OP("%d", mirror_equal(&mirror, &f, 5000, 5050), ==, true, "%s", call);
+	TEST_OP("%zu", istr_len(&mirror.content.data[4999]), ==, (size_t)0, "%s", call);
+	TEST_OP("%llu", (unsigned long long)(r.conn.received - before), <, 50ULL * 12 + 32, "%s", call);
+	before = r.conn.received;
+	remote_fetch(&r, 5010, 5040);
+	TEST_OP("%llu", (unsigned long long)r.conn.received, ==, (unsigned long long)before,
+		"%s", "fetched again");
+
+	// a keystroke, the changed line comes back with it
+	uint64_t sent = r.conn.sent;
+	range_t rng = {{5010, 0}, {5010, 0}, &mirror};
+	range_push(&rng, "x", 1, OP_Char);
+	TEST_OP("%d", mirror_equal(&mirror, &f, 5000, 5050), ==, true, "%s", "range_push");
+	TEST_OP("%zu", rng.start.offset, ==, (size_t)1, "%s", "range_push");
+	TEST_OP("%llu", (unsigned long long)(r.conn.sent - sent), <, 16ULL, "%s", "range_push");
+	TEST_OP("%llu", (unsigned long long)(r.conn.received - before), <, 48ULL, "%s", "range_push");
+
+	rng = (range_t){{5020, 2}, {5020, 2}, &mirror};
+	range_push(&rng, "\n", 1, OP_Char);
+	TEST_OP("%zu", mirror.content.nmemb, ==, (size_t)N + 2, "%s", "range_push");
+	TEST_OP("%d", mirror_equal(&mirror, &f, 5000, 5051), ==, true, "%s", "range_push");
+
+	re_t re;
+	DIEIF(re_compile(&re, "line 6999", 9, 0) < 0);
+	rng = (range_t){{5000, 0}, {5000, 0}, &mirror};
+	TEST_OP("%d", range_find(&rng, &re, false), ==, true, "%s", "range_find");
+	TEST_OP("%zu", rng.start.line, ==, (size_t)7000, "%s", "range_find");
+	re_free(&re);
+
+	edit_t edits[] = {
+		{{5001, 0}, {5001, 4}, "LINE", 4},
+		{{5003, 0}, {5003, 4}, "", 0}
+	};
+	file_push_batch(&mirror, edits, LEN(edits));
+	TEST_OP("%d", mirror_equal(&mirror, &f, 5000, 5051), ==, true, "%s", "file_push_batch");
+	TEST_OP("%zu", edits[1].start.line, ==, (size_t)5003, "%s", "file_push_batch");
+
+	file_undo(&rng);
+	file_undo(&rng);
+	file_undo(&rng);
+	TEST_OP("%zu", mirror.content.nmemb, ==, (size_t)N + 1, "%s", "file_undo");
+	TEST_OP("%d", mirror_equal(&mirror, &f, 5000, 5050), ==, true, "%s", "file_undo");
+
+	// far apart fetches, the oldest lines are dropped
+	remote_fetch(&r, 0, REMOTE_KEEP / 2 + 1);
+	remote_fetch(&r, N - REMOTE_KEEP / 2 - 1, N);
+	remote_fetch(&r, N / 2, N / 2 + 10);
+	TEST_OP("%zu", r.nhave, <=, (size_t)REMOTE_KEEP, "%s", "remote_fetch");
+	TEST_OP("%zu", istr_len(&mirror.content.data[0]), ==, (size_t)0, "%s", "remote_fetch");
+	TEST_OP("%d", mirror_equal(&mirror, &f, N - 100, N), ==, true, "%s", "remote_fetch");
+
+	remote_local_close(&r, &b, th);
+	free(f.undobuf.first);
+	free(f.redobuf.first);
+	file_free(&f);
+	file_free(&mirror);
+	return 0;
+}
+
+/* a keystroke and the line it changed, there and back */
+void
+BENCH_remote_push(bench_t *b)
+{
+	file_t f = {0}, mirror = {0};
+	char line[] = "\tsome line of text, as long as a line of code\n";
+	for(size_t i = 0; i < 1000; i++) {
+		file_insert_line(&f, i, line, sizeof(line)-1);
+	}
+	backend_t be;
+	remote_t r;
+	pthread_t th;
+	remote_local(&r, &mirror, &be, &f, &th);
+	remote_fetch(&r, 480, 520);
+
+	bench_start(b);
+	for(size_t i = 0; i < b->n; i++) {
+		range_t rng = {{500, 10}, {500, 11}, &mirror};
+		range_push(&rng, "y", 1, OP_Replace);
+	}
+	bench_stop(b);
+
+	remote_local_close(&r, &be, th);
+	free(f.undobuf.first);
+	free(f.redobuf.first);
+	file_free(&f);
+	file_free(&mirror);
+}
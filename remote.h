@@ -0,0 +1,35 @@
+/* lines of the mirror that hold text, by the fetch that last wanted them */
+typedef struct {
+	size_t start;
+	size_t end;
+	uint64_t tick;
+} remote_span_t;
+
+typedef ARRAY(remote_span_t) spanarray_t;
+
+enum { REMOTE_KEEP = 1 << 15 }; // lines with text before old ones are dropped
+
+typedef struct remote_t {
+	proto_conn_t conn;
+	proto_msg_t msg;
+	file_t *file; // the mirror
+	spanarray_t have; // sorted, apart
+	size_t nhave; // lines in have
+	uint64_t tick;
+	pid_t pid; // of the backend when spawned, 0 otherwise
+	bool dead; // connection lost, edits are dropped
+	uint64_t nrequests;
+	uint64_t wait_ns; // for replies, in all
+	uint64_t max_ns;
+} remote_t;
+
+int remote_open(remote_t *r, file_t *f, int in, int out);
+int remote_spawn(remote_t *r, file_t *f, char *cmd);
+void remote_close(remote_t *r);
+void remote_fetch(remote_t *r, size_t start, size_t end);
+void remote_push(remote_t *r, range_t *rng, char *mod, size_t mod_len, optype_t type);
+void remote_push_batch(remote_t *r, edit_t *edits, size_t nedits);
+void remote_undo(remote_t *r, range_t *rng, bool redo);
+bool remote_find(remote_t *r, range_t *rng, re_t *re, bool backward);
+ssize_t remote_save(remote_t *r, const char *fname);
+void remote_report(remote_t *r, FILE *f);
@@ -0,0 +1,456 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "array.h"
+#include "test.h"
+
+#include "re.h"
+#include "edit.h"
+#include "search.h"
+
+/* regex search over the lines of a file, nothing is copied; lines are
+ * only read while the threads run, the file stops them before it changes */
+
+enum { SEARCH_STEP = 1 << 16 }; // bytes looked at between checks for cancel
+
+static int64_t
+bytes_until(file_t *f, address_t *from, size_t line)
+{
+	int64_t len = -(int64_t)from->offset;
+	for(size_t i = from->line; i < line; i++) {
+		len += istr_len(&f->content.data[i]);
+	}
+	return len;
+}
+
+static void
+hits_push(rangearray_t *hits, range_t *rng)
+{
+	ARR_EXTEND(hits, 1);
+	hits->data[hits->nmemb - 1] = *rng;
+}
+
+/* past an empty match, which is not a hit */
+static bool
+match_skip_empty(file_t *f, re_match_t *m, re_pos_t *pos)
+{
+	*pos = m->end;
+	if(m->start.chunk != m->end.chunk || m->start.off != m->end.off) {
+		return false;
+	}
+	if(pos->off < istr_len(&f->content.data[pos->chunk])) {
+		pos->off++;
+	} else {
+		*pos = (re_pos_t){pos->chunk + 1, 0};
+	}
+	return true;
+}
+
+static void
+match_to_range(file_t *f, re_match_t *m, range_t *rng)
+{
+	rng->file = f;
+	pos_to_address(f, &m->start, &rng->start);
+	pos_to_address(f, &m->end, &rng->end);
+}
+
+/* workers take partitions in file order, so the front of the file is
+ * ready first and results can be streamed while the rest is searched */
+static void *
+search_worker(void *arg)
+{
+	search_t *s = arg;
+	file_t *f = s->file;
+	re_src_t src = {line_chunk, f};
+	int k;
+
+	while(!atomic_load(&s->cancel) &&
+			(k = atomic_fetch_add(&s->next_part, 1)) < s->npart) {
+		search_part_t *part = &s->part[k];
+		re_pos_t pos = {part->first, 0};
+		re_match_t m;
+		range_t rng;
+
+		// some lines at a time to notice cancellation
+		while((size_t)pos.chunk < part->last && !atomic_load(&s->cancel)) {
+			size_t end = pos.chunk;
+			int64_t left = -(int64_t)pos.off;
+			while(end < part->last && left < SEARCH_STEP) {
+				left += istr_len(&f->content.data[end++]);
+			}
+			if(left <= 0 || !re_find(s->re, &src, &pos, left, &m)) {
+				pos = (re_pos_t){end, 0};
+				continue;
+			}
+			if(match_skip_empty(f, &m, &pos)) {
+				continue;
+			}
+			match_to_range(f, &m, &rng);
+			hits_push(&part->hits, &rng);
+		}
+
+		pthread_mutex_lock(&s->lock);
+		part->done = true;
+		pthread_mutex_unlock(&s->lock);
+		DIEIF(write(s->fd[1], "", 1) < 0 && errno != EAGAIN);
+	}
+	return NULL;
+}
+
+/* Matches found from the start of a partition agree with a sequential
+ * search once they start after the end of the last accepted match. Until
+ * then the search is redone from there. */
+static void
+search_stitch(search_t *s, search_part_t *part)
+{
+	file_t *f = s->file;
+	range_t *hits = part->hits.data;
+	size_t n = part->hits.nmemb;
+	size_t i = 0;
+	bool resync = false;
+
+	for(; i < n && address_cmp(&hits[i].start, &s->resume) < 0; i++) {
+		resync = address_cmp(&hits[i].end, &s->resume) > 0;
+	}
+
+	if(resync) {
+		re_src_t src = {line_chunk, f};
+		re_pos_t pos = {s->resume.line, s->resume.offset};
+		re_match_t m;
+		range_t rng;
+		for(;;) {
+			address_t from = {pos.chunk, pos.off};
+			int64_t left = bytes_until(f, &from, part->last);
+			if(left <= 0 || !re_find(s->re, &src, &pos, left, &m)) {
+				i = n;
+				break;
+			}
+			if(match_skip_empty(f, &m, &pos)) {
+				continue;
+			}
+			match_to_range(f, &m, &rng);
+			while(i < n && address_cmp(&hits[i].start, &rng.start) < 0) {
+				i++;
+			}
+			if(i < n && !address_cmp(&hits[i].start, &rng.start) &&
+					!address_cmp(&hits[i].end, &rng.end)) {
+				break;
+			}
+			hits_push(&s->hits, &rng);
+			s->resume = rng.end;
+		}
+	}
+
+	for(; i < n; i++) {
+		hits_push(&s->hits, &hits[i]);
+		s->resume = hits[i].end;
+	}
+	ARR_FREE(&part->hits);
+}
+
+/* partitions of the file as it is now and threads to search them */
+static int
+search_run(search_t *s)
+{
+	size_t nlines = s->file->content.nmemb;
+
+	s->gen = s->file->nchanges;
+	atomic_store(&s->cancel, false);
+	atomic_store(&s->next_part, 0);
+	s->stitched = 0;
+	s->resume = (address_t){0, 0};
+	s->hits.nmemb = 0;
+
+	// more partitions than threads keeps the streamed front moving
+	s->npart = MIN(nlines, (size_t)s->nthreads * 8);
+	s->part = xcalloc(s->npart, sizeof s->part[0]);
+	for(int i = 0; i < s->npart; i++) {
+		s->part[i].first = nlines * i / s->npart;
+		s->part[i].last = nlines * (i + 1) / s->npart;
+	}
+
+	s->thread = xmalloc(s->nthreads, sizeof s->thread[0]);
+	for(s->nrunning = 0; s->nrunning < s->nthreads; s->nrunning++) {
+		if(pthread_create(&s->thread[s->nrunning], NULL, search_worker, s)) {
+			break;
+		}
+	}
+	return s->nrunning ? 0 : -1;
+}
+
+static void
+search_join(search_t *s)
+{
+	atomic_store(&s->cancel, true);
+	for(int i = 0; i < s->nrunning; i++) {
+		pthread_join(s->thread[i], NULL);
+	}
+	s->nrunning = 0;
+	free(s->thread);
+	s->thread = NULL;
+	for(int i = 0; i < s->npart; i++) {
+		ARR_FREE(&s->part[i].hits);
+	}
+	free(s->part);
+	s->part = NULL;
+	s->npart = 0;
+	s->stitched = 0;
+	s->hits.nmemb = 0;
+}
+
+/* nthreads <= 0 for one per processor */
+int
+search_start(search_t *s, file_t *f, re_t *re, int nthreads)
+{
+	memset(s, 0, sizeof s[0]);
+	s->file = f;
+	s->re = re;
+	atomic_init(&s->cancel, false);
+	atomic_init(&s->next_part, 0);
+
+	if(nthreads <= 0) {
+		nthreads = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	}
+	s->nthreads = nthreads;
+
+	if(pipe2(s->fd, O_CLOEXEC | O_NONBLOCK) < 0) {
+		return -1;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+
+	if(search_run(s) < 0) {
+		search_cancel(s);
+		return -1;
+	}
+	return 0;
+}
+
+/* Before the file changes: the threads stop and what they found is
+ * dropped. A byte on fd[1] tells whoever waits on fd[0] to restart. */
+void
+search_stop(search_t *s)
+{
+	search_join(s);
+	DIEIF(write(s->fd[1], "", 1) < 0 && errno != EAGAIN);
+}
+
+/* again from the start, over the file as it is now */
+int
+search_restart(search_t *s)
+{
+	search_join(s);
+	return search_run(s);
+}
+
+/* stitches finished partitions in file order, returns the number of hits
+ * ready in s->hits */
+size_t
+search_collect(search_t *s, bool *done)
+{
+	char buf[64];
+	while(read(s->fd[0], buf, sizeof buf) > 0) {
+	}
+
+	for(; s->stitched < s->npart; s->stitched++) {
+		search_part_t *part = &s->part[s->stitched];
+		pthread_mutex_lock(&s->lock);
+		bool ready = part->done;
+		pthread_mutex_unlock(&s->lock);
+		if(!ready) {
+			break;
+		}
+		search_stitch(s, part);
+	}
+	*done = s->stitched == s->npart;
+	return s->hits.nmemb;
+}
+
+/* index of the first collected hit starting at or after adr, -1 if none */
+ssize_t
+search_next(search_t *s, address_t *adr)
+{
+	size_t lo = 0;
+	size_t hi = s->hits.nmemb;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(address_cmp(&s->hits.data[mid].start, adr) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < s->hits.nmemb ? (ssize_t)lo : -1;
+}
+
+/* index of the last collected hit starting before adr, -1 if none */
+ssize_t
+search_prev(search_t *s, address_t *adr)
+{
+	ssize_t next = search_next(s, adr);
+	return (next < 0 ? (ssize_t)s->hits.nmemb : next) - 1;
+}
+
+/* stops workers and frees results, also used when search is complete */
+void
+search_cancel(search_t *s)
+{
+	search_join(s);
+	ARR_FREE(&s->hits);
+	close(s->fd[0]);
+	close(s->fd[1]);
+	pthread_mutex_destroy(&s->lock);
+}
+
+static void
+search_all(search_t *s)
+{
+	bool done = false;
+	search_collect(s, &done);
+	while(!done) {
+		poll(&(struct pollfd){.fd = s->fd[0], .events = POLLIN}, 1, -1);
+		search_collect(s, &done);
+	}
+}
+
+/* what a search from the start, one match after the other, finds */
+static void
+search_seq(file_t *f, re_t *re, rangearray_t *hits)
+{
+	re_src_t src = {line_chunk, f};
+	re_pos_t pos = {0, 0};
+	re_match_t m;
+	range_t rng;
+
+	hits->nmemb = 0;
+	while(re_find(re, &src, &pos, -1, &m)) {
+		if(!match_skip_empty(f, &m, &pos)) {
+			match_to_range(f, &m, &rng);
+			hits_push(hits, &rng);
+		}
+	}
+}
+
+static int
+search_check(file_t *f, const char *pat, int nthreads)
+{
+	char call[BUFSIZ];
+	rangearray_t want = {0};
+	search_t s;
+	re_t re;
+
+	re_compile(&re, pat, strlen(pat), 0);
+	snprintf(call, sizeof call, "search_start(\"%s\", %d)", pat, nthreads);
+	TEST_OP("%d", search_start(&s, f, &re, nthreads), ==, 0, "%s", call);
+	search_all(&s);
+	search_seq(f, &re, &want);
+
+	TEST_OP("%zu", s.hits.nmemb, ==, want.nmemb, "%s", call);
+	for(size_t i = 0; i < want.nmemb; i++) {
+		range_t *got = &s.hits.data[i];
+		TEST_OP("%zu", got->start.line, ==, want.data[i].start.line, "%s", call);
+		TEST_OP("%zu", got->start.offset, ==, want.data[i].start.offset, "%s", call);
+		TEST_OP("%zu", got->end.line, ==, want.data[i].end.line, "%s", call);
+		TEST_OP("%zu", got->end.offset, ==, want.data[i].end.offset, "%s", call);
+	}
+
+	ARR_FREE(&want);
+	search_cancel(&s);
+	re_free(&re);
+	return 0;
+}
+
+static void
+test_changing(void *usr)
+{
+	search_stop(usr);
+}
+
+int
+TEST_search_start(void)
+{
+	enum { NLINES = 2000 };
+	char line[256];
+	char call[BUFSIZ];
+	file_t file = {0};
+
+	for(int i = 0; i < NLINES; i++) {
+		int len = 10 + i % 200;
+		// runs of b across line and partition boundaries
+		char c = i >= 600 && i < 900 ? 'b' : 'a';
+		memset(line, c, len);
+		if(i % 3 == 0) {
+			memset(line + len - 5, 'b', 5);
+		}
+		if(i % 3 == 1) {
+			memcpy(line + 3, "needle", 6);
+		}
+		line[len - 1] = '\n';
+		file_insert_line(&file, i, line, len);
+	}
+	file_insert_line(&file, NLINES, "end", 3);
+
+	if(search_check(&file, "needle", 4)) {
+		return -1;
+	}
+	if(search_check(&file, "b+", 4)) {
+		return -1;
+	}
+	if(search_check(&file, "b\na", 3)) {
+		return -1;
+	}
+	if(search_check(&file, "[ab\n]+", 3)) {
+		return -1;
+	}
+	if(search_check(&file, "a+", 2)) {
+		return -1;
+	}
+	if(search_check(&file, "(ab|ba|aa)+", 5)) {
+		return -1;
+	}
+	if(search_check(&file, "x*", 4)) {
+		return -1;
+	}
+
+	search_t s;
+	re_t re;
+	re_compile(&re, "needle", 6, 0);
+	search_start(&s, &file, &re, 2);
+	search_all(&s);
+	size_t found = s.hits.nmemb;
+	address_t adr = {30, 0};
+	ssize_t next = TEST_CALL(call, sizeof(call), "%p, %p",
+		search_next, ((void*)&s, (void*)&adr));
+	TEST_OP("%d", (int)next, >=, 0, "%s", call);
+	TEST_OP("%zu", s.hits.data[next].start.line, ==, (size_t)31, "%s", call);
+	TEST_OP("%d", (int)search_prev(&s, &adr), ==, (int)next - 1, "%s", "search_prev");
+	adr = (address_t){NLINES, 0};
+	TEST_OP("%d", (int)search_next(&s, &adr), ==, -1, "%s", "search_next past last");
+
+	// an edit stops the threads, a restart finds what it made
+	file.changing = test_changing;
+	file.changing_usr = &s;
+	range_t rng = {{0, 0}, {0, 0}, &file};
+	range_push(&rng, "needle", 6, OP_Replace);
+	TEST_OP("%zu", s.hits.nmemb, ==, (size_t)0, "%s", "stopped");
+	TEST_OP("%d", s.gen != file.nchanges, ==, 1, "%s", "stopped");
+	TEST_OP("%d", search_restart(&s), ==, 0, "%s", "search_restart");
+	search_all(&s);
+	TEST_OP("%zu", s.hits.nmemb, ==, found + 1, "%s", "search_restart");
+	search_cancel(&s);
+	re_free(&re);
+
+	free(file.undobuf.first);
+	file_free(&file);
+	return 0;
+}
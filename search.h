@@ -0,0 +1,35 @@
+typedef struct {
+	size_t first; // first line
+	size_t last; // one past the last line
+	bool done;
+	rangearray_t hits;
+} search_part_t;
+
+/* Parallel "find all" over the lines of a file. The file must not change
+ * while the threads run, search_stop stops them before it does and
+ * search_restart runs them again over what it is then. */
+typedef struct {
+	file_t *file;
+	re_t *re;
+	uint64_t gen; // changes made to the file before the threads started
+	atomic_bool cancel;
+	atomic_int next_part;
+	pthread_mutex_t lock;
+	int fd[2]; // a byte is written to fd[1] for every finished partition
+	int nthreads; // asked for
+	int nrunning;
+	pthread_t *thread;
+	int npart;
+	search_part_t *part;
+	int stitched;
+	address_t resume;
+	rangearray_t hits; // stitched matches, file order
+} search_t;
+
+int search_start(search_t *s, file_t *f, re_t *re, int nthreads);
+void search_stop(search_t *s);
+int search_restart(search_t *s);
+size_t search_collect(search_t *s, bool *done);
+ssize_t search_next(search_t *s, address_t *adr);
+ssize_t search_prev(search_t *s, address_t *adr);
+void search_cancel(search_t *s);
@@ -0,0 +1,382 @@
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "test.h"
+
+#include "trace.h"
+
+/* Always on: an event costs two clock reads and a slot in the ring,
+ * which is only read when dumped. Input-to-photon latency runs from the
+ * receipt of the oldest input handled since the last frame to the end
+ * of the blit that shows it. Event-to-photon latency runs from when the
+ * X server sent it instead, so it counts the time input waited in the
+ * queue while a frame was drawn. Server time is in ms from its own
+ * start; the least difference to the receipt seen is taken as the
+ * offset between clocks, a millisecond off at most. */
+
+/* seq is the number of the event in the slot, from 1, written last; 0
+ * while it is being written over */
+typedef struct {
+	atomic_size_t seq;
+	trace_event_t ev;
+} trace_slot_t;
+
+static struct {
+	atomic_size_t head; // events recorded so far
+	trace_slot_t ev[TRACE_SIZE];
+	uint64_t pending; // oldest input not yet on screen, 0 when none
+	uint64_t queued; // when it was sent, by our clock, 0 when unknown
+	uint32_t offset; // ms, receipt less server time when it was not queued
+	bool synced;
+	int frame;
+	size_t nlat;
+	uint32_t lat[TRACE_SIZE]; // us
+	size_t nqlat;
+	uint32_t qlat[TRACE_SIZE]; // us, event to photon
+	size_t ninput; // handled
+	size_t ncoalesced; // handled along with one before
+} trace;
+
+static volatile sig_atomic_t requested;
+
+static const char *kind_name[TRACE_NKINDS] = {
+	[TRACE_INPUT] = "input",
+	[TRACE_EDIT] = "edit",
+	[TRACE_RESHAPE] = "reshape",
+	[TRACE_SHAPE] = "shape",
+	[TRACE_PRESHAPE] = "preshape",
+	[TRACE_DRAW] = "draw",
+	[TRACE_BLIT] = "blit"
+};
+
+uint64_t
+trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* any thread may record, a slot is claimed with one atomic add; a dump
+ * reading it meanwhile sees its seq change and leaves it out */
+static void
+trace_record(int kind, uint64_t begin, uint64_t end, int arg)
+{
+	size_t i = atomic_fetch_add_explicit(&trace.head, 1, memory_order_relaxed);
+	trace_slot_t *s = &trace.ev[i & (TRACE_SIZE - 1)];
+	atomic_store_explicit(&s->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	s->ev = (trace_event_t){begin, end, kind, arg};
+	atomic_store_explicit(&s->seq, i + 1, memory_order_release);
+}
+
+void
+trace_event(int kind, uint64_t begin, int arg)
+{
+	trace_record(kind, begin, trace_now(), arg);
+}
+
+static void
+trace_sent(uint64_t begin, unsigned long sent)
+{
+	uint32_t delay = (uint32_t)(begin / 1000000) - (uint32_t)sent;
+	if(!trace.synced || (int32_t)(delay - trace.offset) < 0) {
+		trace.offset = delay;
+		trace.synced = true;
+	}
+	uint64_t at = begin - (uint64_t)(delay - trace.offset) * 1000000;
+	if(!trace.queued || at < trace.queued) {
+		trace.queued = at;
+	}
+}
+
+/* main thread only, as are the rest but trace_event; sent is the server
+ * time of the event, 0 when it has none */
+void
+trace_input(uint64_t begin, int type, bool handled, unsigned long sent)
+{
+	trace_event(TRACE_INPUT, begin, type);
+	if(!handled) {
+		return;
+	}
+	trace.ninput++;
+	if(!trace.pending || begin < trace.pending) {
+		trace.pending = begin;
+	}
+	if(sent) {
+		trace_sent(begin, sent);
+	}
+}
+
+/* input taken from the queue to be handled with one like it before */
+void
+trace_coalesced(uint64_t begin, int type, unsigned long sent)
+{
+	trace.ncoalesced++;
+	trace_input(begin, type, true, sent);
+}
+
+void
+trace_frame(uint64_t begin)
+{
+	uint64_t end = trace_now();
+	trace_record(TRACE_BLIT, begin, end, trace.frame++);
+	if(trace.pending) {
+		trace.lat[trace.nlat++ % TRACE_SIZE] = (end - trace.pending) / 1000;
+		trace.pending = 0;
+	}
+	if(trace.queued) {
+		trace.qlat[trace.nqlat++ % TRACE_SIZE] = (end - trace.queued) / 1000;
+		trace.queued = 0;
+	}
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* nearest rank, in ms */
+static double
+percentile(uint32_t *sorted, size_t n, size_t p)
+{
+	if(!n) {
+		return 0;
+	}
+	size_t rank = (n * p + 99) / 100;
+	return sorted[MAX(rank, 1) - 1] / 1E3;
+}
+
+static void
+latency_of(uint32_t *ring, size_t count, trace_latency_t *lat)
+{
+	size_t n = MIN(count, (size_t)TRACE_SIZE);
+	uint32_t *sorted = xmalloc(MAX(n, 1), sizeof sorted[0]);
+	memcpy(sorted, ring, n * sizeof sorted[0]);
+	qsort(sorted, n, sizeof sorted[0], cmp_u32);
+
+	lat->n = n;
+	lat->p50 = percentile(sorted, n, 50);
+	lat->p90 = percentile(sorted, n, 90);
+	lat->p99 = percentile(sorted, n, 99);
+	lat->max = percentile(sorted, n, 100);
+	free(sorted);
+}
+
+/* over the last TRACE_SIZE frames that showed input */
+void
+trace_latency(trace_latency_t *lat)
+{
+	latency_of(trace.lat, trace.nlat, lat);
+}
+
+/* over the last TRACE_SIZE frames that showed input with a server time */
+void
+trace_event_latency(trace_latency_t *lat)
+{
+	latency_of(trace.qlat, trace.nqlat, lat);
+}
+
+/* Chrome trace event format, loads in chrome://tracing and Perfetto */
+int
+trace_write(FILE *f)
+{
+	size_t head = atomic_load(&trace.head);
+	size_t first = head - MIN(head, (size_t)TRACE_SIZE);
+	int pid = getpid();
+	trace_latency_t lat, qlat;
+
+	fprintf(f, "{\"traceEvents\": [\n");
+	const char *sep = "";
+	for(size_t i = first; i < head; i++) {
+		// not yet written or written over while it was copied
+		trace_slot_t *s = &trace.ev[i & (TRACE_SIZE - 1)];
+		size_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		trace_event_t ev = s->ev;
+		atomic_thread_fence(memory_order_acquire);
+		if(seq != i + 1 || atomic_load_explicit(&s->seq, memory_order_relaxed) != seq) {
+			continue;
+		}
+		fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+			"\"pid\": %d, \"tid\": 1, \"args\": {\"arg\": %d}}",
+			sep, kind_name[ev.kind], ev.begin / 1E3, (ev.end - ev.begin) / 1E3,
+			pid, ev.arg);
+		sep = ",\n";
+	}
+	trace_latency(&lat);
+	trace_event_latency(&qlat);
+	fprintf(f, "\n],\n\"displayTimeUnit\": \"ms\",\n"
+		"\"metadata\": {\"latency_frames\": %zu, \"latency_p50_ms\": %.3f, "
+		"\"latency_p90_ms\": %.3f, \"latency_p99_ms\": %.3f, \"latency_max_ms\": %.3f, "
+		"\"event_latency_frames\": %zu, \"event_latency_p50_ms\": %.3f, "
+		"\"event_latency_p90_ms\": %.3f, \"event_latency_p99_ms\": %.3f, "
+		"\"event_latency_max_ms\": %.3f, \"inputs\": %zu, \"coalesced\": %zu}}\n",
+		lat.n, lat.p50, lat.p90, lat.p99, lat.max,
+		qlat.n, qlat.p50, qlat.p90, qlat.p99, qlat.max, trace.ninput, trace.ncoalesced);
+	return ferror(f) ? -1 : 0;
+}
+
+int
+trace_dump(const char *fname)
+{
+	FILE *f = fopen(fname, "w");
+	if(!f) {
+		perror(fname);
+		return -1;
+	}
+	int ret = trace_write(f);
+	if(fclose(f) || ret < 0) {
+		perror(fname);
+		return -1;
+	}
+
+	trace_latency_t lat;
+	trace_latency(&lat);
+	fprintf(stderr, "trace: %s, input to photon over %zu frames: "
+		"p50 %.1f p90 %.1f p99 %.1f max %.1f ms\n",
+		fname, lat.n, lat.p50, lat.p90, lat.p99, lat.max);
+	trace_event_latency(&lat);
+	fprintf(stderr, "trace: event to photon over %zu frames: "
+		"p50 %.1f p90 %.1f p99 %.1f max %.1f ms, %zu of %zu inputs coalesced\n",
+		lat.n, lat.p50, lat.p90, lat.p99, lat.max, trace.ncoalesced, trace.ninput);
+	return 0;
+}
+
+/* signal handler, the main loop dumps when trace_requested says so */
+void
+trace_request(int sig)
+{
+	(void)sig;
+	requested = 1;
+}
+
+bool
+trace_requested(void)
+{
+	if(!requested) {
+		return false;
+	}
+	requested = 0;
+	return true;
+}
+
+void
+trace_reset(void)
+{
+	atomic_store(&trace.head, 0);
+	for(size_t i = 0; i < TRACE_SIZE; i++) {
+		atomic_store_explicit(&trace.ev[i].seq, 0, memory_order_relaxed);
+	}
+	trace.pending = 0;
+	trace.queued = 0;
+	trace.synced = false;
+	trace.frame = 0;
+	trace.nlat = 0;
+	trace.nqlat = 0;
+	trace.ninput = 0;
+	trace.ncoalesced = 0;
+}
+
+static size_t
+count_str(const char *s, const char *needle)
+{
+	size_t n = 0;
+	while((s = strstr(s, needle))) {
+		n++;
+		s++;
+	}
+	return n;
+}
+
+int
+TEST_trace_latency(void)
+{
+	char call[BUFSIZ];
+	trace_latency_t lat;
+	char *json;
+	size_t json_len;
+
+	trace_reset();
+	// input received i+1 ms before each frame
+	for(int i = 0; i < 100; i++) {
+		uint64_t now = trace_now();
+		trace_input(now - (i + 1) * UINT64_C(1000000), 2, true, 0);
+		trace_input(now, 2, true, 0);
+		trace_frame(now);
+	}
+	trace_frame(trace_now());
+
+	trace_latency(&lat);
+	TEST_OP("%zu", lat.n, ==, (size_t)100, "%s", "trace_latency");
+	TEST_OP("%f", lat.p50, >=, 50.0, "%s", "trace_latency");
+	TEST_OP("%f", lat.p50, <, 51.0, "%s", "trace_latency");
+	TEST_OP("%f", lat.p99, >=, 99.0, "%s", "trace_latency");
+	TEST_OP("%f", lat.max, >=, 100.0, "%s", "trace_latency");
+	TEST_OP("%f", lat.max, <, 101.0, "%s", "trace_latency");
+
+	FILE *f = open_memstream(&json, &json_len);
+	int ret = TEST_CALL(call, sizeof(call), "%p", trace_write, ((void*)f));
+	fclose(f);
+	TEST_OP("%d", ret, ==, 0, "%s", call);
+	TEST_OP("%zu", count_str(json, "\"ph\""), ==, (size_t)301, "%s", call);
+	TEST_OP("%zu", count_str(json, "\"blit\""), ==, (size_t)101, "%s", call);
+	free(json);
+
+	// the ring keeps the newest events
+	for(int i = 0; i < TRACE_SIZE; i++) {
+		trace_event(TRACE_EDIT, trace_now(), i);
+	}
+	f = open_memstream(&json, &json_len);
+	trace_write(f);
+	fclose(f);
+	TEST_OP("%zu", count_str(json, "\"ph\""), ==, (size_t)TRACE_SIZE, "%s", "wrapped");
+	TEST_OP("%zu", count_str(json, "\"edit\""), ==, (size_t)TRACE_SIZE, "%s", "wrapped");
+	free(json);
+
+	// a slot a thread is writing over is left out
+	size_t head = atomic_load(&trace.head);
+	atomic_store(&trace.ev[(head - 1) & (TRACE_SIZE - 1)].seq, 0);
+	f = open_memstream(&json, &json_len);
+	trace_write(f);
+	fclose(f);
+	TEST_OP("%zu", count_str(json, "\"ph\""), ==, (size_t)TRACE_SIZE - 1, "%s", "torn");
+	TEST_OP("%d", strstr(json, "},\n]") == NULL, ==, 1, "%s", "torn");
+	free(json);
+
+	// the server sent the second 3 ms later than the first, relative to
+	// receipt, and the coalesced third 1 ms later
+	trace_reset();
+	uint64_t now = trace_now();
+	uint64_t ms = UINT64_C(1000000);
+	trace_input(now - 20 * ms, 2, true, 1000);
+	trace_frame(now - 20 * ms);
+	trace_input(now - 10 * ms, 2, true, 1007);
+	trace_coalesced(now - 10 * ms, 2, 1009);
+	trace_frame(now - 10 * ms);
+
+	trace_event_latency(&lat);
+	TEST_OP("%zu", lat.n, ==, (size_t)2, "%s", "trace_event_latency");
+	TEST_OP("%f", lat.p50, >=, 13.0, "%s", "trace_event_latency");
+	TEST_OP("%f", lat.p50, <, 14.0, "%s", "trace_event_latency");
+	TEST_OP("%f", lat.max, >=, 20.0, "%s", "trace_event_latency");
+	TEST_OP("%f", lat.max, <, 21.0, "%s", "trace_event_latency");
+	f = open_memstream(&json, &json_len);
+	trace_write(f);
+	fclose(f);
+	TEST_OP("%zu", count_str(json, "\"inputs\": 3, \"coalesced\": 1}"), ==, (size_t)1, "%s", "coalesced");
+	free(json);
+
+	trace_reset();
+	return 0;
+}
@@ -0,0 +1,42 @@
+enum {
+	TRACE_INPUT, // an X event, arg is its type
+	TRACE_EDIT, // range_push, arg is the op type
+	TRACE_RESHAPE, // view_reshape, arg is the number of lines
+	TRACE_SHAPE, // lines of a reshape shaped on threads, arg is how many
+	TRACE_PRESHAPE, // view_preshape, arg is the number of lines
+	TRACE_DRAW, // draw_view
+	TRACE_BLIT, // XCopyArea and XFlush, arg is the frame
+	TRACE_NKINDS
+};
+
+#define TRACE_FILE "werf.trace.json" // for SIGUSR1 and the trace control command
+
+enum { TRACE_SIZE = 1 << 14 }; // events kept, power of two
+
+typedef struct {
+	uint64_t begin; // ns, CLOCK_MONOTONIC
+	uint64_t end;
+	int kind;
+	int arg;
+} trace_event_t;
+
+typedef struct {
+	size_t n;
+	double p50;
+	double p90;
+	double p99;
+	double max;
+} trace_latency_t;
+
+uint64_t trace_now(void);
+void trace_event(int kind, uint64_t begin, int arg);
+void trace_input(uint64_t begin, int type, bool handled, unsigned long sent);
+void trace_coalesced(uint64_t begin, int type, unsigned long sent);
+void trace_frame(uint64_t begin);
+void trace_latency(trace_latency_t *lat);
+void trace_event_latency(trace_latency_t *lat);
+int trace_write(FILE *f);
+int trace_dump(const char *fname);
+void trace_request(int sig);
+bool trace_requested(void);
+void trace_reset(void);
@@ -1,5 +1,15 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "util.h"
 #include "utf.h"
+#include "bench.h"
+#include "test.h"
 
 /* taken from st (http://st.suckless.org/) */
 
@@ -54,14 +64,92 @@ utf8decode(const char *c, long *u, size_t clen)
 size_t
 utf8chsiz(char *c, size_t clen)
 {
-	if(clen <= 0) {
-		return 0;
-	}
 	long cp;
-	size_t chsiz = utf8decode(c, &cp, MIN(UTF_SIZ, clen));
+	size_t chsiz = utf8scan(c, clen, &cp);
 	return cp != UTF_INVALID ? chsiz : 1;
 }
 
+/* As utf8decode, with the well-formed sequences of Unicode table 3-7
+ * checked byte by byte instead of through the masks. A byte that does
+ * not start one is 1 long and UTF_INVALID, as is a cut off sequence. */
+size_t
+utf8scan(const char *c, size_t clen, long *u)
+{
+	const uchar *s = (const uchar *)c;
+	*u = UTF_INVALID;
+	if(!clen) {
+		return 0;
+	}
+	if(s[0] < 0x80) {
+		*u = s[0];
+		return 1;
+	}
+	if(s[0] < 0xC2 || s[0] > 0xF4) {
+		return 1;
+	}
+	size_t len = s[0] < 0xE0 ? 2 : s[0] < 0xF0 ? 3 : 4;
+	if(clen < len) {
+		return 1;
+	}
+	// the second byte has narrower bounds after these
+	uchar lo = s[0] == 0xE0 ? 0xA0 : s[0] == 0xF0 ? 0x90 : 0x80;
+	uchar hi = s[0] == 0xED ? 0x9F : s[0] == 0xF4 ? 0x8F : 0xBF;
+	if(s[1] < lo || s[1] > hi) {
+		return 1;
+	}
+	long cp = (s[0] & (0x7F >> len)) << 6 | (s[1] & 0x3F);
+	for(size_t i = 2; i < len; i++) {
+		if((s[i] & 0xC0) != 0x80) {
+			return 1;
+		}
+		cp = cp << 6 | (s[i] & 0x3F);
+	}
+	*u = cp;
+	return len;
+}
+
+/* bytes below 0x80 at the start of c, 16 at a time with SSE2, else 8 */
+size_t
+utf8ascii(const char *c, size_t clen)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	for(; i + 16 <= clen; i += 16) {
+		int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(c + i)));
+		if(mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+	for(; i + 8 <= clen; i += 8) {
+		uint64_t w;
+		memcpy(&w, c + i, sizeof w);
+		if(w & UINT64_C(0x8080808080808080)) {
+			break;
+		}
+	}
+	while(i < clen && !(c[i] & 0x80)) {
+		i++;
+	}
+	return i;
+}
+
+/* length of the well-formed start of c, clen when it all is */
+size_t
+utf8valid(const char *c, size_t clen)
+{
+	size_t i = 0;
+	long u;
+	for(;;) {
+		i += utf8ascii(c + i, clen - i);
+		size_t n = utf8scan(c + i, clen - i, &u);
+		if(n < 2) {
+			return i;
+		}
+		i += n;
+	}
+}
+
 /*
 size_t
 utf8chsiz_backward(char *c, size_t clen)
@@ -105,3 +193,76 @@ utf8encode(long u, char *c, size_t clen)
 	c[0] = utf8encodebyte(u, len);
 	return len;
 }
+
+int
+TEST_utf8scan(void)
+{
+	static const uchar tail[] = {0x00, 0x41, 0x7F, 0x80, 0x8F, 0x90, 0x9F, 0xA0, 0xBF, 0xC0, 0xF4, 0xFF};
+	char call[BUFSIZ];
+	char s[UTF_SIZ];
+	long want, got;
+
+	// against utf8decode for every lead byte, cut off at every length
+	for(int b0 = 0; b0 < 256; b0++)
+	for(size_t i1 = 0; i1 < LEN(tail); i1++)
+	for(size_t i2 = 0; i2 < LEN(tail); i2++)
+	for(size_t i3 = 0; i3 < LEN(tail); i3++) {
+		s[0] = b0;
+		s[1] = tail[i1];
+		s[2] = tail[i2];
+		s[3] = tail[i3];
+		for(size_t clen = 1; clen <= UTF_SIZ; clen++) {
+			size_t want_len = utf8decode(s, &want, clen);
+			size_t got_len = utf8scan(s, clen, &got);
+			snprintf(call, sizeof call, "utf8scan(%02X %02X %02X %02X, %zu)",
+				(uchar)s[0], (uchar)s[1], (uchar)s[2], (uchar)s[3], clen);
+			TEST_OP("%ld", got, ==, want, "%s", call);
+			if(want != UTF_INVALID) {
+				TEST_OP("%zu", got_len, ==, want_len, "%s", call);
+			}
+		}
+	}
+
+	static const char text[] = "int x = 0; // zażółć gęślą jaźń, 日本語 \xF0\x9F\x98\x80 ok";
+	size_t len = sizeof(text) - 1;
+	size_t n = TEST_CALL(call, sizeof(call), "%s, %zu", utf8ascii, (text, len));
+	TEST_OP("%zu", n, ==, (size_t)(strchr(text, 0xC5) - text), "%s", call);
+	n = TEST_CALL(call, sizeof(call), "%s, %zu", utf8valid, (text, len));
+	TEST_OP("%zu", n, ==, len, "%s", call);
+	n = TEST_CALL(call, sizeof(call), "%s, %zu", utf8valid, (text, len - 3));
+	TEST_OP("%zu", n, ==, len - 3, "%s", call);
+	n = TEST_CALL(call, sizeof(call), "%s, %zu", utf8valid, (text, len - 4));
+	TEST_OP("%zu", n, ==, len - 7, "%s", call);
+	return 0;
+}
+
+void
+BENCH_utf8decode(bench_t *b)
+{
+	static const char text[] = "if(x) { return \"zażółć gęślą jaźń\"; } // ελληνικά, 日本語 ✓";
+	size_t len = sizeof(text) - 1;
+	long u;
+
+	bench_start(b);
+	for(size_t i = 0; i < b->n; i++) {
+		for(size_t off = 0; off < len; off += MAX(utf8decode(text + off, &u, len - off), 1)) {
+			bench_keep(&u);
+		}
+	}
+	bench_stop(b);
+}
+
+/* a line of code with a comment in Polish, as loading checks it */
+void
+BENCH_utf8valid(bench_t *b)
+{
+	static const char text[] = "\tfor(size_t i = 0; i < f->content.nmemb; i++) { // zażółć gęślą jaźń\n";
+	size_t len = sizeof(text) - 1;
+
+	bench_start(b);
+	for(size_t i = 0; i < b->n; i++) {
+		size_t n = utf8valid(text, len);
+		bench_keep(&n);
+	}
+	bench_stop(b);
+}
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <string.h>
@@ -11,6 +12,11 @@
 #define DEFAULT(a, b) (a) = (a) ? (a) : (b)
 #define BETWEEN(x, a, b) ((a) <= (x) && (x) <= (b))
 
+// only visible with XSI, Linux value
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 #define DIEIF(x) dieif(__FILE__, __LINE__, __func__, #x, (x))
 
 typedef unsigned char uchar;
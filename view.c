@@ -1,7 +1,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <locale.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,77 +26,276 @@
 #include "array.h"
 
 #include "utf.h"
+#include "re.h"
 #include "edit.h"
 #include "font.h"
+#include "wrap.h"
 #include "view.h"
+#include "trace.h"
+#include "alloc.h"
+#include "pool.h"
 #include "command.h"
 
+/* rows of a line not shaped yet, from its length */
+static uint32_t
+view_guess_rows(void *usr, size_t line)
+{
+	view_t *v = usr;
+	double width = v->width - 2 * v->left_margin;
+	double advance = v->line_height / 2;
+	if(width <= advance) {
+		return 1;
+	}
+	return 1 + istr_len(&v->range.file->content.data[line]) * advance / width;
+}
+
+void
+layout_init(layout_t *l, file_t *f)
+{
+	memset(l, 0, sizeof *l);
+	l->file = f;
+}
+
+void
+layout_free(layout_t *l)
+{
+	wrap_free(&l->wrap);
+	ARR_FREE(&l->views);
+}
+
+void
+view_attach(view_t *v, layout_t *l)
+{
+	v->layout = l;
+	v->range.file = l->file;
+	v->range_gen = l->file->nchanges;
+	v->dirty = true;
+	ARR_EXTEND(&l->views, 1);
+	l->views.data[l->views.nmemb - 1] = v;
+}
+
+void
+view_detach(view_t *v)
+{
+	layout_t *l = v->layout;
+	for(size_t i = 0; i < l->views.nmemb; i++) {
+		if(l->views.data[i] == v) {
+			ARR_FRAG_SHIFT(&l->views, i + 1, l->views.nmemb, -1);
+			ARR_SHRINK(&l->views, 1);
+			break;
+		}
+	}
+	v->layout = NULL;
+}
+
+void
+view_free(view_t *v)
+{
+	if(v->layout) {
+		view_detach(v);
+	}
+	arena_free(&v->shaped.arena);
+	arena_free(&v->prev.arena);
+	arena_free(&v->ahead.arena);
+	arena_free(&v->spare.arena);
+	free(v->shaped.lines);
+	free(v->prev.lines);
+	free(v->ahead.lines);
+	free(v->spare.lines);
+}
+
+bool
+view_stale(view_t *v)
+{
+	return v->dirty || v->shaped.gen != v->range.file->nchanges;
+}
+
+/* A change wholly above the top line of a view moves its text, so its
+ * top row moves along and the view keeps showing the same lines. */
+static void
+layout_splice(layout_t *l, linechange_t *c)
+{
+	wrap_t *w = &l->wrap;
+	ssize_t old_rows = wrap_line_to_row(w, c->old_end);
+	wrap_splice(w, c->start, c->old_end, c->new_end);
+	ssize_t shift = (ssize_t)wrap_line_to_row(w, c->new_end) - old_rows;
+
+	for(size_t i = 0; i < l->views.nmemb; i++) {
+		view_t *vw = l->views.data[i];
+		if(vw->top >= c->old_end) {
+			vw->top += c->new_end - c->old_end;
+			vw->start += shift;
+		} else if(vw->top >= c->start) {
+			vw->top = c->start;
+		}
+	}
+}
+
+/* rows measured by v; for the other views, lines above their top,
+ * for all of them when v is NULL */
+static void
+layout_set_rows(layout_t *l, view_t *v, size_t line, uint32_t rows)
+{
+	uint32_t old_rows = wrap_rows(&l->wrap, line);
+	wrap_set(&l->wrap, line, rows);
+	ssize_t shift = (ssize_t)wrap_rows(&l->wrap, line) - old_rows;
+	if(!shift) {
+		return;
+	}
+	for(size_t i = 0; i < l->views.nmemb; i++) {
+		view_t *vw = l->views.data[i];
+		if(vw != v && line < vw->top) {
+			vw->start += shift;
+		}
+	}
+}
+
+/* the shared wrap index brought up to date with the changes made to the
+ * file and the width of v */
+wrap_t *
+view_layout(view_t *v)
+{
+	layout_t *l = v->layout;
+	file_t *f = l->file;
+	wrap_t *w = &l->wrap;
+
+	if(w->tree.nmemb && f->nchanges - w->gen <= FILE_CHANGES) {
+		for(; w->gen < f->nchanges; w->gen++) {
+			linechange_t *c = &f->changes[w->gen % FILE_CHANGES];
+			if(c->old_end > w->lines.nmemb) {
+				break;
+			}
+			layout_splice(l, c);
+		}
+	}
+	if(!w->tree.nmemb || w->gen != f->nchanges || w->lines.nmemb != f->content.nmemb) {
+		wrap_init(w, f->content.nmemb, view_guess_rows, v);
+		w->gen = f->nchanges;
+	}
+	// an edit in one view moves the selections of the others
+	for(size_t i = 0; i < l->views.nmemb; i++) {
+		range_follow(&l->views.data[i]->range, &l->views.data[i]->range_gen);
+	}
+	if(l->width != v->width) {
+		wrap_invalidate(w);
+		l->width = v->width;
+	}
+	return w;
+}
+
 ssize_t
 view_clamp_start(view_t *v, ssize_t nr)
 {
-	return clampss(nr, -v->nmemb + 1, v->range.file->content.nmemb - 1);
+	return clampss(nr, -v->nmemb + 1, wrap_total(view_layout(v)) - 1);
 }
 
+/* scrolls so that all rows of line nr are on screen, or its first ones */
 void
 view_set_start(view_t *v, size_t nr)
 {
-	ssize_t view_end = view_clamp_start(v, v->start + v->nmemb - 1);
-	if((ssize_t)nr < v->start) {
-		v->start = nr;
-		v->range.file->dirty = true;
-	} else if((ssize_t)nr > view_end) {
-		v->start = nr - (v->nmemb - 1);
-		v->range.file->dirty = true;
+	wrap_t *w = view_layout(v);
+	ssize_t row = wrap_line_to_row(w, nr);
+	ssize_t rows = wrap_rows(w, nr);
+	ssize_t view_end = v->start + v->nmemb - 1;
+	if(row < v->start) {
+		v->start = row;
+		v->dirty = true;
+	} else if(row + rows - 1 > view_end) {
+		v->start = MIN(row, row + rows - (ssize_t)v->nmemb);
+		v->dirty = true;
 	}
 }
 
+/* shaping measures the lines, which may push line nr off screen again */
 glyphs_t *
 view_get_glyphs(view_t *v, size_t nr)
 {
-	view_set_start(v, nr);
-	if(v->range.file->dirty) {
-		view_reshape(v);
+	for(;;) {
+		view_set_start(v, nr);
+		if(view_stale(v)) {
+			view_reshape(v);
+		}
+		if(nr >= v->shaped.first && nr < v->shaped.first + v->shaped.nlines) {
+			return &v->shaped.lines[nr - v->shaped.first];
+		}
+		v->dirty = true;
 	}
-
-	return &v->lines[nr - v->start];
 }
 
+/* line at y and the row in it, lines before the first and past the last
+ * for rows out of the file */
 ssize_t
-view_y_to_line(view_t *v, int y)
+view_y_to_line(view_t *v, int y, size_t *row)
 {
-	return y / v->line_height + v->start;
+	wrap_t *w = view_layout(v);
+	ssize_t r = y / v->line_height + v->start;
+	size_t line_row = 0;
+	if(r < 0) {
+		if(row) {
+			*row = 0;
+		}
+		return r;
+	}
+	size_t line = wrap_row_to_line(w, r, &line_row);
+	if(line >= w->lines.nmemb) {
+		if(row) {
+			*row = SIZE_MAX;
+		}
+		return line + (r - line_row);
+	}
+	if(row) {
+		*row = r - line_row;
+	}
+	return line;
+}
+
+int
+glyphs_row(glyphs_t *gl, int gi)
+{
+	int r = gl->nrows - 1;
+	while(r > 0 && gl->rows[r] > gi) {
+		r--;
+	}
+	return MAX(r, 0);
 }
 
 size_t
-view_x_to_offset(view_t *v, size_t nr, int x)
+view_x_to_offset(view_t *v, size_t nr, size_t row, int x)
 {
 	glyphs_t *gl = view_get_glyphs(v, nr);
+	row = MIN(row, (size_t)gl->nrows - 1);
+	int rs = gl->rows[row];
+	int re = row + 1 < (size_t)gl->nrows ? gl->rows[row + 1] : gl->nmemb;
 
 	if(x < v->left_margin) {
-		return 0;
+		return gl->glyph_to_offset[rs];
 	}
 
 	double prevx = 0.0;
-	for(int i = 1; i < gl->nmemb; i++) {
-		if(x < v->left_margin + prevx + (gl->data[i].x - prevx) * 0.5f) {
+	for(int i = rs + 1; i < re; i++) {
+		double gx = gl->data[i].x - gl->data[rs].x;
+		if(x < v->left_margin + prevx + (gx - prevx) * 0.5f) {
 			return gl->glyph_to_offset[i - 1];
 		}
-		prevx = gl->data[i].x;
+		prevx = gx;
 	}
-	return gl->glyph_to_offset[gl->nmemb - 1];
+	return gl->glyph_to_offset[re - 1];
 }
 
+/* within the visual row the address is in */
 double
 view_address_to_x(view_t *v, address_t *adr) {
 	glyphs_t *gl = view_get_glyphs(v, adr->line);
-	return v->left_margin + gl->data[gl->offset_to_glyph[adr->offset]].x;
+	int gi = gl->offset_to_glyph[adr->offset];
+	return v->left_margin + gl->data[gi].x - gl->data[gl->rows[glyphs_row(gl, gi)]].x;
 }
 
 double
 view_line_to_y(view_t *v, size_t nr) {
-	return v->line_height * (nr - v->start);
+	return v->line_height * ((ssize_t)wrap_line_to_row(view_layout(v), nr) - v->start);
 }
 
+/* by visual rows */
 void
 view_move_address_line(view_t *v, address_t *adr, int move)
 {
@@ -102,14 +304,22 @@ view_move_address_line(view_t *v, address_t *adr, int move)
 	} else if(move < 0) {
 		move = -1;
 	}
-	if( (move < 0 && adr->line == 0) ||
+	glyphs_t *gl = view_get_glyphs(v, adr->line);
+	size_t row = glyphs_row(gl, gl->offset_to_glyph[adr->offset]);
+
+	if(move < 0 && row > 0) {
+		row--;
+	} else if(move > 0 && row + 1 < (size_t)gl->nrows) {
+		row++;
+	} else if( (move < 0 && adr->line == 0) ||
 	(move > 0 && adr->line == v->range.file->content.nmemb - 1) ) {
 		view_set_start(v, adr->line);
 		return;
+	} else {
+		adr->line += move;
+		row = move > 0 ? 0 : SIZE_MAX;
 	}
-
-	adr->line += move;
-	adr->offset = view_x_to_offset(v, adr->line, v->last_x);
+	adr->offset = view_x_to_offset(v, adr->line, row, v->last_x);
 }
 
 void
@@ -149,7 +359,7 @@ view_move_start(view_t *v, ssize_t move)
 
 	if(new_start != v->start) {
 		v->start = new_start;
-		v->range.file->dirty = true;
+		v->dirty = true;
 		return true;
 	}
 	return false;
@@ -165,56 +375,82 @@ view_hide_toolbar(view_t *v, toolbar_wrap_t *bar_wrap, size_t line)
 	if(line > bar_wrap->line) {
 		v->start--;
 	}
-	size_t start = clampss(v->start, 0, v->range.file->content.nmemb - 1);
-	size_t end = view_clamp_start(v, v->start + v->nmemb - 1) + 1;
-	if(bar_wrap->line >= start && bar_wrap->line <= end) {
-		v->range.file->dirty = true;
+	ssize_t row = wrap_line_to_row(view_layout(v), bar_wrap->line);
+	if(row >= v->start && row <= v->start + (ssize_t)v->nmemb) {
+		v->dirty = true;
 	}
 	bar_wrap->visible = false;
 }
 
 static void
-glyphs_map(glyphs_t *gl, string_t *line)
+glyphs_map(glyphs_t *gl, arena_t *arena, char *text, size_t text_len)
 {
-	gl->glyph_to_offset = xrealloc(gl->glyph_to_offset, gl->nmemb,
-			sizeof gl->glyph_to_offset[0]);
-	gl->offset_to_glyph = xrealloc(gl->offset_to_glyph, line->nmemb,
-			sizeof gl->offset_to_glyph[0]);
-
-	char *utf8 = line->data;
-	size_t len = line->nmemb;
+	if(arena) {
+		gl->glyph_to_offset = arena_alloc(arena, gl->nmemb,
+				sizeof gl->glyph_to_offset[0]);
+		gl->offset_to_glyph = arena_alloc(arena, text_len,
+				sizeof gl->offset_to_glyph[0]);
+	} else {
+		gl->glyph_to_offset = xrealloc(gl->glyph_to_offset, gl->nmemb,
+				sizeof gl->glyph_to_offset[0]);
+		gl->offset_to_glyph = xrealloc(gl->offset_to_glyph, text_len,
+				sizeof gl->offset_to_glyph[0]);
+	}
+	gl->len = text_len;
 
+	// runs of ASCII are a glyph per byte, a character at a time only
+	// after them
 	int gi = 0;
 	size_t oi = 0;
-	for(size_t chsiz = 0; (chsiz = utf8chsiz(utf8, len)) != 0 &&
-			gi < gl->nmemb && oi < line->nmemb;
-			utf8 += chsiz, len -= chsiz) {
-		gl->glyph_to_offset[gi] = oi;
-		gl->offset_to_glyph[oi] = gi;
-
-		oi += chsiz;
-		gi++;
+	while(gi < gl->nmemb && oi < text_len) {
+		size_t run = MIN(utf8ascii(text + oi, text_len - oi), (size_t)(gl->nmemb - gi));
+		for(size_t end = oi + run; oi < end; oi++, gi++) {
+			gl->glyph_to_offset[gi] = oi;
+			gl->offset_to_glyph[oi] = gi;
+		}
+		if(gi < gl->nmemb && oi < text_len) {
+			gl->glyph_to_offset[gi] = oi;
+			gl->offset_to_glyph[oi] = gi;
+			oi += utf8chsiz(text + oi, text_len - oi);
+			gi++;
+		}
 	}
 }
 
+/* text without a final newline, the last line of a file, gets one for
+ * shaping so there is a glyph to put the cursor at; with an arena the
+ * glyphs live until its reset, otherwise they are gl's own */
 void
-glyphs_from_text(glyphs_t *gl, cairo_scaled_font_t *font, string_t *line)
+glyphs_from_text(glyphs_t *gl, arena_t *arena, cairo_scaled_font_t *font,
+		char *text, size_t len)
 {
-	if(line->nmemb > (size_t)gl->nmemb) {
-		gl->nmemb = line->nmemb;
-		gl->data = xrealloc(gl->data, gl->nmemb, sizeof gl->data[0]);
+	static _Thread_local string_t last;
+	int tag = alloc_tag(ALLOC_GLYPHS);
+
+	if(len == 0 || text[len - 1] != '\n') {
+		last.nmemb = 0;
+		ARR_EXTEND(&last, len + 1);
+		if(len) {
+			memcpy(last.data, text, len);
+		}
+		last.data[len] = '\n';
+		text = last.data;
+		len++;
 	}
-	cairo_glyph_t *gl_initial = gl->data;
 
-	bool last_line = line->nmemb == 0 || line->data[line->nmemb - 1] != '\n';
-	if(last_line) {
-		ARR_EXTEND(line, 1);
-		line->data[line->nmemb - 1] = '\n';
+	// a byte is never more than one glyph, so this is never reallocated
+	if(arena) {
+		gl->nmemb = len;
+		gl->data = arena_alloc(arena, gl->nmemb, sizeof gl->data[0]);
+	} else if(len > (size_t)gl->nmemb) {
+		gl->nmemb = len;
+		gl->data = xrealloc(gl->data, gl->nmemb, sizeof gl->data[0]);
 	}
+	cairo_glyph_t *gl_initial = gl->data;
 
-	font_text_to_glyphs(font, line->data, line->nmemb,
+	font_text_to_glyphs(font, text, len,
 			&gl->data, &gl->nmemb, NULL, NULL, NULL);
-	if(gl->data != gl_initial) {
+	if(gl->data != gl_initial && !arena) {
 		free(gl_initial);
 	}
 
@@ -224,18 +460,46 @@ glyphs_from_text(glyphs_t *gl, cairo_scaled_font_t *font, string_t *line)
 		gl->data[i].x *= mat.xx;
 	}
 
-	glyphs_map(gl, line);
+	glyphs_map(gl, arena, text, len);
+	alloc_tag(tag);
+}
 
-	if(last_line) {
-		line->nmemb--;
+/* Rows break before the glyph that would cross width, or after the last
+ * blank before it. The last glyph, the newline, never starts a row. */
+static void
+glyphs_wrap(glyphs_t *gl, arena_t *arena, char *text, double width)
+{
+	gl->rows = arena_alloc(arena, gl->nmemb, sizeof gl->rows[0]);
+	gl->rows[0] = 0;
+	gl->nrows = 1;
+
+	int rs = 0;
+	int brk = 0;
+	for(int i = 0; i + 1 < gl->nmemb; i++) {
+		if(i > rs && gl->data[i + 1].x - gl->data[rs].x > width) {
+			rs = brk > rs ? brk : i;
+			gl->rows[gl->nrows++] = rs;
+		}
+		char c = text[gl->glyph_to_offset[i]];
+		if(c == ' ' || c == '\t') {
+			brk = i + 1;
+		}
 	}
 }
 
 void
 view_xy_to_address(view_t *v, int x, int y, address_t *adr)
 {
-	adr->line = clampss(view_y_to_line(v, y), 0, v->range.file->content.nmemb - 1);
-	adr->offset = view_x_to_offset(v, adr->line, x);
+	size_t row;
+	ssize_t nr = view_y_to_line(v, y, &row);
+	size_t last = v->range.file->content.nmemb - 1;
+	adr->line = clampss(nr, 0, last);
+	if(nr < 0) {
+		row = 0;
+	} else if((size_t)nr > last) {
+		row = SIZE_MAX;
+	}
+	adr->offset = view_x_to_offset(v, adr->line, row, x);
 	v->last_x = view_address_to_x(v, adr);
 }
 
@@ -258,51 +522,343 @@ toolbar_click(toolbar_t *bar, view_t *v, int x)
 	return true;
 }
 
+/* line nr as sh has it, NULL when the line changed since it was shaped,
+ * the changes are no longer kept or it was not shaped ahead yet */
+static glyphs_t *
+shaped_find(shaped_t *sh, file_t *f, cairo_scaled_font_t *font, size_t nr)
+{
+	if(!sh->nlines || sh->font != font || f->nchanges - sh->gen > FILE_CHANGES) {
+		return NULL;
+	}
+	for(uint64_t i = f->nchanges; i > sh->gen; i--) {
+		linechange_t *c = &f->changes[(i - 1) % FILE_CHANGES];
+		if(nr >= c->new_end) {
+			nr = nr - c->new_end + c->old_end;
+		} else if(nr >= c->start) {
+			return NULL;
+		}
+	}
+	if(nr < sh->first || nr >= sh->first + sh->nlines) {
+		return NULL;
+	}
+	glyphs_t *gl = &sh->lines[nr - sh->first];
+	return gl->data ? gl : NULL;
+}
+
+/* glyphs of line nr from the reshape before, from those shaped ahead or
+ * from another view of the file, so only lines that changed or came into
+ * view unforeseen are shaped */
+static glyphs_t *
+view_find_shaped(view_t *v, size_t nr)
+{
+	file_t *f = v->range.file;
+	layout_t *l = v->layout;
+	glyphs_t *gl = shaped_find(&v->prev, f, v->font, nr);
+	if(!gl) {
+		gl = shaped_find(&v->ahead, f, v->font, nr);
+	}
+	if(!gl) {
+		gl = shaped_find(&v->spare, f, v->font, nr);
+	}
+	for(size_t i = 0; !gl && i < l->views.nmemb; i++) {
+		if(l->views.data[i] != v) {
+			gl = shaped_find(&l->views.data[i]->shaped, f, v->font, nr);
+		}
+	}
+	return gl;
+}
+
+static void
+glyphs_copy(glyphs_t *gl, arena_t *arena, glyphs_t *src)
+{
+	gl->nmemb = src->nmemb;
+	gl->len = src->len;
+	gl->data = arena_alloc(arena, gl->nmemb, sizeof gl->data[0]);
+	gl->glyph_to_offset = arena_alloc(arena, gl->nmemb, sizeof gl->glyph_to_offset[0]);
+	gl->offset_to_glyph = arena_alloc(arena, gl->len, sizeof gl->offset_to_glyph[0]);
+	memcpy(gl->data, src->data, gl->nmemb * sizeof gl->data[0]);
+	memcpy(gl->glyph_to_offset, src->glyph_to_offset,
+		gl->nmemb * sizeof gl->glyph_to_offset[0]);
+	memcpy(gl->offset_to_glyph, src->offset_to_glyph,
+		gl->len * sizeof gl->offset_to_glyph[0]);
+}
+
+/* Lines of a reshape not shaped anywhere before are shaped ahead of it
+ * on the shaping threads, in batches with an arena each, and copied
+ * into the view as the reshape goes through them. */
+static struct {
+	pool_t pool;
+	file_t *file;
+	cairo_scaled_font_t *font;
+	size_t first;
+	ARRAY(size_t) todo; // lines, less first
+	ARRAY(glyphs_t) lines; // by line less first
+	ARRAY(bool) ready;
+	ARRAY(arena_t) arenas; // by batch
+	size_t nbatch; // lines i, i + nbatch... are a batch
+} shapers;
+
+/* nthreads shape, the one reshaping among them, fewer when not that many
+ * could be made; < 0 for one per processor */
+void
+view_threads(int nthreads)
+{
+	if(pool_init(&shapers.pool, nthreads < 0 ? -1 : MAX(nthreads - 1, 0)) < 0) {
+		fputs("no shaping threads, shaping on one\n", stderr);
+	}
+}
+
+void
+view_threads_free(void)
+{
+	pool_free(&shapers.pool);
+	for(size_t i = 0; i < shapers.arenas.nmemb; i++) {
+		arena_free(&shapers.arenas.data[i]);
+	}
+	ARR_FREE(&shapers.arenas);
+	ARR_FREE(&shapers.todo);
+	ARR_FREE(&shapers.lines);
+	ARR_FREE(&shapers.ready);
+}
+
+static void
+shape_batch(void *usr, size_t batch)
+{
+	(void)usr;
+	size_t nbatch = shapers.nbatch;
+	arena_t *arena = &shapers.arenas.data[batch];
+	arena_reset(arena);
+	for(size_t i = batch; i < shapers.todo.nmemb; i += nbatch) {
+		size_t k = shapers.todo.data[i];
+		istring_t *line = &shapers.file->content.data[shapers.first + k];
+		glyphs_from_text(&shapers.lines.data[k], arena, shapers.font,
+			istr_data(line), istr_len(line));
+	}
+}
+
+/* the lines from first on that the rows guessed put on screen, when more
+ * than one of them is to be shaped and there are threads to do it */
+static void
+shapers_run(view_t *v, size_t first, size_t row, ssize_t end)
+{
+	file_t *f = v->range.file;
+	wrap_t *w = &v->layout->wrap;
+	size_t n = 0;
+
+	shapers.todo.nmemb = 0;
+	shapers.ready.nmemb = 0;
+	if(!shapers.pool.nthreads) {
+		return;
+	}
+	for(; n < v->nmemb && first + n < f->content.nmemb && (ssize_t)row < end; n++) {
+		if(!view_find_shaped(v, first + n)) {
+			ARR_EXTEND(&shapers.todo, 1);
+			shapers.todo.data[shapers.todo.nmemb - 1] = n;
+		}
+		row += wrap_rows(w, first + n);
+	}
+	if(shapers.todo.nmemb < 2) {
+		return;
+	}
+
+	size_t nbatch = MIN(shapers.todo.nmemb, (size_t)shapers.pool.nthreads + 1);
+	if(shapers.arenas.nmemb < nbatch) {
+		size_t old = shapers.arenas.nmemb;
+		ARR_EXTEND(&shapers.arenas, nbatch - old);
+		memset(shapers.arenas.data + old, 0, (nbatch - old) * sizeof shapers.arenas.data[0]);
+	}
+	shapers.nbatch = nbatch;
+	if(shapers.lines.nmemb < n) {
+		ARR_EXTEND(&shapers.lines, n - shapers.lines.nmemb);
+	}
+	ARR_EXTEND(&shapers.ready, n);
+	memset(shapers.ready.data, 0, n * sizeof shapers.ready.data[0]);
+
+	shapers.file = f;
+	shapers.font = v->font;
+	shapers.first = first;
+	uint64_t t = trace_now();
+	pool_run(&shapers.pool, shape_batch, NULL, nbatch);
+	trace_event(TRACE_SHAPE, t, shapers.todo.nmemb);
+	for(size_t i = 0; i < shapers.todo.nmemb; i++) {
+		shapers.ready.data[shapers.todo.data[i]] = true;
+	}
+}
+
+static glyphs_t *
+shapers_find(size_t nr)
+{
+	if(nr < shapers.first || nr - shapers.first >= shapers.ready.nmemb ||
+			!shapers.ready.data[nr - shapers.first]) {
+		return NULL;
+	}
+	return &shapers.lines.data[nr - shapers.first];
+}
+
+/* Shapes the lines on screen and measures their rows. When the first
+ * one was a guess that turns out shorter, the top row may be in a later
+ * line by then, so it is done again from there. */
 void
 view_reshape(view_t *v)
 {
 	if(!v->nmemb) {
 		return;
 	}
-	size_t start = clampss(v->start, 0, v->range.file->content.nmemb - 1);
-	size_t end = view_clamp_start(v, v->start + v->nmemb - 1);
-	for(size_t i = start; i <= end; i++) {
-		string_t *line = &v->range.file->content.data[i];
-		glyphs_t *gl = &v->lines[i - v->start];
-		glyphs_from_text(gl, v->font, line);
+	uint64_t t = trace_now();
+	file_t *f = v->range.file;
+	wrap_t *w = view_layout(v);
+	double width = v->width - 2 * v->left_margin;
+	size_t first;
+	size_t n;
+
+	// the last shaping is kept to copy from, the one before is dropped
+	shaped_t sh = v->prev;
+	v->prev = v->shaped;
+	v->shaped = sh;
+
+	for(;;) {
+		v->start = view_clamp_start(v, v->start);
+		ssize_t end = v->start + v->nmemb;
+		size_t row;
+		first = wrap_row_to_line(w, MAX(v->start, 0), &row);
+		if(f->remote) {
+			// lines fetched are noted as changed, so rows are looked up again
+			file_fetch(f, first, first + v->nmemb);
+			view_layout(v);
+			first = wrap_row_to_line(w, MAX(v->start, 0), &row);
+		}
+		shapers_run(v, first, row, end);
+
+		arena_reset(&v->shaped.arena);
+		memset(v->shaped.lines, 0, v->nmemb * sizeof v->shaped.lines[0]);
+		for(n = 0; n < v->nmemb && first + n < f->content.nmemb && (ssize_t)row < end; n++) {
+			istring_t *line = &f->content.data[first + n];
+			glyphs_t *gl = &v->shaped.lines[n];
+			glyphs_t *src = view_find_shaped(v, first + n);
+			if(!src) {
+				src = shapers_find(first + n);
+			}
+			if(src) {
+				glyphs_copy(gl, &v->shaped.arena, src);
+			} else {
+				glyphs_from_text(gl, &v->shaped.arena, v->font,
+					istr_data(line), istr_len(line));
+			}
+			glyphs_wrap(gl, &v->shaped.arena, istr_data(line), width);
+			layout_set_rows(v->layout, v, first + n, gl->nrows);
+			row += gl->nrows;
+		}
+		shapers.ready.nmemb = 0;
+		if(wrap_row_to_line(w, MAX(view_clamp_start(v, v->start), 0), NULL) == first) {
+			break;
+		}
 	}
-	v->range.file->dirty = false;
+	v->shaped.first = first;
+	v->shaped.nlines = n;
+	v->shaped.gen = f->nchanges;
+	v->shaped.font = v->font;
+	v->top = first;
+	v->dirty = false;
+	trace_event(TRACE_RESHAPE, t, n);
 }
 
+/* Shapes the page of lines below the view and the one above while idle,
+ * measuring their rows and loading the fallback fonts they need, so
+ * paging copies them instead. Not for a backend's file: its lines would
+ * be fetched in round trips that hold up input. Stops at deadline, by
+ * trace_now; true when there is more to do. */
+bool
+view_preshape(view_t *v, uint64_t deadline)
+{
+	file_t *f = v->range.file;
+	if(!v->nmemb || !v->font || !v->shaped.nlines || v->dirty || f->remote) {
+		return false;
+	}
+	shaped_t *a = &v->ahead;
+	size_t top = v->shaped.first;
+	size_t end = top + v->shaped.nlines;
+	size_t lo = top - MIN(top, v->nmemb);
+	size_t hi = MIN(end + v->nmemb, f->content.nmemb);
+
+	if(a->first != lo || a->nlines != hi - lo || a->gen != f->nchanges || a->font != v->font) {
+		shaped_t sh = v->spare;
+		v->spare = *a;
+		*a = sh;
+		arena_reset(&a->arena);
+		a->lines = xrealloc(a->lines, MAX(hi - lo, 1), sizeof a->lines[0]);
+		memset(a->lines, 0, (hi - lo) * sizeof a->lines[0]);
+		a->first = lo;
+		a->nlines = hi - lo;
+		a->gen = f->nchanges;
+		a->font = v->font;
+		v->ahead_done = 0;
+	}
+
+	uint64_t t = trace_now();
+	wrap_t *w = view_layout(v);
+	double width = v->width - 2 * v->left_margin;
+	size_t below = hi - end;
+	size_t n = below + (top - lo);
+	size_t done = v->ahead_done;
+	for(; v->ahead_done < n && trace_now() < deadline; v->ahead_done++) {
+		size_t i = v->ahead_done;
+		size_t nr = i < below ? end + i : lo + (i - below);
+		istring_t *line = &f->content.data[nr];
+		glyphs_t *gl = &a->lines[nr - lo];
+		glyphs_t *src = view_find_shaped(v, nr);
+		if(src) {
+			glyphs_copy(gl, &a->arena, src);
+		} else {
+			glyphs_from_text(gl, &a->arena, v->font, istr_data(line), istr_len(line));
+		}
+		if(!wrap_exact(w, nr)) {
+			glyphs_wrap(gl, &a->arena, istr_data(line), width);
+			layout_set_rows(v->layout, NULL, nr, gl->nrows);
+		}
+	}
+	if(v->ahead_done > done) {
+		trace_event(TRACE_PRESHAPE, t, v->ahead_done - done);
+	}
+	return v->ahead_done < n;
+}
+
+/* a new width only marks the rows as guesses, lines are wrapped again
+ * as they are shaped; the views of a file are stacked, so they share it */
 void
 view_resize(view_t *v, int width, int height)
 {
+	if(width != v->width) {
+		v->dirty = true;
+	}
 	v->width = width;
 	v->height = height;
 	v->line_height = v->extents.ascent + v->extents.descent;
 	v->left_margin = v->extents.descent;
 
-	size_t nmemb = v->height / v->line_height;
+	size_t nmemb = MAX(v->height / v->line_height, 1);
 	if(nmemb == v->nmemb) {
 		return;
 	}
 
-	for(size_t i = nmemb; i < v->nmemb; i++) {
-		free(v->lines[i].data);
-		free(v->lines[i].glyph_to_offset);
-		free(v->lines[i].offset_to_glyph);
-	}
-	v->lines = xrealloc(v->lines, nmemb, sizeof v->lines[0]);
+	v->shaped.lines = xrealloc(v->shaped.lines, nmemb, sizeof v->shaped.lines[0]);
+	v->prev.lines = xrealloc(v->prev.lines, nmemb, sizeof v->prev.lines[0]);
 	for(size_t i = v->nmemb; i < nmemb; i++) {
-		memset(v->lines + i, 0, sizeof v->lines[0]);
+		memset(v->shaped.lines + i, 0, sizeof v->shaped.lines[0]);
+		memset(v->prev.lines + i, 0, sizeof v->prev.lines[0]);
 	}
-
-	size_t view_end = view_clamp_start(v, v->start + v->nmemb - 1);
+	v->shaped.nlines = MIN(v->shaped.nlines, nmemb);
+	v->prev.nlines = MIN(v->prev.nlines, nmemb);
+
+	wrap_t *w = view_layout(v);
+	size_t last = v->range.file->content.nmemb - 1;
+	ssize_t view_start = MIN(wrap_row_to_line(w, MAX(v->start, 0), NULL), last);
+	size_t view_end = MIN(wrap_row_to_line(w,
+		MAX(v->start + (ssize_t)v->nmemb - 1, 0), NULL), last);
 	size_t pivot;
-	ssize_t vis_sel_start = v->start;
+	ssize_t vis_sel_start = view_start;
 	ssize_t vis_sel_end = view_end;
-	if(v->range.start.line <= view_end && (ssize_t)v->range.end.line >= v->start) {
-		if((ssize_t)v->range.start.line > v->start) {
+	if(v->range.start.line <= view_end && (ssize_t)v->range.end.line >= view_start) {
+		if((ssize_t)v->range.start.line > view_start) {
 			vis_sel_start = v->range.start.line;
 		}
 		if(v->range.end.line < view_end) {
@@ -320,7 +876,7 @@ pivot, pivot, v->start, nmemb, v->nmemb, pivot - (pivot - v->start) * nmemb / v-
 	}
 	*/
 
-	v->range.file->dirty = true;
+	v->dirty = true;
 	v->nmemb = nmemb;
 	view_set_start(v, pivot);
 }
@@ -329,6 +885,12 @@ bool
 view_keybinds(view_t *v, KeySym keysym)
 {
 	switch(keysym) {
+	case XK_Tab:
+		if(v->range.start.line == v->range.end.line) {
+			return false;
+		}
+		command_indent(v);
+		break;
 	case XK_F2:
 		command_undo(v);
 		break;
@@ -394,6 +956,34 @@ view_keypress(view_t *v, KeySym keysym, char *buf, size_t len)
 	return true;
 }
 
+/* keys that only move the cursor or the view, autorepeat queues them
+ * faster than frames are drawn */
+bool
+view_navigation_key(KeySym keysym)
+{
+	switch(keysym) {
+	case XK_Left: case XK_Right: case XK_Up: case XK_Down:
+	case XK_Page_Up: case XK_Page_Down:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* a navigation key pressed count times, for one frame */
+void
+view_navigate(view_t *v, KeySym keysym, int count)
+{
+	if(keysym == XK_Page_Up || keysym == XK_Page_Down) {
+		view_move_start(v, (keysym == XK_Page_Up ? -count : count) * (ssize_t)v->nmemb);
+	} else {
+		for(int i = 0; i < count; i++) {
+			view_keybinds(v, keysym);
+		}
+	}
+	view_hide_toolbar(v, &v->selbar_wrap, v->range.start.line);
+}
+
 static int scroll_y = 0;
 static bool selecting;
 static address_t anchor;
@@ -403,30 +993,30 @@ view_mouse_press(view_t *v, unsigned int btn, int x, int y)
 {
 	switch(btn) {
 	case Button1: {
-		ssize_t nr = view_y_to_line(v, y);
-		int corr = 0;
+		// the toolbar takes a row above its line
+		int below = 0;
 		if(v->selbar_wrap.visible) {
-			if(nr == (ssize_t)v->selbar_wrap.line) {
+			double bar_y = view_line_to_y(v, v->selbar_wrap.line);
+			if(y >= bar_y && y < bar_y + v->line_height) {
 				// FIXME: what if I don't want to hide toolbar?
 				if(toolbar_click(&v->selbar_wrap.bar, v, x)) {
 					// FIXME: should I call view_hide_toolbar?
 					v->selbar_wrap.visible = false;
-					v->range.file->dirty = true;
+					v->dirty = true;
 				}
 				return true;
-			} else if(nr > (ssize_t)v->selbar_wrap.line) {
-				corr = -1;
+			} else if(y >= bar_y + v->line_height) {
+				y -= v->line_height;
+				below = 1;
 			}
 		}
 
 		selecting = true;
-		anchor.line = clampss(nr + corr, 0, v->range.file->content.nmemb - 1);
-		anchor.offset = view_x_to_offset(v, anchor.line, x);
-		v->last_x = view_address_to_x(v, &anchor);
+		view_xy_to_address(v, x, y, &anchor);
 		v->range.start = anchor;
 		v->range.end = anchor;
 
-		view_hide_toolbar(v, &v->selbar_wrap, nr);
+		view_hide_toolbar(v, &v->selbar_wrap, anchor.line + below);
 		return true;
 		break;
 	}
@@ -3,6 +3,9 @@ typedef struct {
 	int nmemb;
 	size_t *glyph_to_offset;
 	int *offset_to_glyph;
+	size_t len; // of the text shaped
+	int *rows; // first glyph of each visual row
+	int nrows;
 } glyphs_t;
 
 typedef struct {
@@ -20,7 +23,29 @@ typedef struct {
 	toolbar_t bar;
 } toolbar_wrap_t;
 
+struct view_t;
+
+/* What the views of one file share: the wrap index, at their width, and
+ * through them the lines each of them has shaped. */
+typedef struct {
+	file_t *file;
+	wrap_t wrap;
+	int width; // wrapped at
+	ARRAY(struct view_t *) views;
+	rangearray_t *marks; // highlighted, in file order, as found by FindAll
+} layout_t;
+
+/* lines shaped in one reshape, from line first on */
 typedef struct {
+	glyphs_t *lines;
+	size_t first;
+	size_t nlines;
+	uint64_t gen; // file changes made before
+	cairo_scaled_font_t *font;
+	arena_t arena;
+} shaped_t;
+
+typedef struct view_t {
 	int width;
 	int height;
 	cairo_font_extents_t extents;
@@ -29,14 +54,24 @@ typedef struct {
 	cairo_scaled_font_t *font;
 
 	range_t range;
+	uint64_t range_gen; // file changes range was moved through
+	layout_t *layout;
 	int last_x;
-	ssize_t start;
-	glyphs_t *lines;
-	size_t nmemb;
+	ssize_t start; // visual row at the top
+	size_t top; // line of that row, kept through edits
+	size_t nmemb; // rows on screen
+	bool dirty; // to be shaped again, as is a view behind the file
+	shaped_t shaped;
+	shaped_t prev; // by the reshape before, lines still valid are copied
+	shaped_t ahead; // the pages above and below, shaped when idle
+	shaped_t spare; // ahead before it moved, still copied from
+	size_t ahead_done; // lines of ahead gone through
 	toolbar_wrap_t selbar_wrap;
 } view_t;
 
-void glyphs_from_text(glyphs_t *gl, cairo_scaled_font_t *font, string_t *line);
+void glyphs_from_text(glyphs_t *gl, arena_t *arena, cairo_scaled_font_t *font,
+		char *text, size_t len);
+int glyphs_row(glyphs_t *gl, int gi);
 
 bool toolbar_click(toolbar_t *bar, view_t *v, int x);
 
@@ -44,6 +79,8 @@ void view_hide_toolbar(view_t *v, toolbar_wrap_t *bar_wrap, size_t line);
 
 bool view_keybinds(view_t *v, KeySym keysym);
 bool view_keypress(view_t *v, KeySym keysym, char *buf, size_t len);
+bool view_navigation_key(KeySym keysym);
+void view_navigate(view_t *v, KeySym keysym, int count);
 bool view_mouse_motion(view_t *v, unsigned int state, int x, int y, int relx, int rely);
 bool view_mouse_press(view_t *v, unsigned int btn, int x, int y);
 bool view_mouse_release(view_t *v, unsigned int btn, int x, int y);
@@ -54,13 +91,24 @@ void view_move_address(view_t *v, address_t *adr, int move);
 bool view_move_start(view_t *v, ssize_t move);
 void view_set_start(view_t *v, size_t nr);
 
+wrap_t *view_layout(view_t *v);
 glyphs_t *view_get_glyphs(view_t *v, size_t nr);
 ssize_t view_clamp_start(view_t *v, ssize_t nr);
 double view_address_to_x(view_t *v, address_t *adr);
 double view_line_to_y(view_t *v, size_t nr);
-size_t view_x_to_offset(view_t *v, size_t nr, int x);
+size_t view_x_to_offset(view_t *v, size_t nr, size_t row, int x);
 void view_xy_to_address(view_t *v, int x, int y, address_t *adr);
-ssize_t view_y_to_line(view_t *v, int y);
+ssize_t view_y_to_line(view_t *v, int y, size_t *row);
+
+void layout_init(layout_t *l, file_t *f);
+void layout_free(layout_t *l);
+void view_attach(view_t *v, layout_t *l);
+void view_detach(view_t *v);
+void view_free(view_t *v);
+bool view_stale(view_t *v);
 
 void view_resize(view_t *v, int width, int height);
 void view_reshape(view_t *v);
+void view_threads(int nthreads);
+void view_threads_free(void);
+bool view_preshape(view_t *v, uint64_t deadline);
@@ -1,12 +1,17 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <locale.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -15,6 +20,7 @@
 #include <X11/keysym.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
 
 #include <cairo/cairo.h>
 #include <cairo/cairo-xlib.h>
@@ -24,38 +30,45 @@
 
 #include "utf.h"
 #include "font.h"
+#include "re.h"
 #include "edit.h"
+#include "search.h"
+#include "isearch.h"
+#include "proto.h"
+#include "remote.h"
+#include "backend.h"
+#include "follow.h"
+#include "wrap.h"
 #include "view.h"
+#include "draw.h"
 #include "window.h"
 #include "pipe.h"
 #include "command.h"
+#include "filter.h"
+#include "trace.h"
+#include "alloc.h"
+
+/* an open file, with the layout shared by the views of it */
+typedef struct {
+	file_t file;
+	layout_t layout;
+	char *filename;
+	remote_t *remote; // the file is a backend's, see remote.c
+	follow_t *follow; // the file is read as it grows
+	search_t *search; // of FindAll, its matches are marked
+	re_t search_re;
+	int search_quiet; // timerfd, fires when edits stopped for a while
+} doc_t;
 
 static control_t *g_control;
+static string_t snarf; // of Copy and Cut, the clipboard while the window owns it
 
-static file_t file;
-static view_wrap_t view_wrap = {
-	.view.range.file = &file
-};
+static ARRAY(doc_t *) docs;
 static window_t win = {
 	.width = 800,
-	.height = 600,
-	.view_wrap = &view_wrap
+	.height = 600
 };
 
-/*
-typedef struct {
-	size_t line_idx;
-	size_t offset;
-	double width;
-} vis_to_line_t;
-
-typedef struct {
-	double width;
-	size_t vis_first_idx;
-} line_to_vis_t;
-*/
-
-
 int
 selection_recv(control_t *control, void *usr, string_t *buf, size_t len)
 {
@@ -74,6 +87,7 @@ control_recv(control_t *control, void *usr, string_t *buf, size_t len)
 {
 	static const char disregard_str[] = "disregard";
 	static const char finish_str[] = "finish";
+	static const char trace_str[] = "trace";
 
 	(void)usr;
 	if(!len) {
@@ -95,6 +109,8 @@ control_recv(control_t *control, void *usr, string_t *buf, size_t len)
 			if(control->pipe.write_end) {
 				control->pipe.done = true;
 			}
+		} else if(is_str_eq(line_start, line_len, trace_str, sizeof trace_str - 1)) {
+			trace_dump(TRACE_FILE);
 		} else {
 			fprintf(stderr, "unknown ctl command: '%.*s'\n", (int)line_len, line_start);
 		}
@@ -130,34 +146,882 @@ selection_send(control_t *control, void *usr, string_t *buf, size_t len)
 	return 0;
 }
 
+static void
+selection_to_string(range_t rng, string_t *s)
+{
+	size_t len;
+	do {
+		size_t start = s->nmemb;
+		ARR_EXTEND(s, BUFSIZ);
+		len = range_copy(&rng, s->data + start, BUFSIZ);
+		s->nmemb = start + len;
+	} while(len == BUFSIZ);
+}
+
+static int
+builtin_filter(char *cmd)
+{
+	enum { MAX_ARGS = 16 };
+	char *argv[MAX_ARGS + 1];
+	int argc = 0;
+
+	size_t namelen = strcspn(cmd, " \t");
+	const filter_t *f = filter_find(cmd, namelen);
+	if(!f) {
+		return 0;
+	}
+
+	string_t args = {0};
+	ARR_RESIZE(&args, strlen(cmd) + 1);
+	memcpy(args.data, cmd, args.nmemb);
+	for(char *tok = strtok(args.data, " \t"); tok && argc < MAX_ARGS;
+			tok = strtok(NULL, " \t")) {
+		argv[argc++] = tok;
+	}
+	argv[argc] = NULL;
+
+	string_t in = {0};
+	string_t out = {0};
+	range_t *rng = &win.focus->view.range;
+	selection_to_string(*rng, &in);
+	int ret = filter_run(f, &out, in.data, in.nmemb, argc, argv);
+	if(!ret) {
+		range_push(rng, out.data, out.nmemb, OP_Replace);
+	}
+	ARR_FREE(&args);
+	ARR_FREE(&in);
+	ARR_FREE(&out);
+	return ret < 0 ? -1 : 1;
+}
+
+static doc_t *
+doc_of(view_t *v)
+{
+	for(size_t i = 0; i < docs.nmemb; i++) {
+		if(&docs.data[i]->layout == v->layout) {
+			return docs.data[i];
+		}
+	}
+	return NULL;
+}
+
+/* the backend saves its own file, a round trip */
+static int
+remote_save_doc(doc_t *d, char *fname)
+{
+	ssize_t len = remote_save(d->remote, *fname ? fname : NULL);
+	if(len < 0) {
+		fprintf(stderr, "Save: %s\n", strerror(errno));
+	} else {
+		fprintf(stderr, "Save: %zd bytes on the backend\n", len);
+	}
+	return 1;
+}
+
+/* written on a thread, see file_save_start */
+static int
+builtin_save(char *args)
+{
+	doc_t *d = doc_of(&win.focus->view);
+
+	args += strspn(args, " \t");
+	if(d->remote) {
+		return remote_save_doc(d, args);
+	}
+	if(*args) {
+		free(d->filename);
+		d->filename = strdup(args);
+		DIEIF(!d->filename);
+	}
+	if(!d->filename) {
+		fprintf(stderr, "Save: no file name\n");
+		return 1;
+	}
+	if(file_save_start(&d->file, d->filename) < 0) {
+		fprintf(stderr, "Save: %s\n", errno == EBUSY ?
+			"previous one is still running" : strerror(errno));
+	}
+	return 1;
+}
+
+static void
+file_report(file_t *f, char *fname)
+{
+	fprintf(stderr, "file lines: %zu\n", f->content.nmemb);
+	ssize_t bad = file_check_utf8(f);
+	if(bad >= 0) {
+		fprintf(stderr, "%s: not UTF-8 from line %zd\n", fname, bad + 1);
+	}
+}
+
+static int
+file_read(file_t *f, char *fname)
+{
+	int fd = open(fname, O_RDONLY);
+	if(fd < 0) {
+		return -1;
+	}
+	int ret = range_read(&(range_t){.file = f}, fd);
+	if(!ret) {
+		file_track(f, fname, fd);
+	}
+	close(fd);
+	file_report(f, fname);
+	return ret;
+}
+
+/* a file already open is shared, one that does not exist yet is empty */
+static doc_t *
+doc_open(char *fname)
+{
+	for(size_t i = 0; fname && i < docs.nmemb; i++) {
+		if(docs.data[i]->filename && !strcmp(docs.data[i]->filename, fname)) {
+			return docs.data[i];
+		}
+	}
+
+	doc_t *d = xmalloc(1, sizeof *d);
+	memset(d, 0, sizeof *d);
+	file_insert_line(&d->file, 0, "", 0);
+	if(fname && file_read(&d->file, fname) < 0 && errno != ENOENT) {
+		perror(fname);
+		file_free(&d->file);
+		free(d);
+		return NULL;
+	}
+	if(fname) {
+		d->filename = strdup(fname);
+		DIEIF(!d->filename);
+	}
+	layout_init(&d->layout, &d->file);
+	ARR_EXTEND(&docs, 1);
+	docs.data[docs.nmemb - 1] = d;
+	return d;
+}
+
+/* cmd runs a backend with the file, as "ssh host werf -s file" */
+static doc_t *
+doc_open_remote(char *cmd)
+{
+	doc_t *d = xmalloc(1, sizeof *d);
+	memset(d, 0, sizeof *d);
+	d->remote = xmalloc(1, sizeof *d->remote);
+	file_insert_line(&d->file, 0, "", 0);
+	if(remote_spawn(d->remote, &d->file, cmd) < 0) {
+		perror(cmd);
+		file_free(&d->file);
+		free(d->remote);
+		free(d);
+		return NULL;
+	}
+	layout_init(&d->layout, &d->file);
+	ARR_EXTEND(&docs, 1);
+	docs.data[docs.nmemb - 1] = d;
+	return d;
+}
+
+/* only marked, a watch's ready may remove watches while window_run
+ * walks them; it drops them afterwards */
+static void
+watch_remove(int fd)
+{
+	for(size_t i = 0; i < win.watches.nmemb; i++) {
+		if(win.watches.data[i].fd == fd) {
+			win.watches.data[i].fd = -1;
+			break;
+		}
+	}
+}
+
+static void
+doc_unfollow(doc_t *d)
+{
+	watch_remove(d->follow->notify);
+	follow_close(d->follow);
+	free(d->follow);
+	d->follow = NULL;
+}
+
+/* Views that showed the end of the file scroll to show its new end. When
+ * it was read again from the start, views start over at its top. */
+static bool
+doc_grew(void *usr)
+{
+	static ARRAY(view_t *) tail;
+	doc_t *d = usr;
+	layout_t *l = &d->layout;
+
+	tail.nmemb = 0;
+	for(size_t i = 0; i < l->views.nmemb; i++) {
+		view_t *v = l->views.data[i];
+		if(v->start + (ssize_t)v->nmemb >= (ssize_t)wrap_total(view_layout(v))) {
+			ARR_EXTEND(&tail, 1);
+			tail.data[tail.nmemb - 1] = v;
+		}
+	}
+
+	int ret = follow_update(d->follow);
+	if(ret < 0) {
+		perror(d->filename);
+		doc_unfollow(d);
+		return false;
+	}
+	if(ret == FOLLOW_SAME) {
+		return false;
+	}
+	for(size_t i = 0; ret == FOLLOW_RESET && i < l->views.nmemb; i++) {
+		view_t *v = l->views.data[i];
+		v->start = 0;
+		v->top = 0;
+		v->range = (range_t){.file = &d->file};
+		v->selbar_wrap.visible = false;
+		v->dirty = true;
+	}
+	for(size_t i = 0; i < tail.nmemb; i++) {
+		view_set_start(tail.data[i], d->file.content.nmemb - 1);
+	}
+	return true;
+}
+
+/* fname is read as it grows, its views follow its end */
+static doc_t *
+doc_open_follow(char *fname)
+{
+	doc_t *d = xmalloc(1, sizeof *d);
+	memset(d, 0, sizeof *d);
+	d->follow = xmalloc(1, sizeof *d->follow);
+	file_insert_line(&d->file, 0, "", 0);
+	if(follow_open(d->follow, &d->file, fname) < 0) {
+		perror(fname);
+		file_free(&d->file);
+		free(d->follow);
+		free(d);
+		return NULL;
+	}
+	file_report(&d->file, fname);
+	d->filename = strdup(fname);
+	DIEIF(!d->filename);
+	layout_init(&d->layout, &d->file);
+	ARR_EXTEND(&win.watches, 1);
+	win.watches.data[win.watches.nmemb - 1] = (watch_t){d->follow->notify, doc_grew, d};
+	ARR_EXTEND(&docs, 1);
+	docs.data[docs.nmemb - 1] = d;
+	return d;
+}
+
+static void
+doc_unsearch(doc_t *d)
+{
+	if(!d->search) {
+		return;
+	}
+	watch_remove(d->search->fd[0]);
+	watch_remove(d->search_quiet);
+	close(d->search_quiet);
+	search_cancel(d->search);
+	free(d->search);
+	d->search = NULL;
+	re_free(&d->search_re);
+	d->file.changing = NULL;
+	d->file.changing_usr = NULL;
+	d->layout.marks = NULL;
+}
+
+enum { SEARCH_QUIET = 250 }; // ms without edits before FindAll starts over
+
+/* the threads of FindAll do not read the file while it changes; they
+ * start over once edits stopped coming for SEARCH_QUIET, so typing does
+ * not search the whole file on every key */
+static void
+doc_changing(void *usr)
+{
+	doc_t *d = usr;
+	search_stop(d->search);
+	struct itimerspec quiet = {.it_value = {0, SEARCH_QUIET * 1000000L}};
+	timerfd_settime(d->search_quiet, 0, &quiet, NULL);
+}
+
+/* matches came in, or the search stopped for an edit */
+static bool
+doc_found(void *usr)
+{
+	doc_t *d = usr;
+	search_t *s = d->search;
+	size_t n = s->hits.nmemb;
+	bool done;
+
+	bool was_done = s->stitched == s->npart;
+	search_collect(s, &done);
+	if(done && !was_done) {
+		fprintf(stderr, "FindAll: %zu matches\n", s->hits.nmemb);
+	}
+	return s->hits.nmemb != n || s->gen != d->file.nchanges;
+}
+
+static bool
+doc_quiet(void *usr)
+{
+	doc_t *d = usr;
+	uint64_t n;
+	if(read(d->search_quiet, &n, sizeof n) < 0 || d->search->gen == d->file.nchanges) {
+		return false;
+	}
+	if(search_restart(d->search) < 0) {
+		perror("FindAll");
+		doc_unsearch(d);
+	}
+	return true;
+}
+
+static void
+doc_close(doc_t *d)
+{
+	for(size_t i = 0; i < docs.nmemb; i++) {
+		if(docs.data[i] == d) {
+			ARR_FRAG_SHIFT(&docs, i + 1, docs.nmemb, -1);
+			ARR_SHRINK(&docs, 1);
+			break;
+		}
+	}
+	if(d->remote) {
+		remote_close(d->remote);
+		free(d->remote);
+	}
+	if(d->follow) {
+		doc_unfollow(d);
+	}
+	doc_unsearch(d);
+	layout_free(&d->layout);
+	file_free(&d->file);
+	free(d->filename);
+	free(d);
+}
+
+/* The "..." button of the selection toolbar is a command line once
+ * clicked: keys go to it and Enter runs what was typed. Typed as
+ * "Find text", each key selects the match of text nearest after the
+ * selection it was opened with, refined from the matches of the text
+ * one key shorter. Lines out of view are scanned for them between
+ * events, while the watch on wake is there. */
+static struct {
+	view_t *view; // the entry was opened in, NULL when it is closed
+	button_t *btn;
+	string_t text; // typed, NUL terminated
+	range_t origin; // selection when it was opened
+	uint64_t gen; // file changes origin was moved through
+	isearch_t isearch; // of what follows "Find "
+	bool scanning;
+	int wake[2]; // holds a byte, so it is always ready
+} entry = {.wake = {-1, -1}};
+static cairo_scaled_font_t *bar_font; // of the toolbars
+
+enum { ENTRY_SLICE = 2000000 }; // ns of scanning between looks for events
+
+static void
+entry_show(void)
+{
+	char *text = entry.text.nmemb ? entry.text.data : "...";
+	glyphs_from_text(&entry.btn->glyphs, NULL, bar_font, text, strlen(text));
+}
+
+/* the match nearest after origin, origin without one; true when the
+ * selection moved */
+static bool
+entry_select(void)
+{
+	view_t *v = entry.view;
+	range_follow(&entry.origin, &entry.gen);
+	range_t rng = entry.origin;
+	isearch_next(&entry.isearch, &entry.origin.end, &rng);
+	if(!address_cmp(&rng.start, &v->range.start) && !address_cmp(&rng.end, &v->range.end)) {
+		return false;
+	}
+	v->range = rng;
+	v->last_x = view_address_to_x(v, &v->range.start);
+	return true;
+}
+
+static bool
+entry_scan(void *usr)
+{
+	(void)usr;
+	uint64_t deadline = trace_now() + ENTRY_SLICE;
+	bool done;
+	do {
+		done = isearch_scan(&entry.isearch, 256);
+	} while(!done && trace_now() < deadline);
+	if(done) {
+		watch_remove(entry.wake[0]);
+		entry.scanning = false;
+	}
+	return entry_select();
+}
+
+static void
+entry_wake(void)
+{
+	if(entry.scanning || isearch_scan(&entry.isearch, 0)) {
+		return;
+	}
+	ARR_EXTEND(&win.watches, 1);
+	win.watches.data[win.watches.nmemb - 1] = (watch_t){entry.wake[0], entry_scan, NULL};
+	entry.scanning = true;
+}
+
+/* back to "...", with the selection it was opened with unless it goes
+ * with the view */
+static void
+entry_close(bool restore)
+{
+	if(!entry.view) {
+		return;
+	}
+	if(restore) {
+		range_follow(&entry.origin, &entry.gen);
+		entry.view->range = entry.origin;
+		entry.view->last_x = view_address_to_x(entry.view, &entry.view->range.start);
+	}
+	if(entry.scanning) {
+		watch_remove(entry.wake[0]);
+		entry.scanning = false;
+	}
+	isearch_free(&entry.isearch);
+	entry.text.nmemb = 0;
+	entry_show();
+	entry.view = NULL;
+}
+
+/* A new view of d below the focused one, where the focused one is
+ * when it shows d too. The toolbar buttons are shared. */
+static view_wrap_t *
+pane_open(doc_t *d)
+{
+	view_wrap_t *vw = xmalloc(1, sizeof *vw);
+	memset(vw, 0, sizeof *vw);
+	view_attach(&vw->view, &d->layout);
+
+	size_t at = 0;
+	if(win.focus) {
+		view_t *v = &win.focus->view;
+		vw->view.selbar_wrap.bar = v->selbar_wrap.bar;
+		if(v->layout == &d->layout) {
+			vw->view.start = v->start;
+			vw->view.top = v->top;
+			vw->view.range = v->range;
+			vw->view.range_gen = v->range_gen;
+		}
+		while(win.views.data[at] != win.focus) {
+			at++;
+		}
+		at++;
+	}
+	ARR_EXTEND(&win.views, 1);
+	ARR_FRAG_SHIFT(&win.views, at, win.views.nmemb - 1, 1);
+	win.views.data[at] = vw;
+	win.focus = vw;
+	return vw;
+}
+
+/* The last view stays, a file goes with its last view. The view itself
+ * is freed on the next close, a click on its toolbar may be running it. */
+static void
+pane_close(view_wrap_t *vw)
+{
+	static view_wrap_t *closed;
+
+	if(closed) {
+		view_free(&closed->view);
+		free(closed);
+		closed = NULL;
+	}
+	if(!vw || win.views.nmemb < 2) {
+		return;
+	}
+	if(entry.view == &vw->view) {
+		entry_close(false);
+	}
+	size_t at = 0;
+	while(win.views.data[at] != vw) {
+		at++;
+	}
+	ARR_FRAG_SHIFT(&win.views, at + 1, win.views.nmemb, -1);
+	ARR_SHRINK(&win.views, 1);
+	if(win.focus == vw) {
+		win.focus = win.views.data[MIN(at, win.views.nmemb - 1)];
+	}
+
+	doc_t *d = doc_of(&vw->view);
+	view_detach(&vw->view);
+	if(!d->layout.views.nmemb) {
+		doc_close(d);
+	}
+	closed = vw;
+}
+
+/* "Open file" shows file in a new view, bare "Open" the file named by
+ * the selected text */
+static int
+builtin_open(char *args)
+{
+	string_t name = {0};
+
+	args += strspn(args, " \t");
+	if(*args) {
+		ARR_RESIZE(&name, strlen(args) + 1);
+		memcpy(name.data, args, name.nmemb);
+	} else {
+		selection_to_string(win.focus->view.range, &name);
+		if(!name.nmemb) {
+			return 1;
+		}
+		ARR_EXTEND(&name, 1);
+		name.data[name.nmemb - 1] = '\0';
+	}
+	doc_t *d = doc_open(name.data);
+	ARR_FREE(&name);
+	if(d) {
+		pane_open(d);
+		window_layout(&win);
+	}
+	return 1;
+}
+
+/* "Find re" selects next match of re, bare "Find" next occurrence of
+ * the selected text, "FindPrev" the one before the selection; flags are
+ * for re_compile, RE_LITERAL for text typed into the entry */
+static int
+builtin_find(char *args, int flags, bool backward)
+{
+	view_t *v = &win.focus->view;
+	string_t sel = {0};
+	re_t re;
+	int ret;
+
+	args += strspn(args, " \t");
+	if(*args) {
+		ret = re_compile(&re, args, strlen(args), flags);
+	} else {
+		selection_to_string(v->range, &sel);
+		if(!sel.nmemb) {
+			return 1;
+		}
+		ret = re_compile(&re, sel.data, sel.nmemb, RE_LITERAL);
+		ARR_FREE(&sel);
+	}
+	if(ret < 0) {
+		fprintf(stderr, "Find: %s\n", re.err);
+		return 1;
+	}
+	command_find(v, &re, backward);
+	re_free(&re);
+	return 1;
+}
+
+/* "FindAll re" marks every match of re, bare "FindAll" of the selected
+ * text. They are found on threads and marked as they come in, and found
+ * again after the file changes. Another FindAll replaces them, one with
+ * nothing to find clears them. */
+static int
+builtin_findall(char *args)
+{
+	view_t *v = &win.focus->view;
+	doc_t *d = doc_of(v);
+	string_t sel = {0};
+	re_t re;
+	int ret;
+
+	doc_unsearch(d);
+	if(d->remote) {
+		fprintf(stderr, "FindAll: not on a backend's file\n");
+		return 1;
+	}
+	args += strspn(args, " \t");
+	if(*args) {
+		ret = re_compile(&re, args, strlen(args), 0);
+	} else {
+		selection_to_string(v->range, &sel);
+		if(!sel.nmemb) {
+			return 1;
+		}
+		ret = re_compile(&re, sel.data, sel.nmemb, RE_LITERAL);
+		ARR_FREE(&sel);
+	}
+	if(ret < 0) {
+		fprintf(stderr, "FindAll: %s\n", re.err);
+		return 1;
+	}
+
+	d->search_re = re;
+	d->search = xmalloc(1, sizeof *d->search);
+	d->search_quiet = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(d->search_quiet < 0 || search_start(d->search, &d->file, &d->search_re, 0) < 0) {
+		perror("FindAll");
+		if(d->search_quiet >= 0) {
+			close(d->search_quiet);
+		}
+		free(d->search);
+		d->search = NULL;
+		re_free(&d->search_re);
+		return 1;
+	}
+	d->file.changing = doc_changing;
+	d->file.changing_usr = d;
+	d->layout.marks = &d->search->hits;
+	ARR_EXTEND(&win.watches, 1);
+	win.watches.data[win.watches.nmemb - 1] = (watch_t){d->search->fd[0], doc_found, d};
+	ARR_EXTEND(&win.watches, 1);
+	win.watches.data[win.watches.nmemb - 1] = (watch_t){d->search_quiet, doc_quiet, d};
+	return 1;
+}
+
+/* "Next" selects the match of FindAll after the selection, "Prev" the
+ * one before it, around the end of the file; without FindAll matches
+ * they are bare Find and FindPrev */
+static int
+builtin_next(bool backward)
+{
+	view_t *v = &win.focus->view;
+	search_t *s = doc_of(v)->search;
+	if(!s || !s->hits.nmemb) {
+		return builtin_find("", 0, backward);
+	}
+	ssize_t i = backward ? search_prev(s, &v->range.start) : search_next(s, &v->range.end);
+	if(i < 0) {
+		i = backward ? (ssize_t)s->hits.nmemb - 1 : 0;
+	}
+	v->range = s->hits.data[i];
+	v->last_x = view_address_to_x(v, &v->range.start);
+	return 1;
+}
+
+/* what follows "Find " in the entry, NULL when it is not a Find */
+static char *
+entry_query(void)
+{
+	char *text = entry.text.data;
+	if(strncmp("Find", text, 4) || !text[4] || !strchr(" \t", text[4])) {
+		return NULL;
+	}
+	return text + 4 + strspn(text + 4, " \t");
+}
+
+/* brings the entry's isearch to what follows "Find " in it, popping and
+ * pushing only where the two differ */
+static void
+entry_refine(void)
+{
+	view_t *v = entry.view;
+	isearch_t *s = &entry.isearch;
+	char *q = entry_query();
+	if(!q || doc_of(v)->remote) {
+		q = "";
+	}
+	size_t len = strlen(q);
+	size_t same = 0;
+	while(same < s->query.nmemb && same < len && s->query.data[same] == q[same]) {
+		same++;
+	}
+	while(s->query.nmemb > same) {
+		isearch_pop(s);
+	}
+	ssize_t last = view_y_to_line(v, v->height - 1, NULL);
+	for(; same < len; same++) {
+		isearch_push(s, q[same], v->top, MAX(last, (ssize_t)v->top));
+	}
+	entry_wake();
+	entry_select();
+}
+
+int handle_command(char *cmd);
+
+/* Enter, or a click on the entry: what was typed runs as from a button
+ * of the view it was typed in. A Find is of the text as typed, from the
+ * selection before it, so it selects the match the entry showed. */
+static void
+entry_run(void)
+{
+	char *cmd = entry.text.nmemb ? strdup(entry.text.data) : NULL;
+	DIEIF(entry.text.nmemb && !cmd);
+	char *query = cmd && entry_query() ? cmd + (entry_query() - entry.text.data) : NULL;
+	for(size_t i = 0; i < win.views.nmemb; i++) {
+		if(&win.views.data[i]->view == entry.view) {
+			win.focus = win.views.data[i];
+		}
+	}
+	entry_close(true);
+	if(query) {
+		builtin_find(query, RE_LITERAL, false);
+	} else if(cmd) {
+		handle_command(cmd);
+	}
+	free(cmd);
+}
+
+/* "..." opens the entry, keeping the toolbar shown for it */
+static int
+entry_click(void)
+{
+	view_t *v = &win.focus->view;
+	toolbar_t *bar = &v->selbar_wrap.bar;
+
+	if(entry.view) {
+		entry_run();
+		return 1;
+	}
+	entry.btn = NULL;
+	for(size_t i = 0; i < bar->buttons.nmemb; i++) {
+		if(!strcmp("...", bar->buttons.data[i].label.data)) {
+			entry.btn = &bar->buttons.data[i];
+		}
+	}
+	if(!entry.btn || !bar_font) {
+		return 1;
+	}
+	if(entry.wake[0] < 0) {
+		if(pipe(entry.wake) < 0 || write(entry.wake[1], "", 1) < 0) {
+			perror("entry");
+			return 1;
+		}
+		fcntl(entry.wake[0], F_SETFD, FD_CLOEXEC);
+		fcntl(entry.wake[1], F_SETFD, FD_CLOEXEC);
+	}
+	entry.view = v;
+	entry.origin = v->range;
+	entry.gen = v->range_gen;
+	entry.text.nmemb = 0;
+	isearch_init(&entry.isearch, &doc_of(v)->file);
+	return 0;
+}
+
+/* keys while the entry is open go to it, called before anything else
+ * sees them; Escape closes it rather than the window */
+bool
+entry_keypress(KeySym keysym, char *buf, size_t len)
+{
+	if(!entry.view) {
+		return false;
+	}
+	switch(keysym) {
+	case XK_Escape:
+		entry_close(true);
+		return true;
+	case XK_Return:
+	case XK_KP_Enter:
+		entry_run();
+		return true;
+	case XK_BackSpace:
+		// a whole UTF-8 sequence
+		while(entry.text.nmemb && (entry.text.data[entry.text.nmemb - 1] & 0xC0) == 0x80) {
+			entry.text.nmemb--;
+		}
+		if(entry.text.nmemb) {
+			entry.text.nmemb--;
+		}
+		break;
+	default:
+		if(!len || (uchar)buf[0] < ' ' || buf[0] == 0x7f) {
+			return true;
+		}
+		ARR_EXTEND(&entry.text, len);
+		memcpy(entry.text.data + entry.text.nmemb - len, buf, len);
+	}
+	ARR_EXTEND(&entry.text, 1);
+	entry.text.data[--entry.text.nmemb] = '\0';
+	entry_refine();
+	entry_show();
+	return true;
+}
+
+/* another program's text for Paste, see window_clipboard_request */
+void
+paste_text(char *buf, size_t len)
+{
+	range_push(&win.focus->view.range, buf, len, OP_Replace);
+}
+
 int
 builtin_command(char *cmd)
 {
+	range_t *rng = &win.focus->view.range;
+
 	if(!strcmp("Delete", cmd)) {
-		command_delete(&win.view_wrap->view);
+		command_delete(&win.focus->view);
+		return 1;
+	} else if(!strcmp("Copy", cmd)) {
+		snarf.nmemb = 0;
+		selection_to_string(*rng, &snarf);
+		window_clipboard_own(&win, &snarf);
+		return 1;
+	} else if(!strcmp("Cut", cmd)) {
+		snarf.nmemb = 0;
+		selection_to_string(*rng, &snarf);
+		window_clipboard_own(&win, &snarf);
+		range_push(rng, "", 0, OP_Replace);
 		return 1;
+	} else if(!strcmp("Paste", cmd)) {
+		if(!window_clipboard_request(&win)) {
+			range_push(rng, snarf.data, snarf.nmemb, OP_Replace);
+		}
+		return 1;
+	} else if(!strncmp("Find", cmd, 4) && strchr(" \t", cmd[4])) {
+		return builtin_find(cmd + 4, 0, false);
+	} else if(!strncmp("FindPrev", cmd, 8) && strchr(" \t", cmd[8])) {
+		return builtin_find(cmd + 8, 0, true);
+	} else if(!strncmp("FindAll", cmd, 7) && strchr(" \t", cmd[7])) {
+		return builtin_findall(cmd + 7);
+	} else if(!strcmp("Next", cmd)) {
+		return builtin_next(false);
+	} else if(!strcmp("Prev", cmd)) {
+		return builtin_next(true);
 	} else if(!strcmp("Read", cmd)) {
 		return 1;
-	} else if(!strcmp("Write", cmd)) {
+	} else if(!strncmp("Open", cmd, 4) && strchr(" \t", cmd[4])) {
+		return builtin_open(cmd + 4);
+	} else if(!strcmp("Split", cmd)) {
+		pane_open(doc_of(&win.focus->view));
+		window_layout(&win);
+		return 1;
+	} else if(!strcmp("Close", cmd)) {
+		pane_close(win.focus);
+		window_layout(&win);
+		return 1;
+	} else if(!strncmp("Save", cmd, 4) && strchr(" \t", cmd[4])) {
+		return builtin_save(cmd + 4);
+	} else if(!strncmp("Trace", cmd, 5) && strchr(" \t", cmd[5])) {
+		cmd += 5 + strspn(cmd + 5, " \t");
+		trace_dump(*cmd ? cmd : TRACE_FILE);
+		return 1;
+	} else if(!strcmp("Mem", cmd)) {
+		alloc_report(stderr);
+		return 1;
+	} else if(!strcmp("Net", cmd)) {
+		doc_t *d = doc_of(&win.focus->view);
+		if(d->remote) {
+			remote_report(d->remote, stderr);
+		}
+		return 1;
+	} else if(!strcmp("Indent", cmd)) {
+		command_indent(&win.focus->view);
 		return 1;
 	} else if(!strcmp("Undo", cmd)) {
-		command_undo(&win.view_wrap->view);
+		command_undo(&win.focus->view);
 		return 1;
 	} else if(!strcmp("Redo", cmd)) {
-		command_redo(&win.view_wrap->view);
+		command_redo(&win.focus->view);
 		return 1;
 	} else if(!strcmp("+", cmd)) {
 		return 1;
-	} else if(!strcmp("...", cmd)) {
-		return 1;
 	}
 
-	return 0;
+	return builtin_filter(cmd);
 }
 
 int
 handle_command(char *cmd)
 {
+	if(!strcmp("...", cmd)) {
+		return entry_click();
+	}
 	if(builtin_command(cmd)) {
 		return 1;
 	}
@@ -166,7 +1030,7 @@ handle_command(char *cmd)
 	g_control = &control;
 
 	selection_send_work_t selection_send_work = {
-		.rng = win.view_wrap->view.range
+		.rng = win.focus->view.range
 	};
 
 	struct {
@@ -202,20 +1066,20 @@ handle_command(char *cmd)
 	pipe_init(pipes_w, num_w, 1) < 0) {
 		return -1;
 	}
-	if( (control.child.pid = fork()) < 0 ) {
+	char *argv[] = {"sh", "-c", cmd, (char*)0};
+	sigset_t chld;
+	sigset_t oldmask;
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &oldmask);
+	int spawned = pipe_cmd_exec(&control.child.pid, pipes_all, num_r + num_w,
+			pipes.w.selection.child.fd, pipes.r.selection.child.fd, argv);
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	if(spawned < 0) {
+		perror("pipe_cmd_exec failed");
 		goto out_err;
 	}
 
-	if(control.child.pid == 0) {
-		char *argv[] = {"sh", "-c", cmd, (char*)0};
-		if(dup2(pipes.w.selection.child.fd, STDIN_FILENO) < 0 ||
-		dup2(pipes.r.selection.child.fd, STDOUT_FILENO) < 0) {
-			die("dup2 failed: %s\n", strerror(errno));
-		}
-		pipe_cmd_exec(pipes_all, num_r + num_w, argv);
-		die("pipe_cmd_exec failed: %s\n", strerror(errno));
-	}
-
 	for(size_t i = 0; i < num_r + num_w; i++) {
 		close(pipes_all[i].child.fd);
 		if(fcntl(pipes_all[i].fd, F_SETFL, O_NONBLOCK) < 0) {
@@ -259,7 +1123,7 @@ handle_command(char *cmd)
 	g_control = 0;
 
 	if(!control.pipe.disregard) {
-		range_push(&win.view_wrap->view.range, pipes.r.selection.buf.data,
+		range_push(&win.focus->view.range, pipes.r.selection.buf.data,
 				pipes.r.selection.buf.nmemb, OP_Replace);
 	}
 	for(size_t i = 0; i < num_r; i++) {
@@ -283,52 +1147,96 @@ out_err:
 	return -1;
 }
 
-void
-file_read(file_t *f, char *fname)
-{
-	int fd = open(fname, O_RDONLY);
-	DIEIF(fd < 0);
-
-	range_read(&(range_t){.file = f}, fd);
-	close(fd);
-
-	f->dirty = true;
-
-	printf("file lines: %zu\n", f->content.nmemb);
-}
-
+/* signals of children exiting together may come as one, so all that
+ * exited are reaped */
 static void
 sigchld(int sig, siginfo_t *inf, void *ctx)
 {
 	(void)sig;
+	(void)inf;
 	(void)ctx;
 
-	if(g_control && !g_control->error && !g_control->child.exited &&
-	g_control->child.pid == inf->si_pid) {
-		g_control->child.exited = true;
-		g_control->child.status = inf->si_status;
-		if(inf->si_status) {
-			g_control->error = true;
-			g_control->pipe.done = true;
+	int err = errno;
+	int wstatus;
+	pid_t pid;
+	while( (pid = waitpid(-1, &wstatus, WNOHANG)) > 0 ) {
+		if(g_control && !g_control->error && !g_control->child.exited &&
+		g_control->child.pid == pid) {
+			int status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : WTERMSIG(wstatus);
+			g_control->child.exited = true;
+			g_control->child.status = status;
+			if(status) {
+				g_control->error = true;
+				g_control->pipe.done = true;
+			}
+			g_control = 0;
 		}
-		g_control = 0;
 	}
+	errno = err;
+}
+
+/* "-s file" serves file on the standard input and output */
+static int
+serve_main(char *fname)
+{
+	file_t f = {0};
+	file_insert_line(&f, 0, "", 0);
+	if(file_read(&f, fname) < 0 && errno != ENOENT) {
+		perror(fname);
+		return 1;
+	}
+	backend_t b = {
+		.file = &f,
+		.filename = fname,
+		.conn = {.in = STDIN_FILENO, .out = STDOUT_FILENO}
+	};
+	int ret = backend_serve(&b);
+	ARR_FREE(&b.conn.rbuf);
+	file_free(&f);
+	return ret < 0;
+}
+
+/* "-r cmd" is a file of a backend cmd runs, "-f file" a file followed
+ * as it grows, anything else a local one */
+static doc_t *
+doc_open_arg(int argc, char *argv[], int *i)
+{
+	if(!strcmp(argv[*i], "-r") && *i + 1 < argc) {
+		*i += 1;
+		return doc_open_remote(argv[*i]);
+	}
+	if(!strcmp(argv[*i], "-f") && *i + 1 < argc) {
+		*i += 1;
+		return doc_open_follow(argv[*i]);
+	}
+	return doc_open(argv[*i]);
 }
 
 int
 main(int argc, char *argv[])
 {
+	char *progname = strrchr(argv[0], '/');
+	progname = progname ? progname + 1 : argv[0];
+	const filter_t *filter = filter_find(progname, strlen(progname));
+	if(filter) {
+		return filter_main(filter, argc, argv);
+	}
+
 	setlocale(LC_CTYPE, "");
 	signal(SIGPIPE, SIG_IGN);
+	if(argc == 3 && !strcmp(argv[1], "-s")) {
+		return serve_main(argv[2]);
+	}
 	sigaction(SIGCHLD, &(struct sigaction) {
 		.sa_sigaction = sigchld,
 		.sa_flags = SA_SIGINFO | SA_NOCLDSTOP
 	}, 0);
+	signal(SIGUSR1, trace_request);
 
-	file_insert_line(win.view_wrap->view.range.file, 0, "", 0);
-	if(argc > 1) {
-		file_read(&file, argv[1]);
-	}
+	int arg = 1;
+	doc_t *d = argc > 1 ? doc_open_arg(argc, argv, &arg) : doc_open(NULL);
+	DIEIF(!d);
+	pane_open(d);
 
 	window_init(&win);
 
@@ -339,6 +1247,8 @@ main(int argc, char *argv[])
 	fontset_t fontset = {0};
 	DIEIF( fontset_init(&fontset, FcNameParse((FcChar8*)"DroidSans")) );
 	cairo_font_face_t *font = font_cairo_font_face_create(&fontset);
+	char *threads = getenv("WERF_THREADS");
+	view_threads(threads ? atoi(threads) : -1);
 
 	cairo_set_font_face(win.cr, font);
 	//cairo_font_face_destroy(font);
@@ -350,11 +1260,11 @@ main(int argc, char *argv[])
 	cairo_get_font_matrix(win.cr, &mat);
 	cairo_set_font_size(win.cr, mat.xx * s);
 
-	char labels[] = "Cut\nCopy\nPaste\nDelete\nFind\n./Open\nExec\nurxvt\ngrep std | grep \"<.*>\" -o\n+\n...\n";
+	char labels[] = "Cut\nCopy\nPaste\nDelete\nFind\nFindAll\nNext\nPrev\nOpen\nSplit\nClose\nExec\nurxvt\ngrep std | grep \"<.*>\" -o\n+\n...\n";
 	char *lbl = labels;
 	for(char *next; (next = strchr(lbl, '\n')) != NULL; lbl = next) {
 		next++;
-		toolbar_t *bar = &win.view_wrap->view.selbar_wrap.bar;
+		toolbar_t *bar = &win.focus->view.selbar_wrap.bar;
 		ARR_EXTEND(&bar->buttons, 1);
 		button_t *btn = &bar->buttons.data[bar->buttons.nmemb - 1];
 		btn->label.data = lbl;
@@ -362,34 +1272,49 @@ main(int argc, char *argv[])
 		btn->label.amemb = btn->label.nmemb;
 		memset(&btn->glyphs, 0, sizeof btn->glyphs);
 
-		glyphs_from_text(&btn->glyphs, cairo_get_scaled_font(win.cr),
-				&btn->label);
+		glyphs_from_text(&btn->glyphs, NULL, cairo_get_scaled_font(win.cr),
+				btn->label.data, btn->label.nmemb);
 		btn->label.data[btn->label.nmemb - 1] = '\0';
 	}
+	bar_font = cairo_scaled_font_reference(cairo_get_scaled_font(win.cr));
 	cairo_restore(win.cr);
 
-	cairo_font_extents(win.cr, &win.view_wrap->view.extents);
-	if(!win.view_wrap->view.font) {
-		win.view_wrap->view.font = cairo_get_scaled_font(win.cr);
+	// the rest get the toolbar from the first
+	for(int i = arg + 1; i < argc; i++) {
+		if((d = doc_open_arg(argc, argv, &i))) {
+			pane_open(d);
+		}
 	}
-	view_resize(&win.view_wrap->view, win.width, win.height);
+	window_layout(&win);
 	window_run(&win);
 
+	entry_close(false);
+	ARR_FREE(&entry.text);
+	if(entry.wake[0] >= 0) {
+		close(entry.wake[0]);
+		close(entry.wake[1]);
+	}
+	cairo_scaled_font_destroy(bar_font);
+
+	view_threads_free();
+	draw_free();
 	fontset_free(&fontset);
 	FcFini();
 	FT_Done_FreeType(ftlib);
 
 	window_deinit(&win);
 
-	file_free(&file);
-
-	for(size_t i = 0; i < win.view_wrap->view.nmemb; i++) {
-		free(win.view_wrap->view.lines[i].data);
-		free(win.view_wrap->view.lines[i].glyph_to_offset);
-		free(win.view_wrap->view.lines[i].offset_to_glyph);
+	pane_close(NULL);
+	for(size_t i = 0; i < win.views.nmemb; i++) {
+		view_free(&win.views.data[i]->view);
+		free(win.views.data[i]);
 	}
-
-	free(win.view_wrap->view.lines);
+	ARR_FREE(&win.views);
+	while(docs.nmemb) {
+		doc_close(docs.data[docs.nmemb - 1]);
+	}
+	ARR_FREE(&docs);
+	ARR_FREE(&snarf);
 
 	return 0;
 }
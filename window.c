@@ -1,11 +1,15 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ipc.h>
 #include <sys/select.h>
+#include <sys/shm.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -13,8 +17,10 @@
 #include <unistd.h>
 
 #include <X11/keysym.h>
+#include <X11/Xatom.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
 
 #include <cairo/cairo.h>
 #include <cairo/cairo-xlib.h>
@@ -22,24 +28,216 @@
 #include "util.h"
 #include "array.h"
 
+#include "re.h"
 #include "edit.h"
+#include "wrap.h"
 #include "view.h"
 #include "draw.h"
 #include "window.h"
+#include "trace.h"
+
+/* With MIT-SHM cairo draws into an image in memory shared with the X
+ * server and only the rows that changed are put to the window, no RENDER
+ * request goes out per glyph run. Without it, as over the network or with
+ * WERF_NOSHM set, cairo draws into a pixmap through xlib, which is copied
+ * whole. */
+
+static bool shm_failed;
+
+static int
+shm_error(Display *display, XErrorEvent *ev)
+{
+	(void)display;
+	(void)ev;
+	shm_failed = true;
+	return 0;
+}
+
+/* cairo's RGB24 is a native-endian 0x00RRGGBB, so is the image or no */
+static bool
+window_shm_init(window_t *win, int width, int height)
+{
+	Display *dpy = win->display;
+	Visual *vis = DefaultVisual(dpy, win->screen);
+	const union { uint32_t u; uint8_t b; } endian = {1};
+
+	if(getenv("WERF_NOSHM") || !XShmQueryExtension(dpy) || vis->class != TrueColor) {
+		return false;
+	}
+	XImage *img = XShmCreateImage(dpy, vis, DefaultDepth(dpy, win->screen), ZPixmap,
+			NULL, &win->shm, width, height);
+	if(!img) {
+		return false;
+	}
+	if(img->bits_per_pixel != 32 || vis->red_mask != 0xFF0000 ||
+	vis->green_mask != 0xFF00 || vis->blue_mask != 0xFF ||
+	img->byte_order != (endian.b ? LSBFirst : MSBFirst)) {
+		XDestroyImage(img);
+		return false;
+	}
+	win->shm.shmid = shmget(IPC_PRIVATE, (size_t)img->bytes_per_line * img->height,
+			IPC_CREAT | 0600);
+	if(win->shm.shmid < 0) {
+		XDestroyImage(img);
+		return false;
+	}
+	win->shm.shmaddr = img->data = shmat(win->shm.shmid, NULL, 0);
+	win->shm.readOnly = False;
+	// removed now, it goes away once both sides detach
+	shmctl(win->shm.shmid, IPC_RMID, NULL);
+	if(win->shm.shmaddr == (void*)-1) {
+		img->data = NULL;
+		XDestroyImage(img);
+		return false;
+	}
+
+	// a server on another host fails to attach, which shows after a sync
+	shm_failed = false;
+	XErrorHandler prev = XSetErrorHandler(shm_error);
+	XShmAttach(dpy, &win->shm);
+	XSync(dpy, False);
+	XSetErrorHandler(prev);
+	if(shm_failed) {
+		shmdt(win->shm.shmaddr);
+		img->data = NULL;
+		XDestroyImage(img);
+		return false;
+	}
+	win->image = img;
+	win->shm_event = XShmGetEventBase(dpy) + ShmCompletion;
+	win->shm_busy = false;
+	return true;
+}
+
+static void
+window_shm_free(window_t *win)
+{
+	if(!win->image) {
+		return;
+	}
+	XShmDetach(win->display, &win->shm);
+	XSync(win->display, False);
+	shmdt(win->shm.shmaddr);
+	win->image->data = NULL;
+	XDestroyImage(win->image);
+	win->image = NULL;
+}
+
+static Bool
+shm_done(Display *display, XEvent *ev, XPointer usr)
+{
+	(void)display;
+	return ev->type == ((window_t*)usr)->shm_event;
+}
+
+/* the server reads the image until it says it is done */
+static void
+window_shm_wait(window_t *win)
+{
+	XEvent ev;
+	if(win->shm_busy) {
+		XIfEvent(win->display, &ev, shm_done, (XPointer)win);
+		win->shm_busy = false;
+	}
+}
+
+/* a new target keeps the font set on the old one, views get it anew in
+ * window_layout */
+static void
+window_set_target(window_t *win, cairo_surface_t *surf)
+{
+	cairo_t *cr = cairo_create(surf);
+	cairo_surface_destroy(surf);
+	if(win->cr) {
+		cairo_matrix_t mat;
+		cairo_set_font_face(cr, cairo_get_font_face(win->cr));
+		cairo_get_font_matrix(win->cr, &mat);
+		cairo_set_font_matrix(cr, &mat);
+		cairo_destroy(win->cr);
+	}
+	win->cr = cr;
+	for(size_t i = 0; i < win->views.nmemb; i++) {
+		win->views.data[i]->view.font = NULL;
+	}
+}
+
+/* the image is as big as the screen, so resizing seldom makes a new one */
+static cairo_surface_t *
+window_surface(window_t *win)
+{
+	int width = MAX(win->width, DisplayWidth(win->display, win->screen));
+	int height = MAX(win->height, DisplayHeight(win->display, win->screen));
+	if(window_shm_init(win, width, height)) {
+		return cairo_image_surface_create_for_data((unsigned char*)win->image->data,
+				CAIRO_FORMAT_RGB24, win->image->width, win->image->height,
+				win->image->bytes_per_line);
+	}
+	win->pixmap = XCreatePixmap(win->display, win->window, win->width, win->height,
+			DefaultDepth(win->display, win->screen));
+	return cairo_xlib_surface_create(win->display, win->pixmap,
+			DefaultVisual(win->display, win->screen), win->width, win->height);
+}
+
+static void
+window_present(window_t *win)
+{
+	if(!win->image) {
+		XCopyArea(win->display, win->pixmap, win->window, win->gfxctx,
+				0, 0, win->width, win->height, 0, 0);
+		return;
+	}
+	damage_t *d = &win->damage;
+	damage_find(d, cairo_get_target(win->cr), win->width, win->height, win->damage_all);
+	win->damage_all = false;
+	for(size_t i = 0; i < d->bands.nmemb; i++) {
+		band_t *b = &d->bands.data[i];
+		XShmPutImage(win->display, win->window, win->gfxctx, win->image,
+				0, b->y, 0, b->y, win->width, b->height, i + 1 == d->bands.nmemb);
+	}
+	win->shm_busy = d->bands.nmemb > 0;
+}
 
 void
 window_redraw(window_t *win)
 {
-	XFillRectangle(win->display, win->pixmap, win->gfxctx,
-			0, 0, win->width, win->height);
+	if(win->image) {
+		window_shm_wait(win);
+		cairo_identity_matrix(win->cr);
+		cairo_set_source_rgb(win->cr, 1, 1, 1);
+		cairo_rectangle(win->cr, 0, 0, win->width, win->height);
+		cairo_fill(win->cr);
+	} else {
+		XFillRectangle(win->display, win->pixmap, win->gfxctx,
+				0, 0, win->width, win->height);
+	}
 
 	cairo_identity_matrix(win->cr);
 	cairo_set_source_rgba(win->cr, 0, 0, 0, 1);
 
-	draw_view(win->cr, &win->view_wrap->view);
-	
-	XCopyArea(win->display, win->pixmap, win->window, win->gfxctx,
-			0, 0, win->width, win->height, 0, 0);
+	uint64_t t = trace_now();
+	for(size_t i = 0; i < win->views.nmemb; i++) {
+		view_wrap_t *vw = win->views.data[i];
+		cairo_save(win->cr);
+		cairo_translate(win->cr, vw->x, vw->y);
+		cairo_rectangle(win->cr, 0, 0, vw->view.width, vw->view.height);
+		cairo_clip(win->cr);
+		draw_view(win->cr, &vw->view);
+		cairo_restore(win->cr);
+		if(i > 0) {
+			cairo_save(win->cr);
+			cairo_set_source_rgb(win->cr, 0, 0, 0);
+			cairo_rectangle(win->cr, 0, vw->y, win->width, 1);
+			cairo_fill(win->cr);
+			cairo_restore(win->cr);
+		}
+	}
+	trace_event(TRACE_DRAW, t, 0);
+
+	t = trace_now();
+	cairo_surface_flush(cairo_get_target(win->cr));
+	window_present(win);
+	XFlush(win->display);
+	trace_frame(t);
 }
 
 static bool
@@ -50,19 +248,142 @@ window_resize(window_t *win, XEvent *ev)
 	}
 	win->width = ev->xconfigure.width;
 	win->height = ev->xconfigure.height;
+	win->damage_all = true;
+
+	if(!win->image) {
+		XFreePixmap(win->display, win->pixmap);
+		win->pixmap = XCreatePixmap(win->display, win->window, win->width, win->height,
+				DefaultDepth(win->display, win->screen));
+		cairo_xlib_surface_set_drawable(cairo_get_target(win->cr),
+				win->pixmap, win->width, win->height);
+	} else if(win->width > win->image->width || win->height > win->image->height) {
+		window_shm_wait(win);
+		window_shm_free(win);
+		window_set_target(win, window_surface(win));
+	}
 
-	XFreePixmap(win->display, win->pixmap);
-	win->pixmap = XCreatePixmap(win->display, win->window, win->width, win->height,
-			DefaultDepth(win->display, win->screen));
+	window_layout(win);
+	return true;
+}
+
+/* views split the height evenly, the last one takes what is left */
+void
+window_layout(window_t *win)
+{
+	size_t n = win->views.nmemb;
+	int height = n ? win->height / n : 0;
+	for(size_t i = 0; i < n; i++) {
+		view_wrap_t *vw = win->views.data[i];
+		vw->x = 0;
+		vw->y = i * height;
+		cairo_font_extents(win->cr, &vw->view.extents);
+		if(!vw->view.font) {
+			vw->view.font = cairo_get_scaled_font(win->cr);
+		}
+		view_resize(&vw->view, win->width,
+			i + 1 < n ? height : win->height - vw->y);
+	}
+}
+
+static view_wrap_t *
+window_view_at(window_t *win, int y)
+{
+	for(size_t i = win->views.nmemb; i > 1; i--) {
+		if(y >= win->views.data[i - 1]->y) {
+			return win->views.data[i - 1];
+		}
+	}
+	return win->views.data[0];
+}
+
+/* Copy and Cut own CLIPBOARD, and PRIMARY for xclip and middle clicks,
+ * with the text held in werf; other programs get it from SelectionRequest.
+ * Paste asks CLIPBOARD for its text, which comes as SelectionNotify, or
+ * takes the text held here when nobody has it, it does not come in one
+ * piece or this window owns it. */
 
-	cairo_xlib_surface_set_drawable(cairo_get_target(win->cr),
-			win->pixmap, win->width, win->height);
+// in werf.c, Paste's text once it is there
+void paste_text(char *buf, size_t len);
 
-	cairo_font_extents(win->cr, &win->view_wrap->view.extents);
-	if(!win->view_wrap->view.font) {
-		win->view_wrap->view.font = cairo_get_scaled_font(win->cr);
+void
+window_clipboard_own(window_t *win, string_t *text)
+{
+	win->clip = text;
+	XSetSelectionOwner(win->display, win->clipboard, win->window, CurrentTime);
+	XSetSelectionOwner(win->display, XA_PRIMARY, win->window, CurrentTime);
+	win->clip_owned = XGetSelectionOwner(win->display, win->clipboard) == win->window;
+}
+
+/* false when the text held here is the clipboard's, for the caller to
+ * paste; otherwise paste_text gets it later */
+bool
+window_clipboard_request(window_t *win)
+{
+	if(win->clip_owned) {
+		return false;
+	}
+	XConvertSelection(win->display, win->clipboard, win->utf8, win->paste,
+			win->window, CurrentTime);
+	return true;
+}
+
+/* the text goes in one property, no INCR transfers in pieces */
+static size_t
+window_request_bytes(window_t *win)
+{
+	long max = XExtendedMaxRequestSize(win->display);
+	if(!max) {
+		max = XMaxRequestSize(win->display);
+	}
+	return (size_t)max * 4 - 1024;
+}
+
+static void
+window_clipboard_send(window_t *win, XSelectionRequestEvent *req)
+{
+	XSelectionEvent ev = {
+		.type = SelectionNotify, .requestor = req->requestor,
+		.selection = req->selection, .target = req->target,
+		.property = None, .time = req->time,
+	};
+	Atom prop = req->property != None ? req->property : req->target;
+	string_t *text = win->clip;
+	if(req->target == win->targets) {
+		Atom targets[] = {win->targets, win->utf8, XA_STRING};
+		XChangeProperty(win->display, req->requestor, prop, XA_ATOM, 32,
+				PropModeReplace, (unsigned char*)targets, LEN(targets));
+		ev.property = prop;
+	} else if((req->target == win->utf8 || req->target == XA_STRING) && text &&
+			text->nmemb <= window_request_bytes(win)) {
+		XChangeProperty(win->display, req->requestor, prop, req->target, 8,
+				PropModeReplace, (unsigned char*)(text->data ? text->data : ""),
+				text->nmemb);
+		ev.property = prop;
+	}
+	XSendEvent(win->display, req->requestor, False, NoEventMask, (XEvent*)&ev);
+}
+
+static bool
+window_clipboard_receive(window_t *win, XSelectionEvent *ev)
+{
+	Atom type = None;
+	int format = 0;
+	unsigned long n = 0, after;
+	unsigned char *data = NULL;
+	if(ev->property != None) {
+		XGetWindowProperty(win->display, win->window, ev->property, 0, LONG_MAX / 4,
+				True, AnyPropertyType, &type, &format, &n, &after, &data);
+	}
+
+	view_layout(&win->focus->view);
+	if(data && type != win->incr && format == 8) {
+		paste_text((char*)data, n);
+	} else if(win->clip) {
+		paste_text(win->clip->data, win->clip->nmemb);
+	}
+	if(data) {
+		XFree(data);
 	}
-	view_resize(&win->view_wrap->view, win->width, win->height);
 	return true;
 }
 
@@ -106,6 +427,12 @@ window_init(window_t *win)
 
 	window_init_input_methods(win);
 
+	win->clipboard = XInternAtom(win->display, "CLIPBOARD", False);
+	win->utf8 = XInternAtom(win->display, "UTF8_STRING", False);
+	win->targets = XInternAtom(win->display, "TARGETS", False);
+	win->incr = XInternAtom(win->display, "INCR", False);
+	win->paste = XInternAtom(win->display, "WERF_PASTE", False);
+
 	XSelectInput(win->display, win->window, StructureNotifyMask | ExposureMask |
 		KeyPressMask | ButtonMotionMask | ButtonPressMask | ButtonReleaseMask);
 	XMapWindow(win->display, win->window);
@@ -127,11 +454,8 @@ window_init(window_t *win)
 		}
 	}
 
-	win->pixmap = XCreatePixmap(win->display, win->window, win->width, win->height,
-			DefaultDepth(win->display, win->screen));
-	cairo_surface_t *bufsurf = cairo_xlib_surface_create(win->display, win->pixmap, 
-			DefaultVisual(win->display, win->screen), win->width, win->height);
-	win->cr = cairo_create(bufsurf);
+	window_set_target(win, window_surface(win));
+	win->damage_all = true;
 
 	win->run = true;
 }
@@ -140,11 +464,70 @@ void
 window_deinit(window_t *win)
 {
 	cairo_destroy(win->cr);
+	window_shm_wait(win);
+	window_shm_free(win);
+	damage_free(&win->damage);
+	ARR_FREE(&win->watches);
 
 	XCloseDisplay(win->display);
 	win->display = NULL;
 }
 
+/* server time in ms of input events, 0 for others */
+static unsigned long
+event_time(XEvent *ev)
+{
+	switch(ev->type) {
+	case KeyPress:
+	case KeyRelease:
+		return ev->xkey.time;
+	case ButtonPress:
+	case ButtonRelease:
+		return ev->xbutton.time;
+	case MotionNotify:
+		return ev->xmotion.time;
+	default:
+		return 0;
+	}
+}
+
+static bool
+same_key(XEvent *ev, XEvent *next)
+{
+	return next->type == KeyPress && next->xkey.window == ev->xkey.window &&
+		next->xkey.keycode == ev->xkey.keycode && next->xkey.state == ev->xkey.state;
+}
+
+static bool
+same_motion(XEvent *ev, XEvent *next)
+{
+	return next->type == MotionNotify && next->xmotion.window == ev->xmotion.window &&
+		next->xmotion.state == ev->xmotion.state;
+}
+
+/* Takes the events queued right after ev that are like it, leaving the
+ * last in ev, and returns how many. A frame then handles a run of them
+ * at once instead of falling further behind with each. */
+static int
+window_coalesce(window_t *win, XEvent *ev, bool (*like)(XEvent *, XEvent *))
+{
+	XEvent next;
+	int n = 0;
+	while(XPending(win->display)) {
+		XPeekEvent(win->display, &next);
+		if(!like(ev, &next)) {
+			break;
+		}
+		XNextEvent(win->display, ev);
+		trace_coalesced(trace_now(), ev->type, event_time(ev));
+		n++;
+	}
+	return n;
+}
+
+// in werf.c, the toolbar entry takes keys while it is open
+bool entry_keypress(KeySym keysym, char *buf, size_t len);
+
 static bool
 window_keypress(window_t *win, XEvent *ev)
 {
@@ -154,12 +537,22 @@ window_keypress(window_t *win, XEvent *ev)
 	XKeyEvent *e = &ev->xkey;
 	int len = Xutf8LookupString(win->xic, e, buf, sizeof buf, &keysym, &status);
 
+	// the selection moves along with edits made in other views first
+	view_layout(&win->focus->view);
+	if(entry_keypress(keysym, buf, len > 0 ? len : 0)) {
+		return true;
+	}
 	if(keysym == XK_Escape) {
 		win->run = false;
 		return true;
 	}
+	if(view_navigation_key(keysym)) {
+		int count = 1 + window_coalesce(win, ev, same_key);
+		view_navigate(&win->focus->view, keysym, count);
+		return true;
+	}
 
-	return view_keypress(&win->view_wrap->view, keysym, buf, len > 0 ? len : 0);
+	return view_keypress(&win->focus->view, keysym, buf, len > 0 ? len : 0);
 }
 
 static bool
@@ -167,27 +560,32 @@ window_mouse_press(window_t *win, XEvent *ev)
 {
 	bool handled;
 	XButtonEvent *e = &ev->xbutton;
-	int x = e->x - win->view_wrap->x;
-	int y = e->y - win->view_wrap->y;
+	win->focus = window_view_at(win, e->y);
+	view_layout(&win->focus->view);
+	int x = e->x - win->focus->x;
+	int y = e->y - win->focus->y;
 
-	handled = view_mouse_press(&win->view_wrap->view, e->button, x, y);
+	handled = view_mouse_press(&win->focus->view, e->button, x, y);
 
 	win->prevx = e->x;
 	win->prevy = e->y;
 	return handled;
 }
 
+/* relx and rely still add up over the motion taken together, they are
+ * from the last handled */
 static bool
 window_mouse_motion(window_t *win, XEvent *ev)
 {
 	bool handled;
+	window_coalesce(win, ev, same_motion);
 	XMotionEvent *e = &ev->xmotion;
-	int x = e->x - win->view_wrap->x;
-	int y = e->y - win->view_wrap->y;
+	int x = e->x - win->focus->x;
+	int y = e->y - win->focus->y;
 	int relx = e->x - win->prevx;
 	int rely = e->y - win->prevy;
 
-	handled = view_mouse_motion(&win->view_wrap->view, e->state, x, y, relx, rely);
+	handled = view_mouse_motion(&win->focus->view, e->state, x, y, relx, rely);
 
 	win->prevx = e->x;
 	win->prevy = e->y;
@@ -198,9 +596,24 @@ static bool
 window_mouse_release(window_t *win, XEvent *ev)
 {
 	XButtonEvent *e = &ev->xbutton;
-	int x = e->x - win->view_wrap->x;
-	int y = e->y - win->view_wrap->y;
-	return view_mouse_release(&win->view_wrap->view, e->button, x, y);
+	int x = e->x - win->focus->x;
+	int y = e->y - win->focus->y;
+	return view_mouse_release(&win->focus->view, e->button, x, y);
+}
+
+enum { IDLE_SLICE = 2000000 }; // ns of idle work between looks for events
+
+/* work for when no events wait, in slices so input is not held up by it;
+ * true when there is more */
+static bool
+window_idle(window_t *win)
+{
+	uint64_t deadline = trace_now() + IDLE_SLICE;
+	bool more = false;
+	for(size_t i = 0; i < win->views.nmemb; i++) {
+		more |= view_preshape(&win->views.data[i]->view, deadline);
+	}
+	return more;
 }
 
 void
@@ -210,19 +623,46 @@ window_run(window_t *win)
 	int xfd = XConnectionNumber(win->display);
 	struct timespec now, prev;
 	struct timespec drawtime = {.tv_nsec = 0};
+	struct timespec idletime = {.tv_nsec = 0};
 	struct timespec *tv = &drawtime;
 	bool draw_request = false;
 
 	clock_gettime(CLOCK_MONOTONIC, &prev);
 	XEvent ev;
 	while(win->run) {
+		int nfds = xfd;
 		FD_ZERO(&rfd);
 		FD_SET(xfd, &rfd);
-		DIEIF(pselect(xfd+1, &rfd, NULL, NULL, tv, NULL) < 0 && errno != EINTR);
+		for(size_t i = 0; i < win->watches.nmemb; i++) {
+			if(win->watches.data[i].fd >= 0) {
+				FD_SET(win->watches.data[i].fd, &rfd);
+				nfds = MAX(nfds, win->watches.data[i].fd);
+			}
+		}
+		int nready = pselect(nfds+1, &rfd, NULL, NULL, tv, NULL);
+		DIEIF(nready < 0 && errno != EINTR);
+		if(trace_requested()) {
+			trace_dump(TRACE_FILE);
+		}
+		for(size_t i = 0; nready > 0 && i < win->watches.nmemb; i++) {
+			watch_t *w = &win->watches.data[i];
+			if(w->fd >= 0 && FD_ISSET(w->fd, &rfd) && w->ready(w->usr)) {
+				draw_request = true;
+			}
+		}
+		size_t nwatches = 0;
+		for(size_t i = 0; i < win->watches.nmemb; i++) {
+			if(win->watches.data[i].fd >= 0) {
+				win->watches.data[nwatches++] = win->watches.data[i];
+			}
+		}
+		win->watches.nmemb = nwatches;
 
 		while(XPending(win->display)) {
 			bool handled = false;
 			XNextEvent(win->display, &ev);
+			uint64_t t = trace_now();
+			unsigned long sent = event_time(&ev);
 			switch(ev.type) {
 			case DestroyNotify:
 				win->run = false;
@@ -243,17 +683,34 @@ window_run(window_t *win)
 				handled = window_resize(win, &ev);
 				break;
 			case Expose:
+				win->damage_all = true;
 				handled = true;
 				break;
+			case SelectionRequest:
+				window_clipboard_send(win, &ev.xselectionrequest);
+				break;
+			case SelectionClear:
+				if(ev.xselectionclear.selection == win->clipboard) {
+					win->clip_owned = false;
+				}
+				break;
+			case SelectionNotify:
+				handled = window_clipboard_receive(win, &ev.xselection);
+				break;
 			default:
+				if(ev.type == win->shm_event && win->image) {
+					win->shm_busy = false;
+				}
 				break;
 			}
+			trace_input(t, ev.type, handled, sent);
 			if(handled) {
 				draw_request = true;
 			}
 		}
 
 		if(!draw_request) {
+			tv = window_idle(win) ? &idletime : NULL;
 			continue;
 		}
 		clock_gettime(CLOCK_MONOTONIC, &now);
@@ -267,8 +724,7 @@ window_run(window_t *win)
 
 		draw_request = false;
 		window_redraw(win);
-		XFlush(win->display);
 		clock_gettime(CLOCK_MONOTONIC, &prev);
-		tv = NULL;
+		tv = &idletime;
 	}
 }
@@ -4,6 +4,15 @@ typedef struct {
 	view_t view;
 } view_wrap_t;
 
+/* a descriptor waited on along with the display; ready is called when it
+ * can be read and is true when the views changed. fd is -1 once removed,
+ * window_run drops it after calling the others. */
+typedef struct {
+	int fd;
+	bool (*ready)(void *usr);
+	void *usr;
+} watch_t;
+
 typedef struct {
 	int width;
 	int height;
@@ -11,13 +20,29 @@ typedef struct {
 	int screen;
 	GC gfxctx;
 	Window window;
-	Drawable pixmap;
+	Drawable pixmap; // drawn to through xlib, without MIT-SHM
+	XShmSegmentInfo shm;
+	XImage *image; // drawn to in memory, with MIT-SHM
+	int shm_event; // ShmCompletion
+	bool shm_busy; // the server may still read image
+	damage_t damage;
+	bool damage_all; // the window lost its content
 	cairo_t *cr;
 	XIM xim;
 	XIC xic;
-	view_wrap_t *view_wrap;
+	ARRAY(view_wrap_t *) views; // stacked top to bottom
+	view_wrap_t *focus; // gets keys, the last one clicked
+	ARRAY(watch_t) watches;
 	bool run;
 
+	Atom clipboard; // CLIPBOARD, see window_clipboard_own
+	Atom utf8; // UTF8_STRING
+	Atom targets; // TARGETS
+	Atom incr; // INCR, a transfer in pieces
+	Atom paste; // property the clipboard's text is put in for Paste
+	string_t *clip; // the text Copy and Cut hold, in werf
+	bool clip_owned; // CLIPBOARD is clip
+
 	int prevx;
 	int prevy;
 } window_t;
@@ -26,3 +51,6 @@ void window_init(window_t *win);
 void window_deinit(window_t *win);
 void window_run(window_t *win);
 void window_redraw(window_t *win);
+void window_layout(window_t *win);
+void window_clipboard_own(window_t *win, string_t *text);
+bool window_clipboard_request(window_t *win);
@@ -0,0 +1,218 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "array.h"
+#include "test.h"
+
+#include "wrap.h"
+
+#define LOWBIT(i) ((i) & -(i))
+
+/* in O(n), each node adds itself to its parent */
+static void
+tree_build(wrap_t *w)
+{
+	size_t n = w->lines.nmemb;
+	w->tree.nmemb = 0;
+	ARR_EXTEND(&w->tree, n + 1);
+	w->tree.data[0] = 0;
+	for(size_t i = 1; i <= n; i++) {
+		w->tree.data[i] = w->lines.data[i - 1].rows;
+	}
+	for(size_t i = 1; i <= n; i++) {
+		size_t parent = i + LOWBIT(i);
+		if(parent <= n) {
+			w->tree.data[parent] += w->tree.data[i];
+		}
+	}
+}
+
+void
+wrap_init(wrap_t *w, size_t nlines, wrap_guess_t guess, void *usr)
+{
+	w->lines.nmemb = 0;
+	ARR_EXTEND(&w->lines, nlines);
+	for(size_t i = 0; i < nlines; i++) {
+		w->lines.data[i] = (wrap_line_t){guess ? MAX(guess(usr, i), 1u) : 1, 0};
+	}
+	if(!w->epoch) {
+		w->epoch = 1;
+	}
+	tree_build(w);
+}
+
+void
+wrap_free(wrap_t *w)
+{
+	ARR_FREE(&w->lines);
+	ARR_FREE(&w->tree);
+}
+
+/* on a new width, counts stay as guesses until measured again */
+void
+wrap_invalidate(wrap_t *w)
+{
+	w->epoch++;
+}
+
+/* lines [start, old_end) became [start, new_end); when their number is
+ * the same the rows are kept as guesses, so typing does not touch the
+ * tree, else it is built again as the line array is moved anyway */
+void
+wrap_splice(wrap_t *w, size_t start, size_t old_end, size_t new_end)
+{
+	if(new_end - start == old_end - start) {
+		for(size_t i = start; i < new_end; i++) {
+			w->lines.data[i].epoch = 0;
+		}
+		return;
+	}
+	ARR_FRAG_RESIZE(&w->lines, start, old_end, new_end - start);
+	for(size_t i = start; i < new_end; i++) {
+		w->lines.data[i] = (wrap_line_t){1, 0};
+	}
+	tree_build(w);
+}
+
+void
+wrap_set(wrap_t *w, size_t line, uint32_t rows)
+{
+	wrap_line_t *l = &w->lines.data[line];
+	rows = MAX(rows, 1u);
+	l->epoch = w->epoch;
+	if(rows == l->rows) {
+		return;
+	}
+	size_t n = w->lines.nmemb;
+	for(size_t i = line + 1; i <= n; i += LOWBIT(i)) {
+		w->tree.data[i] += (size_t)rows - l->rows;
+	}
+	l->rows = rows;
+}
+
+bool
+wrap_exact(wrap_t *w, size_t line)
+{
+	return w->lines.data[line].epoch == w->epoch;
+}
+
+uint32_t
+wrap_rows(wrap_t *w, size_t line)
+{
+	return line < w->lines.nmemb ? w->lines.data[line].rows : 1;
+}
+
+size_t
+wrap_total(wrap_t *w)
+{
+	return wrap_line_to_row(w, w->lines.nmemb);
+}
+
+/* first row of the line, the total for one past the last line */
+size_t
+wrap_line_to_row(wrap_t *w, size_t line)
+{
+	size_t row = 0;
+	for(size_t i = MIN(line, w->lines.nmemb); i > 0; i -= LOWBIT(i)) {
+		row += w->tree.data[i];
+	}
+	return row;
+}
+
+/* line the row is in and that line's first row, the number of lines for
+ * rows past the end */
+size_t
+wrap_row_to_line(wrap_t *w, size_t row, size_t *line_row)
+{
+	size_t n = w->lines.nmemb;
+	size_t step = 1;
+	while(step * 2 <= n) {
+		step *= 2;
+	}
+	size_t pos = 0;
+	size_t rem = row;
+	for(; n && step; step /= 2) {
+		if(pos + step <= n && w->tree.data[pos + step] <= rem) {
+			pos += step;
+			rem -= w->tree.data[pos];
+		}
+	}
+	if(line_row) {
+		*line_row = row - rem;
+	}
+	return pos;
+}
+
+static uint32_t
+guess_mod7(void *usr, size_t line)
+{
+	(void)usr;
+	return line % 7;
+}
+
+int
+TEST_wrap_row_to_line(void)
+{
+	enum { N = 1000 };
+	char call[BUFSIZ];
+	wrap_t w = {0};
+	size_t first;
+
+	// a row count of 0 is taken as 1
+	wrap_init(&w, N, guess_mod7, NULL);
+	size_t row = 0;
+	for(size_t i = 0; i < N; i++) {
+		TEST_OP("%zu", wrap_line_to_row(&w, i), ==, row, "%s", "wrap_line_to_row");
+		size_t line = TEST_CALL(call, sizeof(call), "%p, %zu, %p",
+			wrap_row_to_line, ((void*)&w, row + wrap_rows(&w, i) - 1, (void*)&first));
+		TEST_OP("%zu", line, ==, i, "%s", call);
+		TEST_OP("%zu", first, ==, row, "%s", call);
+		row += MAX(i % 7, (size_t)1);
+	}
+	TEST_OP("%zu", wrap_total(&w), ==, row, "%s", "wrap_total");
+	TEST_OP("%zu", wrap_row_to_line(&w, row, NULL), ==, (size_t)N, "%s", "past the end");
+	TEST_OP("%d", wrap_exact(&w, 5), ==, false, "%s", "guess");
+
+	// measured
+	wrap_set(&w, 5, 10);
+	TEST_OP("%d", wrap_exact(&w, 5), ==, true, "%s", "wrap_set");
+	TEST_OP("%zu", wrap_line_to_row(&w, 6), ==, (size_t)1+1+2+3+4+10, "%s", "wrap_set");
+	TEST_OP("%zu", wrap_row_to_line(&w, 20, NULL), ==, (size_t)5, "%s", "wrap_set");
+	TEST_OP("%zu", wrap_row_to_line(&w, 21, NULL), ==, (size_t)6, "%s", "wrap_set");
+	wrap_invalidate(&w);
+	TEST_OP("%d", wrap_exact(&w, 5), ==, false, "%s", "wrap_invalidate");
+	TEST_OP("%zu", wrap_total(&w), ==, row + 5, "%s", "wrap_invalidate");
+
+	// typing in a line keeps its rows, a new line starts as one row
+	wrap_set(&w, 5, 10);
+	wrap_splice(&w, 5, 6, 6);
+	TEST_OP("%d", wrap_exact(&w, 5), ==, false, "%s", "same lines");
+	TEST_OP("%zu", wrap_total(&w), ==, row + 5, "%s", "same lines");
+	wrap_splice(&w, 5, 6, 8);
+	TEST_OP("%zu", w.lines.nmemb, ==, (size_t)N + 2, "%s", "split");
+	TEST_OP("%zu", wrap_total(&w), ==, row - 10 + 5 + 3, "%s", "split");
+	TEST_OP("%zu", wrap_line_to_row(&w, 8), ==, (size_t)1+1+2+3+4+3, "%s", "split");
+	wrap_splice(&w, 0, 8, 1);
+	TEST_OP("%zu", w.lines.nmemb, ==, (size_t)N - 5, "%s", "join");
+	TEST_OP("%zu", wrap_row_to_line(&w, 1, NULL), ==, (size_t)1, "%s", "join");
+	TEST_OP("%u", wrap_rows(&w, 1), ==, 6u, "%s", "join");
+	TEST_OP("%zu", w.tree.nmemb, ==, w.lines.nmemb + 1, "%s", "join");
+
+	// an index built again, as when too far behind the file
+	wrap_init(&w, N, guess_mod7, NULL);
+	TEST_OP("%zu", w.lines.nmemb, ==, (size_t)N, "%s", "again");
+	TEST_OP("%zu", w.tree.nmemb, ==, (size_t)N + 1, "%s", "again");
+	for(int i = 0; i < 5; i++) {
+		wrap_splice(&w, i, i + 1, i + 2);
+	}
+	TEST_OP("%zu", w.lines.nmemb, ==, (size_t)N + 5, "%s", "splits");
+	TEST_OP("%zu", w.tree.nmemb, ==, (size_t)N + 6, "%s", "splits");
+	TEST_OP("%zu", wrap_total(&w), ==, row + 5, "%s", "splits");
+
+	wrap_free(&w);
+	return 0;
+}
@@ -0,0 +1,28 @@
+/* Visual rows of every line, with a Fenwick tree over them so mapping
+ * between rows and lines is O(log n). A line's rows are exact once
+ * measured in the current epoch, before that they are a guess: the count
+ * from an older width, or one for a new line. */
+typedef struct {
+	uint32_t rows;
+	uint32_t epoch; // measured in, 0 for never
+} wrap_line_t;
+
+typedef struct {
+	ARRAY(wrap_line_t) lines;
+	ARRAY(size_t) tree; // 1-based, tree[i] sums rows of lines (i - lowbit(i), i]
+	uint32_t epoch;
+	uint64_t gen; // file changes applied
+} wrap_t;
+
+typedef uint32_t (*wrap_guess_t)(void *usr, size_t line);
+
+void wrap_init(wrap_t *w, size_t nlines, wrap_guess_t guess, void *usr);
+void wrap_free(wrap_t *w);
+void wrap_invalidate(wrap_t *w);
+void wrap_splice(wrap_t *w, size_t start, size_t old_end, size_t new_end);
+void wrap_set(wrap_t *w, size_t line, uint32_t rows);
+bool wrap_exact(wrap_t *w, size_t line);
+uint32_t wrap_rows(wrap_t *w, size_t line);
+size_t wrap_total(wrap_t *w);
+size_t wrap_line_to_row(wrap_t *w, size_t line);
+size_t wrap_row_to_line(wrap_t *w, size_t row, size_t *line_row);